@@ -318,13 +318,13 @@ if argweaverclib:
 
 # By default use a random seed.
 if argweaverclib:
-    argweaverclib.srand(int((time.time() * 1000) % 1e9))
+    argweaverclib.seedRand(int((time.time() * 1000) % 1e9))
     argweaverclib.setLogLevel(1)
 
 
 def set_random_seed(num):
     """Set the C random number generator seed"""
-    argweaverclib.srand(num)
+    argweaverclib.seedRand(num)
 
 
 #=============================================================================
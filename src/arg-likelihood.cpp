@@ -17,6 +17,7 @@
 #include "argweaver/parsing.h"
 #include "argweaver/sample_arg.h"
 #include "argweaver/sequences.h"
+#include "argweaver/smc_binary.h"
 #include "argweaver/total_prob.h"
 #include "argweaver/track.h"
 #include "argweaver/est_popsize.h"
@@ -96,7 +97,7 @@ public:
                     "outfile for likelihoods (bed format; default=likelihood.bed)"));
         config.add(new ConfigParam<string>
                    ("-a", "--arg", "<SMC file>", &arg_file, "",
-                    "initial ARG file (*.smc) for resampling"));
+                    "initial ARG file (*.smc, *.smcb) for resampling"));
         config.add(new ConfigParam<string>
                    ("", "--region", "<start>-<end>",
                     &region, "",
@@ -311,14 +312,9 @@ bool read_init_arg(const char *arg_file, const ArgModel *model,
                    vector<int> *invisible_recomb_pos,
                    vector<Spr> *invisible_recombs)
 {
-    CompressStream stream(arg_file, "r");
-    if (!stream.stream) {
-        printError("cannot read '%s'", arg_file);
-        return false;
-    }
-    return read_local_trees(stream.stream, model->times, model->ntimes,
-                            trees, seqnames,
-                            invisible_recomb_pos, invisible_recombs);
+    return read_arg_file(arg_file, model->times, model->ntimes,
+                         trees, seqnames,
+                         invisible_recomb_pos, invisible_recombs);
 }
 
 
@@ -350,8 +346,9 @@ void print_arg_likelihood(const ArgModel *model,
                                       start, end);
     int noncompat = count_noncompat(trees, sequences, start, end);
     int nrecomb=0;
-    int curr_end=trees->start_coord;
-    for (LocalTrees::const_iterator it=trees->begin(); it != trees->end(); ++it) {
+    int curr_end;
+    LocalTrees::const_iterator it = trees->get_first_block(start, curr_end);
+    for (; it != trees->end(); ++it) {
         int curr_start = curr_end;
         curr_end += it->blocklen;
         if (curr_end <= start) continue;
@@ -387,8 +384,10 @@ void print_arg_likelihood(const ArgModel *model,
                 }
             }
         }
-        int curr_end = trees->start_coord;
-        for (LocalTrees::const_iterator it=trees->begin(); it != trees->end(); ++it) {
+        int curr_end;
+        LocalTrees::const_iterator it = trees->get_first_block(start,
+                                                               curr_end);
+        for (; it != trees->end(); ++it) {
             int curr_start = curr_end;
             curr_end += it->blocklen;
             if (curr_end <= start) continue;
@@ -477,7 +476,7 @@ int main(int argc, char **argv)
     // probably never used in this program
     if (c.randseed == 0)
         c.randseed = time(NULL);
-    srand(c.randseed);
+    seed_rand(c.randseed);
     printLog(LOG_LOW, "random seed: %d\n", c.randseed);
 
     vector<class MigEvent> migevents;
@@ -684,6 +683,8 @@ int main(int argc, char **argv)
             invisible_recomb_pos[i] = sites_mapping->compress(invisible_recomb_pos[i], 0,
                                                               i==0 ? 0 : invisible_recomb_pos[i-1]);
     }
+    // index blocks so that each region is found by binary search
+    trees->build_index();
 
     printLog(LOG_LOW, "read input ARG (chrom=%s, start=%d, end=%d,"
              " nseqs=%d)\n",
@@ -3,7 +3,9 @@
 #include "mpi.h"
 #endif
 #include <time.h>
+#include <atomic>
 #include <memory>
+#include <thread>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -11,12 +13,15 @@
 #include "argweaver/compress.h"
 #include "argweaver/ConfigParam.h"
 #include "argweaver/emit.h"
+#include "argweaver/forward_kernel.h"
 #include "argweaver/fs.h"
 #include "argweaver/logging.h"
 #include "argweaver/mem.h"
 #include "argweaver/parsing.h"
 #include "argweaver/sample_arg.h"
+#include "argweaver/sample_thread.h"
 #include "argweaver/sequences.h"
+#include "argweaver/smc_binary.h"
 #include "argweaver/total_prob.h"
 #include "argweaver/track.h"
 #include "argweaver/est_popsize.h"
@@ -41,9 +46,11 @@ Sampler for large ancestral recombination graphs\n\
 const char *SMC_SUFFIX = ".smc";
 const char *TSKIT_SUFFIX = ".ts";
 const char *SITES_SUFFIX = ".sites";
+const char *BED_SUFFIX = ".bed";
 const char *STATS_SUFFIX = ".stats";
 const char *LOG_SUFFIX = ".log";
 const char *COAL_RECORDS_SUFFIX = ".cr";
+const char *RAND_SUFFIX = ".rand";
 
 // help categories
 const int ADVANCED_OPT = 1;
@@ -86,9 +93,9 @@ public:
                    ("", "--vcf", "<.vcf.gz file>", &vcf_file,
                     "sequence alignment in gzipped vcf format. Must also supply"
                     " --region in format chr:start-end, and tabix index file"
-                    " (.vcf.gz.tbi) must also be present. tabix program needs to"
-                    " be installed and in PATH or path must be provided with"
-                    " --tabix-dir. Assumes samples are diploid and unphased;"
+                    " (.vcf.gz.tbi or .vcf.gz.csi) must also be present. The"
+                    " indexed file is read directly; the tabix program is not"
+                    " needed. Assumes samples are diploid and unphased;"
                     " each individual will have _1 and _2 appended to its name for its"
                     " two haploid lineages. Indel-type variants are skipped."
                     " Any positions not specified in VCF are assumed to be"
@@ -108,8 +115,7 @@ public:
                     " names not matching the current sequence set will be ignored."));
         config.add(new ConfigParam<string>
                    ("", "--tabix-dir", "<directory>", &tabix_dir,
-                    " path to tabix executable. May be required if using --vcf"
-                    " and tabix is not in PATH"));
+                    "unused; tabix-indexed files are now read directly"));
 	config.add(new ConfigParam<string>
 		   ("", "--age-file", "<age file>", &age_file,
 		    " file giving age for any ancient samples (two-columns, "
@@ -140,7 +146,7 @@ public:
                     " ind_1 and ind_2)"));
         config.add(new ConfigParam<string>
                    ("-a", "--arg", "<SMC file>", &arg_file, "",
-                    "initial ARG file (*.smc) for resampling (optional)"));
+                    "initial ARG file (*.smc, *.smcb) for resampling (optional)"));
         /*        config.add(new ConfigParam<string>
                    ("", "--cr", "<CR file>", &cr_file, "",
                    "initial ARGfile (*.cf) for resampling (optional)"));*/
@@ -386,11 +392,16 @@ public:
                    ("", "--mcmcmc", "<int>", &mcmcmc_numgroup,
                     1, "number of mcmcmc threads",
                     EXPERIMENTAL_OPT));
+#endif
+        config.add(new ConfigParam<int>
+                   ("", "--mcmcmc-threads", "<int>", &mcmcmc_threads,
+                    0, "run this many (MC)^3 chains as threads of one"
+                    " process (default=0, a single chain)",
+                    EXPERIMENTAL_OPT));
         config.add(new ConfigParam<double>
                    ("", "--mcmcmc-heat", "<val>", &mcmcmc_heat,
                     0.05, "heat interval for each thread in (MC)^3 group",
                     EXPERIMENTAL_OPT));
-#endif
         config.add(new ConfigSwitch
                    ("", "--init-popsize-random", &init_popsize_random,
                     "(for use with --sample-popsize). Initialize each"
@@ -407,6 +418,21 @@ public:
                    ("", "--resample-region", "<start>-<end>",
                     &resample_region_str, "",
                     "region to resample of input ARG (optional)"));
+        config.add(new ConfigParam<int>
+                   ("", "--chunk-size", "<bp>", &chunk_size, 0,
+                    "sample the region in chunks of this many bases and"
+                    " stitch the chunks into <output prefix>.<iter>.bed.gz;"
+                    " chunk k writes its ARGs and log under"
+                    " <output prefix>.chunk<k>"
+                    " (default=0, sample the region as a whole)"));
+        config.add(new ConfigParam<int>
+                   ("", "--chunk-flank", "<bp>", &chunk_flank, 0,
+                    "bases each chunk extends past its neighbors; chunks"
+                    " are joined halfway through the overlap (default=0)"));
+        config.add(new ConfigParam<int>
+                   ("", "--chunk-threads", "<threads>", &chunk_threads, 1,
+                    "number of chunks sampled at the same time"
+                    " (default=1)"));
         config.add(new ConfigSwitch
                    ("", "--resume", &resume, "resume a previous run"));
         config.add(new ConfigSwitch
@@ -436,6 +462,15 @@ public:
         config.add(new ConfigSwitch
                    ("", "--no-compress-output", &no_compress_output,
                     "do not gzip output files"));
+        config.add(new ConfigParam<int>
+                   ("", "--compress-threads", "<threads>",
+                    &compress_threads, 0,
+                    "worker threads compressing each gzipped output file"
+                    " (default=0, compress in the writing thread)",
+                    ADVANCED_OPT));
+        config.add(new ConfigSwitch
+                   ("", "--smc-binary", &smc_binary,
+                    "write sampled ARGs in binary .smcb format"));
         config.add(new ConfigParam<int>
                    ("-x", "--randseed", "<random seed>", &randseed, 0,
                     "seed for random number generator (default=current time)"));
@@ -475,6 +510,37 @@ public:
                     &resample_window_iters, 10,
                     "number of iterations per sliding window for resampling"
                     " (default=10)", ADVANCED_OPT));
+        config.add(new ConfigParam<string>
+                   ("", "--forward-kernel", "auto|scalar|avx2|avx512",
+                    &forward_kernel, "auto",
+                    "instruction set for the forward algorithm. SIMD kernels"
+                    " agree with the scalar kernel to within rounding error"
+                    " (default=auto, best supported by CPU)", ADVANCED_OPT));
+        config.add(new ConfigParam<double>
+                   ("", "--forward-memory-budget", "<megabytes>",
+                    &forward_memory_budget, 0.0,
+                    "memory budget for the forward table of each thread."
+                    " Larger tables store only checkpoint columns and are"
+                    " partly recomputed during traceback. -1 uses"
+                    " sqrt(length) columns per checkpoint"
+                    " (default=0, store full table)", ADVANCED_OPT));
+        config.add(new ConfigSwitch
+                   ("", "--forward-single", &forward_single,
+                    "store forward tables in single precision with a log"
+                    " scale factor per column (halves forward table memory)",
+                    ADVANCED_OPT));
+        config.add(new ConfigParam<int>
+                   ("", "--matrix-threads", "<threads>",
+                    &matrix_threads, 0,
+                    "worker threads computing HMM matrices ahead of the"
+                    " forward algorithm (default=0, compute in the sampling"
+                    " thread)", ADVANCED_OPT));
+        config.add(new ConfigParam<int>
+                   ("", "--window-threads", "<threads>",
+                    &window_threads, 0,
+                    "threads resampling disjoint windows of the sliding"
+                    " window sweep concurrently (default=0, one window at a"
+                    " time)", ADVANCED_OPT));
 
 
         // help information
@@ -551,6 +617,75 @@ public:
         printLog(LOG_LOW, "mcmcmc_group=%i\n", mcmcmc_group);
 #endif
 
+        // select forward algorithm kernel
+        ForwardKernel kernel;
+        if (!parse_forward_kernel(forward_kernel.c_str(), &kernel)) {
+            printError("unknown --forward-kernel '%s'",
+                       forward_kernel.c_str());
+            return EXIT_ERROR;
+        }
+        if (!set_forward_kernel(kernel)) {
+            printError("--forward-kernel '%s' is not supported by this CPU",
+                       forward_kernel.c_str());
+            return EXIT_ERROR;
+        }
+        set_forward_memory_budget(forward_memory_budget);
+        set_forward_single_precision(forward_single);
+        if (matrix_threads < 0) {
+            printError("--matrix-threads must be non-negative");
+            return EXIT_ERROR;
+        }
+        set_matrix_threads(matrix_threads);
+        if (window_threads < 0) {
+            printError("--window-threads must be non-negative");
+            return EXIT_ERROR;
+        }
+        set_window_threads(window_threads);
+        if (compress_threads < 0) {
+            printError("--compress-threads must be non-negative");
+            return EXIT_ERROR;
+        }
+        set_compress_threads(compress_threads);
+
+        if (chunk_size < 0 || chunk_flank < 0 || chunk_threads < 1) {
+            printError("--chunk-size and --chunk-flank must be non-negative"
+                       " and --chunk-threads must be positive");
+            return EXIT_ERROR;
+        }
+        if (chunk_size > 0) {
+#ifdef ARGWEAVER_MPI
+            printError("--chunk-size cannot be used with MPI");
+            return EXIT_ERROR;
+#endif
+            if (resume || arg_file != "" || ts != "" ||
+                resample_region_str != "" || mcmcmc_threads > 1) {
+                printError("--chunk-size cannot be used with --resume,"
+                           " --arg-file, --ts, --resample-region or"
+                           " --mcmcmc-threads");
+                return EXIT_ERROR;
+            }
+        }
+
+        if (mcmcmc_threads < 0) {
+            printError("--mcmcmc-threads must be non-negative");
+            return EXIT_ERROR;
+        }
+        if (mcmcmc_threads > 1) {
+#ifdef ARGWEAVER_MPI
+            printError("--mcmcmc-threads cannot be used with MPI");
+            return EXIT_ERROR;
+#endif
+            if (resume) {
+                printError("--mcmcmc-threads cannot be used with --resume");
+                return EXIT_ERROR;
+            }
+            if (mcmcmc_heat * (mcmcmc_threads - 1) >= 1.0) {
+                printError("--mcmcmc-heat is too large for %d chains",
+                           mcmcmc_threads);
+                return EXIT_ERROR;
+            }
+        }
+
         return 0;
     }
 
@@ -612,11 +747,12 @@ public:
     double pseudocount;
 
 #ifdef ARGWEAVER_MPI
-    double mcmcmc_heat;
     int mcmcmc_group;
     int mcmcmc_numgroup;
     bool mpi;
 #endif
+    double mcmcmc_heat;
+    int mcmcmc_threads;
     string mcmcmc_prefix;
     bool no_sample_arg;
     bool no_resample_mig;
@@ -628,6 +764,9 @@ public:
     int niters;
     string resample_region_str;
     int resample_region[2];
+    int chunk_size;
+    int chunk_flank;
+    int chunk_threads;
     bool resume;
     bool overwrite;
     string resume_stage;
@@ -635,11 +774,18 @@ public:
     int resample_window;
     int resample_window_iters;
     bool gibbs;
+    string forward_kernel;
+    double forward_memory_budget;
+    bool forward_single;
+    int matrix_threads;
+    int window_threads;
 
     // misc
     int compress_seq;
     int sample_step;
     bool no_compress_output;
+    int compress_threads;
+    bool smc_binary;
     int randseed;
     double prob_path_switch;
     bool infsites;
@@ -666,6 +812,7 @@ public:
 
     // logging
     FILE *stats_file;
+    vector<FILE*> mcmcmc_stats_files;  // stats file of each (MC)^3 group
 };
 
 
@@ -772,11 +919,9 @@ void print_stats(FILE *stats_file, const char *stage, int iter,
     int nrecombs = trees->get_num_trees() - 1;
 
     // calculate number of non-compatiable sites
-    int nseqs = trees->get_num_leaves();
-    char *seqs[nseqs];
-    for (int i=0; i<nseqs; i++)
-        seqs[i] = sequences->seqs[trees->seqids[i]];
-    int noncompats = count_noncompat(trees, seqs, nseqs, sequences->length());
+    ArgScores compressed_scores(false, false, false, true);
+    calc_arg_scores(model, sequences, trees, &compressed_scores);
+    int noncompats = compressed_scores.noncompat;
 
     // get memory usage in MB
     double maxrss = get_max_memory_usage() / 1000.0;
@@ -791,13 +936,14 @@ void print_stats(FILE *stats_file, const char *stage, int iter,
         sites_mapping->uncompress(invisible_recomb_pos0, invisible_recomb_pos);
     }
 
-    double prior = calc_arg_prior(model, trees, NULL, NULL, -1, -1,
-                                  invisible_recomb_pos, invisible_recombs);
-    double prior2 = calc_arg_prior_recomb_integrate(model, trees, NULL, NULL, NULL);
-    double likelihood = config->all_masked ? 0.0 :
-        calc_arg_likelihood(model, sequences, trees,
-                            sites_mapping,
-                            maskmap_uncompressed);
+    // only blocks changed since the last call are scored again
+    ArgScores scores(true, true, !config->all_masked);
+    calc_arg_scores(model, sequences, trees, &scores, sites_mapping,
+                    maskmap_uncompressed, invisible_recomb_pos,
+                    invisible_recombs);
+    double prior = scores.prior;
+    double prior2 = scores.prior2;
+    double likelihood = scores.likelihood;
     double joint = prior + likelihood;
     double arglen = get_arglen(trees, model->times);
 
@@ -864,7 +1010,18 @@ string get_out_arg_file(const Config &config, int iter)
 {
     char iterstr[10];
     snprintf(iterstr, 10, ".%d", iter);
-    return config.out_prefix + config.mcmcmc_prefix + iterstr + SMC_SUFFIX;
+    return config.out_prefix + config.mcmcmc_prefix + iterstr +
+        (config.smc_binary ? SMC_BINARY_SUFFIX : SMC_SUFFIX);
+}
+
+// Returns the iteration-specific ARG filename as written, which is gzipped
+// unless it is binary or compression is turned off
+string get_out_arg_path(const Config &config, int iter)
+{
+    string arg_file = get_out_arg_file(config, iter);
+    if (!config.no_compress_output && !config.smc_binary)
+        arg_file += ".gz";
+    return arg_file;
 }
 
 string get_out_ts_file(const Config &config, int iter){
@@ -894,6 +1051,45 @@ string get_out_sites_file(const Config &config, int iter)
     return sitesfile;
 }
 
+// Returns the filename of the saved random stream
+string get_out_rand_file(const Config &config)
+{
+    return config.out_prefix + config.mcmcmc_prefix + RAND_SUFFIX;
+}
+
+// Saves the random stream of the calling thread after iteration 'iter'
+bool log_rand_state(const Config *config, int iter)
+{
+    string out_rand_file = get_out_rand_file(*config);
+    FILE *outfile = fopen(out_rand_file.c_str(), "w");
+    if (!outfile) {
+        printError("cannot write '%s'", out_rand_file.c_str());
+        return false;
+    }
+    fprintf(outfile, "%d\t", iter);
+    get_rand_stream().write(outfile);
+    fclose(outfile);
+    return true;
+}
+
+// Restores the random stream saved after iteration 'iter'
+bool read_rand_state(const Config *config, int iter)
+{
+    string rand_file = get_out_rand_file(*config);
+    FILE *infile = fopen(rand_file.c_str(), "r");
+    if (!infile)
+        return false;
+
+    int iter2;
+    RandStream stream;
+    bool found = (fscanf(infile, "%d", &iter2) == 1 && iter2 == iter &&
+                  stream.read(infile));
+    fclose(infile);
+    if (found)
+        get_rand_stream() = stream;
+    return found;
+}
+
 bool log_sequences(string chrom, const Sequences *sequences,
                    const Config *config,
                    const SitesMapping *sites_mapping, int iter) {
@@ -917,10 +1113,8 @@ bool log_local_trees(const ArgModel *model, const Sequences *sequences,
                      const vector<int> &self_recomb_pos0=vector<int>(),
                      const vector<Spr> &self_recombs=vector<Spr>())
 {
-    string out_arg_file = get_out_arg_file(*config, iter);
+    string out_arg_file = get_out_arg_path(*config, iter);
     const vector<int> *self_recomb_ptr;
-    if (!config->no_compress_output)
-        out_arg_file += ".gz";
 
     // write local trees uncompressed
     vector<int> self_recomb_pos1;
@@ -930,18 +1124,25 @@ bool log_local_trees(const ArgModel *model, const Sequences *sequences,
         self_recomb_ptr = &self_recomb_pos1;
     } else self_recomb_ptr = &self_recomb_pos0;
 
-    // setup output stream
-    CompressStream stream(out_arg_file.c_str(), "w");
-    if (!stream.stream) {
-        printError("cannot write '%s'", out_arg_file.c_str());
-        return false;
-    }
+    if (config->smc_binary) {
+        if (!write_local_trees_binary(out_arg_file.c_str(), trees,
+                                      *sequences, model->times,
+                                      model->ntimes, model->pop_tree != NULL,
+                                      *self_recomb_ptr, self_recombs))
+            return false;
+    } else {
+        // setup output stream
+        CompressStream stream(out_arg_file.c_str(), "w");
+        if (!stream.stream) {
+            printError("cannot write '%s'", out_arg_file.c_str());
+            return false;
+        }
 
+        write_local_trees(stream.stream, trees, sequences, model->times,
+                          model->pop_tree != NULL,
+                          *self_recomb_ptr, self_recombs);
+    }
 
-    write_local_trees(stream.stream, trees, sequences, model->times,
-                      model->pop_tree != NULL,
-                      *self_recomb_ptr, self_recombs);
-    
     if (config->record_ts){
         string out_ts_file = get_out_ts_file(*config, iter);
         write_local_trees_ts(out_ts_file.c_str(), trees, sequences, sites_mapping, model->times);
@@ -1000,13 +1201,8 @@ bool read_doubles(const char *filename, vector<double> &values) {
 bool read_init_arg(const char *arg_file, const ArgModel *model,
                    LocalTrees *trees, vector<string> &seqnames)
 {
-    CompressStream stream(arg_file, "r");
-    if (!stream.stream) {
-        printError("cannot read '%s'", arg_file);
-        return false;
-    }
-    return read_local_trees(stream.stream, model->times, model->ntimes,
-                            trees, seqnames);
+    return read_arg_file(arg_file, model->times, model->ntimes,
+                         trees, seqnames);
 }
 
 bool read_init_ts(const char *ts_fileName, const ArgModel *model, LocalTrees *trees, vector<string> &seqnames,
@@ -1068,6 +1264,17 @@ void climb_arg(ArgModel *model, Sequences *sequences, LocalTrees *trees,
     printLog(LOG_LOW, "\n");
 }
 
+// output file prefix of an (MC)^3 group
+string mcmcmc_group_prefix(int group)
+{
+    if (group == 0)
+        return "";
+    char tmp[100];
+    snprintf(tmp, 100, ".%i", group);
+    return string(tmp);
+}
+
+
 void mcmcmc_swap(Config *config, ArgModel *model, const Sequences *sequences,
                  const LocalTrees *trees, const SitesMapping *sites_mapping) {
 #ifdef ARGWEAVER_MPI
@@ -1164,6 +1371,34 @@ void mcmcmc_swap(Config *config, ArgModel *model, const Sequences *sequences,
             }
         }
     }
+#else
+    Mc3Config *mc3 = &(model->mc3);
+    if (mc3->chains == NULL)
+        return;
+
+    // only the chains in the two proposed groups take part in the swap
+    int swap[2];
+    mc3->chains->propose(swap);
+    if (mc3->group != swap[0] && mc3->group != swap[1])
+        return;
+
+    // joint probability of the compressed ARG, as used by the sampler
+    const int group = mc3->group;
+    ArgScores scores;
+    calc_arg_scores(model, sequences, trees, &scores);
+    double lnl = scores.prior + scores.likelihood;
+    double swapstats[4];
+    bool accept = mc3->chains->exchange(mc3, swap, lnl, swapstats);
+    if (group == swap[0])
+        printLog(LOG_LOW, "swap\t%i\t%i\t%f\t%f\t%f\t%s\n",
+                 swap[0], swap[1], swapstats[1], swapstats[2], swapstats[3],
+                 accept ? "accept" : "reject");
+
+    // write the outputs of the new group (files stay open)
+    if (accept) {
+        config->stats_file = config->mcmcmc_stats_files[mc3->group];
+        config->mcmcmc_prefix = mcmcmc_group_prefix(mc3->group);
+    }
 #endif
 }
 
@@ -1185,9 +1420,16 @@ void resample_arg_all(ArgModel *model, Sequences *sequences, LocalTrees *trees,
 
     // set iteration counter
     int iter = 1;
-    if (config->resume)
+    if (config->resume) {
         iter = config->resume_iter + 1;
-    else {
+        if (read_rand_state(config, config->resume_iter))
+            printLog(LOG_LOW, "restored random stream of iteration %d\n",
+                     config->resume_iter);
+        else
+            printLog(LOG_LOW, "no random stream saved for iteration %d, "
+                     "continuing from random seed %d\n",
+                     config->resume_iter, config->randseed);
+    } else {
         // save first ARG (iter=0)
         printLog(LOG_LOW, "saving first ARG...\n");
         print_stats(config->stats_file, "resample", 0, model, sequences, trees,
@@ -1198,6 +1440,7 @@ void resample_arg_all(ArgModel *model, Sequences *sequences, LocalTrees *trees,
         printLog(LOG_LOW, "log_local_trees done\n");
         if (config->sample_phase_step > 0)
             log_sequences(trees->chrom, sequences, config, sites_mapping, 0);
+        log_rand_state(config, 0);
     }
 
 
@@ -1217,8 +1460,10 @@ void resample_arg_all(ArgModel *model, Sequences *sequences, LocalTrees *trees,
         Timer timer;
         double heat = model->mc3.heat;
         if (model->pop_tree != NULL && i >= config->start_mig_iter) {
-            if (model->pop_tree->max_migrations != config->max_migrations)
+            if (model->pop_tree->max_migrations != config->max_migrations) {
                 printLog(LOG_LOW, "Changing max_migrations to %i\n", config->max_migrations);
+                clear_time_trans_cache();
+            }
             model->pop_tree->max_migrations = config->max_migrations;
         }
 
@@ -1264,6 +1509,9 @@ void resample_arg_all(ArgModel *model, Sequences *sequences, LocalTrees *trees,
         }
 
 
+        // keep the nodes of neighboring trees together in memory
+        trees->compact();
+
         // logging
         print_stats(config->stats_file, "resample", i, model, sequences, trees,
                     sites_mapping, config, maskmap_orig,
@@ -1276,6 +1524,10 @@ void resample_arg_all(ArgModel *model, Sequences *sequences, LocalTrees *trees,
 
         if (config->sample_phase_step > 0 && i%config->sample_phase_step == 0)
             log_sequences(trees->chrom, sequences, config, sites_mapping, i);
+
+        // save random stream for resuming from this iteration
+        if (i % config->sample_step == 0 && ! config->no_sample_arg)
+            log_rand_state(config, i);
     }
     printLog(LOG_LOW, "\n");
 }
@@ -1347,6 +1599,90 @@ void sample_arg(ArgModel *model, Sequences *sequences, LocalTrees *trees,
 }
 
 
+// sample one (MC)^3 chain using its own random stream
+void sample_arg_chain(RandStream *rand_stream, ArgModel *model,
+                      Sequences *sequences, LocalTrees *trees,
+                      SitesMapping* sites_mapping, Config *config,
+                      const TrackNullValue *maskmap_orig)
+{
+    set_rand_stream(rand_stream);
+    sample_arg(model, sequences, trees, sites_mapping, config, maskmap_orig);
+    set_rand_stream(NULL);
+}
+
+
+// Run (MC)^3 chains as threads of this process.  Chain i starts in group
+// i.  The chains share the sequences and sites mapping, and swap heats in
+// memory (see mcmcmc_swap).  Each group writes to its own output files.
+// Every chain draws from its own random stream of the seed, so a run is
+// reproducible from --randseed.
+bool sample_arg_mcmcmc_threads(ArgModel *model, Sequences *sequences,
+                               LocalTrees *trees, SitesMapping* sites_mapping,
+                               Config *config,
+                               const TrackNullValue *maskmap_orig)
+{
+    const int nchains = config->mcmcmc_threads;
+    Mc3ThreadChains chains(nchains, config->randseed);
+
+    // open stats files of heated groups
+    config->mcmcmc_stats_files.assign(1, config->stats_file);
+    for (int i=1; i<nchains; i++) {
+        string stats_filename = config->out_prefix + mcmcmc_group_prefix(i)
+            + STATS_SUFFIX;
+        FILE *stats_file = fopen(stats_filename.c_str(), "w");
+        if (!stats_file) {
+            printError("could not open stats file '%s'",
+                       stats_filename.c_str());
+            for (int j=1; j<i; j++)
+                fclose(config->mcmcmc_stats_files[j]);
+            return false;
+        }
+        config->mcmcmc_stats_files.push_back(stats_file);
+    }
+
+    // setup chains
+    vector<unique_ptr<Config> > chain_configs;
+    vector<unique_ptr<ArgModel> > chain_models;
+    vector<unique_ptr<LocalTrees> > chain_trees;
+    vector<RandStream> chain_streams;
+    for (int i=0; i<nchains; i++) {
+        Config *chain_config = new Config(*config);
+        chain_config->mcmcmc_prefix = mcmcmc_group_prefix(i);
+        chain_config->stats_file = config->mcmcmc_stats_files[i];
+        chain_configs.push_back(unique_ptr<Config>(chain_config));
+
+        ArgModel *chain_model = new ArgModel(*model);
+        chain_model->mc3 = Mc3Config(i, config->mcmcmc_heat, &chains);
+        chain_models.push_back(unique_ptr<ArgModel>(chain_model));
+
+        LocalTrees *chain_tree = new LocalTrees();
+        chain_tree->copy(*trees);
+        chain_trees.push_back(unique_ptr<LocalTrees>(chain_tree));
+
+        // stream 0 of the seed is used by the swaps
+        chain_streams.push_back(RandStream(config->randseed, i + 1));
+    }
+
+    printLog(LOG_LOW, "running %d (MC)^3 chains as threads"
+             " (heat interval %g)\n", nchains, config->mcmcmc_heat);
+    vector<thread> threads;
+    for (int i=0; i<nchains; i++)
+        threads.push_back(thread(sample_arg_chain, &chain_streams[i],
+                                 chain_models[i].get(), sequences,
+                                 chain_trees[i].get(), sites_mapping,
+                                 chain_configs[i].get(), maskmap_orig));
+    for (int i=0; i<nchains; i++)
+        threads[i].join();
+
+    // group 0 stats file is closed by the caller
+    for (int i=1; i<nchains; i++)
+        fclose(config->mcmcmc_stats_files[i]);
+    config->mcmcmc_stats_files.clear();
+
+    return true;
+}
+
+
 //=============================================================================
 
 bool parse_status_line(const char* line, Config &config,
@@ -1521,308 +1857,101 @@ bool ensure_output_dir(const char *outdir)
 //=============================================================================
 
 
-int main(int argc, char **argv)
-{
-
-#ifdef ARGWEAVER_MPI
-    MPI::Init(argc, argv);
-#endif
-
-    // parse command line arguments
-    Config c;
-    int ret = c.parse_args(argc, argv);
-    if (ret)
-        return ret;
-
-    // ensure output dir
-    if (!ensure_output_dir(c.out_prefix.c_str()))
-        return EXIT_ERROR;
+//=============================================================================
+// sampling a region
 
-    // check overwriting
-    if (!check_overwrite(c))
-        return EXIT_ERROR;
+// Sample an ARG for 'sites' over 'seq_region', from masking and compressing
+// the sites to writing the samples.  Returns 0 on success.
+int sample_region(Config &c, Sites &sites, const Region &seq_region)
+{
+    Sequences sequences;
+    SitesMapping *sites_mapping = NULL;
+    unique_ptr<SitesMapping> sites_mapping_ptr;
+    Region seq_region_compress;
 
-    // setup logging
-    set_up_logging(c, c.verbose, (c.resume ? "a" : "w"));
+    printLog(LOG_LOW, "length of reference seq: %d\n", sites.ref.size());
+    //read in masks
+    vector<TrackNullValue> ind_maskmap;
+    for (int i=0; i < sites.get_num_seqs(); i++)
+        ind_maskmap.push_back(TrackNullValue());
+    if (c.ind_maskmap != "") {
+        FILE *infile = fopen(c.ind_maskmap.c_str(), "r");
+        if (infile == NULL) {
+            fprintf(stderr, "Error opening ind_maskmap %s\n", c.ind_maskmap.c_str());
+            return EXIT_ERROR;
+        }
+        char ind[10000], maskfile[100000];
+        while (EOF != fscanf(infile, "%s %s", ind, maskfile)) {
+            CompressStream stream(maskfile, "r");
+            TrackNullValue indmask;
+            if (!stream.stream ||
+                !read_track_filter(stream.stream, &indmask, seq_region)) {
+                printError("cannot read mask %s for ind %s\n", maskfile, ind);
+                return EXIT_ERROR;
+            }
+            apply_mask_sites(&sites, indmask, ind, &ind_maskmap);
+        }
+        fclose(infile);
+    }
 
-    // try to resume a previous run
-    if (!setup_resume(c)) {
-        printError("resume failed.");
-        if (c.overwrite) {
-            c.resume = false;
-            printLog(LOG_LOW, "Resume failed.  Sampling will start from scratch"
-                     " since overwrite is enabled.\n");
-        } else {
+    TrackNullValue maskmap_orig;
+    TrackNullValue maskmap = sites.remove_masked();
+    if (c.maskmap != "") {
+        //read mask
+        printLog(LOG_LOW, "Reading %s\n", c.maskmap.c_str());
+        TrackNullValue curr_maskmap;
+        CompressStream stream(c.maskmap.c_str(), "r");
+        if (!stream.stream ||
+            !read_track_filter(stream.stream, &curr_maskmap, seq_region)) {
+            printError("cannot read mask map '%s'",
+                       c.maskmap.c_str());
             return EXIT_ERROR;
         }
+        maskmap.merge_tracks(curr_maskmap);
     }
+    c.all_masked=false;
 
-#ifdef ARGWEAVER_MPI
-    if (c.mpi) {
-        int numcore = MPI::COMM_WORLD.Get_size();
-        if (numcore % c.mcmcmc_numgroup != 0) {
-            fprintf(stderr, "Error: number of cores should be evenly divisible"
-                    " by number of mcmcmc threads");
+    if (c.maskN >= 0) {
+        TrackNullValue maskNmap = get_n_regions(sites, c.maskN);
+        maskmap.merge_tracks(maskNmap);
+    }
+
+    if (c.mask_cluster != "") {
+        int numsnp, window;
+        if (2 != sscanf(c.mask_cluster.c_str(), "%i,%i", &numsnp, &window)) {
+            printError("Bad format in mask_cluster agument; expect numsnp,windowSize");
+            return EXIT_ERROR;
         }
-        int groupsize = numcore / c.mcmcmc_numgroup;
-        int sites_num = MPI::COMM_WORLD.Get_rank() % groupsize;
-        char tmp[10000];
-        sprintf(tmp, "%s%i.sites", c.sites_file.c_str(),
-                sites_num);
-        c.sites_file = (string)tmp;
-        sprintf(tmp, "%s%i", c.out_prefix.c_str(),
-                sites_num);
-        c.out_prefix = (string)tmp;
-        /*        if (c.cr_file != "") {
-            sprintf(tmp, "%s%i.cr.gz", c.cr_file.c_str(), sites_num);
-            c.cr_file = (string)tmp;
-            }*/
-	if (c.arg_file != "") {
-	    sprintf(tmp, "%s%i.smc.gz", c.arg_file.c_str(), sites_num);
-	    c.arg_file = (string)tmp;
-	}
+        TrackNullValue cluster_mask = get_snp_clusters(sites, numsnp, window);
+        maskmap.merge_tracks(cluster_mask);
     }
-#endif
 
+    if (maskmap.size() > 0 && sites.get_num_sites() > 0) {
+        int old_num_sites = sites.get_num_sites();
+        // this is done so that compression is not affected by missing data
+        // sites (because compression does not actually reduce the number of
+        // sites and will fail if too many sites exist). After compression,
+        // sites are converted to sequences and a compressed mask applied
+        sites.remove_overlapping(maskmap);
+        int new_num_sites = sites.get_num_sites();
+        printLog(LOG_LOW, "Removed %i sites overlapping mask (old=%i , new=%i)\n",
+                 old_num_sites - new_num_sites, old_num_sites, new_num_sites);
+    }
 
+    // before compression unmask everything; do not want masked sites to
+    // prevent compression- reapply masks after compression
+    if (sites.get_num_sites() > 0) {
+        unmask_inds(&sites, &ind_maskmap);
+        int nremove = sites.remove_invariant();
+        printLog(LOG_LOW, "%i sites are partially masked but otherwise invariant\n",
+                 nremove);
+    }
 
-    // log intro
-    if (c.resume)
-        printLog(LOG_LOW, "RESUME\n");
-    log_intro(LOG_LOW);
-    log_prog_commands(LOG_LOW, argc, argv);
-    Timer timer;
+    // compress sequences
+    // first remove any sites that fall under mask
 
-
-    // init random number generator
-    if (c.randseed == 0)
-        c.randseed = time(NULL);
-#ifdef ARGWEAVER_MPI
-    if (MPI::COMM_WORLD.Get_rank()==0) {
-        for (int i=1; i < MPI::COMM_WORLD.Get_size(); i++) {
-            int seed = irand(12581020);
-            MPI::COMM_WORLD.Send(&seed, 1, MPI::INT, i, 13);
-        }
-    } else {
-        MPI::COMM_WORLD.Recv(&c.randseed, 1, MPI::INT, 0, 13);
-    }
-#endif
-    srand(c.randseed);
-    printLog(LOG_LOW, "random seed: %d\n", c.randseed);
-
-    // read sequences
-    Sites sites;
-    Sequences sequences;
-    SitesMapping *sites_mapping = NULL;
-    unique_ptr<SitesMapping> sites_mapping_ptr;
-    Region seq_region;
-    Region seq_region_compress;
-
-    set<string> keep_inds;
-
-    if (c.subsites_file != "") {
-        FILE *infile;
-        if (!(infile = fopen(c.subsites_file.c_str(), "r"))) {
-            printError("Could not open subsites file %s",
-                       c.subsites_file.c_str());
-            return false;
-        }
-        char name[10000];
-        while (EOF != fscanf(infile, "%s", name))
-            keep_inds.insert(string(name));
-        fclose(infile);
-    }
-
-    if (c.fasta_file != "") {
-        // read FASTA file
-
-        if (!read_fasta(c.fasta_file.c_str(), &sequences)) {
-            printError("could not read fasta file");
-            return EXIT_ERROR;
-        }
-        seq_region.set("chr", 0, sequences.length());
-
-        printLog(LOG_LOW, "read input sequences (nseqs=%d, length=%d)\n",
-                 sequences.get_num_seqs(), sequences.length());
-
-        make_sites_from_sequences(&sequences, &sites);
-    } else if (c.sites_file != "") {
-        // read sites file
-
-        // parse subregion if given
-        int subregion[2] = {-1, -1};
-        if (c.subregion_str != "") {
-            if (!parse_region(c.subregion_str.c_str(),
-                              &subregion[0], &subregion[1])) {
-                printError("subregion is not specified as 'start-end'");
-                return EXIT_ERROR;
-            }
-            subregion[0] -= 1; // convert to 0-index
-        }
-
-        // read sites
-        CompressStream stream(c.sites_file.c_str());
-        if (!stream.stream ||
-            !read_sites(stream.stream, &sites, subregion[0], subregion[1])) {
-            printError("could not read sites file");
-            return EXIT_ERROR;
-        }
-        stream.close();
-
-        printLog(LOG_LOW, "read input sites (chrom=%s, start=%d, end=%d, "
-                 "length=%d, nseqs=%d, nsites=%d)\n",
-                 sites.chrom.c_str(), sites.start_coord, sites.end_coord,
-                 sites.length(), sites.get_num_seqs(),
-                 sites.get_num_sites());
-
-        // sanity check for sites
-        if (sites.get_num_sites() == 0) {
-            printLog(LOG_LOW, "no sites given.  terminating.\n");
-            return EXIT_ERROR;
-        }
-        seq_region.set(sites.chrom, sites.start_coord, sites.end_coord);
-    } else if (c.vcf_file != "") {
-        if (c.vcf_list_file != "") {
-            printLog(LOG_LOW, "Cannot use both --vcf-file and --vcf-list-file. Terminating\n");
-            return EXIT_ERROR;
-        }
-        
-        if (!read_vcf(c.vcf_file, &sites, c.subregion_str,
-                      c.vcf_min_qual, c.vcf_filter, c.use_genotype_probs,
-                      c.mask_uncertain, false, c.tabix_dir, keep_inds)) {
-            printError("Could not read VCF file");
-            return EXIT_ERROR;
-        }
-        printLog(LOG_LOW, "read input sites from VCF (chrom=%s, start=%d, end=%d, length=%d, nseqs=%d, nsites=%d)\n",
-                 sites.chrom.c_str(), sites.start_coord, sites.end_coord,
-                 sites.length(), sites.get_num_seqs(),
-                 sites.get_num_sites());
-        if (sites.get_num_sites() == 0) {
-            printLog(LOG_LOW, "no sites given.  terminating.\n");
-            return EXIT_ERROR;
-        }
-        seq_region.set(sites.chrom, sites.start_coord, sites.end_coord);
-    } else if (c.vcf_list_file != "") {
-        vector<string> vcf_files;
-        FILE *infile;
-        if (!(infile= fopen(c.vcf_list_file.c_str(), "r"))) {
-            printError("Could not open vcf_list_file %s\n", c.vcf_list_file.c_str());
-            return false;
-        }
-        char *tmpstr;
-        while (NULL != (tmpstr = fgetline(infile))) {
-            tmpstr = trim(tmpstr);
-            if (strlen(tmpstr) > 0)
-                vcf_files.push_back(string(tmpstr));
-            delete [] tmpstr;
-
-        }
-        if (!read_vcfs(vcf_files, &sites, c.subregion_str,
-                       c.vcf_min_qual, c.vcf_filter, c.use_genotype_probs,
-                       c.mask_uncertain, c.tabix_dir, keep_inds)) {
-            printError("Error reading VCF files\n");
-            return EXIT_ERROR;
-        }
-        seq_region.set(sites.chrom, sites.start_coord, sites.end_coord);
-    } else {
-        // no input sequence specified
-        printError("must specify sequences (use --fasta or --sites)");
-        return EXIT_ERROR;
-    }
-
-    if (c.rename_file != "")
-        sites.rename(c.rename_file);
-
-    if (keep_inds.size() > 0) {
-        if (sites.subset(keep_inds)) {
-            printError("Error subsetting sites\n");
-            return false;
-        }
-    }
-
-    printLog(LOG_LOW, "length of reference seq: %d\n", sites.ref.size());
-    //read in masks
-    vector<TrackNullValue> ind_maskmap;
-    for (int i=0; i < sites.get_num_seqs(); i++)
-        ind_maskmap.push_back(TrackNullValue());
-    if (c.ind_maskmap != "") {
-        FILE *infile = fopen(c.ind_maskmap.c_str(), "r");
-        if (infile == NULL) {
-            fprintf(stderr, "Error opening ind_maskmap %s\n", c.ind_maskmap.c_str());
-            return EXIT_ERROR;
-        }
-        char ind[10000], maskfile[100000];
-        while (EOF != fscanf(infile, "%s %s", ind, maskfile)) {
-            CompressStream stream(maskfile, "r");
-            TrackNullValue indmask;
-            if (!stream.stream ||
-                !read_track_filter(stream.stream, &indmask, seq_region)) {
-                printError("cannot read mask %s for ind %s\n", maskfile, ind);
-                return EXIT_ERROR;
-            }
-            apply_mask_sites(&sites, indmask, ind, &ind_maskmap);
-        }
-        fclose(infile);
-    }
-
-    TrackNullValue maskmap_orig;
-    TrackNullValue maskmap = sites.remove_masked();
-    if (c.maskmap != "") {
-        //read mask
-        printLog(LOG_LOW, "Reading %s\n", c.maskmap.c_str());
-        TrackNullValue curr_maskmap;
-        CompressStream stream(c.maskmap.c_str(), "r");
-        if (!stream.stream ||
-            !read_track_filter(stream.stream, &curr_maskmap, seq_region)) {
-            printError("cannot read mask map '%s'",
-                       c.maskmap.c_str());
-            return EXIT_ERROR;
-        }
-        maskmap.merge_tracks(curr_maskmap);
-    }
-    c.all_masked=false;
-
-    if (c.maskN >= 0) {
-        TrackNullValue maskNmap = get_n_regions(sites, c.maskN);
-        maskmap.merge_tracks(maskNmap);
-    }
-
-    if (c.mask_cluster != "") {
-        int numsnp, window;
-        if (2 != sscanf(c.mask_cluster.c_str(), "%i,%i", &numsnp, &window)) {
-            printError("Bad format in mask_cluster agument; expect numsnp,windowSize");
-            return EXIT_ERROR;
-        }
-        TrackNullValue cluster_mask = get_snp_clusters(sites, numsnp, window);
-        maskmap.merge_tracks(cluster_mask);
-    }
-
-    if (maskmap.size() > 0 && sites.get_num_sites() > 0) {
-        int old_num_sites = sites.get_num_sites();
-        // this is done so that compression is not affected by missing data
-        // sites (because compression does not actually reduce the number of
-        // sites and will fail if too many sites exist). After compression,
-        // sites are converted to sequences and a compressed mask applied
-        sites.remove_overlapping(maskmap);
-        int new_num_sites = sites.get_num_sites();
-        printLog(LOG_LOW, "Removed %i sites overlapping mask (old=%i , new=%i)\n",
-                 old_num_sites - new_num_sites, old_num_sites, new_num_sites);
-    }
-
-    // before compression unmask everything; do not want masked sites to
-    // prevent compression- reapply masks after compression
-    if (sites.get_num_sites() > 0) {
-        unmask_inds(&sites, &ind_maskmap);
-        int nremove = sites.remove_invariant();
-        printLog(LOG_LOW, "%i sites are partially masked but otherwise invariant\n",
-                 nremove);
-    }
-
-    // compress sequences
-    // first remove any sites that fall under mask
-
-    sites_mapping = new SitesMapping();
-    sites_mapping_ptr = unique_ptr<SitesMapping>(sites_mapping);
+    sites_mapping = new SitesMapping();
+    sites_mapping_ptr = unique_ptr<SitesMapping>(sites_mapping);
 
     if (!find_compress_cols(&sites, c.compress_seq, sites_mapping)) {
         printError("unable to compress sequences at given compression level"
@@ -1884,6 +2013,11 @@ int main(int argc, char **argv)
         c.sample_phase_step=0;
     else if (c.sample_phase_step == 0 && c.model.unphased)
         c.sample_phase_step = c.sample_step;
+    if (c.mcmcmc_threads > 1 && c.model.unphased) {
+        // chains share one copy of the sequences
+        printError("--mcmcmc-threads cannot be used with unphased data");
+        return EXIT_ERROR;
+    }
 
     if (c.write_sites || c.write_sites_only) {
         log_sequences(sites.chrom, &sequences, &c, sites_mapping, -1);
@@ -2119,17 +2253,438 @@ int main(int argc, char **argv)
 
     // sample ARG
     printLog(LOG_LOW, "\n");
-    sample_arg(&model, &sequences, trees, sites_mapping, &c, &maskmap_orig);
+    if (c.mcmcmc_threads > 1) {
+        if (!sample_arg_mcmcmc_threads(&model, &sequences, trees,
+                                       sites_mapping, &c, &maskmap_orig))
+            return EXIT_ERROR;
+    } else {
+        sample_arg(&model, &sequences, trees, sites_mapping, &c,
+                   &maskmap_orig);
+    }
+
+    // clean up
+    fclose(c.stats_file);
+    return 0;
+}
+
+
+//=============================================================================
+// sampling a region in chunks
+
+// A chunk of the region.  Its ARG is sampled over [start, end), which
+// includes the flanks shared with its neighbors, but only [core_start,
+// core_end) is kept when the chunks are stitched together.
+struct RegionChunk
+{
+    int start;
+    int end;
+    int core_start;
+    int core_end;
+    unique_ptr<Config> config;
+    int status;
+};
+
+
+// Sample the chunks given out by 'next_chunk' until none are left.  Chunk
+// k draws from stream k+1 of the seed, so the samples do not depend on the
+// number of threads.  Each chunk logs to <prefix>.chunk<k>.log as a run of
+// its own would, so that its ARGs can be read with that log; only progress
+// is logged to the main log.
+void sample_chunks_worker(vector<RegionChunk> *chunks, const Sites *sites,
+                          atomic<int> *next_chunk, int argc, char **argv)
+{
+    while (true) {
+        const int k = (*next_chunk)++;
+        if (k >= (int) chunks->size())
+            break;
+        RegionChunk &chunk = (*chunks)[k];
+        const Config &config = *chunk.config;
+
+        printLog(LOG_LOW, "sampling chunk %d (%s:%d-%d)\n", k,
+                 sites->chrom.c_str(), chunk.start + 1, chunk.end);
+        Timer timer;
+        string log_filename = config.out_prefix + config.mcmcmc_prefix +
+            LOG_SUFFIX;
+        Logger logger(NULL, config.verbose);
+        if (!logger.openLogFile(log_filename.c_str(), "w")) {
+            printError("Could not open log file '%s'", log_filename.c_str());
+            chunk.status = EXIT_ERROR;
+            continue;
+        }
+        setThreadLogger(&logger);
+        log_intro(LOG_LOW);
+        log_prog_commands(LOG_LOW, argc, argv);
+
+        Sites chunk_sites;
+        make_sites_region(sites, chunk.start, chunk.end, &chunk_sites);
+        Region chunk_region(sites->chrom, chunk.start, chunk.end);
+
+        RandStream rand_stream(config.randseed, k + 1);
+        set_rand_stream(&rand_stream);
+        chunk.status = sample_region(*chunk.config, chunk_sites,
+                                     chunk_region);
+        set_rand_stream(NULL);
+
+        setThreadLogger(NULL);
+        logger.closeLogFile();
+        printTimerLog(timer, LOG_LOW, "sampled chunk %d:", k);
+    }
+}
+
+
+// Joins the core regions of the chunk ARGs of iteration 'iter' and writes
+// them as one BED file of local trees.  Returns false if a chunk has no ARG
+// for this iteration.
+bool stitch_chunks(const Config &c, const vector<RegionChunk> &chunks,
+                   int iter)
+{
+    // the ARGs of all chunks must have been saved
+    vector<string> arg_files;
+    for (unsigned int k=0; k<chunks.size(); k++) {
+        string arg_file = get_out_arg_path(*chunks[k].config, iter);
+        struct stat st;
+        if (stat(arg_file.c_str(), &st) != 0)
+            return false;
+        arg_files.push_back(arg_file);
+    }
+
+    char iterstr[20];
+    snprintf(iterstr, 20, ".%d", iter);
+    string out_file = c.out_prefix + iterstr + BED_SUFFIX;
+    if (!c.no_compress_output)
+        out_file += ".gz";
+    CompressStream out(out_file.c_str(), "w");
+    if (!out.stream) {
+        printError("cannot write '%s'", out_file.c_str());
+        return false;
+    }
+
+    for (unsigned int k=0; k<chunks.size(); k++) {
+        const ArgModel *model = &chunks[k].config->model;
+        LocalTrees *trees = new LocalTrees();
+        vector<string> seqnames;
+        if (!read_arg_file(arg_files[k].c_str(), model->times,
+                           model->ntimes, trees, seqnames)) {
+            printError("cannot read '%s'", arg_files[k].c_str());
+            delete trees;
+            return false;
+        }
+
+        // trim the flanks
+        LocalTrees *core = partition_local_trees(
+            trees, chunks[k].core_start, true);
+        delete trees;
+        delete partition_local_trees(core, chunks[k].core_end, true);
+
+        write_local_trees_as_bed(out.stream, core, seqnames, model, iter);
+        delete core;
+    }
+    return true;
+}
+
+
+// Sample the region in chunks with overlapping flanks on a pool of
+// threads, then stitch the samples of each iteration at the middle of the
+// overlaps.  The chunks share the sites that have already been read.
+int sample_chunks(Config &c, Sites &sites, const Region &seq_region,
+                  int argc, char **argv)
+{
+    // partition region into chunks
+    vector<RegionChunk> chunks;
+    for (int start=seq_region.start; start<seq_region.end;
+         start += c.chunk_size) {
+        RegionChunk chunk;
+        chunk.core_start = start;
+        chunk.core_end = min(start + c.chunk_size, seq_region.end);
+        chunk.start = max(start - c.chunk_flank, seq_region.start);
+        chunk.end = min(chunk.core_end + c.chunk_flank, seq_region.end);
+        chunk.status = 0;
+
+        char chunkstr[30];
+        snprintf(chunkstr, 30, ".chunk%d", (int) chunks.size());
+        chunk.config = unique_ptr<Config>(new Config(c));
+        chunk.config->out_prefix = c.out_prefix + chunkstr;
+        chunks.push_back(move(chunk));
+    }
+
+    const int nthreads = min(c.chunk_threads, (int) chunks.size());
+    printLog(LOG_LOW, "sampling %d chunks (size=%d, flank=%d) with %d"
+             " threads\n", (int) chunks.size(), c.chunk_size, c.chunk_flank,
+             nthreads);
+    atomic<int> next_chunk(0);
+    vector<thread> threads;
+    for (int i=1; i<nthreads; i++)
+        threads.push_back(thread(sample_chunks_worker, &chunks, &sites,
+                                 &next_chunk, argc, argv));
+    sample_chunks_worker(&chunks, &sites, &next_chunk, argc, argv);
+    for (unsigned int i=0; i<threads.size(); i++)
+        threads[i].join();
+
+    for (unsigned int k=0; k<chunks.size(); k++) {
+        if (chunks[k].status) {
+            printError("sampling chunk %d failed", k);
+            return chunks[k].status;
+        }
+    }
+
+    // stitch the saved iterations
+    int nstitched = 0;
+    for (int iter=0; iter<=c.niters; iter++) {
+        if (stitch_chunks(c, chunks, iter))
+            nstitched++;
+    }
+    printLog(LOG_LOW, "stitched %d samples of %d chunks\n", nstitched,
+             (int) chunks.size());
+
+    return 0;
+}
+
+
+int main(int argc, char **argv)
+{
+
+#ifdef ARGWEAVER_MPI
+    MPI::Init(argc, argv);
+#endif
+
+    // parse command line arguments
+    Config c;
+    int ret = c.parse_args(argc, argv);
+    if (ret)
+        return ret;
+
+    // ensure output dir
+    if (!ensure_output_dir(c.out_prefix.c_str()))
+        return EXIT_ERROR;
+
+    // check overwriting
+    if (!check_overwrite(c))
+        return EXIT_ERROR;
+
+    // setup logging
+    set_up_logging(c, c.verbose, (c.resume ? "a" : "w"));
+
+    // try to resume a previous run
+    if (!setup_resume(c)) {
+        printError("resume failed.");
+        if (c.overwrite) {
+            c.resume = false;
+            printLog(LOG_LOW, "Resume failed.  Sampling will start from scratch"
+                     " since overwrite is enabled.\n");
+        } else {
+            return EXIT_ERROR;
+        }
+    }
+
+#ifdef ARGWEAVER_MPI
+    if (c.mpi) {
+        int numcore = MPI::COMM_WORLD.Get_size();
+        if (numcore % c.mcmcmc_numgroup != 0) {
+            fprintf(stderr, "Error: number of cores should be evenly divisible"
+                    " by number of mcmcmc threads");
+        }
+        int groupsize = numcore / c.mcmcmc_numgroup;
+        int sites_num = MPI::COMM_WORLD.Get_rank() % groupsize;
+        char tmp[10000];
+        sprintf(tmp, "%s%i.sites", c.sites_file.c_str(),
+                sites_num);
+        c.sites_file = (string)tmp;
+        sprintf(tmp, "%s%i", c.out_prefix.c_str(),
+                sites_num);
+        c.out_prefix = (string)tmp;
+        /*        if (c.cr_file != "") {
+            sprintf(tmp, "%s%i.cr.gz", c.cr_file.c_str(), sites_num);
+            c.cr_file = (string)tmp;
+            }*/
+	if (c.arg_file != "") {
+	    sprintf(tmp, "%s%i.smc.gz", c.arg_file.c_str(), sites_num);
+	    c.arg_file = (string)tmp;
+	}
+    }
+#endif
+
+
+
+    // log intro
+    if (c.resume)
+        printLog(LOG_LOW, "RESUME\n");
+    log_intro(LOG_LOW);
+    log_prog_commands(LOG_LOW, argc, argv);
+    Timer timer;
+
+
+    // init random number generator
+    if (c.randseed == 0)
+        c.randseed = time(NULL);
+#ifdef ARGWEAVER_MPI
+    if (MPI::COMM_WORLD.Get_rank()==0) {
+        for (int i=1; i < MPI::COMM_WORLD.Get_size(); i++) {
+            int seed = irand(12581020);
+            MPI::COMM_WORLD.Send(&seed, 1, MPI::INT, i, 13);
+        }
+    } else {
+        MPI::COMM_WORLD.Recv(&c.randseed, 1, MPI::INT, 0, 13);
+    }
+#endif
+    seed_rand(c.randseed);
+    printLog(LOG_LOW, "random seed: %d\n", c.randseed);
+    printLog(LOG_LOW, "forward kernel: %s\n",
+             forward_kernel_name(get_forward_kernel()));
+    if (c.forward_memory_budget != 0.0)
+        printLog(LOG_LOW, "forward memory budget: %g MB\n",
+                 c.forward_memory_budget);
+    else if (c.forward_single)
+        printLog(LOG_LOW, "forward table: single precision\n");
+    if (c.matrix_threads > 0)
+        printLog(LOG_LOW, "matrix threads: %d\n", c.matrix_threads);
+    if (c.window_threads > 1)
+        printLog(LOG_LOW, "window threads: %d\n", c.window_threads);
+
+    // read sequences
+    Sites sites;
+    Sequences sequences;
+    Region seq_region;
+
+    set<string> keep_inds;
+
+    if (c.subsites_file != "") {
+        FILE *infile;
+        if (!(infile = fopen(c.subsites_file.c_str(), "r"))) {
+            printError("Could not open subsites file %s",
+                       c.subsites_file.c_str());
+            return false;
+        }
+        char name[10000];
+        while (EOF != fscanf(infile, "%s", name))
+            keep_inds.insert(string(name));
+        fclose(infile);
+    }
+
+    if (c.tabix_dir != "")
+        printLog(LOG_LOW, "Warning: --tabix-dir is deprecated and ignored;"
+                 " tabix-indexed files are read directly\n");
+
+    if (c.fasta_file != "") {
+        // read FASTA file
+
+        if (!read_fasta(c.fasta_file.c_str(), &sequences)) {
+            printError("could not read fasta file");
+            return EXIT_ERROR;
+        }
+        seq_region.set("chr", 0, sequences.length());
+
+        printLog(LOG_LOW, "read input sequences (nseqs=%d, length=%d)\n",
+                 sequences.get_num_seqs(), sequences.length());
+
+        make_sites_from_sequences(&sequences, &sites);
+    } else if (c.sites_file != "") {
+        // read sites file
+
+        // parse subregion if given
+        int subregion[2] = {-1, -1};
+        if (c.subregion_str != "") {
+            if (!parse_region(c.subregion_str.c_str(),
+                              &subregion[0], &subregion[1])) {
+                printError("subregion is not specified as 'start-end'");
+                return EXIT_ERROR;
+            }
+            subregion[0] -= 1; // convert to 0-index
+        }
+
+        // read sites
+        CompressStream stream(c.sites_file.c_str());
+        if (!stream.stream ||
+            !read_sites(stream.stream, &sites, subregion[0], subregion[1])) {
+            printError("could not read sites file");
+            return EXIT_ERROR;
+        }
+        stream.close();
+
+        printLog(LOG_LOW, "read input sites (chrom=%s, start=%d, end=%d, "
+                 "length=%d, nseqs=%d, nsites=%d)\n",
+                 sites.chrom.c_str(), sites.start_coord, sites.end_coord,
+                 sites.length(), sites.get_num_seqs(),
+                 sites.get_num_sites());
+
+        // sanity check for sites
+        if (sites.get_num_sites() == 0) {
+            printLog(LOG_LOW, "no sites given.  terminating.\n");
+            return EXIT_ERROR;
+        }
+        seq_region.set(sites.chrom, sites.start_coord, sites.end_coord);
+    } else if (c.vcf_file != "") {
+        if (c.vcf_list_file != "") {
+            printLog(LOG_LOW, "Cannot use both --vcf-file and --vcf-list-file. Terminating\n");
+            return EXIT_ERROR;
+        }
+        
+        if (!read_vcf(c.vcf_file, &sites, c.subregion_str,
+                      c.vcf_min_qual, c.vcf_filter, c.use_genotype_probs,
+                      c.mask_uncertain, false, c.tabix_dir, keep_inds)) {
+            printError("Could not read VCF file");
+            return EXIT_ERROR;
+        }
+        printLog(LOG_LOW, "read input sites from VCF (chrom=%s, start=%d, end=%d, length=%d, nseqs=%d, nsites=%d)\n",
+                 sites.chrom.c_str(), sites.start_coord, sites.end_coord,
+                 sites.length(), sites.get_num_seqs(),
+                 sites.get_num_sites());
+        if (sites.get_num_sites() == 0) {
+            printLog(LOG_LOW, "no sites given.  terminating.\n");
+            return EXIT_ERROR;
+        }
+        seq_region.set(sites.chrom, sites.start_coord, sites.end_coord);
+    } else if (c.vcf_list_file != "") {
+        vector<string> vcf_files;
+        FILE *infile;
+        if (!(infile= fopen(c.vcf_list_file.c_str(), "r"))) {
+            printError("Could not open vcf_list_file %s\n", c.vcf_list_file.c_str());
+            return false;
+        }
+        char *tmpstr;
+        while (NULL != (tmpstr = fgetline(infile))) {
+            tmpstr = trim(tmpstr);
+            if (strlen(tmpstr) > 0)
+                vcf_files.push_back(string(tmpstr));
+            delete [] tmpstr;
+
+        }
+        if (!read_vcfs(vcf_files, &sites, c.subregion_str,
+                       c.vcf_min_qual, c.vcf_filter, c.use_genotype_probs,
+                       c.mask_uncertain, c.tabix_dir, keep_inds)) {
+            printError("Error reading VCF files\n");
+            return EXIT_ERROR;
+        }
+        seq_region.set(sites.chrom, sites.start_coord, sites.end_coord);
+    } else {
+        // no input sequence specified
+        printError("must specify sequences (use --fasta or --sites)");
+        return EXIT_ERROR;
+    }
+
+    if (c.rename_file != "")
+        sites.rename(c.rename_file);
+
+    if (keep_inds.size() > 0) {
+        if (sites.subset(keep_inds)) {
+            printError("Error subsetting sites\n");
+            return false;
+        }
+    }
+
+    // sample ARG
+    if (c.chunk_size > 0)
+        ret = sample_chunks(c, sites, seq_region, argc, argv);
+    else
+        ret = sample_region(c, sites, seq_region);
+    if (ret)
+        return ret;
 
     // final log message
-    maxrss = get_max_memory_usage() / 1000.0;
+    double maxrss = get_max_memory_usage() / 1000.0;
     printTimerLog(timer, LOG_LOW, "sampling time: ");
     printLog(LOG_LOW, "max memory usage: %.1f MB\n", maxrss);
     printLog(LOG_LOW, "FINISH\n");
 
-    // clean up
-    fclose(c.stats_file);
-
 #ifdef ARGWEAVER_MPI
     MPI_Finalize();
 #endif
@@ -1,6 +1,9 @@
 // C/C++ includes
 #include <time.h>
+#include <condition_variable>
 #include <memory>
+#include <mutex>
+#include <thread>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <iostream>
@@ -339,11 +342,15 @@ public:
         config.add(new ConfigParam<int>
                    ("-u", "--burnin", "<num>", &burnin, 0,
                     "Discard results from iterations < burnin before computing statistics"));
+        config.add(new ConfigParam<int>
+                   ("", "--threads", "<threads>", &nthreads, 1,
+                    "number of threads applying the trees of MCMC samples"
+                    " (default=1; not used with --snp-file)"));
         config.add(new ConfigSwitch
                    ("-n", "--no-header", &noheader, "Do not output header"));
         config.add(new ConfigParam<string>
                    ("-t", "--tabix-dir", "<tabix dir>", &tabix_dir,
-                    "Specify the directory of the tabix executable"));
+                    "unused; tabix-indexed files are now read directly"));
         config.add(new ConfigSwitch
                    ("", "--html", &html,
                     "output HTML instead of plain text (useful with --tree;"
@@ -383,6 +390,10 @@ public:
             printf(VERSION_INFO);
             return EXIT_ERROR;
         }
+        if (nthreads < 1) {
+            printError("--threads must be at least 1");
+            return EXIT_ERROR;
+        }
         return 0;
     }
     ConfigParser config;
@@ -434,6 +445,7 @@ public:
     string quantile;
 
     int burnin;
+    int nthreads;
     bool noheader;
     string tabix_dir;
     bool quiet;
@@ -497,10 +509,10 @@ void checkResults(IntervalIterator<vector<double> > *results) {
 
 class BedLine {
 public:
-    BedLine(char *chr, int start, int end, int sample, char *nwk,
+    BedLine(const char *chr, int start, int end, int sample, char *nwk,
             SprPruned *trees=NULL) :
         start(start), end(end), sample(sample),
-        trees(trees) {
+        trees(trees), formatted(false) {
         chrom = new char[strlen(chr)+1];
         strcpy(chrom, chr);
         if (nwk != NULL) {
@@ -526,6 +538,8 @@ public:
     char derAllele, otherAllele;
     int derFreq, otherFreq;
     int infSites;
+    string statstr;    // output columns of stats, see formatBedLineStats
+    bool formatted;
 };
 
 
@@ -536,6 +550,7 @@ void scoreBedLine(BedLine *line, vector<string> &statname,
     Tree * tree = (line->trees->pruned_tree != NULL ?
                    line->trees->pruned_tree :
                    line->trees->orig_tree);
+    const FlatTree *flat = &line->trees->flat_tree;
     double bl=-1.0;
     int node_dist_idx=0;
     int min_coal_time_idx=0;
@@ -545,23 +560,23 @@ void scoreBedLine(BedLine *line, vector<string> &statname,
     line->stats.resize(statname.size());
     for (unsigned int i=0; i < statname.size(); i++) {
         if (statname[i] == "tmrca")
-            line->stats[i] = tree->tmrca();
+            line->stats[i] = flat->tmrca();
         else if (statname[i]=="tmrca_half")
-            line->stats[i] = tree->tmrca_half();
+            line->stats[i] = flat->tmrca_half();
         else if (statname[i]=="pi")
-            line->stats[i] = tree->avg_pairwise_distance();
+            line->stats[i] = flat->avg_pairwise_distance();
         else if (statname[i]=="branchlen") {
             if (bl < 0) {
-                line->stats[i] = tree->total_branchlength();
+                line->stats[i] = flat->total_branchlength();
                 bl=line->stats[i];
             }
         }
         else if (statname[i]=="rth")
-            line->stats[i] = tree->rth();
+            line->stats[i] = flat->rth();
         else if (statname[i]=="popsize")
-            line->stats[i] = tree->popsize();
+            line->stats[i] = flat->popsize();
         else if (statname[i]=="recomb") {
-            if (bl < 0) bl = tree->total_branchlength();
+            if (bl < 0) bl = flat->total_branchlength();
             line->stats[i] = 1.0/(bl*(double)(line->end - line->start));
         }
         else if (statname[i]=="breaks") {
@@ -667,7 +682,7 @@ void scoreBedLine(BedLine *line, vector<string> &statname,
 	    ind_dist_idx++;
 	}
         else if (statname[i].substr(0, 11)=="coalcounts.") {
-            vector<double>coal_counts = tree->coalCounts(model->times, model->ntimes);
+            vector<double>coal_counts = flat->coalCounts(model->times, model->ntimes);
             for (unsigned int j=0; j < coal_counts.size(); j++) {
                 assert(i+j < statname.size() &&
                        statname[i+j].substr(0,11)=="coalcounts.");
@@ -771,6 +786,53 @@ struct CompareBedLineEnd
     }
 };
 
+// Formats the stat columns of a scored BedLine for output.  Output is
+// written in order by one thread, so the columns are formatted beforehand
+// by the thread that scored the line.
+void formatBedLineStats(BedLine *l, vector<string> &statname) {
+    string &out = l->statstr;
+    char buf[32];
+    out.clear();
+    for (unsigned int i=0; i < statname.size(); i++) {
+        if (statname[i]=="tree") {
+            if (!html) {
+                out += '\t';
+                out += l->newick;
+            } else {
+                out += "</td><td nowrap>";
+                out += "\t<a href=\"http://mhubisz.genome-mirror.cshl.edu/cgi-bin/phyloGif?phyloGif_width=240&phyloGif_height=512&phyloGif_branchLengths=on&phyloGif_underscores=on&phyloGif_tree=";
+                for (unsigned int i=0; i < strlen(l->newick); i++) {
+                    if (l->newick[i]=='(') {
+                        out += "%28";
+                    } else if (l->newick[i]==':') {
+                        out += "%3A";
+                    } else if (l->newick[i]==',') {
+                        out += "%2C";
+                    } else if (l->newick[i]==')') {
+                        out += "%29";
+                    } else if (l->newick[i]==';') {
+                        out += "%3B";
+                    } else if (l->newick[i]=='&') {
+                        out += "%26";
+                    } else if (l->newick[i]=='[') {
+                        out += "%5B";
+                    } else if (l->newick[i]==']') {
+                        out += "%5D";
+                    } else out += l->newick[i];
+                }
+                out += "%0D%0A\">";
+                out += l->newick;
+                out += "</a>";
+            }
+        } else {
+            if (html) out += "</td><td>";
+            snprintf(buf, sizeof(buf), "\t%g", l->stats[i]);
+            out += buf;
+        }
+    }
+    l->formatted = true;
+}
+
 void processNextBedLine(BedLine *line,
                         IntervalIterator<vector<double> > *results,
                         vector<string> &statname,
@@ -812,39 +874,9 @@ void processNextBedLine(BedLine *line,
                 printf("%i\t", l->end);
                 if (html) printf("</td><td>");
                 printf("%i", l->sample);
-                for (unsigned int i=0; i < statname.size(); i++) {
-                    if (statname[i]=="tree") {
-                        if (!html) {
-                            printf("\t%s", l->newick);
-                        } else {
-                            printf("</td><td nowrap>");
-                            printf("\t<a href=\"http://mhubisz.genome-mirror.cshl.edu/cgi-bin/phyloGif?phyloGif_width=240&phyloGif_height=512&phyloGif_branchLengths=on&phyloGif_underscores=on&phyloGif_tree=");
-                           for (unsigned int i=0; i < strlen(l->newick); i++) {
-                              if (l->newick[i]=='(') {
-                                printf("%%28");
-                              } else if (l->newick[i]==':') {
-                                printf("%%3A");
-                              } else if (l->newick[i]==',') {
-                                printf("%%2C");
-                              } else if (l->newick[i]==')') {
-                                printf("%%29");
-                              } else if (l->newick[i]==';') {
-                                printf("%%3B");
-                              } else if (l->newick[i]=='&') {
-                                printf("%%26");
-                              } else if (l->newick[i]=='[') {
-                                printf("%%5B");
-                              } else if (l->newick[i]==']') {
-                                printf("%%5D");
-                              } else printf("%c", l->newick[i]);
-                           }
-                           printf("%%0D%%0A\">%s</a>", l->newick);
-                        }
-                    } else {
-                        if (html) printf("</td><td>");
-                        printf("\t%g", l->stats[i]);
-                    }
-                }
+                if (!l->formatted)
+                    formatBedLineStats(l, statname);
+                fputs(l->statstr.c_str(), stdout);
                 printf("\n");
                 if (html) printf("</td></tr>\n");
                 delete l;
@@ -1093,11 +1125,10 @@ void print_summaries(vector<double> &stat) {
 }
 
 
-int summarizeRegionBySnp(Config *config, const char *region,
+int summarizeRegionBySnp(Config *config, TabixStream *snp_infile,
+                         TabixStream *infile, const char *region,
                          set<string> inds, vector<string> statname,
                          ArgSummarizeData &data) {
-    TabixStream snp_infile(config->snpfile, region, config->tabix_dir);
-    TabixStream infile(config->argfile, region, config->tabix_dir);
     vector<string> token;
     map<int,BedLine*> last_entry;
     map<int,BedLine*>::iterator it;
@@ -1106,22 +1137,22 @@ int summarizeRegionBySnp(Config *config, const char *region,
     BedLine *l=NULL;
     const ArgModel *model = data.model;
 
-    if (snp_infile.stream == NULL) return 1;
-    if (infile.stream == NULL) return 1;
-    while (EOF != (c=fgetc(infile.stream))) {
-        ungetc(c, infile.stream);
+    if (!snp_infile->set_region(region)) return 1;
+    if (!infile->set_region(region)) return 1;
+    while (EOF != (c=fgetc(infile->stream))) {
+        ungetc(c, infile->stream);
         if (c != '#') break;
-        while ('\n' != (c=fgetc(infile.stream))) {
+        while ('\n' != (c=fgetc(infile->stream))) {
             if (c==EOF) return 0;
         }
     }
-    SnpStream snpStream = SnpStream(&snp_infile);
+    SnpStream snpStream = SnpStream(snp_infile);
     char *newick;
     while (1) {
-        if (EOF==fscanf(infile.stream, "%s %i %i %i",
+        if (EOF==fscanf(infile->stream, "%s %i %i %i",
                         chrom, &start, &end, &sample)) return 0;
-        assert('\t' == fgetc(infile.stream));
-        newick = fgetline(infile.stream);
+        assert('\t' == fgetc(infile->stream));
+        newick = fgetline(infile->stream);
         if (sample >= config->burnin && (config->sample_num == 0 ||
                                          config->sample_num == sample))
             break;
@@ -1170,14 +1201,14 @@ int summarizeRegionBySnp(Config *config, const char *region,
                 bedlist.push_back(l);
             }
             while (1) {
-                if (4 != fscanf(infile.stream, "%s %i %i %i",
+                if (4 != fscanf(infile->stream, "%s %i %i %i",
                                 chrom, &start, &end, &sample)) {
                     start = -1;
                     break;
                 } else {
-                    assert('\t' == fgetc(infile.stream));
+                    assert('\t' == fgetc(infile->stream));
                     delete [] newick;
-                    newick = fgetline(infile.stream);
+                    newick = fgetline(infile->stream);
                     chomp(newick);
                     if (sample >= config->burnin && (config->sample_num == 0 || config->sample_num==sample))
                        break;
@@ -1305,21 +1336,347 @@ int summarizeRegionBySnp(Config *config, const char *region,
 }
 
 
-int summarizeRegionNoSnp(Config *config, const char *region,
+// The trees of MCMC samples, and the BedLine of each sample that its next
+// tree may extend
+class SampleTrees {
+public:
+    ~SampleTrees() {
+        for (map<int,SprPruned*>::iterator it=trees.begin();
+             it != trees.end(); ++it)
+            delete it->second;
+    }
+
+    // Applies the tree of an ARG line to the trees of its sample, and
+    // scores the sample's BedLine if the tree ends in a recombination.
+    // Returns the BedLine started by this line, or NULL if the line
+    // extends the previous one.
+    BedLine *add_line(const char *chrom, int start, int end, int sample,
+                      char *newick, const set<string> &inds,
+                      vector<string> &statname, ArgSummarizeData &data) {
+        const ArgModel *model = data.model;
+        map<int,SprPruned*>::iterator it = trees.find(sample);
+        if (it == trees.end())   //first tree from this sample
+            it = trees.insert(make_pair(sample, new SprPruned(newick, inds,
+                                                              model))).first;
+        else it->second->update(newick, model);
+        SprPruned *sample_trees = it->second;
+
+        map<int,BedLine*>::iterator it3 = bedlineMap.find(sample);
+        BedLine *currline, *newline=NULL;
+        if (it3 == bedlineMap.end()) {
+            currline = newline = new BedLine(chrom, start, end, sample,
+                                             newick, sample_trees);
+            bedlineMap[sample] = currline;
+        } else {
+            currline = it3->second;
+            assert(strcmp(currline->chrom, chrom)==0);
+            assert(currline->end == start);
+            currline->end = end;
+        }
+
+        //assume orig_spr.recomb_node == NULL is a rare occurrence that
+        // happens at the boundaries of regions analyzed by arg-sample; treat
+        // these as recombination events
+        if (sample_trees->orig_spr.recomb_node == NULL ||
+            sample_trees->pruned_tree == NULL ||
+            sample_trees->pruned_spr.recomb_node != NULL) {
+            scoreBedLine(currline, statname, data);
+            if (!summarize)
+                formatBedLineStats(currline, statname);
+            bedlineMap.erase(sample);
+        }
+        return newline;
+    }
+
+    map<int,SprPruned*> trees;
+    map<int,BedLine*> bedlineMap;
+};
+
+
+// Splits a line of an ARG file in place into its chrom, start, end, sample
+// and newick fields.  The newick keeps its newline.  Returns false if the
+// line is malformed.
+bool splitArgLine(char *line, char **chrom, int *start, int *end,
+                  int *sample, char **newick) {
+    char *field = strchr(line, '\t');
+    if (field == NULL)
+        return false;
+    *field = '\0';
+    *chrom = line;
+    int *values[] = {start, end, sample};
+    for (int i=0; i < 3; i++) {
+        char *next;
+        *values[i] = strtol(field + 1, &next, 10);
+        if (next == field + 1 || *next != '\t')
+            return false;
+        field = next;
+    }
+    *newick = field + 1;
+    return true;
+}
+
+
+// A line of an ARG file, with the worker thread of its sample.  'chrom'
+// and 'newick' point into 'line'.
+struct ArgLine {
+    ArgLine(char *line, char *chrom, int start, int end, int sample,
+            char *newick, int worker) :
+        line(line), chrom(chrom), start(start), end(end), sample(sample),
+        newick(newick), worker(worker) {}
+    char *line;
+    char *chrom;
+    int start;
+    int end;
+    int sample;
+    char *newick;
+    int worker;
+};
+
+
+// Applies the lines of an ARG file to the trees of MCMC samples with
+// worker threads.  Each sample belongs to one worker, which parses and
+// applies its lines in order; the caller only splits the lines into fields
+// to route them.  Lines are added in batches; while the workers apply one
+// batch, the caller reads the next one.  BedLines are returned in the
+// order of the lines that started them, as summarizeRegionNoSnp queues
+// them without threads.
+class SampleTreesPool {
+public:
+    SampleTreesPool(int nthreads, const set<string> &inds,
+                    vector<string> &statname, ArgSummarizeData &data) :
+        inds(inds),
+        statname(statname),
+        data(data),
+        samples(nthreads),
+        generation(0),
+        remaining(0),
+        stop(false)
+    {
+        for (int i=0; i < nthreads; i++)
+            workers.push_back(thread(&SampleTreesPool::worker, this, i));
+    }
+
+    ~SampleTreesPool() {
+        {
+            unique_lock<mutex> guard(lock);
+            while (remaining > 0)
+                batch_done.wait(guard);
+            stop = true;
+        }
+        batch_ready.notify_all();
+        for (unsigned int i=0; i < workers.size(); i++)
+            workers[i].join();
+        for (unsigned int i=0; i < pending.size(); i++)
+            delete [] pending[i].line;
+    }
+
+    // Adds a line split by splitArgLine to the next batch.  The pool
+    // deletes 'line'.
+    void add(char *line, char *chrom, int start, int end, int sample,
+             char *newick) {
+        map<int,int>::iterator it = sample_worker.find(sample);
+        int worker;
+        if (it == sample_worker.end()) {
+            worker = sample_worker.size() % workers.size();
+            sample_worker[sample] = worker;
+        } else worker = it->second;
+        pending.push_back(ArgLine(line, chrom, start, end, sample, newick,
+                                  worker));
+    }
+
+    unsigned int num_pending() const {
+        return pending.size();
+    }
+
+    // Waits for the workers to apply the running batch, and appends the
+    // BedLines it started to 'bedlineQueue'.  Until start() is called,
+    // the caller may read every BedLine.
+    void wait(queue<BedLine*> &bedlineQueue) {
+        unique_lock<mutex> guard(lock);
+        while (remaining > 0)
+            batch_done.wait(guard);
+        for (unsigned int i=0; i < started.size(); i++)
+            if (started[i] != NULL)
+                bedlineQueue.push(started[i]);
+        started.clear();
+        running.clear();
+    }
+
+    // Starts the workers on the lines added since the last batch.  Until
+    // wait() is called, the caller may only read BedLines that were scored
+    // before.
+    void start() {
+        {
+            lock_guard<mutex> guard(lock);
+            running.swap(pending);
+            started.assign(running.size(), NULL);
+            remaining = workers.size();
+            generation++;
+        }
+        batch_ready.notify_all();
+    }
+
+    // number of lines in a batch
+    static const unsigned int batch_size = 4096;
+
+protected:
+    void worker(int index) {
+        int seen = 0;
+        while (true) {
+            {
+                unique_lock<mutex> guard(lock);
+                while (!stop && generation == seen)
+                    batch_ready.wait(guard);
+                if (stop)
+                    return;
+                seen = generation;
+            }
+
+            for (unsigned int i=0; i < running.size(); i++) {
+                ArgLine &line = running[i];
+                if (line.worker != index)
+                    continue;
+                chomp(line.newick);
+                started[i] = samples[index].add_line(
+                    line.chrom, line.start, line.end, line.sample,
+                    line.newick, inds, statname, data);
+                delete [] line.line;
+            }
+
+            {
+                lock_guard<mutex> guard(lock);
+                remaining--;
+            }
+            batch_done.notify_all();
+        }
+    }
+
+    const set<string> &inds;
+    vector<string> &statname;
+    ArgSummarizeData &data;
+    vector<SampleTrees> samples;   // samples of each worker
+    map<int,int> sample_worker;
+    vector<ArgLine> pending;       // lines of the next batch
+    vector<ArgLine> running;       // lines of the running batch
+    vector<BedLine*> started;      // BedLine started by each running line
+    vector<thread> workers;
+    mutex lock;
+    condition_variable batch_ready;
+    condition_variable batch_done;
+    int generation;                // number of batches started
+    int remaining;                 // workers still applying the batch
+    bool stop;
+};
+
+
+// Outputs the BedLines at the front of the queue that have been scored
+void processScoredBedLines(queue<BedLine*> &bedlineQueue,
+                           IntervalIterator<vector<double> > *results,
+                           vector<string> &statname,
+                           char *region_chrom, int region_start,
+                           int region_end, ArgSummarizeData &data) {
+    while (bedlineQueue.size() > 0) {
+        BedLine *firstline = bedlineQueue.front();
+        if (firstline->stats.size() == statname.size()) {
+            processNextBedLine(firstline, results, statname,
+                               region_chrom, region_start, region_end,
+                               data);
+            bedlineQueue.pop();
+        } else break;
+    }
+}
+
+
+// Outputs scored BedLines in order with a thread of its own, so that
+// the caller reads the ARG file while earlier lines are printed or
+// summarized.  Until finish() is called, only this thread may call
+// processNextBedLine.
+class BedLineWriter {
+public:
+    BedLineWriter(IntervalIterator<vector<double> > *results,
+                  vector<string> &statname, char *region_chrom,
+                  int region_start, int region_end,
+                  ArgSummarizeData &data) :
+        results(results),
+        statname(statname),
+        region_chrom(region_chrom),
+        region_start(region_start),
+        region_end(region_end),
+        data(data),
+        stop(false),
+        writer(&BedLineWriter::run, this)
+    {}
+
+    ~BedLineWriter() {
+        finish();
+    }
+
+    // Queues the scored BedLines at the front of 'bedlineQueue'
+    void add(queue<BedLine*> &bedlineQueue) {
+        {
+            lock_guard<mutex> guard(lock);
+            while (bedlineQueue.size() > 0 &&
+                   bedlineQueue.front()->stats.size() == statname.size()) {
+                pending.push(bedlineQueue.front());
+                bedlineQueue.pop();
+            }
+        }
+        ready.notify_one();
+    }
+
+    // Outputs the queued BedLines and stops the thread
+    void finish() {
+        if (!writer.joinable())
+            return;
+        {
+            lock_guard<mutex> guard(lock);
+            stop = true;
+        }
+        ready.notify_one();
+        writer.join();
+    }
+
+protected:
+    void run() {
+        while (true) {
+            queue<BedLine*> lines;
+            {
+                unique_lock<mutex> guard(lock);
+                while (!stop && pending.size() == 0)
+                    ready.wait(guard);
+                if (pending.size() == 0)
+                    return;
+                lines.swap(pending);
+            }
+            processScoredBedLines(lines, results, statname, region_chrom,
+                                  region_start, region_end, data);
+        }
+    }
+
+    IntervalIterator<vector<double> > *results;
+    vector<string> &statname;
+    char *region_chrom;
+    int region_start;
+    int region_end;
+    ArgSummarizeData &data;
+    queue<BedLine*> pending;
+    mutex lock;
+    condition_variable ready;
+    bool stop;
+    thread writer;                 // started last, once the rest is set
+};
+
+
+int summarizeRegionNoSnp(Config *config, TabixStream *infile,
+                         const char *region,
                          set<string> inds, vector<string>statname,
                          ArgSummarizeData &data) {
-    TabixStream *infile;
     char c;
     char *region_chrom = NULL;
-    char chrom[1000];
     vector<string> token;
     int region_start=-1, region_end=-1, start, end, sample;
     IntervalIterator<vector<double> > results;
     queue<BedLine*> bedlineQueue;
-    map<int,BedLine*> bedlineMap;
-    map<int,SprPruned*> trees;
-    map<int,SprPruned*>::iterator it;
-    const ArgModel *model = data.model;
     /*
       Class BedLine contains chr,start,end, newick tree, parsed tree.
       parsed tree may be NULL if not parsing trees but otherwise will
@@ -1363,10 +1720,12 @@ int summarizeRegionNoSnp(Config *config, const char *region,
       After reading all lines:
       go through queue and dump everything to intervalIterator...
 
+      With --threads, SampleTreesPool parses the lines and applies them to
+      the trees, queueing the BedLines in the same order a batch of lines
+      at a time, and BedLineWriter outputs the scored ones.
     */
 
-    infile = new TabixStream(config->argfile, region, config->tabix_dir);
-    if (infile->stream == NULL) return 1;
+    if (!infile->set_region(region)) return 1;
 
     //parse region to get region_chrom, region_start, region_end.
     // these are only needed to truncate results which fall outside
@@ -1398,61 +1757,58 @@ int summarizeRegionNoSnp(Config *config, const char *region,
         }
     }
 
-    while (EOF != fscanf(infile->stream, "%s %i %i %i",
-                         chrom, &start, &end, &sample)) {
-        assert('\t'==fgetc(infile->stream));
-        char* newick = fgetline(infile->stream);
-        if (config->sample_num != 0 && sample != config->sample_num) {
-            delete [] newick;
-            continue;
+    SampleTrees samples;
+    SampleTreesPool *pool = NULL;
+    BedLineWriter *writer = NULL;
+    if (config->nthreads > 1) {
+        pool = new SampleTreesPool(config->nthreads, inds, statname, data);
+        writer = new BedLineWriter(&results, statname, region_chrom,
+                                   region_start, region_end, data);
+    }
+
+    int status = 0;
+    char *line;
+    while (NULL != (line = fgetline(infile->stream))) {
+        char *chrom, *newick;
+        if (!splitArgLine(line, &chrom, &start, &end, &sample, &newick)) {
+            fprintf(stderr, "Error: bad line in ARG file\n");
+            delete [] line;
+            status = 1;
+            break;
         }
-        chomp(newick);
-        if (sample < config->burnin) {
-            delete [] newick;
+        if ((config->sample_num != 0 && sample != config->sample_num) ||
+            sample < config->burnin) {
+            delete [] line;
             continue;
         }
-        it = trees.find(sample);
-        if (it == trees.end())   //first tree from this sample
-            trees[sample] = new SprPruned(newick, inds, model);
-        else trees[sample]->update(newick, model);
 
-        map<int,BedLine*>::iterator it3 = bedlineMap.find(sample);
-        BedLine *currline;
-        if (it3 == bedlineMap.end()) {
-            currline = new BedLine(chrom, start, end, sample, newick,
-                                   trees[sample]);
-            bedlineMap[sample] = currline;
-            bedlineQueue.push(currline);
+        if (pool == NULL) {
+            chomp(newick);
+            BedLine *newline = samples.add_line(chrom, start, end, sample,
+                                                newick, inds, statname, data);
+            if (newline != NULL)
+                bedlineQueue.push(newline);
+            processScoredBedLines(bedlineQueue, &results, statname,
+                                  region_chrom, region_start, region_end,
+                                  data);
+            delete [] line;
         } else {
-            currline = it3->second;
-            assert(strcmp(currline->chrom, chrom)==0);
-            assert(currline->end == start);
-            currline->end = end;
-        }
-
-        //assume orig_spr.recomb_node == NULL is a rare occurrence that happens
-        // at the boundaries of regions analyzed by arg-sample; treat these as
-        // recombination events
-        if (trees[sample]->orig_spr.recomb_node == NULL ||
-            trees[sample]->pruned_tree == NULL ||
-            trees[sample]->pruned_spr.recomb_node != NULL) {
-            scoreBedLine(currline, statname, data);
-            bedlineMap.erase(sample);
-        }
-
-        while (bedlineQueue.size() > 0) {
-            BedLine *firstline = bedlineQueue.front();
-            if (firstline->stats.size() == statname.size()) {
-                processNextBedLine(firstline, &results, statname,
-                                   region_chrom, region_start, region_end,
-                                   data);
-                bedlineQueue.pop();
-            } else break;
+            pool->add(line, chrom, start, end, sample, newick);
+            if (pool->num_pending() >= SampleTreesPool::batch_size) {
+                // hand the lines scored by the last batch to the writer,
+                // and read on while the workers apply the next one
+                pool->wait(bedlineQueue);
+                writer->add(bedlineQueue);
+                pool->start();
+            }
         }
-        delete [] newick;
     }
-    infile->close();
-    delete infile;
+    if (pool != NULL) {
+        pool->wait(bedlineQueue);
+        pool->start();
+        pool->wait(bedlineQueue);
+        writer->finish();
+    }
 
     while (bedlineQueue.size() > 0) {
         BedLine *firstline = bedlineQueue.front();
@@ -1471,22 +1827,24 @@ int summarizeRegionNoSnp(Config *config, const char *region,
                            region_start, region_end, data);
     }
 
-    it = trees.begin();
-    while (it != trees.end()) {
-        delete it->second;
-        advance(it, 1);
-    }
+    if (pool != NULL) delete pool;
+    if (writer != NULL) delete writer;
     if (region_chrom != NULL) delete[] region_chrom;
-    return 0;
+    return status;
 }
 
-int summarizeRegion(Config *config, const char *region,
+// Summarizes one region.  The streams stay open between regions, so that
+// many regions are read without reopening the files.
+int summarizeRegion(Config *config, TabixStream *infile,
+                    TabixStream *snp_infile, const char *region,
                     set<string> inds, vector<string>statname,
                     ArgSummarizeData &data) {
     if (config->snpfile.empty())
-        return summarizeRegionNoSnp(config, region, inds, statname, data);
+        return summarizeRegionNoSnp(config, infile, region, inds, statname,
+                                    data);
     else
-        return summarizeRegionBySnp(config, region, inds, statname, data);
+        return summarizeRegionBySnp(config, snp_infile, infile, region,
+                                    inds, statname, data);
 }
 
 
@@ -2024,8 +2382,11 @@ int main(int argc, char *argv[]) {
         }
         }*/
 
+    TabixStream infile(c.argfile.c_str());
+    TabixStream snp_infile(c.snpfile.c_str());
     if (c.bedfile.empty()) {
-        summarizeRegion(&c, c.region.empty() ? NULL : c.region.c_str(),
+        summarizeRegion(&c, &infile, &snp_infile,
+                        c.region.empty() ? NULL : c.region.c_str(),
                         haps, statname, data);
     } else {
         CompressStream bedstream(c.bedfile.c_str());
@@ -2048,7 +2409,8 @@ int main(int argc, char *argv[]) {
             int start = atoi(token[1].c_str());
             int end = atoi(token[2].c_str());
             sprintf(regionStr, "%s:%i-%i", token[0].c_str(), start+1, end);
-            summarizeRegion(&c, regionStr, haps, statname, data);
+            summarizeRegion(&c, &infile, &snp_infile, regionStr, haps,
+                            statname, data);
             delete [] regionStr;
         }
         bedstream.close();
@@ -200,6 +200,13 @@ public:
     ConfigParser()
     {}
 
+    // Rules point into the object that added them, so a copy of a parser
+    // keeps the program name and rest arguments but no rules.
+    ConfigParser(const ConfigParser &other) :
+        prog(other.prog),
+        rest(other.rest)
+    {}
+
     ~ConfigParser()
     {
         clear();
@@ -304,6 +311,9 @@ public:
     string prog;
     vector<ConfigParamBase*> rules;
     vector<string> rest;
+
+private:
+    ConfigParser &operator=(const ConfigParser &other);
 };
 
 
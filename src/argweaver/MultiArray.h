@@ -1,7 +1,9 @@
 #ifndef ARGWEAVER_MULTIARRAY_H
 #define ARGWEAVER_MULTIARRAY_H
 
+#include <assert.h>
 #include <stdarg.h>
+#include <stddef.h>
 
 namespace argweaver {
 
@@ -11,29 +13,41 @@ namespace argweaver {
  struct MultiArray {
 
  public:
-     MultiArray(int ndim, ...) : ndim(ndim), defaultVal(0) {
+     static const int MAX_NDIM = 5;
+
+     MultiArray() : ndim(0), mat(NULL), matSize(0), defaultVal(0),
+                    own_mat(false) {}
+
+     MultiArray(int ndim, ...) : defaultVal(0) {
          va_list ap;
          va_start(ap, ndim);
-         dimSize = new int[ndim];
-         multipliers = new int[ndim];
-         multipliers[ndim-1] = 1;
-         matSize = 1;
-         for (int i=0; i < ndim; i++) {
-             dimSize[i] = va_arg(ap, int);
-             matSize *= dimSize[i];
-         }
+         set_dims(ndim, ap);
          va_end(ap);
-         if (ndim >= 2)
-             multipliers[ndim-2] = dimSize[ndim-1];
-         for (int i=ndim-3; i >= 0; i--)
-             multipliers[i] = multipliers[i+1]*dimSize[i+1];
          mat = new double[matSize];
+         own_mat = true;
      }
      ~MultiArray() {
-         delete [] dimSize;
-         delete [] multipliers;
-         delete [] mat;
+         if (own_mat)
+             delete [] mat;
+     }
+
+     // Sets the dimensions of a default constructed matrix.  The matrix
+     // data must then be given with set_data().
+     void init(int ndim, ...) {
+         va_list ap;
+         va_start(ap, ndim);
+         set_dims(ndim, ap);
+         va_end(ap);
      }
+
+     // Uses 'data' (matSize doubles, owned by the caller) as matrix data
+     void set_data(double *data) {
+         if (own_mat)
+             delete [] mat;
+         mat = data;
+         own_mat = false;
+     }
+
      void setDefault(double val) {
          defaultVal = val;
      }
@@ -187,11 +201,33 @@ namespace argweaver {
      }
 
      int ndim;
-     int *dimSize;
-     int *multipliers;
+     int dimSize[MAX_NDIM];
+     int multipliers[MAX_NDIM];
      double *mat;
      int matSize;
      double defaultVal;
+
+ private:
+     void set_dims(int _ndim, va_list ap) {
+         ndim = _ndim;
+         assert(ndim >= 1 && ndim <= MAX_NDIM);
+         multipliers[ndim-1] = 1;
+         matSize = 1;
+         for (int i=0; i < ndim; i++) {
+             dimSize[i] = va_arg(ap, int);
+             matSize *= dimSize[i];
+         }
+         if (ndim >= 2)
+             multipliers[ndim-2] = dimSize[ndim-1];
+         for (int i=ndim-3; i >= 0; i--)
+             multipliers[i] = multipliers[i+1]*dimSize[i+1];
+     }
+
+     // matrix data is not copyable
+     MultiArray(const MultiArray &other);
+     MultiArray &operator=(const MultiArray &other);
+
+     bool own_mat;
  };
 }
 #endif
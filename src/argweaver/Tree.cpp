@@ -737,6 +737,7 @@ void SprPruned::update(char *newick, const ArgModel *model) {
         update_slow(newick, model);
     } else {
         //otherwise, apply the SPR and node map, and get next SPR
+        flat_tree.apply_spr(pruned_tree != NULL ? pruned_spr : orig_spr);
         orig_tree->apply_spr(&orig_spr, inds.size() > 0 ? &node_map : NULL,
                              model);
         orig_spr.update_spr_from_newick(orig_tree, newick, model);
@@ -873,6 +874,7 @@ void SprPruned::update_slow(char *newick, const ArgModel *model) {
         node_map = pruned_tree->prune(inds, true, model);
         update_spr_pruned(model);
     } else pruned_tree = NULL;
+    flat_tree.set_tree(pruned_tree != NULL ? pruned_tree : orig_tree);
 }
 
 // assumes both trees have same number of nodes
@@ -1896,6 +1898,222 @@ double Tree::maxCoalRate(const ArgModel *model) {
 }
 
 
+//=============================================================================
+// Flat tree with statistics maintained under SPR operations
+
+// Length of a branch from age2 up to age1, clamped at 0 as in
+// Tree::age_diff()
+static inline double branch_dist(double age1, double age2)
+{
+    double diff = age1 - age2;
+    return diff < 0 ? 0.0 : diff;
+}
+
+
+void FlatTree::set_tree(const Tree *tree)
+{
+    nnodes = tree->nnodes;
+    root = (tree->root != NULL ? tree->root->name : -1);
+    parent.assign(nnodes, -1);
+    child.assign(2 * nnodes, -1);
+    age.resize(nnodes);
+    dist.resize(nnodes);
+    nleaves.resize(nnodes);
+    ncoal.clear();
+    for (int i=0; i < nnodes; i++) {
+        const Node *node = tree->nodes[i];
+        assert(node->nchildren == 0 || node->nchildren == 2);
+        if (node->parent != NULL)
+            parent[i] = node->parent->name;
+        for (int j=0; j < node->nchildren; j++)
+            child[2*i + j] = node->children[j]->name;
+        age[i] = node->age;
+        dist[i] = node->dist;
+        if (node->nchildren > 0)
+            add_coal(age[i], 1);
+    }
+
+    ExtendArray<Node*> postnodes;
+    getTreePostOrder(tree, &postnodes);
+    for (int i=0; i < postnodes.size(); i++) {
+        int j = postnodes[i]->name;
+        nleaves[j] = (child[2*j] == -1 ? 1 :
+                      nleaves[child[2*j]] + nleaves[child[2*j+1]]);
+    }
+}
+
+
+void FlatTree::add_coal(double a, int count)
+{
+    map<double, int>::iterator it = ncoal.insert(make_pair(a, 0)).first;
+    it->second += count;
+    if (it->second == 0)
+        ncoal.erase(it);
+}
+
+
+void FlatTree::apply_spr(int recomb_node, int coal_node, double coal_time)
+{
+    if (recomb_node == coal_node)
+        return;
+
+    int recomb_parent = parent[recomb_node];
+    assert(recomb_parent != -1);
+    int x = (child[2*recomb_parent] == recomb_node ? 0 : 1);
+    int recomb_sibling = child[2*recomb_parent + !x];
+    int recomb_grandparent = parent[recomb_parent];
+    int coal_parent = parent[coal_node];
+
+    // only recomb_parent changes age
+    add_coal(age[recomb_parent], -1);
+    add_coal(coal_time, 1);
+
+    // topology doesn't change; only the age of recomb_parent and the
+    // lengths of the branches next to it
+    if (coal_parent == recomb_parent || coal_node == recomb_parent) {
+        age[recomb_parent] = coal_time;
+        dist[recomb_sibling] = branch_dist(coal_time, age[recomb_sibling]);
+        dist[recomb_node] = branch_dist(coal_time, age[recomb_node]);
+        if (recomb_grandparent != -1)
+            dist[recomb_parent] = branch_dist(age[recomb_grandparent],
+                                              coal_time);
+        return;
+    }
+
+    // prune recomb_parent
+    parent[recomb_sibling] = recomb_grandparent;
+    if (recomb_grandparent != -1) {
+        int x1 = (child[2*recomb_grandparent] == recomb_parent ? 0 : 1);
+        child[2*recomb_grandparent + x1] = recomb_sibling;
+        dist[recomb_sibling] += dist[recomb_parent];
+    } else {
+        root = recomb_sibling;
+    }
+
+    // regraft it above coal_node
+    child[2*recomb_parent + !x] = coal_node;
+    parent[coal_node] = recomb_parent;
+    dist[coal_node] = branch_dist(coal_time, age[coal_node]);
+    dist[recomb_node] = branch_dist(coal_time, age[recomb_node]);
+    age[recomb_parent] = coal_time;
+    parent[recomb_parent] = coal_parent;
+    if (coal_parent != -1) {
+        int x1 = (child[2*coal_parent] == coal_node ? 0 : 1);
+        child[2*coal_parent + x1] = recomb_parent;
+        dist[recomb_parent] = branch_dist(age[coal_parent], coal_time);
+    } else {
+        root = recomb_parent;
+    }
+
+    // recount leaves.  Where the two paths meet, the first pass may read a
+    // stale count below recomb_parent, which the second pass corrects.
+    for (int n=recomb_grandparent; n != -1; n=parent[n])
+        nleaves[n] = nleaves[child[2*n]] + nleaves[child[2*n+1]];
+    for (int n=recomb_parent; n != -1; n=parent[n])
+        nleaves[n] = nleaves[child[2*n]] + nleaves[child[2*n+1]];
+}
+
+
+double FlatTree::total_branchlength() const
+{
+    double len = 0.0;
+    add_branchlengths(root, &len);
+    return len;
+}
+
+
+void FlatTree::add_branchlengths(int node, double *len) const
+{
+    if (child[2*node] != -1) {
+        add_branchlengths(child[2*node], len);
+        add_branchlengths(child[2*node+1], len);
+    }
+    if (node != root)
+        *len += dist[node];
+}
+
+
+double FlatTree::avg_pairwise_distance() const
+{
+    int num_leaf = (nnodes + 1) / 2;
+    double pi = 0.0;
+    add_pairwise(root, num_leaf, &pi);
+    return pi*2.0/(num_leaf * (num_leaf-1));
+}
+
+
+void FlatTree::add_pairwise(int node, int num_leaf, double *pi) const
+{
+    if (child[2*node] != -1) {
+        add_pairwise(child[2*node], num_leaf, pi);
+        add_pairwise(child[2*node+1], num_leaf, pi);
+    }
+    if (node != root)
+        *pi += dist[node] * (double)(num_leaf - nleaves[node])*nleaves[node];
+}
+
+
+double FlatTree::tmrca_half() const
+{
+    // counts of nodes below each node, as in Tree::tmrca_half()
+    const int numnode = (nnodes - 1) / 2;
+    int node = root;
+    while (true) {
+        if (2 * nleaves[node] - 1 == numnode)
+            return age[node];
+        if (child[2*node] == -1) {
+            fprintf(stderr,
+                    "Error: tmrca_half only works for bifurcating trees\n");
+            return age[node];
+        }
+        int c0 = child[2*node], c1 = child[2*node+1];
+        int n0 = 2 * nleaves[c0] - 1, n1 = 2 * nleaves[c1] - 1;
+        if (n0 == numnode && n1 == numnode)
+            return min(age[c0], age[c1]);
+        if (n0 >= numnode)
+            node = c0;
+        else if (n1 >= numnode)
+            node = c1;
+        else
+            return age[node];
+    }
+}
+
+
+double FlatTree::popsize() const
+{
+    int numleaf = (nnodes + 1) / 2;
+    double lasttime=0, popsize=0;
+    int k = numleaf;
+    for (map<double, int>::const_iterator it=ncoal.begin();
+         it != ncoal.end(); ++it) {
+        for (int j=0; j < it->second; j++) {
+            popsize += (double)k*(k-1)*(it->first-lasttime);
+            lasttime = it->first;
+            k--;
+        }
+    }
+    return popsize/(4.0*numleaf-4);
+}
+
+
+//assume that times is sorted!
+vector<double> FlatTree::coalCounts(const double *times, int ntimes) const
+{
+    vector<double> counts(ntimes, 0.0);
+    int idx=0;
+    for (map<double, int>::const_iterator it=ncoal.begin();
+         it != ncoal.end(); ++it) {
+        while (fabs(it->first - times[idx]) >= 0.00001) {
+            idx++;
+            assert(idx < ntimes);
+        }
+        counts[idx] += it->second;
+    }
+    return counts;
+}
+
+
 //=============================================================================
 // primitive tree format conversion functions
 
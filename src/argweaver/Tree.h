@@ -390,6 +390,65 @@ public:
 };
 
 
+// A compact array copy of a binary tree (nodes indexed by their name ids)
+// that keeps the data behind tree statistics up to date under SPR
+// operations.  An SPR only changes the leaf counts of the ancestors of the
+// pruned and regrafted branches, so each update walks those two paths
+// rather than the whole tree.
+//
+// Branch lengths are updated as Tree::apply_spr() updates Node::dist, and
+// sums are taken in the same order as the Tree methods, so that the
+// statistics are the same as those of the Tree, bit for bit.
+class FlatTree {
+public:
+    FlatTree() : nnodes(0), root(-1) {}
+    FlatTree(const Tree *tree) { set_tree(tree); }
+
+    // Copies the topology and ages of 'tree'
+    void set_tree(const Tree *tree);
+
+    // Applies an SPR as Tree::apply_spr does
+    void apply_spr(int recomb_node, int coal_node, double coal_time);
+    void apply_spr(const NodeSpr &spr) {
+        if (spr.recomb_node != NULL)
+            apply_spr(spr.recomb_node->name, spr.coal_node->name,
+                      spr.coal_time);
+    }
+
+    // Same statistics as the Tree methods of the same name
+    double tmrca() const { return age[root]; }
+
+    // These visit every branch on each call, O(n).  They add up the
+    // branches in postorder as Tree does, so the sums round the same way;
+    // partial sums kept up to date by apply_spr() would not.
+    double total_branchlength() const;
+    double avg_pairwise_distance() const;
+
+    double tmrca_half() const;
+    double rth() const { return tmrca_half() / tmrca(); }
+    double popsize() const;
+    vector<double> coalCounts(const double *times, int ntimes) const;
+
+    int nnodes;
+    int root;
+    vector<int> parent;     // -1 for root
+    vector<int> child;      // children of node i at 2*i and 2*i+1
+    vector<double> age;
+    vector<double> dist;    // length of branch above each node
+    vector<int> nleaves;    // number of leaves below each node
+
+protected:
+    // adds 'count' internal nodes of age 'a' to 'ncoal'
+    void add_coal(double a, int count);
+
+    // add the terms of the branches below 'node' in postorder
+    void add_branchlengths(int node, double *len) const;
+    void add_pairwise(int node, int num_leaf, double *pi) const;
+
+    map<double, int> ncoal;     // number of internal nodes of each age
+};
+
+
 // Efficient SPR operation on a tree and its pruned version
 class SprPruned {
 private:
@@ -435,6 +494,7 @@ public:
     NodeSpr pruned_spr;
     NodeMap node_map;
     set<string> inds;
+    FlatTree flat_tree;  //copy of pruned tree if set, otherwise full tree
 };
 
 
@@ -5,7 +5,7 @@
 namespace argweaver {
 
 /* make a draw from a gamma distribution with parameters 'a' and
- * 'b'. Be sure to call srandom externally.  If a == 1, exp_draw is
+ * 'b'. Be sure to call seed_rand externally.  If a == 1, exp_draw is
  * called.  If a > 1, Best's (1978) rejection algorithm is used, and
  * if a < 1, rejection sampling from the Weibull distribution is
  * performed, both as described in "Non-Uniform Random Variate
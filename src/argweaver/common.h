@@ -11,6 +11,7 @@
 #include <sys/types.h>
 #include <vector>
 
+#include "random.h"
 #include "t2exp.h"
 
 
@@ -101,30 +102,30 @@ void permute(T* array, int *perm, int size)
 //=============================================================================
 // Math
 
+// Random draws come from the stream of the calling thread (see random.h)
+
 inline double frand()
-{ return rand() / double(RAND_MAX); }
+{ return get_rand_stream().uniform(); }
 
 inline double frand(double max)
-{ return rand() / double(RAND_MAX) * max; }
+{ return get_rand_stream().uniform() * max; }
 
 inline double frand(double min, double max)
-{ return min + (rand() / double(RAND_MAX) * (max-min)); }
+{ return min + (get_rand_stream().uniform() * (max-min)); }
 
 inline int irand(int max)
-{
-    const int i = int(rand() / float(RAND_MAX) * max);
-    return (i == max) ? max - 1 : i;
-}
+{ return get_rand_stream().uniform_int(max); }
 
 inline int irand(int min, int max)
-{
-    const int i = min + int(rand() / float(RAND_MAX) * (max - min));
-    return (i == max) ? max - 1 : i;
-}
+{ return min + get_rand_stream().uniform_int(max - min); }
+
+// Returns a random non-negative int (31 random bits), like rand()
+inline int rand_int()
+{ return int(get_rand_stream().next() >> 33); }
 
 inline double rand_norm(const double mean=0, const double sd=1) {
-  static bool gen_new=true;
-  static double y=0;
+  static thread_local bool gen_new=true;
+  static thread_local double y=0;
   double x;
   double pi = 3.1415926535897;
   if (gen_new) {
@@ -172,7 +173,7 @@ inline int rand_poisson(double rate) {
 }
 
  /* make a draw from a gamma distribution with parameters 'a' and
- * 'b'. Be sure to call srandom externally.  If a == 1, exp_draw is
+ * 'b'. Be sure to call seed_rand externally.  If a == 1, exp_draw is
  * called.  If a > 1, Best's (1978) rejection algorithm is used, and
  * if a < 1, rejection sampling from the Weibull distribution is
  * performed, both as described in "Non-Uniform Random Variate
@@ -0,0 +1,251 @@
+//=============================================================================
+// compact storage of local trees
+
+#include "compact_arg.h"
+
+
+namespace argweaver {
+
+
+static inline bool nodes_equal(const LocalNode &a, const LocalNode &b)
+{
+    return a.parent == b.parent &&
+        a.child[0] == b.child[0] && a.child[1] == b.child[1] &&
+        a.age == b.age && a.pop_path == b.pop_path;
+}
+
+
+void CompactLocalTrees::set_info(const LocalTrees *trees)
+{
+    chrom = trees->chrom;
+    start_coord = trees->start_coord;
+    nnodes = trees->nnodes;
+    seqids = trees->seqids;
+    clear();
+}
+
+
+void CompactLocalTrees::set(const LocalTrees *trees)
+{
+    set_info(trees);
+    for (LocalTrees::const_iterator it=trees->begin(); it != trees->end();
+         ++it)
+        push_back(*it);
+    assert(end_coord == trees->end_coord);
+}
+
+
+void CompactLocalTrees::clear()
+{
+    end_coord = start_coord;
+    blocks.clear();
+    node_names.clear();
+    nodes.clear();
+    map_names.clear();
+    map_values.clear();
+    last_tree.clear();
+}
+
+
+void CompactLocalTrees::push_back(const LocalTreeSpr &block)
+{
+    const LocalTree *tree = block.tree;
+    assert(tree->nnodes == nnodes);
+    const int i = blocks.size();
+
+    Block b;
+    b.spr = block.spr;
+    b.blocklen = block.blocklen;
+    b.root = tree->root;
+    b.node_start = node_names.size();
+    b.map_start = map_names.size();
+    b.has_mapping = (block.mapping != NULL);
+    blocks.push_back(b);
+
+    if (block.mapping) {
+        for (int j=0; j<nnodes; j++) {
+            if (block.mapping[j] != j) {
+                map_names.push_back(j);
+                map_values.push_back(block.mapping[j]);
+            }
+        }
+    }
+
+    if (is_keyframe(i)) {
+        for (int j=0; j<nnodes; j++) {
+            node_names.push_back(j);
+            nodes.push_back(tree->nodes[j]);
+        }
+    } else {
+        // record the nodes that the SPR changed.  Nodes that are only
+        // broken by the SPR are replaced by the delta, so only a true
+        // renaming requires moving nodes.
+        int mapping[nnodes];
+        if (get_mapping(i, mapping))
+            rename_nodes(mapping, &last_tree, push_scratch);
+        for (int j=0; j<nnodes; j++) {
+            if (!nodes_equal(last_tree.nodes[j], tree->nodes[j])) {
+                node_names.push_back(j);
+                nodes.push_back(tree->nodes[j]);
+            }
+        }
+    }
+
+    last_tree.copy(*tree);
+    end_coord += block.blocklen;
+}
+
+
+bool CompactLocalTrees::get_mapping(int i, int *mapping) const
+{
+    const int map_end = (i+1 < (int) blocks.size() ?
+                         blocks[i+1].map_start : map_names.size());
+
+    bool rename = false;
+    for (int j=0; j<nnodes; j++)
+        mapping[j] = j;
+    for (int k=blocks[i].map_start; k<map_end; k++) {
+        mapping[map_names[k]] = map_values[k];
+        if (map_values[k] != -1)
+            rename = true;
+    }
+    return rename;
+}
+
+
+void CompactLocalTrees::rename_nodes(const int *mapping, LocalTree *tree,
+                                     vector<LocalNode> &scratch) const
+{
+    scratch.assign(tree->nodes, tree->nodes + nnodes);
+    for (int j=0; j<nnodes; j++) {
+        if (mapping[j] == -1)
+            continue;
+        LocalNode &node = tree->nodes[mapping[j]];
+        node.copy(scratch[j]);
+        if (node.parent != -1)
+            node.parent = mapping[node.parent];
+        for (int k=0; k<2; k++)
+            if (node.child[k] != -1)
+                node.child[k] = mapping[node.child[k]];
+    }
+}
+
+
+void CompactLocalTrees::replay(int i, LocalTree *tree, vector<int> *mapping,
+                               vector<LocalNode> &scratch) const
+{
+    const Block &b = blocks[i];
+    const int node_end = (i+1 < (int) blocks.size() ?
+                          blocks[i+1].node_start : node_names.size());
+
+    tree->ensure_capacity(nnodes);
+    tree->nnodes = nnodes;
+
+    int full_mapping[nnodes];
+    if (get_mapping(i, full_mapping) && !is_keyframe(i))
+        rename_nodes(full_mapping, tree, scratch);
+
+    for (int k=b.node_start; k<node_end; k++)
+        tree->nodes[node_names[k]].copy(nodes[k]);
+    tree->root = b.root;
+
+    if (mapping) {
+        if (b.has_mapping)
+            mapping->assign(full_mapping, full_mapping + nnodes);
+        else
+            mapping->clear();
+    }
+}
+
+
+void CompactLocalTrees::get_tree(int i, LocalTree *tree) const
+{
+    vector<LocalNode> scratch;
+    for (int j = i - i % keyframe_step; j <= i; j++)
+        replay(j, tree, NULL, scratch);
+}
+
+
+void CompactLocalTrees::expand(LocalTrees *trees, int start, int end) const
+{
+    if (start < start_coord)
+        start = start_coord;
+    if (end < 0 || end > end_coord)
+        end = end_coord;
+
+    trees->clear();
+    trees->chrom = chrom;
+    trees->nnodes = nnodes;
+    trees->seqids = seqids;
+    trees->start_coord = start;
+    trees->end_coord = start;
+
+    // find first tree overlapping region
+    const int ntrees = blocks.size();
+    int i = 0;
+    int pos = start_coord;
+    while (i < ntrees && pos + blocks[i].blocklen <= start)
+        pos += blocks[i++].blocklen;
+    if (i == ntrees || pos >= end)
+        return;
+    trees->start_coord = pos;
+
+    vector<int> mapping;
+    vector<LocalNode> scratch;
+    LocalTree *last = NULL;
+    for (; i < ntrees && pos < end; i++) {
+        const Block &b = blocks[i];
+        LocalTree *tree;
+        Spr spr;
+        int *mapping2 = NULL;
+
+        if (last == NULL) {
+            // first tree has no SPR
+            tree = new LocalTree();
+            get_tree(i, tree);
+            spr.set_null();
+        } else {
+            tree = new LocalTree(*last);
+            replay(i, tree, &mapping, scratch);
+            spr = b.spr;
+            if (b.has_mapping) {
+                mapping2 = new int [nnodes];
+                std::copy(mapping.begin(), mapping.end(), mapping2);
+            }
+        }
+
+        trees->trees.push_back(LocalTreeSpr(tree, spr, b.blocklen, mapping2));
+        pos += b.blocklen;
+        last = tree;
+    }
+    trees->end_coord = pos;
+}
+
+
+size_t CompactLocalTrees::get_memory() const
+{
+    return blocks.size() * sizeof(Block) +
+        node_names.size() * sizeof(int) +
+        nodes.size() * sizeof(LocalNode) +
+        map_names.size() * sizeof(int) +
+        map_values.size() * sizeof(int);
+}
+
+
+bool CompactLocalTrees::Cursor::next()
+{
+    if (index + 1 >= trees->get_num_trees())
+        return false;
+
+    index++;
+    const Block &b = trees->blocks[index];
+    trees->replay(index, &tree, &mapping, scratch);
+    spr = b.spr;
+    blocklen = b.blocklen;
+    start = end;
+    end += blocklen;
+    return true;
+}
+
+
+} // namespace argweaver
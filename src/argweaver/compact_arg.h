@@ -0,0 +1,172 @@
+//=============================================================================
+// compact storage of local trees
+
+#ifndef ARGWEAVER_COMPACT_ARG_H
+#define ARGWEAVER_COMPACT_ARG_H
+
+// c/c++ includes
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+// arghmm includes
+#include "local_tree.h"
+
+
+namespace argweaver {
+
+using namespace std;
+
+
+// A read-only ARG stored as a sequence of SPR deltas.
+//
+// Every 'keyframe_step' trees a full copy of the tree is kept.  Every
+// other tree is stored as its SPR, the non-identity entries of its
+// mapping, and the nodes that differ from the previous tree once that tree
+// is renamed by the mapping.  Since neighboring trees differ by one SPR,
+// this is only a few nodes per tree.  A tree is materialized by replaying
+// the deltas from the nearest keyframe.
+class CompactLocalTrees
+{
+public:
+    CompactLocalTrees(int keyframe_step=32) :
+        chrom("chr"),
+        start_coord(0),
+        end_coord(0),
+        nnodes(0),
+        keyframe_step(keyframe_step)
+    {}
+
+    // Removes all trees and takes the region and leaves from 'trees'
+    void set_info(const LocalTrees *trees);
+
+    // Stores a copy of 'trees'
+    void set(const LocalTrees *trees);
+
+    // Appends a tree to the end of the ARG
+    void push_back(const LocalTreeSpr &block);
+
+    // Removes all trees
+    void clear();
+
+    inline int get_num_trees() const
+    {
+        return blocks.size();
+    }
+
+    inline int get_num_leaves() const
+    {
+        return (nnodes + 1) / 2;
+    }
+
+    inline int length() const
+    {
+        return end_coord - start_coord;
+    }
+
+    // Materializes the i-th tree
+    void get_tree(int i, LocalTree *tree) const;
+
+    // Materializes the trees that overlap [start, end) into 'trees'.  The
+    // first tree has no SPR so that 'trees' is a valid ARG.  A negative
+    // start or end means the start or end of the ARG.
+    void expand(LocalTrees *trees, int start=-1, int end=-1) const;
+
+    // Returns the number of bytes used to store the trees
+    size_t get_memory() const;
+
+
+    // Visits the trees in order, materializing each tree from the previous
+    // one
+    class Cursor
+    {
+    public:
+        Cursor(const CompactLocalTrees *trees) :
+            trees(trees),
+            index(-1),
+            start(trees->start_coord),
+            end(trees->start_coord),
+            blocklen(0)
+        {
+            spr.set_null();
+        }
+
+        // Moves to the next tree.  Returns false after the last tree.
+        bool next();
+
+        // Returns the mapping from the previous tree (NULL if there is
+        // none)
+        inline const int *get_mapping() const
+        {
+            return mapping.empty() ? NULL : &mapping[0];
+        }
+
+        const CompactLocalTrees *trees;
+        int index;        // index of current tree
+        int start;        // start coordinate of current block
+        int end;          // end coordinate of current block
+        int blocklen;     // length of current block
+        LocalTree tree;   // current tree
+        Spr spr;          // SPR to the left of current tree
+
+    protected:
+        vector<int> mapping;
+        vector<LocalNode> scratch;
+    };
+
+
+    string chrom;          // chromosome name of region
+    int start_coord;       // start coordinate of region
+    int end_coord;         // end coordinate of region
+    int nnodes;            // number of nodes in each tree
+    vector<int> seqids;    // mapping from tree leaves to sequence ids
+
+protected:
+    // The delta of one tree.  The changed nodes are at
+    // [node_start, next block's node_start) in 'node_names'/'nodes' and
+    // the non-identity mapping entries at [map_start, next block's
+    // map_start) in 'map_names'/'map_values'.
+    struct Block
+    {
+        Spr spr;
+        int blocklen;
+        int root;
+        int node_start;
+        int map_start;
+        bool has_mapping;
+    };
+
+    inline bool is_keyframe(int i) const
+    {
+        return i % keyframe_step == 0;
+    }
+
+    // Turns 'tree' (the tree before block i) into the tree of block i.
+    // If 'mapping' is not NULL, the full mapping of block i is stored in
+    // it.
+    void replay(int i, LocalTree *tree, vector<int> *mapping,
+                vector<LocalNode> &scratch) const;
+
+    // Gets the full mapping of block i.  Returns false if the mapping
+    // only drops nodes and does not rename any.
+    bool get_mapping(int i, int *mapping) const;
+
+    // Renames the nodes of 'tree' by 'mapping'
+    void rename_nodes(const int *mapping, LocalTree *tree,
+                      vector<LocalNode> &scratch) const;
+
+    int keyframe_step;
+    vector<Block> blocks;
+    vector<int> node_names;
+    vector<LocalNode> nodes;
+    vector<int> map_names;
+    vector<int> map_values;
+
+    LocalTree last_tree;   // last tree appended
+    vector<LocalNode> push_scratch;
+};
+
+
+} // namespace argweaver
+
+#endif // ARGWEAVER_COMPACT_ARG_H
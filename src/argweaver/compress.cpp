@@ -1,53 +1,563 @@
 
 #include <unistd.h>
+#include <zlib.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <set>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "compress.h"
+#include "logging.h"
 #include "parsing.h"
 
 namespace argweaver {
 
 using namespace std;
 
+
+static int g_compress_threads = 0;
+
+// streams opened with an external command
+static set<FILE*> g_pipes;
+static mutex g_pipes_lock;
+
+
+void set_compress_threads(int nthreads)
+{
+    g_compress_threads = nthreads;
+}
+
+
+int get_compress_threads()
+{
+    return g_compress_threads;
+}
+
+
+//=============================================================================
+// BGZF writing
+
+// Last block of every BGZF file
+static const char BGZF_EOF[28] = {
+    '\x1f', '\x8b', '\x08', '\x04', 0, 0, 0, 0, 0, '\xff', '\x06', 0,
+    'B', 'C', '\x02', 0, '\x1b', 0, '\x03', 0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+static const int BGZF_HEADER_SIZE = 18;
+static const int BGZF_FOOTER_SIZE = 8;
+
+
+static inline void put_uint16(char *buf, unsigned int value)
+{
+    buf[0] = value & 0xff;
+    buf[1] = (value >> 8) & 0xff;
+}
+
+
+static inline void put_uint32(char *buf, unsigned long value)
+{
+    put_uint16(buf, value & 0xffff);
+    put_uint16(buf + 2, (value >> 16) & 0xffff);
+}
+
+
+// Compresses 'data' into a single BGZF block 'out'
+static bool compress_bgzf_block(const string &data, string *out)
+{
+    z_stream zs;
+    zs.zalloc = Z_NULL;
+    zs.zfree = Z_NULL;
+    zs.opaque = Z_NULL;
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+        return false;
+
+    out->resize(BGZF_HEADER_SIZE + deflateBound(&zs, data.size()) +
+                BGZF_FOOTER_SIZE);
+    char *buf = &(*out)[0];
+    zs.next_in = (Bytef*) data.data();
+    zs.avail_in = data.size();
+    zs.next_out = (Bytef*) (buf + BGZF_HEADER_SIZE);
+    zs.avail_out = out->size() - BGZF_HEADER_SIZE - BGZF_FOOTER_SIZE;
+    int status = deflate(&zs, Z_FINISH);
+    const size_t zsize = zs.total_out;
+    deflateEnd(&zs);
+    if (status != Z_STREAM_END)
+        return false;
+
+    const size_t size = BGZF_HEADER_SIZE + zsize + BGZF_FOOTER_SIZE;
+    if (size > 0x10000)
+        return false;
+
+    // gzip header with the BGZF extra field holding the block size
+    memcpy(buf, BGZF_EOF, BGZF_HEADER_SIZE);
+    put_uint16(buf + 16, size - 1);
+
+    char *footer = buf + BGZF_HEADER_SIZE + zsize;
+    put_uint32(footer, crc32(crc32(0L, Z_NULL, 0),
+                             (const Bytef*) data.data(), data.size()));
+    put_uint32(footer + 4, data.size());
+    out->resize(size);
+    return true;
+}
+
+
+// Writes a stream in BGZF blocks, optionally compressing blocks on worker
+// threads.  Blocks are written in order regardless of which thread
+// compressed them.
+class BgzfWriter
+{
+public:
+    BgzfWriter(FILE *out, int nthreads) :
+        out(out),
+        nthreads(nthreads),
+        error(false),
+        stopping(false)
+    {
+        buffer.reserve(BGZF_BLOCK_SIZE);
+        for (int i=0; i<nthreads; i++)
+            workers.push_back(thread(&BgzfWriter::worker, this));
+    }
+
+    ~BgzfWriter()
+    {
+        stop();
+        for (size_t i=0; i<inflight.size(); i++)
+            delete inflight[i];
+    }
+
+    bool write(const char *buf, size_t size)
+    {
+        while (size > 0) {
+            size_t n = min(size, (size_t) BGZF_BLOCK_SIZE - buffer.size());
+            buffer.append(buf, n);
+            buf += n;
+            size -= n;
+            if (buffer.size() == (size_t) BGZF_BLOCK_SIZE && !flush_block())
+                return false;
+        }
+        return !error;
+    }
+
+    // Writes remaining data and the end-of-file block and closes the file
+    bool close()
+    {
+        if (buffer.size() > 0)
+            flush_block();
+        write_done_blocks(0);
+        stop();
+        if (fwrite(BGZF_EOF, 1, sizeof(BGZF_EOF), out) != sizeof(BGZF_EOF))
+            error = true;
+        if (fclose(out) != 0)
+            error = true;
+        return !error;
+    }
+
+protected:
+    struct Block {
+        Block() : ok(false), done(false) {}
+        string data;
+        string compressed;
+        bool ok;
+        bool done;
+    };
+
+    bool write_block(const string &compressed)
+    {
+        if (fwrite(compressed.data(), 1, compressed.size(), out) !=
+            compressed.size())
+            error = true;
+        return !error;
+    }
+
+    // Compresses the buffered data as one block
+    bool flush_block()
+    {
+        if (nthreads == 0) {
+            string compressed;
+            if (!compress_bgzf_block(buffer, &compressed))
+                error = true;
+            buffer.clear();
+            return !error && write_block(compressed);
+        }
+
+        Block *block = new Block();
+        block->data.swap(buffer);
+        buffer.reserve(BGZF_BLOCK_SIZE);
+        {
+            lock_guard<mutex> guard(lock);
+            inflight.push_back(block);
+            jobs.push_back(block);
+        }
+        job_ready.notify_one();
+
+        // bound the number of blocks held in memory
+        return write_done_blocks(2 * nthreads);
+    }
+
+    // Writes compressed blocks in order, waiting until at most
+    // 'max_pending' blocks remain
+    bool write_done_blocks(size_t max_pending)
+    {
+        while (true) {
+            Block *block;
+            {
+                unique_lock<mutex> guard(lock);
+                while (inflight.size() > max_pending &&
+                       !inflight.front()->done)
+                    block_done.wait(guard);
+                if (inflight.empty() || !inflight.front()->done)
+                    break;
+                block = inflight.front();
+                inflight.pop_front();
+            }
+            if (!block->ok)
+                error = true;
+            write_block(block->compressed);
+            delete block;
+        }
+        return !error;
+    }
+
+    void worker()
+    {
+        while (true) {
+            Block *block;
+            {
+                unique_lock<mutex> guard(lock);
+                while (jobs.empty() && !stopping)
+                    job_ready.wait(guard);
+                if (jobs.empty())
+                    return;
+                block = jobs.front();
+                jobs.pop_front();
+            }
+
+            bool ok = compress_bgzf_block(block->data, &block->compressed);
+            {
+                lock_guard<mutex> guard(lock);
+                block->ok = ok;
+                block->done = true;
+            }
+            block_done.notify_all();
+        }
+    }
+
+    void stop()
+    {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        job_ready.notify_all();
+        for (size_t i=0; i<workers.size(); i++)
+            workers[i].join();
+        workers.clear();
+    }
+
+    FILE *out;
+    int nthreads;
+    bool error;
+    string buffer;  // data of the block being filled
+
+    vector<thread> workers;
+    deque<Block*> inflight;  // blocks not yet written, in file order
+    deque<Block*> jobs;      // blocks not yet compressed
+    mutex lock;
+    condition_variable job_ready;
+    condition_variable block_done;
+    bool stopping;
+};
+
+
+//=============================================================================
+// BGZF reading
+
+static inline unsigned int get_uint16(const unsigned char *buf)
+{
+    return buf[0] | (buf[1] << 8);
+}
+
+
+bool BgzfReader::open(const char *filename)
+{
+    close();
+    infile = fopen(filename, "rb");
+    if (!infile)
+        return false;
+    loaded = false;
+    block.clear();
+    block_address = next_address = 0;
+    block_offset = 0;
+    return true;
+}
+
+
+void BgzfReader::close()
+{
+    if (infile) {
+        fclose(infile);
+        infile = NULL;
+    }
+}
+
+
+bool BgzfReader::read_block()
+{
+    // gzip header and extra field
+    unsigned char header[12];
+    if (fread(header, 1, sizeof(header), infile) != sizeof(header))
+        return false;
+    if (header[0] != 0x1f || header[1] != 0x8b || header[2] != 8 ||
+        !(header[3] & 4)) {
+        printError("file is not in BGZF format");
+        return false;
+    }
+    const unsigned int xlen = get_uint16(header + 10);
+    vector<unsigned char> extra(xlen);
+    if (fread(&extra[0], 1, xlen, infile) != xlen)
+        return false;
+
+    // BC subfield holds the block size
+    long bsize = -1;
+    for (unsigned int i=0; i + 4 <= xlen;
+         i += 4 + get_uint16(&extra[i + 2])) {
+        if (extra[i] == 'B' && extra[i + 1] == 'C' &&
+            get_uint16(&extra[i + 2]) == 2 && i + 6 <= xlen) {
+            bsize = get_uint16(&extra[i + 4]) + 1;
+            break;
+        }
+    }
+    const long zsize = bsize - 12 - xlen - BGZF_FOOTER_SIZE;
+    if (zsize < 0) {
+        printError("file is not in BGZF format");
+        return false;
+    }
+
+    string data(zsize + BGZF_FOOTER_SIZE, '\0');
+    if (fread(&data[0], 1, data.size(), infile) != data.size())
+        return false;
+    const unsigned char *footer = (const unsigned char*) &data[zsize];
+    const size_t isize = get_uint16(footer + 4) |
+        ((size_t) get_uint16(footer + 6) << 16);
+
+    block.resize(isize);
+    if (isize > 0) {
+        z_stream zs;
+        zs.zalloc = Z_NULL;
+        zs.zfree = Z_NULL;
+        zs.opaque = Z_NULL;
+        zs.next_in = (Bytef*) data.data();
+        zs.avail_in = zsize;
+        if (inflateInit2(&zs, -15) != Z_OK)
+            return false;
+        zs.next_out = (Bytef*) &block[0];
+        zs.avail_out = isize;
+        int status = inflate(&zs, Z_FINISH);
+        inflateEnd(&zs);
+        if (status != Z_STREAM_END) {
+            printError("corrupt BGZF block");
+            return false;
+        }
+    }
+
+    block_address = next_address;
+    next_address += bsize;
+    block_offset = 0;
+    loaded = true;
+    return true;
+}
+
+
+bool BgzfReader::seek(uint64_t voffset)
+{
+    const uint64_t address = voffset >> 16;
+    if (!loaded || address != block_address) {
+        if (fseeko(infile, address, SEEK_SET) != 0)
+            return false;
+        next_address = address;
+        if (!read_block())
+            return false;
+    }
+    block_offset = voffset & 0xffff;
+    return block_offset <= block.size();
+}
+
+
+bool BgzfReader::getline(string &line)
+{
+    line.clear();
+    while (true) {
+        if (!loaded || block_offset >= block.size()) {
+            if (!read_block())
+                return !line.empty();
+            continue;
+        }
+
+        const char *start = block.data() + block_offset;
+        const size_t len = block.size() - block_offset;
+        const char *end = (const char*) memchr(start, '\n', len);
+        if (end) {
+            line.append(start, end - start);
+            block_offset += end - start + 1;
+            return true;
+        }
+        line.append(start, len);
+        block_offset += len;
+    }
+}
+
+
+//=============================================================================
+// stdio streams backed by zlib
+
+#ifdef __APPLE__
+typedef int cookie_size_t;
+typedef int cookie_ssize_t;
+#else
+typedef size_t cookie_size_t;
+typedef ssize_t cookie_ssize_t;
+#endif
+
+
+static cookie_ssize_t gz_cookie_read(void *cookie, char *buf,
+                                     cookie_size_t size)
+{
+    return gzread((gzFile) cookie, buf, size);
+}
+
+
+static int gz_cookie_close(void *cookie)
+{
+    return gzclose((gzFile) cookie) == Z_OK ? 0 : EOF;
+}
+
+
+static cookie_ssize_t bgzf_cookie_write(void *cookie, const char *buf,
+                                        cookie_size_t size)
+{
+    return ((BgzfWriter*) cookie)->write(buf, size) ? size : 0;
+}
+
+
+static int bgzf_cookie_close(void *cookie)
+{
+    BgzfWriter *writer = (BgzfWriter*) cookie;
+    bool ok = writer->close();
+    delete writer;
+    return ok ? 0 : EOF;
+}
+
+
+static cookie_ssize_t reader_cookie_read(void *cookie, char *buf,
+                                         cookie_size_t size)
+{
+    return ((StreamReader*) cookie)->read(buf, size);
+}
+
+
+static int reader_cookie_close(void *cookie)
+{
+    return 0;
+}
+
+
+typedef cookie_ssize_t (*cookie_read_t)(void *, char *, cookie_size_t);
+typedef cookie_ssize_t (*cookie_write_t)(void *, const char *, cookie_size_t);
+typedef int (*cookie_close_t)(void *);
+
+static FILE *open_cookie_stream(void *cookie, cookie_read_t readfn,
+                                cookie_write_t writefn,
+                                cookie_close_t closefn)
+{
+#ifdef __APPLE__
+    return funopen(cookie, readfn, writefn, NULL, closefn);
+#else
+    cookie_io_functions_t funcs = {readfn, writefn, NULL, closefn};
+    return fopencookie(cookie, writefn ? "w" : "r", funcs);
+#endif
+}
+
+
+FILE *open_read_stream(StreamReader *reader)
+{
+    return open_cookie_stream(reader, reader_cookie_read, NULL,
+                              reader_cookie_close);
+}
+
+
+static FILE *open_pipe(const string &cmd, const char *mode)
+{
+    FILE *stream = popen(cmd.c_str(), mode);
+    if (stream) {
+        lock_guard<mutex> guard(g_pipes_lock);
+        g_pipes.insert(stream);
+    }
+    return stream;
+}
+
+
+//=============================================================================
+
 FILE *read_compress(const char *filename, const char *command)
 {
     bool exists = !access(filename, F_OK);
     if (!exists)
         return NULL;
-    const char *command2 = (command ? command : UNZIP_COMMAND);
-    string cmd = string(command2) + " < " + quote_arg(filename);
-    return popen(cmd.c_str(), "r");
+    if (command)
+        return open_pipe(string(command) + " < " + quote_arg(filename), "r");
+
+    gzFile gz = gzopen(filename, "rb");
+    if (!gz)
+        return NULL;
+    gzbuffer(gz, 1 << 17);
+    FILE *stream = open_cookie_stream(gz, gz_cookie_read, NULL,
+                                      gz_cookie_close);
+    if (!stream)
+        gzclose(gz);
+    return stream;
 }
 
 
 FILE *write_compress(const char *filename, const char *command)
 {
-    // TODO: add check to prevent write error
-    const char *command2 = (command ? command : ZIP_COMMAND);
-    string cmd = string(command2) + " > " + quote_arg(filename);
-    return popen(cmd.c_str(), "w");
+    if (command)
+        return open_pipe(string(command) + " > " + quote_arg(filename), "w");
+
+    FILE *out = fopen(filename, "wb");
+    if (!out)
+        return NULL;
+    BgzfWriter *writer = new BgzfWriter(out, g_compress_threads);
+    FILE *stream = open_cookie_stream(writer, NULL, bgzf_cookie_write,
+                                      bgzf_cookie_close);
+    if (!stream)
+        bgzf_cookie_close(writer);
+    return stream;
 }
 
 
 FILE *open_compress(const char *filename, const char *mode,
                     const char *command)
 {
-    string cmd;
     if (mode[0] == 'w')
-        cmd = string(command) + " > " + quote_arg(filename);
+        return write_compress(filename, command);
     else if (mode[0] == 'r')
-        cmd = string(command) + " < " + quote_arg(filename);
-
-    return popen(cmd.c_str(), mode);
+        return read_compress(filename, command);
+    return NULL;
 }
 
 
 int close_compress(FILE *stream)
 {
-    return pclose(stream);
+    bool piped;
+    {
+        lock_guard<mutex> guard(g_pipes_lock);
+        piped = g_pipes.erase(stream) > 0;
+    }
+    return piped ? pclose(stream) : fclose(stream);
 }
 
 
 } // namespace argweaver
-
-
@@ -1,26 +1,104 @@
 #ifndef ARGWEAVER_COMPRESS_H
 #define ARGWEAVER_COMPRESS_H
 
+#include <stdint.h>
 #include <string.h>
 #include <stdio.h>
+#include <string>
 
 namespace argweaver {
 
 
-// default zip/unzip commands
+// External zip/unzip commands.  Compressed files are read and written
+// in-process with zlib unless one of these (or another command) is given
+// explicitly.
 #define ZIP_COMMAND "gzip -"
 #define UNZIP_COMMAND "gunzip -f -"
 
+// Largest amount of uncompressed data held in one BGZF block
+#define BGZF_BLOCK_SIZE 0xff00
 
-FILE *read_compress(const char *filename, const char *command=UNZIP_COMMAND);
 
-FILE *write_compress(const char *filename, const char *command=ZIP_COMMAND);
+// Opens a gzip (or BGZF) file for reading.  Files that are not compressed
+// are read as is.
+FILE *read_compress(const char *filename, const char *command=NULL);
+
+// Opens a file for writing in BGZF format, which gzip can read and tabix
+// can index
+FILE *write_compress(const char *filename, const char *command=NULL);
 
 FILE *open_compress(const char *filename, const char *mode,
-                    const char *command=ZIP_COMMAND);
+                    const char *command=NULL);
 
 int close_compress(FILE *stream);
 
+// Number of worker threads compressing BGZF blocks of each file written
+// by write_compress (0 compresses in the writing thread)
+void set_compress_threads(int nthreads);
+int get_compress_threads();
+
+
+// A source of data for a read-only stdio stream
+class StreamReader
+{
+public:
+    virtual ~StreamReader() {}
+
+    // Copies up to 'size' bytes into 'buf'.  Returns 0 at the end of data.
+    virtual size_t read(char *buf, size_t size) = 0;
+};
+
+// Opens a stdio stream reading from 'reader'.  Closing the stream does not
+// delete the reader.
+FILE *open_read_stream(StreamReader *reader);
+
+
+// Reads a BGZF file with random access by virtual file offsets, as used
+// by tabix indexes (compressed block offset << 16 | offset within block)
+class BgzfReader
+{
+public:
+    BgzfReader() :
+        infile(NULL),
+        loaded(false),
+        block_address(0),
+        next_address(0),
+        block_offset(0)
+    {}
+
+    ~BgzfReader()
+    {
+        close();
+    }
+
+    bool open(const char *filename);
+    void close();
+
+    // Moves to virtual file offset 'voffset'
+    bool seek(uint64_t voffset);
+
+    // Returns the virtual file offset of the next unread byte
+    inline uint64_t tell() const
+    {
+        return (block_address << 16) | block_offset;
+    }
+
+    // Reads the next line without its newline.  Returns false at the end
+    // of the file.
+    bool getline(std::string &line);
+
+protected:
+    bool read_block();
+
+    FILE *infile;
+    bool loaded;              // whether 'block' holds the block at
+                              // 'block_address'
+    std::string block;        // uncompressed data of current block
+    uint64_t block_address;   // file offset of current block
+    uint64_t next_address;    // file offset of the next block
+    size_t block_offset;      // offset of next unread byte in 'block'
+};
+
 
 class CompressStream
 {
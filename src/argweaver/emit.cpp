@@ -1,8 +1,12 @@
 
+// c/c++ includes
+#include <string.h>
+
 #include "common.h"
 #include "emit.h"
 #include "seq.h"
 #include "thread.h"
+#include "workspace.h"
 
 namespace argweaver {
 
@@ -85,6 +89,82 @@ void find_masked_sites(const char *const *seqs, int nseqs, int seqlen,
 }
 
 
+// Returns true if sites i and j have the same bases (and base probabilities)
+static inline bool same_site_pattern(
+    const char *const *seqs, int nseqs,
+    const vector<vector<BaseProbs> > &base_probs, int i, int j)
+{
+    for (int k=0; k<nseqs; k++)
+        if (seqs[k][i] != seqs[k][j])
+            return false;
+    if (base_probs.size() > 0) {
+        for (int k=0; k<nseqs; k++)
+            if (memcmp(base_probs[k][i].prob, base_probs[k][j].prob,
+                       sizeof(base_probs[k][i].prob)) != 0)
+                return false;
+    }
+    return true;
+}
+
+
+// Assigns each variant site the index of its alignment column pattern
+// (-1 for other sites).  Columns match if all bases (and base
+// probabilities) are equal.  'sites' (of length seqlen) receives one site
+// for each pattern.  The pattern hash table is taken from 'workspace'.
+int find_site_patterns(const char *const *seqs, int nseqs, int seqlen,
+                       const bool *variant,
+                       const vector<vector<BaseProbs> > &base_probs,
+                       int *pattern, int *sites, HmmWorkspace &workspace)
+{
+    const bool have_base_probs = ( base_probs.size() > 0 );
+
+    // open addressing hash table of pattern indices
+    int nvariant = 0;
+    for (int i=0; i<seqlen; i++)
+        nvariant += variant[i];
+    unsigned int size = 16;
+    while (size < 2 * (unsigned int) nvariant)
+        size *= 2;
+    int *table = workspace.alloc<int>(size);
+    fill(table, table + size, -1);
+
+    int npatterns = 0;
+    for (int i=0; i<seqlen; i++) {
+        if (!variant[i]) {
+            pattern[i] = -1;
+            continue;
+        }
+
+        // FNV-1a hash of the column
+        unsigned int hash = 2166136261u;
+        for (int j=0; j<nseqs; j++)
+            hash = (hash ^ (unsigned char) seqs[j][i]) * 16777619u;
+        if (have_base_probs) {
+            for (int j=0; j<nseqs; j++) {
+                const unsigned char *bytes =
+                    (const unsigned char*) base_probs[j][i].prob;
+                for (unsigned int k=0; k<sizeof(base_probs[j][i].prob); k++)
+                    hash = (hash ^ bytes[k]) * 16777619u;
+            }
+        }
+
+        unsigned int slot = hash & (size - 1);
+        while (table[slot] != -1 &&
+               !same_site_pattern(seqs, nseqs, base_probs, i,
+                                  sites[table[slot]]))
+            slot = (slot + 1) & (size - 1);
+
+        if (table[slot] == -1) {
+            table[slot] = npatterns;
+            sites[npatterns++] = i;
+        }
+        pattern[i] = table[slot];
+    }
+
+    return npatterns;
+}
+
+
 int count_alleles(const char *const *seqs,
                   const int nseqs, const int pos)
 {
@@ -146,31 +226,44 @@ void prob_tree_mutation(const LocalTree *tree, const ArgModel *model,
 //============================================================================
 // emissions
 
-// table of partial likelihood values
-typedef double lk_row[4];
-
+// Rows (sites) are views into one contiguous site-major block.
 class LikelihoodTable
 {
 public:
     LikelihoodTable(int seqlen, int nnodes) :
         seqlen(seqlen),
-        nnodes(nnodes)
+        nnodes(nnodes),
+        owned(true)
     {
         data = new lk_row* [seqlen];
+        block = new lk_row [max(seqlen * nnodes, 1)];
         for (int i=0; i<seqlen; i++)
-            data[i] = new double [nnodes][4];
+            data[i] = &block[i * nnodes];
+    }
+
+    // allocate table in a workspace (freed by the workspace's next reset)
+    LikelihoodTable(int seqlen, int nnodes, HmmWorkspace &workspace) :
+        seqlen(seqlen),
+        nnodes(nnodes),
+        owned(false)
+    {
+        data = workspace.alloc_matrix<lk_row>(seqlen, nnodes);
+        block = NULL;
     }
 
     ~LikelihoodTable()
     {
-        for (int i=0; i<seqlen; i++)
-            delete [] data[i];
-        delete [] data;
+        if (owned) {
+            delete [] block;
+            delete [] data;
+        }
     }
 
     int seqlen;
     int nnodes;
+    bool owned;
     lk_row **data;
+    lk_row *block;
 };
 
 
@@ -331,12 +424,14 @@ void likelihood_site_outer(
 }
 
 
-void calc_inner_outer(const LocalTree *tree, const ArgModel *model,
-                      const char *const *seqs,
-                      const vector<vector<BaseProbs> > &base_probs,
-                      const int seqlen,
-                      const bool *variant, bool internal,
-                      lk_row **inner, lk_row **outer)
+// calculate inner and outer tables at 'sites' (where 'use' is true);
+// row k of the tables is for site sites[k]
+void calc_inner_outer_slow(const LocalTree *tree, const ArgModel *model,
+                           const char *const *seqs,
+                           const vector<vector<BaseProbs> > &base_probs,
+                           const int *sites, const int nsites,
+                           const bool *use, bool internal,
+                           lk_row **inner, lk_row **outer)
 {
     // get postorder
     int norder = tree->nnodes;
@@ -350,12 +445,269 @@ void calc_inner_outer(const LocalTree *tree, const ArgModel *model,
     prob_tree_mutation(tree, model, muts, nomuts);
 
     // calculate emissions for tree at each site
-    for (int i=0; i<seqlen; i++) {
-        if (variant[i]) {
-            likelihood_site_inner(tree, seqs, base_probs, i, order, norder,
-                                  muts, nomuts, inner[i]);
+    for (int k=0; k<nsites; k++) {
+        if (use == NULL || use[k]) {
+            likelihood_site_inner(tree, seqs, base_probs, sites[k],
+                                  order, norder, muts, nomuts, inner[k]);
             likelihood_site_outer(tree, muts, nomuts, internal,
-                                  inner[i], outer[i]);
+                                  inner[k], outer[k]);
+        }
+    }
+}
+
+
+
+//=============================================================================
+// batched pruning
+//
+// The batched functions below apply each node update to PRUNE_BATCH sites
+// at once.  The partial likelihoods of a batch are stored site-minor,
+// table[(node*4 + a)*PRUNE_BATCH + s], so that every update is a vector
+// operation across sites.  Each site goes through the same sequence of
+// floating point operations as in the per-site functions above, so the
+// results are identical.
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#   define ARGWEAVER_X86_SIMD
+#endif
+
+#ifdef __GNUC__
+#   define PRUNE_INLINE inline __attribute__((always_inline))
+#else
+#   define PRUNE_INLINE inline
+#endif
+
+const int PRUNE_BATCH = 8;
+
+
+// tree information shared by all batches of a tree
+struct PruneTree
+{
+    const LocalTree *tree;
+    const int *postorder;   // nodes for inner tables (children first)
+    int npostorder;
+    const int *preorder;    // nodes for outer tables (parents first)
+    int npreorder;
+    int outer_root;
+    const double *muts;
+    const double *nomuts;
+};
+
+
+// set leaf partial likelihoods for a batch of sites
+static PRUNE_INLINE void prune_leaf_batch(
+    const int node,
+    const char *const *seqs,
+    const vector<vector<BaseProbs> > &base_probs,
+    const int *sites, const int nsites, double *inner)
+{
+    double *row = &inner[node * 4 * PRUNE_BATCH];
+
+    for (int s=0; s<PRUNE_BATCH; s++) {
+        if (s >= nsites) {
+            // unused lane
+            for (int a=0; a<4; a++)
+                row[a*PRUNE_BATCH + s] = 1.0;
+            continue;
+        }
+
+        const int pos = sites[s];
+        const char c = seqs[node][pos];
+        if (c == 'N') {
+            for (int a=0; a<4; a++)
+                row[a*PRUNE_BATCH + s] = 1.0;
+        } else if (base_probs.size() > 0) {
+            for (int a=0; a<4; a++)
+                row[a*PRUNE_BATCH + s] = base_probs[node][pos].prob[a];
+        } else {
+            for (int a=0; a<4; a++)
+                row[a*PRUNE_BATCH + s] = 0.0;
+            row[dna2int[(int) c]*PRUNE_BATCH + s] = 1.0;
+        }
+    }
+}
+
+
+// p[a][s] = sum_b P(a -> b along branch) * lk[b][s], summed in order of b
+// (the products are shared between the four values of a)
+static PRUNE_INLINE void prune_branch_batch(
+    const double *lk, const double mut, const double nomut, double *p)
+{
+    const int W = PRUNE_BATCH;
+    for (int s=0; s<W; s++) {
+        const double m0 = lk[s] * mut, n0 = lk[s] * nomut;
+        const double m1 = lk[W + s] * mut, n1 = lk[W + s] * nomut;
+        const double m2 = lk[2*W + s] * mut, n2 = lk[2*W + s] * nomut;
+        const double m3 = lk[3*W + s] * mut, n3 = lk[3*W + s] * nomut;
+        const double m01 = m0 + m1;
+        p[s] = ((n0 + m1) + m2) + m3;
+        p[W + s] = ((m0 + n1) + m2) + m3;
+        p[2*W + s] = (m01 + n2) + m3;
+        p[3*W + s] = (m01 + m2) + n3;
+    }
+}
+
+
+// compute inner (and if 'outer' is not NULL, outer) tables for a batch
+static PRUNE_INLINE void prune_batch_body(
+    const PruneTree &pt, const char *const *seqs,
+    const vector<vector<BaseProbs> > &base_probs,
+    const int *sites, const int nsites, double *inner, double *outer)
+{
+    const LocalNode *nodes = pt.tree->nodes;
+    const int W = PRUNE_BATCH;
+    double p1[4 * PRUNE_BATCH], p2[4 * PRUNE_BATCH];
+
+    // inner tables in postorder
+    for (int i=0; i<pt.npostorder; i++) {
+        const int j = pt.postorder[i];
+        if (nodes[j].is_leaf()) {
+            prune_leaf_batch(j, seqs, base_probs, sites, nsites, inner);
+            continue;
+        }
+
+        const int c1 = nodes[j].child[0];
+        const int c2 = nodes[j].child[1];
+        prune_branch_batch(&inner[c1*4*W], pt.muts[c1], pt.nomuts[c1], p1);
+        prune_branch_batch(&inner[c2*4*W], pt.muts[c2], pt.nomuts[c2], p2);
+        double *row = &inner[j*4*W];
+        for (int k=0; k<4*W; k++)
+            row[k] = p1[k] * p2[k];
+    }
+
+    if (!outer)
+        return;
+
+    // outer tables in preorder
+    for (int i=0; i<pt.npreorder; i++) {
+        const int j = pt.preorder[i];
+        double *row = &outer[j*4*W];
+        if (j == pt.outer_root) {
+            for (int k=0; k<4*W; k++)
+                row[k] = 1.0;
+            continue;
+        }
+
+        const int sib = pt.tree->get_sibling(j);
+        const int parent = nodes[j].parent;
+        prune_branch_batch(&inner[sib*4*W], pt.muts[sib], pt.nomuts[sib], p1);
+        if (parent != pt.outer_root) {
+            prune_branch_batch(&outer[parent*4*W], pt.muts[parent],
+                               pt.nomuts[parent], p2);
+            for (int k=0; k<4*W; k++)
+                row[k] = p1[k] * p2[k];
+        } else {
+            for (int k=0; k<4*W; k++)
+                row[k] = p1[k];
+        }
+    }
+}
+
+
+static void prune_batch_generic(
+    const PruneTree &pt, const char *const *seqs,
+    const vector<vector<BaseProbs> > &base_probs,
+    const int *sites, const int nsites, double *inner, double *outer)
+{
+    prune_batch_body(pt, seqs, base_probs, sites, nsites, inner, outer);
+}
+
+
+#ifdef ARGWEAVER_X86_SIMD
+// NOTE: fma is deliberately not enabled, so that products and sums are
+// rounded exactly as in the per-site code
+__attribute__((target("avx2")))
+static void prune_batch_avx2(
+    const PruneTree &pt, const char *const *seqs,
+    const vector<vector<BaseProbs> > &base_probs,
+    const int *sites, const int nsites, double *inner, double *outer)
+{
+    prune_batch_body(pt, seqs, base_probs, sites, nsites, inner, outer);
+}
+#endif
+
+
+// Computes the inner (and if 'outer' is not NULL, outer) tables of up to
+// PRUNE_BATCH sites.  Tables have nnodes*4*PRUNE_BATCH entries.
+static void prune_batch(
+    const PruneTree &pt, const char *const *seqs,
+    const vector<vector<BaseProbs> > &base_probs,
+    const int *sites, const int nsites, double *inner, double *outer)
+{
+#ifdef ARGWEAVER_X86_SIMD
+    static const bool use_avx2 = __builtin_cpu_supports("avx2");
+    if (use_avx2) {
+        prune_batch_avx2(pt, seqs, base_probs, sites, nsites, inner, outer);
+        return;
+    }
+#endif
+    prune_batch_generic(pt, seqs, base_probs, sites, nsites, inner, outer);
+}
+
+
+// calculate inner and outer tables at 'sites' (where 'use' is true);
+// row k of the tables is for site sites[k]
+void calc_inner_outer(const LocalTree *tree, const ArgModel *model,
+                      const char *const *seqs,
+                      const vector<vector<BaseProbs> > &base_probs,
+                      const int *sites, const int nsites,
+                      const bool *use, bool internal,
+                      lk_row **inner, lk_row **outer)
+{
+    const int nnodes = tree->nnodes;
+    const int W = PRUNE_BATCH;
+
+    // get postorder
+    int postorder[nnodes];
+    tree->get_postorder(postorder);
+
+    // get preorder of the tree below the outer root
+    const int outer_root = internal ? tree->nodes[tree->root].child[1] :
+        tree->root;
+    int preorder[nnodes];
+    int npreorder = 0;
+    tree->get_preorder(outer_root, preorder, npreorder);
+
+    // get mutation probabilities
+    double muts[nnodes];
+    double nomuts[nnodes];
+    prob_tree_mutation(tree, model, muts, nomuts);
+
+    PruneTree pt = {tree, postorder, nnodes, preorder, npreorder,
+                    outer_root, muts, nomuts};
+    double inner_batch[nnodes * 4 * W];
+    double outer_batch[nnodes * 4 * W];
+
+    // calculate tables in batches of sites
+    int batch_sites[W];
+    int batch_rows[W];
+    int k = 0;
+    while (k < nsites) {
+        int nbatch = 0;
+        for (; k<nsites && nbatch < W; k++) {
+            if (use == NULL || use[k]) {
+                batch_sites[nbatch] = sites[k];
+                batch_rows[nbatch++] = k;
+            }
+        }
+        if (nbatch == 0)
+            break;
+
+        prune_batch(pt, seqs, base_probs, batch_sites, nbatch,
+                    inner_batch, outer_batch);
+
+        // copy batch into tables
+        for (int s=0; s<nbatch; s++) {
+            lk_row *inner_row = inner[batch_rows[s]];
+            lk_row *outer_row = outer[batch_rows[s]];
+            for (int j=0; j<nnodes; j++)
+                for (int a=0; a<4; a++)
+                    inner_row[j][a] = inner_batch[(j*4 + a)*W + s];
+            for (int i=0; i<npreorder; i++) {
+                const int j = preorder[i];
+                for (int a=0; a<4; a++)
+                    outer_row[j][a] = outer_batch[(j*4 + a)*W + s];
+            }
         }
     }
 }
@@ -435,11 +787,11 @@ void likelihood_sites(const LocalTree *tree, const ArgModel *model,
 
 
 
-double likelihood_tree(const LocalTree *tree, const ArgModel *model,
-                       const char *const *seqs,
-                       const vector<vector<BaseProbs> > &base_probs,
-                       const int nseqs,
-                       const int start, const int end)
+double likelihood_tree_slow(const LocalTree *tree, const ArgModel *model,
+                            const char *const *seqs,
+                            const vector<vector<BaseProbs> > &base_probs,
+                            const int nseqs,
+                            const int start, const int end)
 {
     const double *times = model->times;
     const int nnodes = tree->nnodes;
@@ -493,6 +845,89 @@ double likelihood_tree(const LocalTree *tree, const ArgModel *model,
 
 
 
+double likelihood_tree(const LocalTree *tree, const ArgModel *model,
+                       const char *const *seqs,
+                       const vector<vector<BaseProbs> > &base_probs,
+                       const int nseqs,
+                       const int start, const int end)
+{
+    const double *times = model->times;
+    const int nnodes = tree->nnodes;
+    const LocalNode *nodes = tree->nodes;
+    const int W = PRUNE_BATCH;
+    double invariant_lk = -1;
+    lk_row table[nnodes];
+
+    // get postorder
+    int order[tree->nnodes];
+    tree->get_postorder(order);
+
+    // get mutation probabilities
+    double muts[tree->nnodes];
+    double nomuts[tree->nnodes];
+    for (int i=0; i<tree->nnodes; i++) {
+        if (i != tree->root) {
+            double t = ( nodes[nodes[i].parent].age == nodes[i].age ?
+                  model->get_mintime(nodes[i].age) :
+                  times[nodes[nodes[i].parent].age] - times[nodes[i].age] );
+            muts[i] = prob_branch(t, model->mu, true);
+            nomuts[i] = prob_branch(t, model->mu, false);
+        }
+    }
+
+    PruneTree pt = {tree, order, nnodes, NULL, 0, tree->root, muts, nomuts};
+    double inner_batch[nnodes * 4 * W];
+    const double *root_row = &inner_batch[tree->root * 4 * W];
+
+    // calculate site likelihoods in chunks, batching the variant sites,
+    // and sum their logs in site order
+    const int CHUNK = 32 * PRUNE_BATCH;
+    double lks[CHUNK];
+    bool masked[CHUNK];
+    int batch_sites[CHUNK];
+    double lnl = 0.0;
+    for (int chunk=start; chunk<end; chunk+=CHUNK) {
+        const int chunk_end = min(chunk + CHUNK, end);
+        int nbatch = 0;
+
+        for (int i=chunk; i<chunk_end; i++) {
+            bool invariant = is_invariant_site(seqs, nseqs, i, base_probs);
+            masked[i - chunk] = (invariant && seqs[0][i] == 'N');
+            if (masked[i - chunk]) {
+                continue;
+            } else if (invariant) {
+                if (invariant_lk < 0)
+                    invariant_lk = likelihood_site_inner(
+                        tree, seqs, base_probs, i, order, nnodes,
+                        muts, nomuts, table);
+                // use precommuted invariant site likelihood
+                lks[i - chunk] = invariant_lk;
+            } else {
+                batch_sites[nbatch++] = i;
+            }
+        }
+
+        for (int b=0; b<nbatch; b+=W) {
+            const int n = min(W, nbatch - b);
+            prune_batch(pt, seqs, base_probs, &batch_sites[b], n,
+                        inner_batch, NULL);
+            for (int s=0; s<n; s++) {
+                double p = 0.0;
+                for (int a=0; a<4; a++)
+                    p += root_row[a*W + s] * .25;
+                lks[batch_sites[b + s] - chunk] = p;
+            }
+        }
+
+        for (int i=chunk; i<chunk_end; i++)
+            if (!masked[i - chunk])
+                lnl += log(lks[i - chunk]);
+    }
+
+    return lnl;
+}
+
+
 //=============================================================================
 // emission calculation
 
@@ -713,46 +1148,58 @@ void calc_emissions(const States &states, const LocalTree *tree,
     }
 
 
+    // scratch tables for this block
+    HmmWorkspace &workspace = HmmWorkspace::thread_workspace();
+    workspace.reset();
+
     // find invariant sites
-    bool *variant = new bool [seqlen];
-    bool *masked = new bool [seqlen];
+    bool *variant = workspace.alloc<bool>(seqlen);
+    bool *masked = workspace.alloc<bool>(seqlen);
     find_variant_sites(seqs, nseqs, seqlen, variant, base_probs);
     find_masked_sites(seqs, nseqs, seqlen, masked, variant);
 
+    // group variant sites by alignment column pattern
+    int *pattern = workspace.alloc<int>(seqlen);
+    int *pattern_sites = workspace.alloc<int>(seqlen);
+    const int npatterns = find_site_patterns(seqs, nseqs, seqlen, variant,
+                                             base_probs, pattern,
+                                             pattern_sites, workspace);
 
-    // compute inner and outer likelihood tables
-    LikelihoodTable inner(seqlen, tree->nnodes);
-    LikelihoodTable inner_subtree(seqlen, 1);
-    LikelihoodTable outer(seqlen, tree->nnodes);
-    calc_inner_outer(tree, model, seqs, base_probs, seqlen, variant, internal,
-                     inner.data, outer.data);
+    // compute inner and outer likelihood tables for each pattern
+    LikelihoodTable inner(npatterns, tree->nnodes, workspace);
+    LikelihoodTable inner_subtree(npatterns, 1, workspace);
+    LikelihoodTable outer(npatterns, tree->nnodes, workspace);
+    calc_inner_outer(tree, model, seqs, base_probs, pattern_sites,
+                     npatterns, NULL, internal, inner.data, outer.data);
 
     if (!internal) {
         // compute inner table for new leaf
-        for (int i=0; i<seqlen; i++) {
+        for (int k=0; k<npatterns; k++) {
+            const int i = pattern_sites[k];
             const char c = seqs[newleaf][i];
             if (c == 'N') {
-                inner_subtree.data[i][0][0] = 1.0;
-                inner_subtree.data[i][0][1] = 1.0;
-                inner_subtree.data[i][0][2] = 1.0;
-                inner_subtree.data[i][0][3] = 1.0;
+                inner_subtree.data[k][0][0] = 1.0;
+                inner_subtree.data[k][0][1] = 1.0;
+                inner_subtree.data[k][0][2] = 1.0;
+                inner_subtree.data[k][0][3] = 1.0;
             } else if (base_probs.size() > 0) {
                 for (int j=0; j < 4; j++)
-                    inner_subtree.data[i][0][j] = base_probs[newleaf][i].prob[j];
+                    inner_subtree.data[k][0][j] = base_probs[newleaf][i].prob[j];
             } else {
-                inner_subtree.data[i][0][0] = 0.0;
-                inner_subtree.data[i][0][1] = 0.0;
-                inner_subtree.data[i][0][2] = 0.0;
-                inner_subtree.data[i][0][3] = 0.0;
-                inner_subtree.data[i][0][dna2int[(int) c]] = 1.0;
+                inner_subtree.data[k][0][0] = 0.0;
+                inner_subtree.data[k][0][1] = 0.0;
+                inner_subtree.data[k][0][2] = 0.0;
+                inner_subtree.data[k][0][3] = 0.0;
+                inner_subtree.data[k][0][dna2int[(int) c]] = 1.0;
             }
         }
     }
 
-    LikelihoodTable inner2(seqlen, tree->nnodes);
-    LikelihoodTable inner_subtree2(seqlen, 1);
-    LikelihoodTable outer2(seqlen, tree->nnodes);
+    // het[k] is true if the phasing pair differs at pattern k
     bool *het = NULL;
+    lk_row **inner2 = NULL;
+    lk_row **inner_subtree2 = NULL;
+    lk_row **outer2 = NULL;
     if (model->unphased && phase_pr != NULL &&
 	phase_pr->treemap1 >= 0 && phase_pr->treemap1 < nseqs &&
 	phase_pr->treemap2 >= 0 && phase_pr->treemap2 < nseqs) {
@@ -761,11 +1208,12 @@ void calc_emissions(const States &states, const LocalTree *tree,
 	    subseqs[i] = seqs[i];
 	subseqs[phase_pr->treemap1] = seqs[phase_pr->treemap2];
 	subseqs[phase_pr->treemap2] = seqs[phase_pr->treemap1];
-	het = new bool[seqlen];
-	for (int i=0; i < seqlen; i++) {
-	    het[i] = (seqs[phase_pr->treemap1][i] != seqs[phase_pr->treemap2][i]);
-            if (base_probs.size() > 0 && !het[i])
-                het[i] = ! (base_probs[phase_pr->treemap1][i].is_equal(
+	het = workspace.alloc<bool>(npatterns);
+	for (int k=0; k < npatterns; k++) {
+            const int i = pattern_sites[k];
+	    het[k] = (seqs[phase_pr->treemap1][i] != seqs[phase_pr->treemap2][i]);
+            if (base_probs.size() > 0 && !het[k])
+                het[k] = ! (base_probs[phase_pr->treemap1][i].is_equal(
                             base_probs[phase_pr->treemap2][i]));
         }
         vector<vector<BaseProbs> > base_probs2;
@@ -779,27 +1227,31 @@ void calc_emissions(const States &states, const LocalTree *tree,
             }
         }
 
-	calc_inner_outer(tree, model, subseqs, base_probs2, seqlen, het,
-			 internal, inner2.data, outer2.data);
+        inner2 = workspace.alloc_matrix<lk_row>(npatterns, tree->nnodes);
+        inner_subtree2 = workspace.alloc_matrix<lk_row>(npatterns, 1);
+        outer2 = workspace.alloc_matrix<lk_row>(npatterns, tree->nnodes);
+	calc_inner_outer(tree, model, subseqs, base_probs2, pattern_sites,
+                         npatterns, het, internal, inner2, outer2);
 
 	if (!internal) {
 	    // compute inner table for new leaf
-	    for (int i=0; i<seqlen; i++) {
+	    for (int k=0; k<npatterns; k++) {
+                const int i = pattern_sites[k];
 		const char c = subseqs[newleaf][i];
 		if (c == 'N') {
-		    inner_subtree2.data[i][0][0] = 1.0;
-		    inner_subtree2.data[i][0][1] = 1.0;
-		    inner_subtree2.data[i][0][2] = 1.0;
-		    inner_subtree2.data[i][0][3] = 1.0;
+		    inner_subtree2[k][0][0] = 1.0;
+		    inner_subtree2[k][0][1] = 1.0;
+		    inner_subtree2[k][0][2] = 1.0;
+		    inner_subtree2[k][0][3] = 1.0;
                 } else if (base_probs2.size() > 0) {
                     for (int j=0; j < 4; j++)
-                        inner_subtree2.data[i][0][j] = base_probs2[newleaf][i].prob[j];
+                        inner_subtree2[k][0][j] = base_probs2[newleaf][i].prob[j];
 		} else {
-		    inner_subtree2.data[i][0][0] = 0.0;
-		    inner_subtree2.data[i][0][1] = 0.0;
-		    inner_subtree2.data[i][0][2] = 0.0;
-		    inner_subtree2.data[i][0][3] = 0.0;
-		    inner_subtree2.data[i][0][dna2int[(int) c]] = 1.0;
+		    inner_subtree2[k][0][0] = 0.0;
+		    inner_subtree2[k][0][1] = 0.0;
+		    inner_subtree2[k][0][2] = 0.0;
+		    inner_subtree2[k][0][3] = 0.0;
+		    inner_subtree2[k][0][dna2int[(int) c]] = 1.0;
 		}
 	    }
 	}
@@ -841,6 +1293,8 @@ void calc_emissions(const States &states, const LocalTree *tree,
 
 
     // populate emission table
+    double *pattern_emit = workspace.alloc<double>(npatterns);
+    double *pattern_emit2 = workspace.alloc<double>(npatterns);
     for (int j=0; j<nstates; j++) {
         State state = states[j];
 
@@ -885,6 +1339,20 @@ void calc_emissions(const States &states, const LocalTree *tree,
         // calculate invariant_lk
         double invariant_lk = .25 * exp(- model->mu * treelen);
 
+        // calculate emission of each variant site pattern
+        for (int k=0; k<npatterns; k++) {
+            pattern_emit[k] = calc_emit(
+                inner.data[k], outer.data[k],
+                internal ? inner.data[k] : inner_subtree.data[k],
+                pattern_sites[k], node1, node2, maintree_root, nomut, mut);
+            assert(!isnan(pattern_emit[k]));
+            if (het != NULL && het[k])
+                pattern_emit2[k] = calc_emit(
+                    inner2[k], outer2[k],
+                    internal ? inner2[k] : inner_subtree2[k],
+                    pattern_sites[k], node1, node2, maintree_root, nomut, mut);
+        }
+
         // fill in row of emission table
         for (int i=0; i<seqlen; i++) {
             if (masked[i]) {
@@ -894,16 +1362,10 @@ void calc_emissions(const States &states, const LocalTree *tree,
                 // invariant site
                 emit[i][j] = invariant_lk;
             } else {
-		emit[i][j] = calc_emit(inner.data[i], outer.data[i],
-				       internal ? inner.data[i] : inner_subtree.data[i],
-				       i, node1, node2, maintree_root,
-				       nomut, mut);
-                assert(!isnan(emit[i][j]));
-		if (het != NULL && het[i]) {
-		    double emit2 = calc_emit(inner2.data[i], outer2.data[i],
-					    internal ? inner2.data[i] : inner_subtree2.data[i],
-					    i, node1, node2, maintree_root,
-					    nomut, mut);
+                const int k = pattern[i];
+		emit[i][j] = pattern_emit[k];
+		if (het != NULL && het[k]) {
+		    double emit2 = pattern_emit2[k];
 		    phase_pr->add(i, j, emit[i][j]/(emit[i][j] + emit2), nstates);
 		    emit[i][j] += emit2;
 		    emit[i][j] *= 0.5;
@@ -916,7 +1378,7 @@ void calc_emissions(const States &states, const LocalTree *tree,
     // optionally enforce infinite sites model
     if (model->infsites_penalty < 1.0) {
 
-        bool **valid_states = new_matrix<bool>(seqlen, nstates);
+        bool **valid_states = workspace.alloc_matrix<bool>(seqlen, nstates);
         get_infinite_sites_states(states, tree, seqs, nseqs, seqlen,
                                   variant, internal, valid_states,
                                   model->unphased ? phase_pr : NULL);
@@ -927,14 +1389,7 @@ void calc_emissions(const States &states, const LocalTree *tree,
                         emit[i][j] *= model->infsites_penalty;
             }
         }
-        delete_matrix<bool>(valid_states, seqlen);
     }
-
-
-    // clean up
-    delete [] variant;
-    delete [] masked;
-    if (het != NULL) delete [] het;
 }
 
 // calculate emissions for external branch resampling
@@ -1188,9 +1643,9 @@ int count_noncompat(const LocalTrees *trees, const char * const *seqs,
     if (start_coord == -1) start_coord = trees->start_coord;
     if (end_coord == -1) end_coord = trees->end_coord;
 
-    int end = trees->start_coord;
-    for (LocalTrees::const_iterator it=trees->begin();
-         it != trees->end(); ++it)
+    int end;
+    LocalTrees::const_iterator it = trees->get_first_block(start_coord, end);
+    for (; it != trees->end(); ++it)
     {
         int start = end;
         end += it->blocklen;
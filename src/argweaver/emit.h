@@ -8,6 +8,9 @@
 
 namespace argweaver {
 
+// table of partial likelihood values
+typedef double lk_row[4];
+
 void find_masked_sites(const char *const *seqs, int nseqs, int seqlen,
                        bool *masked, bool *invariant=NULL);
 
@@ -37,7 +40,30 @@ double likelihood_tree(const LocalTree *tree, const ArgModel *model,
                        const vector<vector<BaseProbs> > &base_probs,
                        const int nseqs,
                        const int start, const int end);
+double likelihood_tree_slow(const LocalTree *tree, const ArgModel *model,
+                            const char *const *seqs,
+                            const vector<vector<BaseProbs> > &base_probs,
+                            const int nseqs,
+                            const int start, const int end);
+
+// Inner and outer partial likelihood tables at 'sites' (where 'use' is
+// true).  The batched version computes several sites at once and gives
+// the same tables as the per-site calc_inner_outer_slow().
+void calc_inner_outer(const LocalTree *tree, const ArgModel *model,
+                      const char *const *seqs,
+                      const vector<vector<BaseProbs> > &base_probs,
+                      const int *sites, const int nsites,
+                      const bool *use, bool internal,
+                      lk_row **inner, lk_row **outer);
+void calc_inner_outer_slow(const LocalTree *tree, const ArgModel *model,
+                           const char *const *seqs,
+                           const vector<vector<BaseProbs> > &base_probs,
+                           const int *sites, const int nsites,
+                           const bool *use, bool internal,
+                           lk_row **inner, lk_row **outer);
 
+int count_noncompat(const LocalTree *tree, const char * const *seqs,
+                    int nseqs, int block_start, int block_len, int *postorder);
 int count_noncompat(const LocalTrees *trees, const char * const *seqs,
                     int nseqs, int seqlen, int start_coord=-1, int end_coord=-1);
 
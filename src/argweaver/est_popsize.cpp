@@ -10,6 +10,7 @@
 #include "total_prob.h"
 #include "logging.h"
 #include "model.h"
+#include "sample_thread.h"
 
 #define POPSIZE_UPPER_BOUND 1e10
 
@@ -18,10 +19,13 @@ namespace argweaver {
 using namespace std;
 
 
+// Proposes a new population size for the parameter 'it'.  The prior of
+// the proposal is calculated from 'stats' if given.
 double resample_single_popsize_mh(ArgModel *model, const LocalTrees *trees,
                                   bool sample_popsize_recomb, double heat,
                                   const list<PopsizeConfigParam>::iterator &it,
-                                  double curr_like, int index) {
+                                  double curr_like, int index,
+                                  const PopsizePriorStats *stats) {
     list<PopsizeConfigParam> &l = model->popsize_config.params;
     double new_popsize, curr_popsize;
     bool accept;
@@ -50,29 +54,17 @@ double resample_single_popsize_mh(ArgModel *model, const LocalTrees *trees,
     for ( ; it2 != it->intervals.end(); it2++)
         model->popsizes[it2->pop][it2->time] = new_popsize;
 
-    const int npop = model->num_pops();
-    int ntimes = model->ntimes;
-    int vec_size = 2 * npop * ntimes;
-    double num_coal_alloc[vec_size];
-    double num_nocoal_alloc[vec_size];
-    double *num_coal[npop];
-    double *num_nocoal[npop];
-    for (int i=0; i < npop; i++) {
-        num_coal[i] = &num_coal_alloc[i*ntimes];
-        num_nocoal[i] = &num_nocoal_alloc[i*ntimes];
-    }
-
-    double new_like = sample_popsize_recomb ?
-        calc_arg_prior(model, trees, num_coal, num_nocoal) :
-        calc_arg_prior_recomb_integrate(model, trees, num_coal, num_nocoal);
+    double new_like;
+    if (stats)
+        new_like = stats->log_prior(model);
+    else
+        new_like = sample_popsize_recomb ?
+            calc_arg_prior(model, trees) :
+            calc_arg_prior_recomb_integrate(model, trees, NULL, NULL, NULL);
 
 #ifdef ARGWEAVER_MPI
     comm->Reduce(rank == 0 ? MPI_IN_PLACE : &new_like,
                  &new_like, 1, MPI::DOUBLE, MPI_SUM, 0);
-    comm->Reduce(rank == 0 ? MPI_IN_PLACE : num_coal,
-                 num_coal, vec_size, MPI::DOUBLE, MPI::SUM, 0);
-    comm->Reduce(rank == 0 ? MPI_IN_PLACE : num_nocoal,
-                 num_nocoal, vec_size, MPI::DOUBLE, MPI::SUM, 0);
     if (rank == 0) {
 #endif
 
@@ -85,7 +77,6 @@ double resample_single_popsize_mh(ArgModel *model, const LocalTrees *trees,
 
         printLog(LOG_LOW, "%i\t%f\t%f\t%f\t%f\t%s\n",
                  index,
-                 //num_coal[pop][tidx], num_nocoal[pop][tidx],
                  lr, curr_popsize, new_popsize, lr,
                  accept ? "accept" : "reject");
 
@@ -110,8 +101,22 @@ double resample_single_popsize_mh(ArgModel *model, const LocalTrees *trees,
 void resample_popsizes_mh(ArgModel *model, const LocalTrees *trees,
                        bool sample_popsize_recomb, double heat) {
     list<PopsizeConfigParam> &l = model->popsize_config.params;
-    double curr_like = sample_popsize_recomb ? calc_arg_prior(model, trees) :
-        calc_arg_prior_recomb_integrate(model, trees, NULL, NULL, NULL);
+
+    // The ARG does not change while population sizes are sampled, so the
+    // prior of each proposal is calculated from statistics gathered once.
+    // The prior integrating over recombinations does not factor by
+    // population size and is calculated over the whole ARG each time.
+    PopsizePriorStats stats;
+    PopsizePriorStats *stats_ptr = NULL;
+    double curr_like;
+    if (sample_popsize_recomb) {
+        stats.calc(model, trees);
+        stats_ptr = &stats;
+        curr_like = stats.log_prior(model);
+    } else {
+        curr_like = calc_arg_prior_recomb_integrate(model, trees,
+                                                    NULL, NULL, NULL);
+    }
 #ifdef ARGWEAVER_MPI
     MPI::Intracomm *comm = model->mc3.group_comm;
     int rank = comm->Get_rank();
@@ -124,10 +129,11 @@ void resample_popsizes_mh(ArgModel *model, const LocalTrees *trees,
              it != l.end(); it++) {
             curr_like =
                 resample_single_popsize_mh(model, trees, sample_popsize_recomb,
-                                           heat, it, curr_like, idx++);
+                                           heat, it, curr_like, idx++,
+                                           stats_ptr);
         }
     }
-
+    clear_time_trans_cache();
 }
 
 
@@ -489,6 +495,25 @@ double mle_one_popsize(int start_t, int end_t, double init_popsize, void *data0)
 }
 
 
+// Sets the population size of each time interval to its maximum
+// likelihood estimate.  Time intervals with fewer than 'min_total' events
+// are combined with the next older interval.
+void mle_popsize(ArgModel *model, const struct popsize_data *data, double min_total) {
+    int start_time = 0;
+    double curr_total = 0.0;
+    for (int i=0; i < model->ntimes-1; i++) {
+	curr_total += data->coal_totals[i] + data->nocoal_totals[i];
+	if (curr_total < min_total && i < model->ntimes - 2) continue;
+	double popsize = mle_one_popsize(start_time, i, model->popsizes[0][2*i], (void*)data);
+	for (int j = start_time; j <= i; j++) {
+	    model->popsizes[0][2*j] = popsize;
+	    if (j > 0) model->popsizes[0][2*j-1] = popsize;
+	}
+	start_time = i+1;
+	curr_total = 0.0;
+    }
+}
+
     /*void popsize_sufficient_stats_recomb_integrate(struct popsize_data *data, ArgModel *model, const LocalTrees *trees) {
     int end = trees->start_coord;
     LineageCounts lineages(model->ntimes);
@@ -614,137 +639,137 @@ double mle_one_popsize(int start_t, int end_t, double init_popsize, void *data0)
     data->t2 = -1;
     }*/
 
-    /*
-void popsize_sufficient_stats(struct popsize_data *data, ArgModel *model,
-                              const LocalTrees *trees, bool add) {
-    int end = trees->start_coord;
-    LineageCounts lineages(model->ntimes);
-    int numleaf = trees->get_num_leaves();
-    //coal_counts[p][i][j][k] gives number of SPRs which coalesce in
-    // population p, time i, with j
-    // lineages in the tree interval before time i, and k lineages in the
-    // interval after time i. If coalescence happens at the same time as
+
+// Allocates the sufficient statistics of ARGs with 'numleaf' leaves,
+// adding 'pseudocount' prior observations to each time interval
+void init_popsize_data(struct popsize_data *data, ArgModel *model,
+                       int numleaf, double pseudocount) {
+    //coal_counts[i][j][k] gives number of SPRs which coalesce in time i,
+    // with j lineages in the tree interval before time i, and k lineages in
+    // the interval after time i. If coalescence happens at the same time as
     // the recombination (which is implied if coal_time==0), then j is always 0
     //nocoal_counts is the same, but for non-coalescing segments; so counted
     // for each segment from the recomb up until before the coal
-    double ****coal_counts;
-    double ****nocoal_counts;
-    double *coal_totals;
-    double *nocoal_totals;
+    int arr_size = 2*(model->ntimes * numleaf * numleaf + model->ntimes);
+    double *arr_alloc = new double[arr_size]();
+    int pos = model->ntimes * 2;
+
+    double *coal_totals = &arr_alloc[0];
+    double *nocoal_totals = &arr_alloc[model->ntimes];
+    double ***coal_counts = new double**[model->ntimes];
+    double ***nocoal_counts = new double**[model->ntimes];
+    for (int i=0; i < model->ntimes; i++) {
+        coal_counts[i] = new double*[numleaf];
+        nocoal_counts[i] = new double*[numleaf];
+        for (int j = 0; j < numleaf; j++) {
+            coal_counts[i][j] = &(arr_alloc[pos]);
+            pos += numleaf;
+            nocoal_counts[i][j] = &(arr_alloc[pos]);
+            pos += numleaf;
+        }
+        if (pseudocount > 0) {
+            double pr_nocoal;
+            if (i==0) {
+                pr_nocoal = exp(-model->coal_time_steps[0] / 20000.0);
+                coal_counts[i][0][1] = (1.0 - pr_nocoal) * pseudocount;
+                nocoal_counts[i][0][1] = pr_nocoal * pseudocount;
+            } else {
+                pr_nocoal = exp(-(model->coal_time_steps[2*i-1] +
+                                  model->coal_time_steps[2*i]) / 20000.0);
+                coal_counts[i][1][1] = (1.0 - pr_nocoal) * pseudocount;
+                nocoal_counts[i][1][1] = pr_nocoal * pseudocount;
+            }
+            coal_totals[i] += (1.0 - pr_nocoal) * pseudocount;
+            nocoal_totals[i] += pr_nocoal * pseudocount;
+        }
+    }
+    assert(pos == arr_size);
+
+    data->arr_alloc = arr_alloc;
+    data->arr_size = arr_size;
+    data->coal_counts = coal_counts;
+    data->nocoal_counts = nocoal_counts;
+    data->coal_totals = coal_totals;
+    data->nocoal_totals = nocoal_totals;
+    data->numleaf = numleaf;
+    data->model = model;
+    data->popsize_idx = -1;
+    data->t1 = -1;
+    data->t2 = -1;
+}
+
+
+// Adds the SPR 'spr' from 'tree' to the sufficient statistics.  'lineages'
+// is used as scratch space.
+void add_popsize_spr(struct popsize_data *data, const LocalTree *tree,
+                     const Spr &spr, LineageCounts &lineages) {
+    double ***coal_counts = data->coal_counts;
+    double ***nocoal_counts = data->nocoal_counts;
+    double *coal_totals = data->coal_totals;
+    double *nocoal_totals = data->nocoal_totals;
+
+    lineages.count(tree, data->model->pop_tree);
+    int broken_age = tree->nodes[tree->nodes[spr.recomb_node].parent].age;
+    int nlineage1=0;
+    int nlineage2=lineages.nbranches[spr.recomb_time] - int(spr.recomb_time < broken_age);
 
+    if (spr.recomb_time == spr.coal_time) {
+        coal_counts[spr.coal_time][0][nlineage2]++;
+        coal_totals[spr.coal_time]++;
+    } else {
+        nocoal_counts[spr.recomb_time][0][nlineage2]++;
+        nocoal_totals[spr.recomb_time]++;
+    }
+    for (int i=spr.recomb_time + 1; i < spr.coal_time; i++) {
+        nlineage1 = nlineage2;
+        nlineage2 = lineages.nbranches[i] - int(i < broken_age);
+        nocoal_counts[i][nlineage1][nlineage2]++;
+        nocoal_totals[i]++;
+    }
+    if (spr.recomb_time != spr.coal_time) {
+        nlineage1 = nlineage2;
+        nlineage2 = lineages.nbranches[spr.coal_time] - int(spr.coal_time < broken_age);
+        coal_counts[spr.coal_time][nlineage1][nlineage2]++;
+        coal_totals[spr.coal_time]++;
+    }
+}
+
+
+// Adds the sufficient statistics 'other' of ARGs with the same number of
+// leaves to 'data'
+void add_popsize_data(struct popsize_data *data,
+                      const struct popsize_data *other) {
+    assert(data->arr_size == other->arr_size);
+    for (int i=0; i < data->arr_size; i++)
+        data->arr_alloc[i] += other->arr_alloc[i];
+}
+
+
+void popsize_sufficient_stats(struct popsize_data *data, ArgModel *model,
+                              const LocalTrees *trees, bool add) {
     if (!add) {
-	int arr_size = 2*(model->ntimes * numleaf * numleaf * model->num_pops()
-                          + model->ntimes);
-	double *arr_alloc = new double[arr_size]();
-	double pseudocount = model->popsize_config.pseudocount;
-	//	printf("pseudocount=%f\n", pseudocount);
+        double pseudocount = model->popsize_config.pseudocount;
 #ifdef ARGWEAVER_MPI
-	//Set pseudocount to zero for all but one MPI, since it will all get combined
-	MPI::Intracomm *comm = model->mc3.group_comm;
-	int rank = comm->Get_rank();
-	if (rank > 0) pseudocount = 0;
+        //Set pseudocount to zero for all but one MPI, since it will all get combined
+        MPI::Intracomm *comm = model->mc3.group_comm;
+        int rank = comm->Get_rank();
+        if (rank > 0) pseudocount = 0;
 #endif
-
-	int pos=model->ntimes * 2;
-
-	coal_totals = &arr_alloc[0];
-	nocoal_totals = &arr_alloc[model->ntimes];
-
-        // TODO: come back here and check if calculations need to be changed to
-        // reflect probability of each pop. Don't think so so long as
-        // coal_totals/nocoal_totals only used for display purposes
-        const int numpop = model->num_pops();
-        coal_counts = new double***[numpop];
-        nocoal_counts = new double***[numpop];
-        for (int pop=0; pop < numpop; pop++) {
-            coal_counts[pop] = new double**[model->ntimes];
-            nocoal_counts[pop] = new double**[model->ntimes];
-            for (int i=0; i < model->ntimes; i++) {
-                coal_counts[pop][i] = new double*[numleaf];
-                nocoal_counts[pop][i] = new double*[numleaf];
-                for (int j = 0; j < numleaf; j++) {
-                    coal_counts[pop][i][j] = &(arr_alloc[pos]);
-                    pos += numleaf;
-                    nocoal_counts[pop][i][j] = &(arr_alloc[pos]);
-                    pos += numleaf;
-                }
-                if (pseudocount > 0) {
-                    double pr_nocoal;
-                    if (i==0) {
-                        pr_nocoal = exp(-model->coal_time_steps[0] / 20000.0);
-                        coal_counts[pop][i][0][1] = (1.0 - pr_nocoal) * pseudocount;
-                        nocoal_counts[pop][i][0][1] = pr_nocoal * pseudocount;
-                    } else {
-                        pr_nocoal = exp(-(model->coal_time_steps[2*i-1] +
-                                          model->coal_time_steps[2*i]) / 20000.0);
-                        coal_counts[pop][i][1][1] = (1.0 - pr_nocoal) * pseudocount;
-                        nocoal_counts[pop][i][1][1] = pr_nocoal * pseudocount;
-                    }
-                    coal_totals[i] += (1.0 - pr_nocoal) * pseudocount;
-                    nocoal_totals[i] += pr_nocoal * pseudocount;
-                }
-	    }
-	}
-	if (pos != arr_size) {
-	    printf("pos=%i arr_size=%i ntimes=%i numleaf=%i\n",
-                   pos, arr_size, model->ntimes, numleaf);
-	    assert(pos == arr_size);
-	}
-	data->arr_alloc = arr_alloc;
-	data->arr_size = arr_size;
-	data->coal_counts = coal_counts;
-	data->nocoal_counts = nocoal_counts;
-	data->coal_totals = coal_totals;
-	data->nocoal_totals = nocoal_totals;
-	data->numleaf = numleaf;
-	data->model = model;
-	data->popsize_idx = -1;
-	data->t1 = -1;
-	data->t2 = -1;
-    } else {  // add counts to already initialized structure
-	coal_counts = data->coal_counts;
-	nocoal_counts = data->nocoal_counts;
-	coal_totals = data->coal_totals;
-	nocoal_totals = data->nocoal_totals;
+        init_popsize_data(data, model, trees->get_num_leaves(), pseudocount);
     }
-    // Need to update this section. Population has to be encoded in the tree nodes,
-    // and we need to use that here.
 
+    LineageCounts lineages(model->ntimes, model->num_pops());
+    int end = trees->start_coord;
     for (LocalTrees::const_iterator it=trees->begin(); it != trees->end();) {
-	end += it->blocklen;
-	LocalTree *tree = it->tree;
-	if (end >= trees->end_coord) break;
+        end += it->blocklen;
+        const LocalTree *tree = it->tree;
+        if (end >= trees->end_coord) break;
         ++it;
         assert(it != trees->end());
-        LocalTree *next_tree = it->tree;
-	const Spr *spr = &it->spr;
-	lineages.count(tree, model->pop_tree);
-	int broken_age = tree->nodes[tree->nodes[spr->recomb_node].parent].age;
-	int nlineage1=0;
-	int nlineage2=lineages.nbranches[spr->recomb_time] - int(spr->recomb_time < broken_age);
-        int pop = next_tree->nodes[spr->recomb_node].pop[spr->recomb_time];
-
-	if (spr->recomb_time == spr->coal_time) {
-	    coal_counts[pop][spr->coal_time][0][nlineage2]++;
-	    coal_totals[spr->coal_time]++;
-	} else {
-	    nocoal_counts[pop][spr->recomb_time][0][nlineage2]++;
-	    nocoal_totals[spr->recomb_time]++;
-	}
-	for (int i=spr->recomb_time + 1; i < spr->coal_time; i++) {
-	    nlineage1 = nlineage2;
-	    nlineage2 = lineages.nbranches[i] - int(i < broken_age);
-	    nocoal_counts[i][nlineage1][nlineage2]++;
-	    nocoal_totals[i]++;
-	}
-	if (spr->recomb_time != spr->coal_time) {
-	    nlineage1 = nlineage2;
-	    nlineage2 = lineages.nbranches[spr->coal_time] - int(spr->coal_time < broken_age);
-	    coal_counts[spr->coal_time][nlineage1][nlineage2]++;
-	    coal_totals[spr->coal_time]++;
-	}
+        add_popsize_spr(data, tree, it->spr, lineages);
     }
-    } */
+}
+
 
 void delete_popsize_data(struct popsize_data *data) {
     int ntimes = data->model->ntimes;
@@ -1019,21 +1044,6 @@ void update_popsize_hmc(ArgModel *model, const LocalTrees *trees) {
 
 
 
-void mle_popsize(ArgModel *model, const struct popsize_data *data, double min_total) {
-    int start_time = 0;
-    double curr_total = 0.0;
-    for (int i=0; i < model->ntimes-1; i++) {
-	curr_total += data->coal_totals[i] + data->nocoal_totals[i];
-	if (curr_total < min_total && i < model->ntimes - 2) continue;
-	double popsize = mle_one_popsize(start_time, i, model->popsizes[2*i], (void*)data);
-	for (int j = start_time; j <= i; j++) {
-	    model->popsizes[2*j] = popsize;
-	    if (j > 0) model->popsizes[2*j-1] = popsize;
-	}
-	start_time = i+1;
-	curr_total = 0.0;
-    }
-}
 
 
 void mle_popsize(ArgModel *model, const LocalTrees *trees, double min_total) {
@@ -36,6 +36,12 @@ double one_popsize_likelihood(int t, double log_popsize, struct popsize_data *da
 double one_popsize_dlikelihood(int t, double log_popsize, struct popsize_data *data);
 
 void popsize_sufficient_stats(struct popsize_data *data, ArgModel *model, const LocalTrees *trees, bool add=false);
+void init_popsize_data(struct popsize_data *data, ArgModel *model,
+                       int numleaf, double pseudocount);
+void add_popsize_spr(struct popsize_data *data, const LocalTree *tree,
+                     const Spr &spr, LineageCounts &lineages);
+void add_popsize_data(struct popsize_data *data,
+                      const struct popsize_data *other);
 void delete_popsize_data(struct popsize_data *data);
 
 void update_popsize_hmc(ArgModel *model, const LocalTrees *trees);
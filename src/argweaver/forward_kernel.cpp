@@ -0,0 +1,404 @@
+//=============================================================================
+// vectorized column kernels for the forward algorithm
+
+// c/c++ includes
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+
+#include "forward_kernel.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#   define ARGWEAVER_X86_SIMD
+#   include <immintrin.h>
+#endif
+
+
+namespace argweaver {
+
+
+//=============================================================================
+// kernel selection
+
+static ForwardKernel g_forward_kernel = FORWARD_KERNEL_AUTO;
+
+
+static bool forward_kernel_supported(ForwardKernel kernel)
+{
+    switch (kernel) {
+    case FORWARD_KERNEL_SCALAR:
+        return true;
+#ifdef ARGWEAVER_X86_SIMD
+    case FORWARD_KERNEL_AVX2:
+        return __builtin_cpu_supports("avx2") &&
+            __builtin_cpu_supports("fma");
+    case FORWARD_KERNEL_AVX512:
+        return __builtin_cpu_supports("avx512f");
+#endif
+    default:
+        return false;
+    }
+}
+
+
+ForwardKernel detect_forward_kernel()
+{
+    if (forward_kernel_supported(FORWARD_KERNEL_AVX512))
+        return FORWARD_KERNEL_AVX512;
+    if (forward_kernel_supported(FORWARD_KERNEL_AVX2))
+        return FORWARD_KERNEL_AVX2;
+    return FORWARD_KERNEL_SCALAR;
+}
+
+
+ForwardKernel get_forward_kernel()
+{
+    if (g_forward_kernel == FORWARD_KERNEL_AUTO)
+        g_forward_kernel = detect_forward_kernel();
+    return g_forward_kernel;
+}
+
+
+bool set_forward_kernel(ForwardKernel kernel)
+{
+    if (kernel == FORWARD_KERNEL_AUTO) {
+        g_forward_kernel = detect_forward_kernel();
+        return true;
+    }
+    if (!forward_kernel_supported(kernel))
+        return false;
+    g_forward_kernel = kernel;
+    return true;
+}
+
+
+const char *forward_kernel_name(ForwardKernel kernel)
+{
+    switch (kernel) {
+    case FORWARD_KERNEL_AUTO:   return "auto";
+    case FORWARD_KERNEL_SCALAR: return "scalar";
+    case FORWARD_KERNEL_AVX2:   return "avx2";
+    case FORWARD_KERNEL_AVX512: return "avx512";
+    }
+    return "unknown";
+}
+
+
+bool parse_forward_kernel(const char *name, ForwardKernel *kernel)
+{
+    const ForwardKernel kernels[] = {
+        FORWARD_KERNEL_AUTO, FORWARD_KERNEL_SCALAR,
+        FORWARD_KERNEL_AVX2, FORWARD_KERNEL_AVX512};
+    for (unsigned int i=0; i<sizeof(kernels)/sizeof(kernels[0]); i++) {
+        if (strcmp(name, forward_kernel_name(kernels[i])) == 0) {
+            *kernel = kernels[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+
+//=============================================================================
+// block data
+
+void ForwardBlockData::resize(int _nstates, int _ntimes, int _npaths)
+{
+    nstates = _nstates;
+    ntimes = _ntimes;
+    npaths = _npaths;
+    ngroups = ntimes * npaths;
+
+    // pad rows to a multiple of the widest vector (8 doubles)
+    ldt = (ngroups + 7) & ~7;
+
+    group.resize(nstates);
+
+    tmatrix.assign(ngroups * ldt, 0.0);
+
+    trans_start.clear();
+    trans_src.clear();
+    trans_prob.clear();
+
+    fgroups.assign(ldt, 0.0);
+    tmatrix_fgroups.assign(ngroups, 0.0);
+}
+
+
+//=============================================================================
+// column kernels
+
+// Each kernel performs, for every column i of the block:
+//   1. fgroups: sum previous column by (time, path) group
+//   2. tmatrix_fgroups = tmatrix * fgroups
+//   3. col2[k] = (tmatrix_fgroups[group[k]] + same branch terms) * emit[k]
+//   4. normalize col2
+
+
+// sum previous column by (time, path) group
+static inline void forward_sum_groups(const ForwardBlockData &data,
+                                      const double *col1, double *fgroups)
+{
+    const int nstates = data.nstates;
+    const int *group = &data.group[0];
+
+    for (int g=0; g<data.ldt; g++)
+        fgroups[g] = 0.0;
+    for (int j=0; j<nstates; j++)
+        fgroups[group[j]] += col1[j];
+}
+
+
+// add same branch transitions to column
+static inline void forward_same_branch(const ForwardBlockData &data,
+                                       const double *col1, double *col2)
+{
+    const int nstates = data.nstates;
+    const int *start = &data.trans_start[0];
+    const int *src = data.trans_src.empty() ? NULL : &data.trans_src[0];
+    const double *prob = data.trans_prob.empty() ? NULL : &data.trans_prob[0];
+
+    for (int k=0; k<nstates; k++) {
+        double sum = col2[k];
+        for (int e=start[k]; e<start[k+1]; e++)
+            sum += prob[e] * col1[src[e]];
+        col2[k] = sum;
+    }
+}
+
+
+static void forward_columns_scalar(ForwardBlockData &data, int blocklen,
+                                   const double* const *emit, double **fw)
+{
+    const int nstates = data.nstates;
+    const int nrows = (data.ntimes - 1) * data.npaths;
+    const int ldt = data.ldt;
+    const int *group = &data.group[0];
+    const double *tmatrix = &data.tmatrix[0];
+    double *fgroups = &data.fgroups[0];
+    double *tmatrix_fgroups = &data.tmatrix_fgroups[0];
+
+    for (int i=1; i<blocklen; i++) {
+        const double *col1 = fw[i-1];
+        double *col2 = fw[i];
+        const double *emit2 = emit[i];
+
+        forward_sum_groups(data, col1, fgroups);
+
+        // multiply tmatrix and fgroups together
+        for (int r=0; r<nrows; r++) {
+            const double *row = &tmatrix[r * ldt];
+            double sum = 0.0;
+            for (int g=0; g<nrows; g++)
+                sum += row[g] * fgroups[g];
+            tmatrix_fgroups[r] = sum;
+        }
+
+        for (int k=0; k<nstates; k++)
+            col2[k] = tmatrix_fgroups[group[k]];
+        forward_same_branch(data, col1, col2);
+
+        double norm = 0.0;
+        for (int k=0; k<nstates; k++) {
+            col2[k] *= emit2[k];
+            norm += col2[k];
+        }
+        assert(norm > 0);
+        assert(!isinf(norm));
+
+        // normalize column for numerical stability
+        for (int k=0; k<nstates; k++)
+            col2[k] /= norm;
+    }
+}
+
+
+#ifdef ARGWEAVER_X86_SIMD
+
+__attribute__((target("avx2,fma")))
+static inline double hsum_avx2(__m256d v)
+{
+    __m128d lo = _mm256_castpd256_pd128(v);
+    __m128d hi = _mm256_extractf128_pd(v, 1);
+    lo = _mm_add_pd(lo, hi);
+    return _mm_cvtsd_f64(_mm_add_sd(lo, _mm_unpackhi_pd(lo, lo)));
+}
+
+
+__attribute__((target("avx2,fma")))
+static void forward_columns_avx2(ForwardBlockData &data, int blocklen,
+                                 const double* const *emit, double **fw)
+{
+    const int nstates = data.nstates;
+    const int nstates4 = nstates & ~3;
+    const int nrows = (data.ntimes - 1) * data.npaths;
+    const int ldt = data.ldt;
+    const int *group = &data.group[0];
+    const double *tmatrix = &data.tmatrix[0];
+    double *fgroups = &data.fgroups[0];
+    double *tmatrix_fgroups = &data.tmatrix_fgroups[0];
+    const __m256d mask = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+
+    for (int i=1; i<blocklen; i++) {
+        const double *col1 = fw[i-1];
+        double *col2 = fw[i];
+        const double *emit2 = emit[i];
+
+        forward_sum_groups(data, col1, fgroups);
+
+        // multiply tmatrix and fgroups together
+        for (int r=0; r<nrows; r++) {
+            const double *row = &tmatrix[r * ldt];
+            __m256d acc = _mm256_setzero_pd();
+            for (int g=0; g<ldt; g+=4)
+                acc = _mm256_fmadd_pd(_mm256_loadu_pd(&row[g]),
+                                      _mm256_loadu_pd(&fgroups[g]), acc);
+            tmatrix_fgroups[r] = hsum_avx2(acc);
+        }
+
+        // gather group sums for each state
+        int k = 0;
+        for (; k<nstates4; k+=4) {
+            __m128i idx = _mm_loadu_si128((const __m128i*) &group[k]);
+            _mm256_storeu_pd(&col2[k], _mm256_mask_i32gather_pd(
+                _mm256_setzero_pd(), tmatrix_fgroups, idx, mask, 8));
+        }
+        for (; k<nstates; k++)
+            col2[k] = tmatrix_fgroups[group[k]];
+
+        forward_same_branch(data, col1, col2);
+
+        // apply emissions
+        __m256d vnorm = _mm256_setzero_pd();
+        for (k=0; k<nstates4; k+=4) {
+            __m256d v = _mm256_mul_pd(_mm256_loadu_pd(&col2[k]),
+                                      _mm256_loadu_pd(&emit2[k]));
+            _mm256_storeu_pd(&col2[k], v);
+            vnorm = _mm256_add_pd(vnorm, v);
+        }
+        double norm = hsum_avx2(vnorm);
+        for (; k<nstates; k++) {
+            col2[k] *= emit2[k];
+            norm += col2[k];
+        }
+        assert(norm > 0);
+        assert(!isinf(norm));
+
+        // normalize column for numerical stability
+        const __m256d vdiv = _mm256_set1_pd(norm);
+        for (k=0; k<nstates4; k+=4)
+            _mm256_storeu_pd(&col2[k], _mm256_div_pd(
+                _mm256_loadu_pd(&col2[k]), vdiv));
+        for (; k<nstates; k++)
+            col2[k] /= norm;
+    }
+}
+
+
+__attribute__((target("avx512f")))
+static inline double hsum_avx512(__m512d v)
+{
+    __m256d v4 = _mm256_add_pd(_mm512_maskz_extractf64x4_pd(0xF, v, 0),
+                               _mm512_maskz_extractf64x4_pd(0xF, v, 1));
+    __m128d v2 = _mm_add_pd(_mm256_castpd256_pd128(v4),
+                            _mm256_extractf128_pd(v4, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(v2, _mm_unpackhi_pd(v2, v2)));
+}
+
+
+__attribute__((target("avx512f")))
+static void forward_columns_avx512(ForwardBlockData &data, int blocklen,
+                                   const double* const *emit, double **fw)
+{
+    const int nstates = data.nstates;
+    const int nstates8 = nstates & ~7;
+    const int nrows = (data.ntimes - 1) * data.npaths;
+    const int ldt = data.ldt;
+    const int *group = &data.group[0];
+    const double *tmatrix = &data.tmatrix[0];
+    double *fgroups = &data.fgroups[0];
+    double *tmatrix_fgroups = &data.tmatrix_fgroups[0];
+
+    for (int i=1; i<blocklen; i++) {
+        const double *col1 = fw[i-1];
+        double *col2 = fw[i];
+        const double *emit2 = emit[i];
+
+        forward_sum_groups(data, col1, fgroups);
+
+        // multiply tmatrix and fgroups together
+        for (int r=0; r<nrows; r++) {
+            const double *row = &tmatrix[r * ldt];
+            __m512d acc = _mm512_setzero_pd();
+            for (int g=0; g<ldt; g+=8)
+                acc = _mm512_fmadd_pd(_mm512_loadu_pd(&row[g]),
+                                      _mm512_loadu_pd(&fgroups[g]), acc);
+            tmatrix_fgroups[r] = hsum_avx512(acc);
+        }
+
+        // gather group sums for each state
+        int k = 0;
+        for (; k<nstates8; k+=8) {
+            __m256i idx = _mm256_loadu_si256((const __m256i*) &group[k]);
+            _mm512_storeu_pd(&col2[k], _mm512_mask_i32gather_pd(
+                _mm512_setzero_pd(), 0xFF, idx, tmatrix_fgroups, 8));
+        }
+        for (; k<nstates; k++)
+            col2[k] = tmatrix_fgroups[group[k]];
+
+        forward_same_branch(data, col1, col2);
+
+        // apply emissions
+        __m512d vnorm = _mm512_setzero_pd();
+        for (k=0; k<nstates8; k+=8) {
+            __m512d v = _mm512_mul_pd(_mm512_loadu_pd(&col2[k]),
+                                      _mm512_loadu_pd(&emit2[k]));
+            _mm512_storeu_pd(&col2[k], v);
+            vnorm = _mm512_add_pd(vnorm, v);
+        }
+        double norm = hsum_avx512(vnorm);
+        for (; k<nstates; k++) {
+            col2[k] *= emit2[k];
+            norm += col2[k];
+        }
+        assert(norm > 0);
+        assert(!isinf(norm));
+
+        // normalize column for numerical stability
+        const __m512d vdiv = _mm512_set1_pd(norm);
+        for (k=0; k<nstates8; k+=8)
+            _mm512_storeu_pd(&col2[k], _mm512_div_pd(
+                _mm512_loadu_pd(&col2[k]), vdiv));
+        for (; k<nstates; k++)
+            col2[k] /= norm;
+    }
+}
+
+#endif // ARGWEAVER_X86_SIMD
+
+
+void forward_block_columns(ForwardBlockData &data, int blocklen,
+                           const double* const *emit, double **fw,
+                           ForwardKernel kernel)
+{
+    assert(int(data.trans_start.size()) == data.nstates + 1);
+
+    if (kernel == FORWARD_KERNEL_AUTO)
+        kernel = get_forward_kernel();
+
+    switch (kernel) {
+#ifdef ARGWEAVER_X86_SIMD
+    case FORWARD_KERNEL_AVX512:
+        forward_columns_avx512(data, blocklen, emit, fw);
+        break;
+    case FORWARD_KERNEL_AVX2:
+        forward_columns_avx2(data, blocklen, emit, fw);
+        break;
+#endif
+    default:
+        forward_columns_scalar(data, blocklen, emit, fw);
+    }
+}
+
+
+} // namespace argweaver
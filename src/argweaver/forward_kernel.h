@@ -0,0 +1,122 @@
+//=============================================================================
+// vectorized column kernels for the forward algorithm
+
+#ifndef ARGWEAVER_FORWARD_KERNEL_H
+#define ARGWEAVER_FORWARD_KERNEL_H
+
+// c++ includes
+#include <vector>
+
+
+namespace argweaver {
+
+using namespace std;
+
+
+// Instruction set used for the forward algorithm column updates.
+//
+// The SIMD kernels reorder floating point sums (dense time-group product
+// and column normalization), so their forward tables agree with the
+// scalar kernel and with arghmm_forward_block_slow() only to within
+// FORWARD_KERNEL_TOLERANCE relative error per entry.  The scalar kernel
+// reproduces the original forward recursion exactly.
+enum ForwardKernel {
+    FORWARD_KERNEL_AUTO = -1,
+    FORWARD_KERNEL_SCALAR = 0,
+    FORWARD_KERNEL_AVX2,
+    FORWARD_KERNEL_AVX512
+};
+
+const double FORWARD_KERNEL_TOLERANCE = 1e-9;
+
+
+// Returns the best kernel supported by the running CPU
+ForwardKernel detect_forward_kernel();
+
+// Returns the kernel used by arghmm_forward_block()
+ForwardKernel get_forward_kernel();
+
+// Selects the kernel used by arghmm_forward_block().  FORWARD_KERNEL_AUTO
+// uses CPU detection.  Returns false if the CPU does not support 'kernel'.
+bool set_forward_kernel(ForwardKernel kernel);
+
+const char *forward_kernel_name(ForwardKernel kernel);
+bool parse_forward_kernel(const char *name, ForwardKernel *kernel);
+
+
+// Struct-of-arrays description of one non-recombining block of the
+// forward algorithm.
+//
+// Each state k is described by parallel columns so that the per-column
+// work vectorizes: the sum over all states (grouped by time and population
+// path) becomes a dense product with 'tmatrix', and the remaining
+// same-branch transitions are stored as a sparse row per state.
+class ForwardBlockData
+{
+public:
+    ForwardBlockData() :
+        nstates(0),
+        ntimes(0),
+        npaths(0),
+        ngroups(0),
+        ldt(0)
+    {}
+
+    // allocate columns for a block with the given dimensions
+    void resize(int nstates, int ntimes, int npaths);
+
+    // group index of (time, path) in fgroups and tmatrix columns
+    inline int group_index(int time, int path) const {
+        return time * npaths + path;
+    }
+
+    // start a new sparse transition row for the next state
+    inline void begin_row() {
+        trans_start.push_back(trans_src.size());
+    }
+
+    // add a same-branch transition into the current state
+    inline void add_trans(int src, double prob) {
+        trans_src.push_back(src);
+        trans_prob.push_back(prob);
+    }
+
+    // finish sparse transition rows
+    inline void end_rows() {
+        trans_start.push_back(trans_src.size());
+    }
+
+    int nstates;
+    int ntimes;
+    int npaths;     // maximum number of population paths per time
+    int ngroups;    // number of (time, path) groups
+    int ldt;        // row stride of tmatrix (padded for SIMD loads)
+
+    // (time, path) group of each state
+    vector<int> group;
+
+    // transition probabilities between (time, path) groups
+    // tmatrix[group(b, pb) * ldt + group(a, pa)]
+    vector<double> tmatrix;
+
+    // sparse same-branch transitions into each state (CSR layout)
+    vector<int> trans_start;
+    vector<int> trans_src;
+    vector<double> trans_prob;
+
+    // scratch space for column updates
+    vector<double> fgroups;
+    vector<double> tmatrix_fgroups;
+};
+
+
+// Computes columns 1..blocklen-1 of the forward table for one block.
+// NOTE: first column of forward table should be pre-populated
+void forward_block_columns(ForwardBlockData &data, int blocklen,
+                           const double* const *emit, double **fw,
+                           ForwardKernel kernel=FORWARD_KERNEL_AUTO);
+
+
+} // namespace argweaver
+
+#endif // ARGWEAVER_FORWARD_KERNEL_H
@@ -485,7 +485,7 @@ void set_up_spr(Spr *spr, int coal_node, int recomb_node, int recomb_time_upper_
     // up to now, we have the guarantee that recoal_time >= recomb_time_lower_bound
     int diff = min(recoal_time, recomb_time_upper_bound) - recomb_time_lower_bound;
     assert(diff >= 0);
-    int recomb_time = diff == 0 ? recomb_time_lower_bound : recomb_time_lower_bound + rand() % diff;
+    int recomb_time = diff == 0 ? recomb_time_lower_bound : recomb_time_lower_bound + rand_int() % diff;
     spr->coal_node = coal_node;
     spr->recomb_node = recomb_node;
     spr->coal_time = recoal_time;
@@ -616,7 +616,8 @@ LocalTrees::LocalTrees(int **ptrees, int**ages, int **isprs, int *blocklens,
                        int ntrees, int nnodes, int capacity, int start) :
     chrom("chr"),
     start_coord(start),
-    nnodes(nnodes)
+    nnodes(nnodes),
+    undo(NULL)
 {
     if (capacity < nnodes)
         capacity = nnodes;
@@ -676,6 +677,175 @@ void LocalTrees::copy(const LocalTrees &other)
 }
 
 
+void LocalTrees::compact(int chunk_size)
+{
+    iterator it = begin();
+    while (it != end()) {
+        // find the trees of the next chunk
+        iterator it2 = it;
+        int size = 0;
+        for (int i=0; i<chunk_size && it2 != end(); i++, ++it2)
+            size += it2->tree->capacity;
+
+        // move their nodes into one slab
+        LocalNodeSlab *slab = new LocalNodeSlab(size);
+        LocalNode *nodes = slab->nodes;
+        for (; it != it2; ++it) {
+            it->tree->set_slab(slab, nodes);
+            nodes += it->tree->capacity;
+        }
+    }
+}
+
+
+void LocalTrees::save_block(iterator it)
+{
+    if (undo)
+        undo->save(it);
+}
+
+
+LocalTrees::iterator LocalTrees::insert_block(iterator pos,
+                                              const LocalTreeSpr &block)
+{
+    iterator it = trees.insert(pos, block);
+    if (undo)
+        undo->inserted(it);
+    return it;
+}
+
+
+void LocalTrees::erase_block(iterator it)
+{
+    if (undo) {
+        undo->erase(it);
+    } else {
+        it->clear();
+        trees.erase(it);
+    }
+}
+
+
+//=============================================================================
+// undo log for local trees
+
+void LocalTreesUndo::begin(LocalTrees *_trees)
+{
+    assert(!trees && !_trees->undo);
+    trees = _trees;
+    trees->undo = this;
+}
+
+
+void LocalTreesUndo::commit()
+{
+    for (list<LocalTreeSpr>::iterator it=erased.begin();
+         it != erased.end(); ++it)
+        it->clear();
+    erased.clear();
+    clear();
+}
+
+
+void LocalTreesUndo::revert()
+{
+    trees->reset_index();
+
+    // undo edits in reverse order
+    for (int i=edits.size()-1; i>=0; i--) {
+        const Edit &edit = edits[i];
+        LocalTreeSpr &block = *edit.it;
+
+        switch (edit.type) {
+        case EDIT_SAVE: {
+            LocalTree *tree = block.tree;
+            tree->nnodes = edit.nnodes;
+            tree->root = edit.root;
+            for (int j=0; j<edit.nnodes; j++)
+                tree->nodes[j].copy(nodes[edit.offset + j]);
+
+            block.spr = edit.spr;
+            block.blocklen = edit.blocklen;
+            if (edit.has_mapping) {
+                if (!block.mapping)
+                    block.mapping = new int [tree->capacity];
+                std::copy(mappings.begin() + edit.offset,
+                          mappings.begin() + edit.offset + edit.nnodes,
+                          block.mapping);
+            } else if (block.mapping) {
+                delete [] block.mapping;
+                block.mapping = NULL;
+            }
+            } break;
+
+        case EDIT_INSERT:
+            block.clear();
+            trees->trees.erase(edit.it);
+            break;
+
+        case EDIT_ERASE:
+            trees->trees.splice(edit.next, erased, edit.it);
+            break;
+        }
+    }
+
+    assert(erased.empty());
+    clear();
+}
+
+
+void LocalTreesUndo::save(LocalTrees::iterator it)
+{
+    if (!saved.insert(&*it).second)
+        return;
+
+    const LocalTree *tree = it->tree;
+    Edit edit(EDIT_SAVE, it);
+    edit.spr = it->spr;
+    edit.blocklen = it->blocklen;
+    edit.root = tree->root;
+    edit.nnodes = tree->nnodes;
+    edit.has_mapping = (it->mapping != NULL);
+    edit.offset = nodes.size();
+    edits.push_back(edit);
+
+    nodes.insert(nodes.end(), tree->nodes, tree->nodes + tree->nnodes);
+    if (it->mapping)
+        mappings.insert(mappings.end(), it->mapping,
+                        it->mapping + tree->nnodes);
+    mappings.resize(nodes.size());
+}
+
+
+void LocalTreesUndo::inserted(LocalTrees::iterator it)
+{
+    edits.push_back(Edit(EDIT_INSERT, it));
+}
+
+
+void LocalTreesUndo::erase(LocalTrees::iterator it)
+{
+    Edit edit(EDIT_ERASE, it);
+    ++edit.next;
+    edits.push_back(edit);
+
+    // keep the block so that it can be put back
+    erased.splice(erased.end(), trees->trees, it);
+}
+
+
+void LocalTreesUndo::clear()
+{
+    edits.clear();
+    saved.clear();
+    nodes.clear();
+    mappings.clear();
+    if (trees)
+        trees->undo = NULL;
+    trees = NULL;
+}
+
+
 // get total ARG length
 double get_arglen(const LocalTrees *trees, const double *times)
 {
@@ -715,6 +885,7 @@ bool remove_null_spr(LocalTrees *trees, LocalTrees::iterator it,
         return false;
 
     int nnodes = it2->tree->nnodes;
+    trees->save_block(it2);
 
     int subtree_root = it->tree->nodes[it->tree->root].child[0];
     for (int i=0; i < it2->tree->nnodes; i++) {
@@ -761,8 +932,7 @@ bool remove_null_spr(LocalTrees *trees, LocalTrees::iterator it,
 
     // delete this tree
     it2->blocklen += it->blocklen;
-    it->clear();
-    trees->trees.erase(it);
+    trees->erase_block(it);
 
     return true;
 }
@@ -772,6 +942,7 @@ bool remove_null_spr(LocalTrees *trees, LocalTrees::iterator it,
 // Removes trees with null SPRs from the local trees
 void remove_null_sprs(LocalTrees *trees, const PopulationTree *pop_tree)
 {
+    trees->reset_index();
     for (LocalTrees::iterator it=trees->begin(); it != trees->end();) {
         LocalTrees::iterator it2 = it;
         ++it2;
@@ -827,6 +998,7 @@ LocalTrees *partition_local_trees(LocalTrees *trees, int pos,
 
     // splice trees over
     trees2->trees.splice(trees2->begin(), trees->trees, it, trees->end());
+    trees->truncate_index(it_start);
 
     LocalTrees::iterator it2 = trees2->begin();
     if (trim) {
@@ -876,6 +1048,7 @@ LocalTrees *partition_local_trees(LocalTrees *trees, int pos, bool trim)
                               trees->seqids.end());
         trees2->trees.splice(trees2->begin(), trees->trees,
                              trees->begin(), trees->end());
+        trees->reset_index();
         trees->end_coord = pos;
         return trees2;
     }
@@ -1073,11 +1246,15 @@ void append_local_trees(LocalTrees *trees, LocalTrees *trees2, bool merge,
         assert(trees->seqids[i] == trees2->seqids[i]);
     assert(trees->nnodes == trees2->nnodes);
 
-    // move trees2 onto end of trees
+    // move trees2 onto end of trees.  The last block of trees may be
+    // merged away, so it is dropped from the index.
     LocalTrees::iterator it = trees->end();
     --it;
+    if (ntrees > 0)
+        trees->truncate_index(trees->end_coord - it->blocklen);
     trees->trees.splice(trees->end(),
                         trees2->trees, trees2->begin(), trees2->end());
+    trees2->reset_index();
     trees->end_coord = trees2->end_coord;
     trees2->end_coord = trees2->start_coord;
 
@@ -1125,6 +1302,8 @@ void remove_population_paths(LocalTrees *trees) {
 void uncompress_local_trees(LocalTrees *trees,
                             const SitesMapping *sites_mapping)
 {
+    trees->reset_index();
+
     // get block lengths
     vector<int> blocklens;
     for (LocalTrees::iterator it=trees->begin(); it != trees->end(); ++it)
@@ -1153,6 +1332,8 @@ void uncompress_local_trees(LocalTrees *trees,
 void compress_local_trees(LocalTrees *trees, const SitesMapping *sites_mapping,
                           bool fuzzy)
 {
+    trees->reset_index();
+
     // get block lengths
     vector<int> blocklens;
     for (LocalTrees::iterator it=trees->begin(); it != trees->end(); ++it)
@@ -1734,6 +1915,20 @@ void write_local_tree(const LocalTree *tree) {
 }
 
 
+// Writes one line of a bed file for the tree of block [start, end).
+// 'next_spr' is the SPR to the right of the tree.
+void write_local_tree_as_bed(FILE *out, const string &chrom,
+                             int start, int end, int sample,
+                             const LocalTree *tree,
+                             const char *const *nodeids,
+                             const ArgModel *model, const Spr &next_spr)
+{
+    fprintf(out, "%s\t%i\t%i\t%i\t", chrom.c_str(), start, end, sample);
+    write_newick_tree_for_bedfile(out, tree, nodeids, model, next_spr);
+    fprintf(out, "\n");
+}
+
+
 void write_local_trees_as_bed(FILE *out, const LocalTrees *trees,
                               const vector<string> seqnames,
                               const ArgModel *model, int sample) {
@@ -1761,9 +1956,6 @@ void write_local_trees_as_bed(FILE *out, const LocalTrees *trees,
         LocalTree *tree = it->tree;
 
         if (end - start > 0) {
-            fprintf(out, "%s\t%i\t%i\t%i\t",
-                    trees->chrom.c_str(), start, end, sample);
-
             LocalTrees::const_iterator it2 = it;
             ++it2;
             if (it2 != trees->end()) {
@@ -1772,8 +1964,8 @@ void write_local_trees_as_bed(FILE *out, const LocalTrees *trees,
                 spr.set_null();
             }
 
-            write_newick_tree_for_bedfile(out, tree, nodeids, model, spr);
-            fprintf(out, "\n");
+            write_local_tree_as_bed(out, trees->chrom, start, end, sample,
+                                    tree, nodeids, model, spr);
         }
     }
 
@@ -2405,6 +2597,7 @@ bool read_local_trees(FILE *infile, const double *times, int ntimes,
     if (trees->get_num_trees() > 0) {
         trees->nnodes = trees->front().tree->nnodes;
         trees->set_default_seqids();
+        trees->compact();
     }
 
     return true;
@@ -2427,6 +2620,162 @@ bool read_local_trees(const char *filename, const double *times,
     return result;
 }
 
+//=============================================================================
+// streaming reader of local trees
+
+
+LocalTreesReader::LocalTreesReader(FILE *infile, const double *times,
+                                   int ntimes) :
+    chrom("chr"),
+    start_coord(0),
+    end_coord(0),
+    start(0),
+    end(0),
+    infile(infile),
+    times(times),
+    ntimes(ntimes),
+    nnodes(0),
+    lineno(0),
+    error(false),
+    skip_pos(-1),
+    pending(NULL)
+{
+    spr.set_null();
+    next_spr.set_null();
+    pending_spr.set_null();
+
+    // read header up to the first tree
+    char *line;
+    while ((line = fgetline(infile))) {
+        chomp(line);
+        lineno++;
+
+        if (strncmp(line, "NAMES", 5) == 0) {
+            split(&line[6], "\t", seqnames);
+            nnodes = 2 * seqnames.size() - 1;
+        } else if (strncmp(line, "REGION\t", 7) == 0) {
+            char chrom2[51];
+            if (sscanf(&line[7], "%50s\t%d\t%d",
+                       chrom2, &start_coord, &end_coord) != 3) {
+                printError("bad REGION line (line %d)", lineno);
+                error = true;
+            }
+            chrom = chrom2;
+            start_coord--; // convert start to 0-index
+        } else if (strncmp(line, "TREE", 4) == 0) {
+            pending = line;
+            break;
+        } else if (strncmp(line, "RANGE", 5) == 0) {
+            printError("deprecated RANGE line detected, use REGION instead (line %d)", lineno);
+            error = true;
+        }
+        delete [] line;
+        if (error)
+            return;
+    }
+    if (seqnames.empty()) {
+        printError("missing NAMES line");
+        error = true;
+        return;
+    }
+
+    tree.ensure_capacity(nnodes);
+    tree.nnodes = nnodes;
+}
+
+
+// Parses the newick tree of a TREE line into 'tree'
+bool LocalTreesReader::parse_tree(const char *line)
+{
+    const char *line_end = line + strlen(line);
+    const char *newick = find(line+5, line_end, '\t') + 1;
+    newick = find(newick, line_end, '\t') + 1;
+    if (newick >= line_end || !parse_local_tree(newick, &tree, times, ntimes)) {
+        printError("bad newick format (line %d)", lineno);
+        return false;
+    }
+    return true;
+}
+
+
+bool LocalTreesReader::next()
+{
+    while (!error && pending) {
+        char *line = pending;
+        pending = NULL;
+        const int treeno = lineno;
+
+        int start2, end2;
+        if (sscanf(&line[5], "%d\t%d", &start2, &end2) != 2) {
+            printError("bad TREE line (line %d)", treeno);
+            error = true;
+            delete [] line;
+            return false;
+        }
+
+        // read the SPR to the right, up to the next tree
+        Spr right;
+        right.set_null();
+        char *line2;
+        while ((line2 = fgetline(infile))) {
+            chomp(line2);
+            lineno++;
+            if (strncmp(line2, "TREE", 4) == 0) {
+                pending = line2;
+                break;
+            } else if (strncmp(line2, "SPR-INVIS", 9) == 0) {
+                // invisible recombinations do not change the tree
+            } else if (strncmp(line2, "SPR", 3) == 0) {
+                int pos, val;
+                double recomb_time, coal_time;
+                right.pop_path = 0;
+                val = sscanf(&line2[4], "%d\t%d\t%lf\t%d\t%lf\t%i",
+                             &pos, &right.recomb_node, &recomb_time,
+                             &right.coal_node, &coal_time, &right.pop_path);
+                if (val != 5 && val != 6) {
+                    printError("bad SPR line (line %d)", lineno);
+                    error = true;
+                    delete [] line2;
+                    delete [] line;
+                    return false;
+                }
+                right.recomb_time = find_time(recomb_time, times, ntimes);
+                right.coal_time = find_time(coal_time, times, ntimes);
+            }
+            delete [] line2;
+        }
+
+        Spr left = pending_spr;
+        pending_spr = right;
+
+        if (end2 <= skip_pos) {
+            // pass over tree
+            delete [] line;
+            continue;
+        }
+
+        // parse tree, keeping the child order of its newick
+        int lineno2 = lineno;
+        lineno = treeno;
+        bool parsed = parse_tree(line);
+        lineno = lineno2;
+        delete [] line;
+        if (!parsed) {
+            error = true;
+            return false;
+        }
+
+        start = start2 - 1;
+        end = end2;
+        spr = left;
+        next_spr = right;
+        return true;
+    }
+
+    return false;
+}
+
+
 /////////////////////////////////// read from tsinfer ////////////////////////////////////
 
 void clean_up_intermediaryTrees(vector<LocalTreeSpr_tmp> *intermediaryTrees){
@@ -3029,7 +3378,7 @@ bool identify_1SPR(Spr *spr, int *mapping, const map<tsk_id_t, int> *prev, const
             exit(EXIT_FAILURE);
         }
 
-        recomb_time = rand() % (min((int)age_out, (int)coal_time) - (int)lower_bound_recomb_time) + (int)lower_bound_recomb_time;
+        recomb_time = rand_int() % (min((int)age_out, (int)coal_time) - (int)lower_bound_recomb_time) + (int)lower_bound_recomb_time;
         spr->recomb_time = find_time(recomb_time, times, ntimes);
         spr->coal_time = find_time(coal_time, times, ntimes);
     
@@ -3281,7 +3630,7 @@ bool assert_spr(const LocalTree *last_tree, const LocalTree *tree,
 {
     LocalNode *last_nodes = last_tree->nodes;
     LocalNode *nodes = tree->nodes;
-    static int count=0;
+    static thread_local int count=0;
     count++;
     //display_localtree(last_tree);
     //printLog(LOG_LOW, "recoal node: %d\n", spr->coal_node);
@@ -6,12 +6,15 @@
 
 // c++ includes
 #include <assert.h>
+#include <stdint.h>
+#include <atomic>
 #include <list>
 #include <vector>
 #include <string.h>
 #include <stdio.h>
 #include <iostream>
 #include <memory>
+#include <unordered_set>
 
 // arghmm includes
 #include "sequences.h"
@@ -164,6 +167,38 @@ public:
 extern LocalNode null_node;
 
 
+// A slab of nodes shared by several neighboring local trees
+//
+// Each tree placed in a slab holds a reference to it, so trees can still
+// be spliced between LocalTrees and the slab is freed with its last tree.
+class LocalNodeSlab
+{
+public:
+    explicit LocalNodeSlab(int size) :
+        nodes(new LocalNode [size]),
+        refs(0)
+    {}
+    ~LocalNodeSlab()
+    {
+        delete [] nodes;
+    }
+
+    void acquire()
+    {
+        refs++;
+    }
+
+    void release()
+    {
+        if (--refs == 0)
+            delete this;
+    }
+
+    LocalNode *nodes;
+    std::atomic<int> refs;
+};
+
+
 // A local tree in a set of local trees
 //
 //   Leaves are always listed first in nodes array
@@ -175,17 +210,19 @@ public:
         nnodes(0),
         capacity(0),
         root(-1),
-        nodes(NULL)
+        nodes(NULL),
+        slab(NULL)
     {}
 
     LocalTree(int nnodes, int capacity=0) :
         nnodes(nnodes),
         capacity(capacity),
-        root(-1)
+        root(-1),
+        slab(NULL)
     {
-        if (capacity < nnodes)
-            capacity = nnodes;
-        nodes = new LocalNode [capacity];
+        if (this->capacity < nnodes)
+            this->capacity = nnodes;
+        nodes = new LocalNode [this->capacity];
     }
 
 
@@ -194,7 +231,8 @@ public:
         nnodes(nnodes),
         capacity(0),
         root(-1),
-        nodes(NULL)
+        nodes(NULL),
+        slab(NULL)
     {
         set_ptree(ptree, nnodes, ages, paths, capacity);
     }
@@ -203,17 +241,38 @@ public:
         nnodes(0),
         capacity(0),
         root(-1),
-        nodes(NULL)
+        nodes(NULL),
+        slab(NULL)
     {
         copy(other);
     }
 
 
     ~LocalTree() {
-        if (nodes) {
+        free_nodes();
+    }
+
+    // deallocate nodes array
+    void free_nodes()
+    {
+        if (slab) {
+            slab->release();
+            slab = NULL;
+        } else if (nodes) {
             delete [] nodes;
-            nodes = NULL;
         }
+        nodes = NULL;
+    }
+
+    // Moves the nodes array to 'slab_nodes' within 'slab', which must have
+    // room for 'capacity' nodes
+    void set_slab(LocalNodeSlab *_slab, LocalNode *slab_nodes)
+    {
+        std::copy(nodes, nodes + nnodes, slab_nodes);
+        _slab->acquire();
+        free_nodes();
+        slab = _slab;
+        nodes = slab_nodes;
     }
 
     // initialize a local tree by on a parent array
@@ -221,9 +280,7 @@ public:
                    int _capacity=-1)
     {
         // delete existing nodes if they exist
-        if (nodes) {
-	    delete [] nodes;
-	}
+        free_nodes();
 
         nnodes = _nnodes;
         if (_capacity >= 0)
@@ -293,7 +350,7 @@ public:
 	assert(tmp);
 
         std::copy(nodes, nodes + capacity, tmp);
-        delete [] nodes;
+        free_nodes();
 
         nodes = tmp;
         capacity = _capacity;
@@ -563,11 +620,35 @@ public:
     int capacity;      // capacity of nodes array
     int root;          // id of root node
     LocalNode *nodes;  // nodes array
+    LocalNodeSlab *slab;  // slab holding nodes array (NULL if owned)
 };
 
 
 
 
+// A score of a block and the key (a hash of the inputs) it was
+// calculated for.  A key of 0 means no score.
+struct CachedScore
+{
+    CachedScore() : key(0), value(0.0) {}
+
+    uint64_t key;
+    double value;
+};
+
+
+// Scores of a block cached by calc_arg_scores().  Two entries are kept for
+// each score so that the scores of both the compressed and uncompressed
+// ARG stay cached.
+struct BlockScores
+{
+    CachedScore likelihood[2];
+    CachedScore prior[2];
+    CachedScore prior2[2];
+    CachedScore noncompat[2];
+};
+
+
 // A tree within a set of local trees
 //
 // Specifically this structure describes the block over which the
@@ -635,9 +716,12 @@ public:
     Spr spr;          // SPR operation to the left of local tree
     int *mapping;     // node mapping between previous tree and this tree
     int blocklen;     // length of sequence block
+    mutable BlockScores scores;  // cached scores of block
 };
 
 
+class LocalTreesUndo;
+
 
 // A set of local trees that together specify an ARG
 //
@@ -651,7 +735,8 @@ public:
         chrom("chr"),
         start_coord(start_coord),
         end_coord(end_coord),
-        nnodes(nnodes) {}
+        nnodes(nnodes),
+        undo(NULL) {}
     LocalTrees(int **ptrees, int**ages, int **isprs, int *blocklens,
                int ntrees, int nnodes, int capacity=-1, int start=0);
     ~LocalTrees()
@@ -707,14 +792,31 @@ public:
     // Copy trees from another set of local trees
     void copy(const LocalTrees &other);
 
+    // Packs the nodes of each run of 'chunk_size' neighboring trees into
+    // one slab, so that sweeps across the ARG read contiguous memory
+    void compact(int chunk_size=256);
+
     // deallocate local trees
     void clear()
     {
         for (iterator it=begin(); it!=end(); it++)
             it->clear();
         trees.clear();
+        index.clear();
     }
 
+    // Editing blocks in place.  If an undo log is attached, the edits are
+    // recorded so that they can be reverted (see LocalTreesUndo).
+
+    // Must be called before a block is changed in place
+    void save_block(iterator it);
+
+    // Inserts a block before 'pos'
+    iterator insert_block(iterator pos, const LocalTreeSpr &block);
+
+    // Removes a block and deallocates it
+    void erase_block(iterator it);
+
     // make trunk genealogy
     void make_trunk(int start, int end, int seqid, int pop_path,
                     int capacity=-1)
@@ -768,11 +870,33 @@ public:
     }
 
 
+    // Finding blocks by coordinate
+    //
+    // 'index' holds the start coordinates of a prefix of the blocks, so
+    // that blocks are found by binary search.  Non-const lookups extend the
+    // index as far as the site they look up.  Appending blocks or changing
+    // the length of the last indexed block keeps the index valid; any
+    // other edit to the indexed blocks must truncate or reset the index.
+
     // return local block containing site
     const_iterator get_block(int site, int &start, int &end) const
     {
+        const_iterator it = begin();
         start = end = start_coord;
-        for (const_iterator it = begin(); it != this->end(); ++it) {
+        if (!index.empty()) {
+            if (site < index[0].start)
+                return this->end();
+            const BlockStart &block = find_index(site);
+            start = block.start;
+            end = start + block.it->blocklen;
+            if (site < end)
+                return block.it;
+            it = block.it;
+            ++it;
+        }
+
+        // walk past the indexed blocks
+        for (; it != this->end(); ++it) {
             start = end;
             end += it->blocklen;
             if (start <= site && site < end)
@@ -791,13 +915,15 @@ public:
     // return local block containing site
     iterator get_block(int site, int &start, int &end)
     {
-        start = end = start_coord;
-        for (iterator it = begin(); it != this->end(); ++it) {
-            start = end;
-            end += it->blocklen;
-            if (start <= site && site < end)
-                return it;
-        }
+        if (trees.empty() || site < start_coord)
+            return this->end();
+        extend_index(site);
+
+        const BlockStart &block = find_index(site);
+        start = block.start;
+        end = start + block.it->blocklen;
+        if (site < end)
+            return block.it;
         return this->end();
     }
 
@@ -808,6 +934,38 @@ public:
         return get_block(site, start, end);
     }
 
+    // Returns the first block that ends after 'site' and sets 'start' to
+    // its start coordinate.  Iterating from here visits the blocks
+    // overlapping [site, end_coord).
+    const_iterator get_first_block(int site, int &start) const
+    {
+        if (site <= start_coord) {
+            start = start_coord;
+            return begin();
+        }
+        int end;
+        return get_block(site, start, end);
+    }
+
+    // Indexes all blocks, so that const lookups take O(log n)
+    void build_index()
+    {
+        if (!trees.empty())
+            extend_index(end_coord);
+    }
+
+    // Drops the blocks starting at or after 'coord' from the index
+    void truncate_index(int coord)
+    {
+        while (!index.empty() && index.back().start >= coord)
+            index.pop_back();
+    }
+
+    // Drops all blocks from the index
+    void reset_index()
+    {
+        index.clear();
+    }
 
 
     string chrom;              // chromosome name of region
@@ -818,6 +976,121 @@ public:
     list<LocalTreeSpr> trees;  // linked list of local trees
 
     vector<int> seqids;        // mapping from tree leaves to sequence ids
+    LocalTreesUndo *undo;      // log of edits to revert (optional)
+
+protected:
+    // a block and its start coordinate
+    struct BlockStart
+    {
+        BlockStart(int start, iterator it) :
+            start(start), it(it) {}
+
+        int start;
+        iterator it;
+    };
+
+    // Returns the last indexed block that starts at or before 'site'
+    const BlockStart &find_index(int site) const
+    {
+        int low = 0, high = index.size();
+        while (high - low > 1) {
+            int mid = (low + high) / 2;
+            if (index[mid].start <= site)
+                low = mid;
+            else
+                high = mid;
+        }
+        return index[low];
+    }
+
+    // Indexes blocks until the block containing 'site' or the last block
+    void extend_index(int site)
+    {
+        if (index.empty())
+            index.push_back(BlockStart(start_coord, begin()));
+        while (true) {
+            const BlockStart &last = index.back();
+            const int end = last.start + last.it->blocklen;
+            iterator next = last.it;
+            ++next;
+            if (site < end || next == trees.end())
+                break;
+            index.push_back(BlockStart(end, next));
+        }
+    }
+
+    vector<BlockStart> index;  // start coordinates of a prefix of blocks
+};
+
+
+// A log of the edits made to a set of local trees, so that they can be
+// reverted (e.g. when an MCMC proposal is rejected).
+//
+// While the log is attached, each block is saved the first time it is
+// changed and removed blocks are kept, so reverting costs time in
+// proportion to the blocks changed instead of copying the whole ARG.
+class LocalTreesUndo
+{
+public:
+    LocalTreesUndo() :
+        trees(NULL)
+    {}
+    ~LocalTreesUndo()
+    {
+        commit();
+    }
+
+    // Start recording the edits made to 'trees'
+    void begin(LocalTrees *trees);
+
+    // Keep the edits and stop recording
+    void commit();
+
+    // Undo the edits and stop recording
+    void revert();
+
+    // record edits (see LocalTrees::save_block, insert_block, erase_block)
+    void save(LocalTrees::iterator it);
+    void inserted(LocalTrees::iterator it);
+    void erase(LocalTrees::iterator it);
+
+protected:
+    void clear();
+
+    enum EditType {
+        EDIT_SAVE,
+        EDIT_INSERT,
+        EDIT_ERASE
+    };
+
+    // One edit to a block.  Saved blocks store their tree nodes and
+    // mapping at 'offset' in 'nodes' and 'mappings'.
+    struct Edit
+    {
+        Edit(EditType type, LocalTrees::iterator it) :
+            type(type), it(it), next(it), blocklen(0), root(-1), nnodes(0),
+            has_mapping(false), offset(0)
+        {
+            spr.set_null();
+        }
+
+        EditType type;
+        LocalTrees::iterator it;
+        LocalTrees::iterator next;  // block that followed an erased block
+        Spr spr;
+        int blocklen;
+        int root;
+        int nnodes;
+        bool has_mapping;
+        int offset;
+    };
+
+    LocalTrees *trees;
+    vector<Edit> edits;
+    unordered_set<const LocalTreeSpr*> saved;
+    vector<LocalNode> nodes;
+    vector<int> mappings;
+    list<LocalTreeSpr> erased;  // blocks removed from trees
 };
 
 
@@ -996,12 +1269,69 @@ bool write_local_trees(const char *filename, const LocalTrees *trees,
                        const vector<Spr> &self_recombs=vector<Spr>());
 bool parse_local_tree(const char* newick, LocalTree *tree,
                       const double *times, int ntimes);
+int find_time(double time, const double *times, int ntimes);
 bool read_local_trees(FILE *infile, const double *times, int ntimes,
                       LocalTrees *trees, vector<string> &seqnames,
                       vector<int> *invisible_recomb_pos=NULL,
                       vector<Spr> *invisible_recombs=NULL);
 bool read_local_trees(const char *filename, const double *times, int ntimes,
                       LocalTrees *trees, vector<string> &seqnames);
+
+
+// Reads the trees of an .smc stream one at a time, holding only the
+// current tree.  Each tree is parsed from its newick, so it is the same
+// tree, with the same child order, as read_local_trees() gives.
+class LocalTreesReader
+{
+public:
+    // Reads the header of 'infile'; check ok() for errors
+    LocalTreesReader(FILE *infile, const double *times, int ntimes);
+
+    ~LocalTreesReader()
+    {
+        delete [] pending;
+    }
+
+    // Moves to the next tree.  Returns false after the last tree or on
+    // error.
+    bool next();
+
+    // Makes next() pass over trees ending at or before 'pos' without
+    // building them
+    inline void skip_to(int pos)
+    {
+        skip_pos = pos;
+    }
+
+    inline bool ok() const
+    {
+        return !error;
+    }
+
+    string chrom;            // chromosome name of region
+    int start_coord;         // start coordinate of region (0-based)
+    int end_coord;           // end coordinate of region
+    vector<string> seqnames;
+
+    LocalTree tree;          // current tree
+    int start;               // current block [start, end) (0-based)
+    int end;
+    Spr spr;                 // SPR to the left of current tree
+    Spr next_spr;            // SPR to the right of current tree
+
+protected:
+    bool parse_tree(const char *line);
+
+    FILE *infile;
+    const double *times;
+    int ntimes;
+    int nnodes;
+    int lineno;
+    bool error;
+    int skip_pos;
+    char *pending;           // TREE line not yet visited
+    Spr pending_spr;         // SPR to the left of 'pending'
+};
 bool read_local_trees_from_ts(const char *ts_fileName, const double *times, int ntimes,
                       LocalTrees *trees, vector<string> &seqnames, int start_coord, int end_coord);
 void node_mapping(const LocalTree *lasttree, const LocalTree *localtree, int *mapping);
@@ -1016,6 +1346,11 @@ void write_newick_Tree_for_bedfile(FILE *out, const LocalTree *tree,
 void write_local_trees_as_bed(FILE *out, const LocalTrees *trees,
                               const vector<string> seqnames,
                               const ArgModel *model, int sample);
+void write_local_tree_as_bed(FILE *out, const string &chrom,
+                             int start, int end, int sample,
+                             const LocalTree *tree,
+                             const char *const *nodeids,
+                             const ArgModel *model, const Spr &next_spr);
 string get_newick_rep_rSPR(const LocalTree *tree);
 void get_newick_rep_rSPR_helper(string *s, const LocalTree *tree, int node);
 
@@ -16,6 +16,21 @@ namespace argweaver {
 
 Logger g_logger(stderr, LOG_QUIET);
 
+// logger replacing g_logger for the current thread
+static thread_local Logger *g_thread_logger = NULL;
+
+
+Logger &getLogger()
+{
+    return g_thread_logger ? *g_thread_logger : g_logger;
+}
+
+
+void setThreadLogger(Logger *logger)
+{
+    g_thread_logger = logger;
+}
+
 
 void Logger::printTimerLog(const Timer &timer, int level, const char *fmt, ...)
 {
@@ -64,14 +79,15 @@ void Logger::printTimerLog(const Timer &timer, int level, const char *fmt,
 void printLog(int level, const char *fmt, ...)
 {
     va_list ap;
+    Logger &current = getLogger();
 
-    if (g_logger.isLogLevel(level)) {
+    if (current.isLogLevel(level)) {
         va_start(ap, fmt);
-        g_logger.printLog(level, fmt, ap);
+        current.printLog(level, fmt, ap);
         va_end(ap);
     }
 
-    Logger *logger = g_logger.getChain();
+    Logger *logger = current.getChain();
     if (logger && logger->isLogLevel(level)) {
         va_start(ap, fmt);
         logger->printLog(level, fmt, ap);
@@ -83,14 +99,15 @@ void printLog(int level, const char *fmt, ...)
 void printTimerLog(const Timer &timer, int level, const char *fmt, ...)
 {
     va_list ap;
+    Logger &current = getLogger();
 
-    if (g_logger.isLogLevel(level)) {
+    if (current.isLogLevel(level)) {
         va_start(ap, fmt);
-        g_logger.printTimerLog(timer, level, fmt, ap);
+        current.printTimerLog(timer, level, fmt, ap);
         va_end(ap);
     }
 
-    Logger *logger = g_logger.getChain();
+    Logger *logger = current.getChain();
     if (logger && logger->isLogLevel(level)) {
         va_start(ap, fmt);
         logger->printTimerLog(timer, level, fmt, ap);
@@ -105,7 +122,7 @@ void printError(const char *fmt, va_list ap)
     vfprintf(stderr, fmt, ap);
     fprintf(stderr, "\n");
 
-    g_logger.printLog(LOG_HIGH, fmt, ap);
+    getLogger().printLog(LOG_HIGH, fmt, ap);
 }
 
 void printWarning(const char *fmt, va_list ap)
@@ -114,7 +131,7 @@ void printWarning(const char *fmt, va_list ap)
     vfprintf(stderr, fmt, ap);
     fprintf(stderr, "\n");
 
-    g_logger.printLog(LOG_HIGH, fmt, ap);
+    getLogger().printLog(LOG_HIGH, fmt, ap);
 }
 
 
@@ -128,7 +145,7 @@ void printError(const char *fmt, ...)
     va_end(ap);
 
     va_start(ap, fmt);
-    g_logger.printLog(LOG_HIGH, fmt, ap);
+    getLogger().printLog(LOG_HIGH, fmt, ap);
     va_end(ap);
 }
 
@@ -142,7 +159,7 @@ void printWarning(const char *fmt, ...)
     va_end(ap);
 
     va_start(ap, fmt);
-    g_logger.printLog(LOG_HIGH, fmt, ap);
+    getLogger().printLog(LOG_HIGH, fmt, ap);
     va_end(ap);
 }
 
@@ -164,7 +181,7 @@ void exitError(const char *fmt, ...)
     va_end(ap);
 
     va_start(ap, fmt);
-    g_logger.printLog(LOG_HIGH, fmt, ap);
+    getLogger().printLog(LOG_HIGH, fmt, ap);
     va_end(ap);
     exit(1);
 }
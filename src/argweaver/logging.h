@@ -16,6 +16,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <sys/time.h>
+#include <atomic>
 
 namespace argweaver {
 
@@ -143,16 +144,14 @@ public:
     {
         if (chain)
             chain->incLogLevel();
-        loglevel++;
-        return loglevel;
+        return ++loglevel;
     }
 
     int decLogLevel()
     {
         if (chain)
             chain->decLogLevel();
-        loglevel--;
-        return loglevel;
+        return --loglevel;
     }
 
     int getLogLevel()
@@ -214,7 +213,8 @@ public:
 protected:
 
     FILE *logstream;
-    int loglevel;
+    // atomic so that sampling threads can adjust verbosity concurrently
+    std::atomic<int> loglevel;
     Logger *chain;
 };
 
@@ -224,6 +224,14 @@ protected:
 
 extern Logger g_logger;
 
+// Returns the logger of the calling thread, which is g_logger unless the
+// thread has called setThreadLogger()
+Logger &getLogger();
+
+// Logs the messages of the calling thread to 'logger' instead of g_logger.
+// A NULL logger restores g_logger.
+void setThreadLogger(Logger *logger);
+
 inline bool openLogFile(const char *filename, const char* mode="w")
 { return g_logger.openLogFile(filename, mode); }
 
@@ -237,13 +245,13 @@ inline FILE *getLogFile()
 { return g_logger.getLogFile(); }
 
 inline bool isLogLevel(int level)
-{ return g_logger.isLogLevel(level); }
+{ return getLogger().isLogLevel(level); }
 
 inline int incLogLevel()
-{ return g_logger.incLogLevel(); }
+{ return getLogger().incLogLevel(); }
 
 inline int decLogLevel()
-{ return g_logger.decLogLevel(); }
+{ return getLogger().decLogLevel(); }
 
 
 // global function API
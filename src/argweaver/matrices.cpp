@@ -1,9 +1,42 @@
 
 
+// c++ includes
+#include <memory>
+
 #include "matrices.h"
 
 namespace argweaver {
 
+
+// Scratch space for the matrices of one block, reused by all blocks
+// computed on the same thread
+class BlockScratch
+{
+public:
+    // Returns lineage counts with the given dimensions
+    LineageCounts &get_lineages(int ntimes, int npops)
+    {
+        if (!lineages || lineages->ntimes != ntimes ||
+            lineages->npops != npops)
+            lineages.reset(new LineageCounts(ntimes, npops));
+        return *lineages;
+    }
+
+    // Returns the scratch space of the calling thread
+    static BlockScratch &thread_scratch()
+    {
+        static thread_local BlockScratch scratch;
+        return scratch;
+    }
+
+    States states;
+    States last_states;
+
+protected:
+    unique_ptr<LineageCounts> lineages;
+};
+
+
 // calculate transition and emission matrices for current block
 void calc_arghmm_matrices_internal(
     const ArgModel *model, const Sequences *seqs, const LocalTrees *trees,
@@ -18,9 +51,11 @@ void calc_arghmm_matrices_internal(
     matrices->blocklen = blocklen;
     const LocalTree *tree = tree_spr->tree;
 
-    LineageCounts lineages(model->ntimes, model->num_pops());  // only allocates
-    States last_states;
-    States states;
+    BlockScratch &scratch = BlockScratch::thread_scratch();
+    LineageCounts &lineages = scratch.get_lineages(model->ntimes,
+                                                   model->num_pops());
+    States &last_states = scratch.last_states;
+    States &states = scratch.states;
     matrices->states_model.set(model->ntimes, internal, minage, model->pop_tree);
     matrices->states_model.get_coal_states(tree, states);
     const int nstates = states.size();
@@ -99,9 +134,11 @@ void calc_arghmm_matrices_external(
     matrices->blocklen = blocklen;
     const LocalTree *tree = tree_spr->tree;
 
-    LineageCounts lineages(model->ntimes, model->num_pops());
-    States last_states;
-    States states;
+    BlockScratch &scratch = BlockScratch::thread_scratch();
+    LineageCounts &lineages = scratch.get_lineages(model->ntimes,
+                                                   model->num_pops());
+    States &last_states = scratch.last_states;
+    States &states = scratch.states;
     matrices->states_model.set(model->ntimes, false, 0, model->pop_tree,
                                start_pop);
     matrices->states_model.get_coal_states(tree, states);
@@ -189,5 +226,140 @@ void calc_arghmm_matrices(
 }
 
 
+//=============================================================================
+// Matrix pipeline
+
+
+void ArgHmmMatrixPipeline::clear()
+{
+    stop();
+    slots.clear();
+    current = NULL;
+}
+
+
+void ArgHmmMatrixPipeline::start(int block)
+{
+    stop();
+    if (nthreads <= 0 || block >= blocks.size())
+        return;
+
+    if (slots.size() == 0)
+        slots.resize(lookahead);
+    next_block = first_block = block;
+    stopping = false;
+    running = true;
+    for (int i=0; i<nthreads; i++)
+        workers.push_back(thread(&ArgHmmMatrixPipeline::worker, this));
+}
+
+
+void ArgHmmMatrixPipeline::stop()
+{
+    if (!running)
+        return;
+
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    slot_free.notify_all();
+    for (unsigned int i=0; i<workers.size(); i++)
+        workers[i].join();
+    workers.clear();
+    running = false;
+
+    // keep the matrices of the current block until the consumer moves on
+    for (unsigned int i=0; i<slots.size(); i++) {
+        if (&slots[i].matrices != current) {
+            slots[i].matrices.clear();
+            slots[i].block = -1;
+        }
+    }
+}
+
+
+void ArgHmmMatrixPipeline::worker()
+{
+    unique_lock<mutex> guard(lock);
+    while (true) {
+        while (!stopping && (next_block >= blocks.size() ||
+                             next_block >= first_block + lookahead))
+            slot_free.wait(guard);
+        if (stopping)
+            return;
+
+        // the slot's previous block has been released by the consumer
+        const int block = next_block++;
+        Slot &slot = slots[block % lookahead];
+        guard.unlock();
+        slot.matrices.clear();
+        calc_block_matrices(block, &slot.matrices);
+        guard.lock();
+
+        slot.block = block;
+        slot_ready.notify_all();
+    }
+}
+
+
+// Done with the current block: move its transition matrices into the kept
+// list and release its slot to the workers.
+void ArgHmmMatrixPipeline::release()
+{
+    if (kept && current && current->transmat)
+        kept->set_transitions(block_index, *current);
+    current = NULL;
+
+    if (running && block_index >= first_block) {
+        {
+            unique_lock<mutex> guard(lock);
+            Slot &slot = slots[block_index % lookahead];
+            while (slot.block != block_index)
+                slot_ready.wait(guard);
+            slot.matrices.clear();
+            slot.block = -1;
+            first_block = block_index + 1;
+        }
+        slot_free.notify_all();
+    }
+}
+
+
+bool ArgHmmMatrixPipeline::next()
+{
+    release();
+    bool more = ArgHmmMatrixIter::next();
+    if (!more)
+        stop();
+    return more;
+}
+
+
+ArgHmmMatrices &ArgHmmMatrixPipeline::ref_matrices(PhaseProbs *phase_pr)
+{
+    if (running && (phase_pr != NULL || block_index != first_block))
+        stop();
+
+    if (!running) {
+        // compute matrices in this thread
+        mat.clear();
+        calc_matrices(&mat, phase_pr);
+        current = &mat;
+        return mat;
+    }
+
+    Slot &slot = slots[block_index % lookahead];
+    {
+        unique_lock<mutex> guard(lock);
+        while (slot.block != block_index)
+            slot_ready.wait(guard);
+    }
+    current = &slot.matrices;
+    return slot.matrices;
+}
+
+
+
 } // namespace argweaver
 
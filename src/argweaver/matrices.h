@@ -6,7 +6,10 @@
 
 
 // c++ includes
+#include <condition_variable>
 #include <list>
+#include <mutex>
+#include <thread>
 #include <vector>
 #include <string.h>
 
@@ -273,6 +276,22 @@ public:
         block_index = blocks.size() - 1;
     }
 
+    // moves iterator to the block containing position pos
+    virtual void seek(int pos)
+    {
+        if (blocks.size() == 0)
+            setup();
+        int low = 0, high = blocks.size() - 1;
+        while (low < high) {
+            int mid = (low + high + 1) / 2;
+            if (blocks.at(mid).start <= pos)
+                low = mid;
+            else
+                high = mid - 1;
+        }
+        block_index = low;
+    }
+
     virtual bool next()
     {
         block_index++;
@@ -352,12 +371,21 @@ public:
 protected:
 
     void calc_matrices(ArgHmmMatrices *matrices, PhaseProbs *phase_pr = NULL)
+    {
+        calc_block_matrices(block_index, matrices, phase_pr);
+    }
+
+    // calculate matrices for the block with the given index
+    // (safe to call from several threads at once)
+    void calc_block_matrices(int index, ArgHmmMatrices *matrices,
+                             PhaseProbs *phase_pr = NULL) const
     {
         ArgModel local_model;
-        ArgModelBlock &block = blocks.at(block_index);
+        const ArgModelBlock &block = blocks.at(index);
 
         model->get_local_model_index(block.model_index, local_model);
-        const LocalTreeSpr * last_tree_spr = get_last_tree_spr();
+        const LocalTreeSpr * last_tree_spr =
+            index > 0 ? blocks.at(index-1).tree_spr : NULL;
 
         argweaver::calc_arghmm_matrices(
             &local_model, seqs, trees, last_tree_spr, block.tree_spr,
@@ -402,12 +430,36 @@ public:
     {
         ArgHmmMatrixIter::setup();
 
+        // matrices own their data and must not be copied on reallocation
+        matrices.reserve(blocks.size());
         for (begin(); more(); next()) {
             matrices.push_back(ArgHmmMatrices());
             calc_matrices(&matrices.back(), phase_pr);
         }
     }
 
+    // take ownership of the transition matrices of block 'index'
+    // (blocks without stored matrices are computed on demand)
+    void set_transitions(int index, ArgHmmMatrices &mat)
+    {
+        if (matrices.size() == 0) {
+            if (blocks.size() == 0)
+                ArgHmmMatrixIter::setup();
+            matrices.resize(blocks.size());
+        }
+        ArgHmmMatrices &dest = matrices[index];
+        if (dest.transmat)
+            return;
+        dest.nstates1 = mat.nstates1;
+        dest.nstates2 = mat.nstates2;
+        dest.blocklen = mat.blocklen;
+        dest.states_model = mat.states_model;
+        dest.transmat = mat.transmat;
+        dest.transmat_switch = mat.transmat_switch;
+        mat.transmat = NULL;
+        mat.transmat_switch = NULL;
+    }
+
     // free all computed matrices
     virtual void clear()
     {
@@ -431,6 +483,12 @@ public:
         matrix_index = matrices.size() - 1;
     }
 
+    virtual void seek(int pos)
+    {
+        ArgHmmMatrixIter::seek(pos);
+        matrix_index = block_index;
+    }
+
     // moves iterator to next block
     virtual bool next()
     {
@@ -448,8 +506,10 @@ public:
     //==================================================
     // accessors
 
-    virtual ArgHmmMatrices &ref_matrices()
+    virtual ArgHmmMatrices &ref_matrices(PhaseProbs *phase_pr = NULL)
     {
+        if (matrices.size() == 0 || !matrices[matrix_index].transmat)
+            return ArgHmmMatrixIter::ref_matrices(phase_pr);
         return matrices[matrix_index];
     }
 
@@ -460,6 +520,113 @@ protected:
 };
 
 
+
+// Iterates through matrices that are computed by worker threads a bounded
+// number of blocks ahead of an in-order (forward) pass.
+//
+// Computed matrices are held in a ring buffer of 'lookahead' slots.  Out
+// of order iteration (prev(), rbegin()) and requests with phasing
+// probabilities fall back to computing matrices in the calling thread, as
+// does a pipeline with no worker threads.
+class ArgHmmMatrixPipeline : public ArgHmmMatrixIter
+{
+public:
+    ArgHmmMatrixPipeline(const ArgModel *model, const Sequences *seqs,
+                         const LocalTrees *trees, int nthreads,
+                         int new_chrom=-1) :
+        ArgHmmMatrixIter(model, seqs, trees, new_chrom),
+        nthreads(nthreads),
+        lookahead(2 * nthreads + 2),
+        running(false),
+        stopping(false),
+        current(NULL),
+        kept(NULL)
+    {}
+
+    virtual ~ArgHmmMatrixPipeline()
+    {
+        clear();
+    }
+
+    // stop worker threads and free buffered matrices
+    virtual void clear();
+
+    // Move the transition matrices of each block visited by this iterator
+    // into 'list', so that backward passes can reuse them.
+    void keep_transitions(ArgHmmMatrixList *list)
+    {
+        kept = list;
+    }
+
+    //==================================================
+    // iteration methods
+
+    virtual void begin()
+    {
+        release();
+        ArgHmmMatrixIter::begin();
+        start(block_index);
+    }
+
+    virtual void rbegin()
+    {
+        release();
+        stop();
+        ArgHmmMatrixIter::rbegin();
+    }
+
+    virtual void seek(int pos)
+    {
+        release();
+        ArgHmmMatrixIter::seek(pos);
+        start(block_index);
+    }
+
+    virtual bool next();
+
+    virtual bool prev()
+    {
+        release();
+        stop();
+        return ArgHmmMatrixIter::prev();
+    }
+
+    //==================================================
+    // accessors
+
+    virtual ArgHmmMatrices &ref_matrices(PhaseProbs *phase_pr = NULL);
+
+protected:
+    // a buffered block of matrices
+    struct Slot {
+        Slot() : block(-1) {}
+        int block; // index of block held in slot, -1 if not ready
+        ArgHmmMatrices matrices;
+    };
+
+    // start workers computing blocks from 'block' onward
+    void start(int block);
+    void stop();
+    void worker();
+    void release();
+
+    int nthreads;
+    int lookahead;
+    vector<thread> workers;
+    vector<Slot> slots;
+    mutex lock;
+    condition_variable slot_free;
+    condition_variable slot_ready;
+    int next_block;  // next block for workers to compute
+    int first_block; // oldest block still held by the consumer
+    bool running;
+    bool stopping;
+
+    ArgHmmMatrices *current; // matrices last returned by ref_matrices()
+    ArgHmmMatrixList *kept;
+};
+
+
 } // namespace argweaver
 
 
@@ -2,12 +2,16 @@
 #include "mpi.h"
 #endif
 
+// c/c++ includes
+#include <math.h>
+
+#include "common.h"
 #include "mcmcmc.h"
 
 namespace argweaver {
 
  Mc3Config::Mc3Config(int group, double heat_interval) :
-        group(group), heat_interval(heat_interval) {
+        group(group), heat_interval(heat_interval), chains(NULL) {
 #ifdef ARGWEAVER_MPI
     int numthread=MPI::COMM_WORLD.Get_size();
     int *groups = (int*)malloc(numthread*sizeof(int));
@@ -41,6 +45,89 @@ namespace argweaver {
         }
     }
     free(groups);
+#else
+    max_group = group;
+    heat = 1.0 - heat_interval * group;
 #endif
 }
+
+
+Mc3Config::Mc3Config(int group, double heat_interval,
+                     Mc3ThreadChains *chains) :
+    group(group),
+    max_group(chains->nchains - 1),
+    heat_interval(heat_interval),
+    heat(1.0 - heat_interval * group),
+    chains(chains)
+{}
+
+
+//=============================================================================
+// chains as threads
+
+
+void Mc3ThreadChains::propose(int swap[2])
+{
+    std::unique_lock<std::mutex> guard(lock);
+    const int my_round = round;
+
+    if (++narrived == nchains) {
+        // last chain to arrive picks two groups to swap
+        swap_groups[0] = rand_stream.uniform_int(nchains);
+        swap_groups[1] = rand_stream.uniform_int(nchains - 1);
+        if (swap_groups[1] >= swap_groups[0])
+            swap_groups[1]++;
+        narrived = 0;
+        round++;
+        arrived.notify_all();
+    } else {
+        while (round == my_round)
+            arrived.wait(guard);
+    }
+
+    swap[0] = swap_groups[0];
+    swap[1] = swap_groups[1];
+}
+
+
+bool Mc3ThreadChains::exchange(Mc3Config *mc3, const int swap[2],
+                               double lnl, double stats[4])
+{
+    std::unique_lock<std::mutex> guard(lock);
+    const int my_round = round;
+    const int side = (mc3->group == swap[0] ? 0 : 1);
+    assert(mc3->group == swap[side]);
+
+    exchange_lnl[side] = lnl;
+    if (++nexchange == 2) {
+        // second chain decides
+        const double heat[2] = {1.0 - mc3->heat_interval * swap[0],
+                                1.0 - mc3->heat_interval * swap[1]};
+        const double accept_ratio =
+            (heat[0] - heat[1]) * exchange_lnl[1] +
+            (heat[1] - heat[0]) * exchange_lnl[0];
+        const bool accept = (accept_ratio >= 0.0 ||
+                             rand_stream.uniform() < exp(accept_ratio));
+        exchange_stats[0] = accept ? 1.0 : 0.0;
+        exchange_stats[1] = heat[0];
+        exchange_stats[2] = heat[1];
+        exchange_stats[3] = accept_ratio;
+        exchange_round = my_round;
+        nexchange = 0;
+        decided.notify_all();
+    } else {
+        while (nexchange != 0 || exchange_round != my_round)
+            decided.wait(guard);
+    }
+
+    for (int i=0; i<4; i++)
+        stats[i] = exchange_stats[i];
+    const bool accept = (stats[0] > 0.5);
+    if (accept) {
+        mc3->group = swap[1 - side];
+        mc3->heat = 1.0 - mc3->heat_interval * mc3->group;
+    }
+    return accept;
+}
+
 }
@@ -1,7 +1,12 @@
 #ifndef ARGWEAVER_MCMCMC_H
 #define ARGWEAVER_MCMCMC_H
 
+// c++ includes
+#include <condition_variable>
+#include <mutex>
+
 #include "logging.h"
+#include "random.h"
 
 #ifdef ARGWEAVER_MPI
 //extern class MPI::Intracomm;
@@ -12,6 +17,8 @@ namespace MPI {
 
 namespace argweaver {
 
+class Mc3ThreadChains;
+
 class Mc3Config
 {
  public:
@@ -21,19 +28,73 @@ class Mc3Config
         max_group=0;
         heat_interval=0.05;
         heat=1.0;
+        chains=NULL;
     }
 
     Mc3Config(int group, double heat_interval);
 
+    // chain in group 'group' of chains running as threads
+    Mc3Config(int group, double heat_interval, Mc3ThreadChains *chains);
+
     int group;
     int max_group;
     double heat_interval;
     double heat;
+    Mc3ThreadChains *chains;
 #ifdef ARGWEAVER_MPI
     MPI::Intracomm *group_comm;
 #endif
 };
 
+
+// Swaps heats between (MC)^3 chains that run as threads of one process.
+//
+// Every chain calls propose() once per iteration.  When all chains have
+// arrived, two groups are picked at random.  Only the two chains holding
+// those groups call exchange() with their log posterior; the other chains
+// continue sampling without waiting for the decision.  An accepted swap
+// exchanges the groups (and heats) of the two chains.
+class Mc3ThreadChains
+{
+ public:
+    // Swap proposals and decisions are drawn from stream 0 of 'seed'
+    Mc3ThreadChains(int nchains, unsigned long seed) :
+        nchains(nchains),
+        rand_stream(seed, 0),
+        narrived(0),
+        round(0),
+        nexchange(0),
+        exchange_round(-1)
+    {}
+
+    // Waits for all chains and returns the two groups to swap
+    void propose(int swap[2]);
+
+    // Decides the swap proposed in this round and updates 'mc3' of the
+    // calling chain.  'stats' receives {accept, heat0, heat1, ratio}, where
+    // heat0 and heat1 are the heats of the chains in groups swap[0] and
+    // swap[1].  Returns true if the swap is accepted.
+    bool exchange(Mc3Config *mc3, const int swap[2], double lnl,
+                  double stats[4]);
+
+    const int nchains;
+
+ protected:
+    RandStream rand_stream;
+    std::mutex lock;
+    std::condition_variable arrived;
+    std::condition_variable decided;
+    int narrived;
+    int round;
+    int swap_groups[2];
+
+    // state of the current exchange
+    int nexchange;
+    int exchange_round;
+    double exchange_lnl[2];
+    double exchange_stats[4];
+};
+
 } //namespace argweaver
 
 #endif
@@ -187,7 +187,8 @@ void ArgModel::copy(const ArgModel &other) {
     else pop_tree = NULL;
 
     // copy popsizes and times
-    set_times(other.times, other.coal_time_steps, ntimes);
+    if (other.times)
+        set_times(other.times, other.coal_time_steps, ntimes);
     if (other.popsizes)
         set_popsizes(other.popsizes);
 
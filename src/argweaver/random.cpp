@@ -0,0 +1,159 @@
+//=============================================================================
+// random number streams
+
+// c/c++ includes
+#include <inttypes.h>
+#include <atomic>
+
+#include "random.h"
+
+
+namespace argweaver {
+
+
+void RandStream::set_seed(unsigned long seed, int stream)
+{
+    // fill the state with splitmix64 so that similar seeds give unrelated
+    // states
+    uint64_t x = seed;
+    for (int i=0; i<4; i++) {
+        x += 0x9e3779b97f4a7c15ULL;
+        uint64_t z = x;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        s[i] = z ^ (z >> 31);
+    }
+
+    for (int i=0; i<stream; i++)
+        jump();
+}
+
+
+void RandStream::jump()
+{
+    static const uint64_t JUMP[] = {
+        0x180ec6d33cfd0abaULL, 0xd5a61266f0c9392cULL,
+        0xa9582618e03fc9aaULL, 0x39abdc4529b1661cULL};
+
+    uint64_t t[4] = {0, 0, 0, 0};
+    for (int i=0; i<4; i++) {
+        for (int b=0; b<64; b++) {
+            if (JUMP[i] & (uint64_t(1) << b)) {
+                for (int j=0; j<4; j++)
+                    t[j] ^= s[j];
+            }
+            next();
+        }
+    }
+    for (int j=0; j<4; j++)
+        s[j] = t[j];
+}
+
+
+void RandStream::long_jump()
+{
+    static const uint64_t LONG_JUMP[] = {
+        0x76e15d3efefdcbbfULL, 0xc5004e441c522fb3ULL,
+        0x77710069854ee241ULL, 0x39109bb02acbe635ULL};
+
+    uint64_t t[4] = {0, 0, 0, 0};
+    for (int i=0; i<4; i++) {
+        for (int b=0; b<64; b++) {
+            if (LONG_JUMP[i] & (uint64_t(1) << b)) {
+                for (int j=0; j<4; j++)
+                    t[j] ^= s[j];
+            }
+            next();
+        }
+    }
+    for (int j=0; j<4; j++)
+        s[j] = t[j];
+}
+
+
+bool RandStream::read(FILE *infile)
+{
+    uint64_t t[4];
+    if (fscanf(infile, "%" SCNx64 " %" SCNx64 " %" SCNx64 " %" SCNx64,
+               &t[0], &t[1], &t[2], &t[3]) != 4)
+        return false;
+
+    // the all zero state is not valid
+    if ((t[0] | t[1] | t[2] | t[3]) == 0)
+        return false;
+
+    for (int j=0; j<4; j++)
+        s[j] = t[j];
+    return true;
+}
+
+
+void RandStream::write(FILE *outfile) const
+{
+    fprintf(outfile, "%016" PRIx64 " %016" PRIx64 " %016" PRIx64
+            " %016" PRIx64 "\n", s[0], s[1], s[2], s[3]);
+}
+
+
+//=============================================================================
+// stream of each thread
+
+static std::atomic<unsigned long> g_rand_seed(1);
+static std::atomic<int> g_nthread_streams(0);
+static thread_local RandStream *g_rand_stream = NULL;
+
+
+// Returns the n-th default thread stream of 'seed'.  These streams start
+// 2^192 draws apart, past every numbered stream of the seed.
+static RandStream default_thread_stream(unsigned long seed, int n)
+{
+    RandStream stream(seed);
+    for (int i=0; i<=n; i++)
+        stream.long_jump();
+    return stream;
+}
+
+
+static RandStream &default_rand_stream()
+{
+    // threads get default streams in the order they start drawing
+    static thread_local RandStream stream(
+        default_thread_stream(g_rand_seed, g_nthread_streams++));
+    return stream;
+}
+
+
+RandStream &get_rand_stream()
+{
+    if (g_rand_stream)
+        return *g_rand_stream;
+    return default_rand_stream();
+}
+
+
+void set_rand_stream(RandStream *stream)
+{
+    g_rand_stream = stream;
+}
+
+
+void seed_rand(unsigned long seed)
+{
+    g_rand_seed = seed;
+    get_rand_stream().set_seed(seed);
+}
+
+
+//=============================================================================
+// C interface
+extern "C" {
+
+void seedRand(int seed)
+{
+    seed_rand(seed);
+}
+
+} // extern "C"
+
+
+} // namespace argweaver
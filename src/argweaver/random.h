@@ -0,0 +1,116 @@
+//=============================================================================
+// random number streams
+
+#ifndef ARGWEAVER_RANDOM_H
+#define ARGWEAVER_RANDOM_H
+
+// c/c++ includes
+#include <stdint.h>
+#include <stdio.h>
+
+
+namespace argweaver {
+
+
+// A stream of pseudo-random numbers (xoshiro256**).
+//
+// Streams created with the same seed and different stream numbers are
+// non-overlapping subsequences of one generator (each is 2^128 draws
+// apart), so independent chains or threads can each be given their own
+// reproducible stream.  Threads that are not given a stream draw from
+// streams 2^192 draws apart (see long_jump()), which numbered streams
+// never reach.
+class RandStream
+{
+public:
+    RandStream(unsigned long seed=1, int stream=0)
+    {
+        set_seed(seed, stream);
+    }
+
+    // Restarts the stream with 'seed' and skips ahead to stream number
+    // 'stream'
+    void set_seed(unsigned long seed, int stream=0);
+
+    // Skips ahead by 2^128 draws
+    void jump();
+
+    // Skips ahead by 2^192 draws
+    void long_jump();
+
+    // Returns 64 random bits
+    inline uint64_t next()
+    {
+        const uint64_t result = rotl(s[1] * 5, 7) * 9;
+        const uint64_t t = s[1] << 17;
+        s[2] ^= s[0];
+        s[3] ^= s[1];
+        s[1] ^= s[2];
+        s[0] ^= s[3];
+        s[2] ^= t;
+        s[3] = rotl(s[3], 45);
+        return result;
+    }
+
+    // Returns a uniform draw from the open interval (0, 1)
+    inline double uniform()
+    {
+        return ((next() >> 11) + 0.5) * (1.0 / 9007199254740992.0);
+    }
+
+    // Returns a uniform integer in [0, max)
+    inline int uniform_int(int max)
+    {
+        const int i = int(uniform() * max);
+        return (i == max) ? max - 1 : i;
+    }
+
+    // Reads and writes the state of the stream as one line of text
+    bool read(FILE *infile);
+    void write(FILE *outfile) const;
+
+    bool operator==(const RandStream &other) const
+    {
+        return s[0] == other.s[0] && s[1] == other.s[1] &&
+            s[2] == other.s[2] && s[3] == other.s[3];
+    }
+
+protected:
+    static inline uint64_t rotl(const uint64_t x, int k)
+    {
+        return (x << k) | (x >> (64 - k));
+    }
+
+    uint64_t s[4];
+};
+
+
+// The stream used by frand(), irand() and the other random functions in
+// the calling thread.  Unless a stream has been set with set_rand_stream(),
+// each thread uses its own stream derived from the last seed_rand() seed.
+// These default streams are numbered in the order threads first draw, so
+// worker threads whose draws must be reproducible should be given a
+// numbered stream with set_rand_stream().
+RandStream &get_rand_stream();
+
+// Makes 'stream' the stream of the calling thread.  NULL restores the
+// default stream of the thread.
+void set_rand_stream(RandStream *stream);
+
+// Seeds the stream of the calling thread.  Its default stream becomes
+// stream 0 of 'seed'.
+void seed_rand(unsigned long seed);
+
+
+//=============================================================================
+// C interface
+extern "C" {
+
+void seedRand(int seed);
+
+} // extern "C"
+
+
+} // namespace argweaver
+
+#endif // ARGWEAVER_RANDOM_H
@@ -3,6 +3,8 @@
 //
 
 // c++ includes
+#include <atomic>
+#include <thread>
 #include <vector>
 
 // arghmm includes
@@ -159,9 +161,9 @@ bool resample_arg_mcmc(const ArgModel *model, Sequences *sequences,
     const int maxtime = model->get_removed_root_time();
     int *removal_path = new int [trees->get_num_trees()];
 
-    // save a copy of the local trees
-    LocalTrees trees2;
-    trees2.copy(*trees);
+    // record edits so that the proposal can be rejected
+    LocalTreesUndo undo;
+    undo.begin(trees);
 
     // ramdomly choose a removal path
     double npaths = sample_arg_removal_path_uniform(trees, removal_path);
@@ -172,8 +174,10 @@ bool resample_arg_mcmc(const ArgModel *model, Sequences *sequences,
     // perform reject if needed
     double accept_prob = exp(npaths - npaths2);
     bool accept = (frand() < accept_prob);
-    if (!accept)
-        trees->copy(trees2);
+    if (accept)
+        undo.commit();
+    else
+        undo.revert();
 
     // logging
     printLog(LOG_LOW, "accept_prob = exp(%lf - %lf) = %f, accept = %d\n",
@@ -472,7 +476,7 @@ int resample_arg_by_time_and_hap(
     LocalTrees *trees, int time_interval, int hap)
 {
     const int maxtime = model->get_removed_root_time();
-    static int count=0;
+    static thread_local int count=0;
     const bool open_ended=true;
     LocalTrees orig_trees;
     decLogLevel();
@@ -517,6 +521,8 @@ int resample_arg_by_time_and_hap(
                 stub_mapping = new int[trees2->nnodes];
                 for (int j=0; j < trees2->nnodes; j++)
                     stub_mapping[j] = trees2->back().mapping[j];
+                trees2->truncate_index(trees2->end_coord);
+                trees2->back().clear();
                 trees2->trees.pop_back();
             }
             assert(trees2->trees.back().blocklen == 1);
@@ -621,31 +627,37 @@ int resample_arg_by_time_and_hap(
 }
 
 
-// resample an ARG only for a given region
-// all branches are possible to resample
-// open_ended -- If true and region touches start or end of local trees do not
-//               conditioned on state.
-double resample_arg_region(
-    const ArgModel *model, Sequences *sequences,
-    LocalTrees *trees, int region_start, int region_end, int niters,
-    bool open_ended, double heat)
+//=============================================================================
+// region resampling
+
+
+// worker threads resampling windows in resample_arg_regions()
+static int g_window_threads = 0;
+
+
+void set_window_threads(int nthreads)
 {
-    const int maxtime = model->get_removed_root_time();
-    static int count=0;
+    g_window_threads = nthreads;
+}
 
-    // special case: zero length region
-    if (region_start == region_end)
-        return 1.0;
 
-    // assert region is within trees
-    assert(region_start >= trees->start_coord);
-    assert(region_end <= trees->end_coord);
-    assert(region_start < region_end);
+int get_window_threads()
+{
+    return g_window_threads;
+}
 
-    // partion trees into three segments
-    LocalTrees *trees2 = partition_local_trees(trees, region_start);
-    LocalTrees *trees3 = partition_local_trees(trees2, region_end);
-    assert(trees2->length() == region_end - region_start);
+
+// resample the trees of one region with 'niters' MCMC iterations
+// open_start/open_end -- If true, do not condition on the start/end state.
+// Returns the number of accepted proposals.
+static int resample_arg_region_trees(
+    const ArgModel *model, const Sequences *sequences, LocalTrees *trees2,
+    int niters, bool open_start, bool open_end, double heat)
+{
+    const int maxtime = model->get_removed_root_time();
+    static thread_local int count=0;
+    const int region_start = trees2->start_coord;
+    const int region_end = trees2->end_coord;
 
     // TODO: refactor
     // extend stub (zero length block) if it happens to exist
@@ -658,14 +670,14 @@ double resample_arg_region(
 
     // perform several iterations of resampling
     int accepts = 0;
+    LocalTreesUndo undo;
     for (int i=0; i<niters; i++) {
         count++;
         printLog(LOG_LOW, "region sample: iter=%d, region=(%d, %d)\n",
                  i, region_start, region_end);
 
-        // save a copy of the local trees
-        LocalTrees old_trees2;
-        old_trees2.copy(*trees2);
+        // record edits so that the proposal can be rejected
+        undo.begin(trees2);
 
         // get starting and ending trees
         LocalTree start_tree(*trees2->front().tree);
@@ -688,12 +700,11 @@ double resample_arg_region(
             &end_tree, end_tree_partial, maxtime);
 
         // set start/end state to null if open ended is requested
-        if (open_ended) {
-            if (region_start == trees->start_coord)
-                start_state.set_null();
-            if (region_end == trees3->end_coord)
-                end_state.set_null();
-        }
+        if (open_start)
+            start_state.set_null();
+        if (open_end)
+            end_state.set_null();
+
         // sample new ARG conditional on start and end states
         decLogLevel();
         cond_sample_arg_thread_internal(model, sequences, trees2,
@@ -708,8 +719,9 @@ double resample_arg_region(
         bool accept = (frand() < accept_prob);
 
         if (!accept) {
-            trees2->copy(old_trees2);
+            undo.revert();
         } else {
+            undo.commit();
             accepts++;
         }
 
@@ -726,6 +738,38 @@ double resample_arg_region(
         trees2->end_coord--;
     }
 
+    return accepts;
+}
+
+
+// resample an ARG only for a given region
+// all branches are possible to resample
+// open_ended -- If true and region touches start or end of local trees do not
+//               conditioned on state.
+double resample_arg_region(
+    const ArgModel *model, Sequences *sequences,
+    LocalTrees *trees, int region_start, int region_end, int niters,
+    bool open_ended, double heat)
+{
+    // special case: zero length region
+    if (region_start == region_end)
+        return 1.0;
+
+    // assert region is within trees
+    assert(region_start >= trees->start_coord);
+    assert(region_end <= trees->end_coord);
+    assert(region_start < region_end);
+
+    // partion trees into three segments
+    LocalTrees *trees2 = partition_local_trees(trees, region_start);
+    LocalTrees *trees3 = partition_local_trees(trees2, region_end);
+    assert(trees2->length() == region_end - region_start);
+
+    int accepts = resample_arg_region_trees(
+        model, sequences, trees2, niters,
+        open_ended && region_start == trees->start_coord,
+        open_ended && region_end == trees3->end_coord, heat);
+
     // rejoin trees
     append_local_trees(trees, trees2, true, model->pop_tree);
     append_local_trees(trees, trees3, true, model->pop_tree);
@@ -738,6 +782,81 @@ double resample_arg_region(
 }
 
 
+// a window of resample_arg_regions()
+struct RegionWindow
+{
+    int start;
+    int end;
+    uint64_t seed;       // seed of the random stream of the window
+    LocalTrees *trees;   // trees of the window while it is resampled
+    LocalTrees *after;   // trees between this window and the next
+    int accepts;
+};
+
+
+// resample windows[next++] until all windows are done
+static void resample_arg_windows_worker(
+    const ArgModel *model, const Sequences *sequences,
+    vector<RegionWindow*> *windows, atomic<int> *next,
+    int seqstart, int seqend, int niters, double heat)
+{
+    RandStream *caller_stream = &get_rand_stream();
+    for (int i=(*next)++; i<int(windows->size()); i=(*next)++) {
+        RegionWindow *window = (*windows)[i];
+        RandStream stream(window->seed);
+        set_rand_stream(&stream);
+        window->accepts = resample_arg_region_trees(
+            model, sequences, window->trees, niters,
+            window->start == seqstart, window->end == seqend, heat);
+    }
+    set_rand_stream(caller_stream);
+}
+
+
+// resample every other window concurrently, 'phase' gives the first window
+static void resample_arg_windows(
+    const ArgModel *model, const Sequences *sequences,
+    LocalTrees *trees, vector<RegionWindow> &windows, int phase,
+    int niters, double heat)
+{
+    const int seqstart = trees->start_coord;
+    const int seqend = trees->end_coord;
+
+    // windows two apart do not overlap, so they can be cut out of the
+    // trees and resampled independently given their boundary trees
+    vector<RegionWindow*> phase_windows;
+    LocalTrees *rest = trees;
+    for (unsigned int i=phase; i<windows.size(); i+=2) {
+        RegionWindow *window = &windows[i];
+        window->seed = get_rand_stream().next();
+        window->trees = partition_local_trees(rest, window->start);
+        window->after = partition_local_trees(window->trees, window->end);
+        assert(window->trees->length() == window->end - window->start);
+        phase_windows.push_back(window);
+        rest = window->after;
+    }
+
+    const int nthreads = min(g_window_threads, int(phase_windows.size()));
+    atomic<int> next(0);
+    vector<thread> threads;
+    for (int i=1; i<nthreads; i++)
+        threads.push_back(thread(resample_arg_windows_worker, model,
+                                 sequences, &phase_windows, &next,
+                                 seqstart, seqend, niters, heat));
+    resample_arg_windows_worker(model, sequences, &phase_windows, &next,
+                                seqstart, seqend, niters, heat);
+    for (unsigned int i=0; i<threads.size(); i++)
+        threads[i].join();
+
+    // rejoin trees
+    for (unsigned int i=0; i<phase_windows.size(); i++) {
+        RegionWindow *window = phase_windows[i];
+        append_local_trees(trees, window->trees, true, model->pop_tree);
+        append_local_trees(trees, window->after, true, model->pop_tree);
+        delete window->trees;
+        delete window->after;
+    }
+}
 
 
 // resample an ARG a region at a time in a sliding window
@@ -750,14 +869,42 @@ double resample_arg_regions(
     int nwindows = 0;
     int currwindow = irand(window - window/4, window + window/4);
     int currstep = (int)currwindow/2+1;
-    for (int start=trees->start_coord;
-         start == trees->start_coord || start+currwindow/2 <trees->end_coord;
-         start+=currstep)
-    {
-        nwindows++;
-        int end = min(start + currwindow, trees->end_coord);
-        accept_rate += resample_arg_region(
-             model, sequences, trees, start, end, niters, true, heat);
+
+    if (g_window_threads > 1) {
+        // windows two steps apart are disjoint; resample even and then
+        // odd windows, each set concurrently
+        vector<RegionWindow> windows;
+        for (int start=trees->start_coord;
+             start == trees->start_coord || start+currwindow/2 <trees->end_coord;
+             start+=currstep)
+        {
+            nwindows++;
+            int end = min(start + currwindow, trees->end_coord);
+            if (start == end) {
+                // zero length region
+                accept_rate += 1.0;
+                continue;
+            }
+            RegionWindow region = {start, end, 0, NULL, NULL, 0};
+            windows.push_back(region);
+        }
+
+        for (int phase=0; phase<2; phase++)
+            resample_arg_windows(model, sequences, trees, windows, phase,
+                                 niters, heat);
+        for (unsigned int i=0; i<windows.size(); i++)
+            accept_rate += windows[i].accepts / double(niters);
+        assert_trees(trees, model->pop_tree);
+    } else {
+        for (int start=trees->start_coord;
+             start == trees->start_coord || start+currwindow/2 <trees->end_coord;
+             start+=currstep)
+        {
+            nwindows++;
+            int end = min(start + currwindow, trees->end_coord);
+            accept_rate += resample_arg_region(
+                 model, sequences, trees, start, end, niters, true, heat);
+        }
     }
     incLogLevel();
 
@@ -793,6 +940,7 @@ void resample_migrates(ArgModel *model,
                                                      curr_self_rate - diff);
         model->pop_tree->update_population_probs();
     }
+    clear_time_trans_cache();
 }
 
 /*
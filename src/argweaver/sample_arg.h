@@ -74,6 +74,14 @@ double resample_arg_regions(
     LocalTrees *trees, int window, int niters=1,
     double heat=1.0);
 
+// Number of threads resampling windows in resample_arg_regions().  With
+// more than one thread, the sweep resamples every other window and then
+// the windows in between, each set concurrently and each window with its
+// own random stream.  Results then depend on the seed but not on the
+// number of threads.  0 or 1 keeps the sequential sliding window.
+void set_window_threads(int nthreads);
+int get_window_threads();
+
 int resample_arg_by_time_and_hap(
     const ArgModel *model, Sequences *sequences,
     LocalTrees *trees, int time_interval, int hap);
@@ -1,11 +1,14 @@
 // c++ includes
+#include <atomic>
 #include <list>
+#include <map>
 #include <vector>
 #include <string.h>
 
 // arghmm includes
 #include "common.h"
 #include "emit.h"
+#include "forward_kernel.h"
 #include "hmm.h"
 #include "local_tree.h"
 #include "logging.h"
@@ -26,6 +29,410 @@ namespace argweaver {
 using namespace std;
 
 
+//=============================================================================
+// Forward tables
+
+
+// memory budget for thread sampling forward tables (megabytes)
+static double g_forward_memory_budget = 0.0;
+
+// store thread sampling forward tables in single precision
+static bool g_forward_single_precision = false;
+
+// worker threads computing HMM matrices ahead of the forward algorithm
+static int g_matrix_threads = 0;
+
+
+void set_forward_memory_budget(double mbytes)
+{
+    g_forward_memory_budget = mbytes;
+}
+
+
+double get_forward_memory_budget()
+{
+    return g_forward_memory_budget;
+}
+
+
+void set_forward_single_precision(bool single)
+{
+    g_forward_single_precision = single;
+}
+
+
+bool get_forward_single_precision()
+{
+    return g_forward_single_precision;
+}
+
+
+void set_matrix_threads(int nthreads)
+{
+    g_matrix_threads = nthreads;
+}
+
+
+int get_matrix_threads()
+{
+    return g_matrix_threads;
+}
+
+
+// Returns the number of entries per checkpoint segment of a forward table,
+// or 0 if the full table fits in the memory budget
+static size_t get_forward_segment_size(int seqlen, int nstates)
+{
+    const double budget = g_forward_memory_budget;
+    nstates = max(nstates, 1);
+
+    if (budget == 0.0)
+        return 0;
+    if (budget < 0.0)
+        return size_t(ceil(sqrt(double(seqlen)))) * nstates;
+
+    const double bytes = budget * 1048576.0;
+    if (double(seqlen) * nstates * sizeof(double) <= bytes)
+        return 0;
+
+    // split budget between the stored segment and the checkpoints
+    return max(size_t(bytes / sizeof(double) / 2), size_t(nstates));
+}
+
+
+// Returns a new forward table for threading through trees
+//   checkpoint: whether the table may recompute columns from checkpoints
+static ArgHmmForwardTable *new_thread_forward_table(
+    const LocalTrees *trees, const ArgModel *model,
+    ArgHmmMatrixIter *matrix_iter, int nstates, bool internal,
+    bool checkpoint)
+{
+    size_t segment_size = get_forward_segment_size(trees->length(), nstates);
+    if (checkpoint && segment_size > 0) {
+        ArgHmmCheckpointForwardTable *forward =
+            new ArgHmmCheckpointForwardTable(
+                trees->start_coord, trees->length(), segment_size);
+        forward->set_recompute(trees, model, matrix_iter, internal);
+        return forward;
+    }
+
+    if (g_forward_single_precision)
+        return new ArgHmmFloatForwardTable(trees->start_coord,
+                                           trees->length());
+
+    return new ArgHmmForwardTable(trees->start_coord, trees->length());
+}
+
+
+void ArgHmmCheckpointForwardTable::new_block(int start, int end,
+                                             int nstates)
+{
+    nstates = max(nstates, 1);
+    size_t size = size_t(end - start) * nstates;
+
+    if (recomputing) {
+        // restore first column of segment from its checkpoint
+        ArgHmmForwardTable::new_block(start, end, nstates);
+        const Segment &segment = segments[loaded];
+        if (start == segment.start)
+            std::copy(segment.checkpoint.begin(), segment.checkpoint.end(),
+                      fw[start - start_coord]);
+        return;
+    }
+
+    if (segments.empty() ||
+        (segment_used > 0 && segment_used + size > segment_size))
+        start_segment(start, nstates);
+
+    ArgHmmForwardTable::new_block(start, end, nstates);
+    segments.back().end = end;
+    segment_used += size;
+    full_size += size;
+    peak_size = max(peak_size, segment_used);
+    last_nstates = nstates;
+}
+
+
+// finish the current segment and start a new one at position start
+void ArgHmmCheckpointForwardTable::start_segment(int start, int nstates)
+{
+    if (!segments.empty()) {
+        // keep first column of finished segment as its checkpoint
+        Segment &last = segments.back();
+        const double *col = fw[last.start - start_coord];
+        last.checkpoint.assign(col, col + last.nstates);
+
+        // keep last column, which the next block still needs
+        col = fw[start - 1 - start_coord];
+        boundary.assign(col, col + last_nstates);
+
+        ArgHmmForwardTable::delete_blocks();
+        fw[start - 1 - start_coord] = &boundary[0];
+    }
+
+    segments.push_back(Segment(start, nstates));
+    loaded = segments.size() - 1;
+    segment_used = 0;
+}
+
+
+void ArgHmmCheckpointForwardTable::load_columns(int start, int end)
+{
+    // find segment containing start
+    int low = 0, high = segments.size() - 1;
+    while (low < high) {
+        int mid = (low + high + 1) / 2;
+        if (segments[mid].start <= start)
+            low = mid;
+        else
+            high = mid - 1;
+    }
+    if (low == loaded)
+        return;
+
+    // the last segment gets its checkpoint when it is first unloaded
+    if (loaded != -1 && segments[loaded].checkpoint.empty()) {
+        Segment &current = segments[loaded];
+        const double *col = fw[current.start - start_coord];
+        current.checkpoint.assign(col, col + current.nstates);
+    }
+
+    // recompute segment from its checkpoint
+    const Segment &segment = segments[low];
+    assert(end <= segment.end);
+    ArgHmmForwardTable::delete_blocks();
+    loaded = low;
+    recomputing = true;
+    arghmm_forward_blocks(trees, model, matrix_iter, this, NULL, false,
+                          internal, false, segment.start, segment.end);
+    recomputing = false;
+    recomputed += segment.end - segment.start;
+}
+
+
+void ArgHmmCheckpointForwardTable::log_stats() const
+{
+    size_t checkpoint_size = boundary.size();
+    for (unsigned int i=0; i<segments.size(); i++)
+        checkpoint_size += segments[i].checkpoint.size();
+    size_t stored_size = peak_size + checkpoint_size;
+    const double mb = sizeof(double) / 1048576.0;
+
+    printLog(LOG_LOW, "forward checkpoints: %d segments, "
+             "%.1f MB stored, %.1f MB saved, "
+             "%d columns recomputed (%.1f%%)\n",
+             int(segments.size()), stored_size * mb,
+             (double(full_size) - double(stored_size)) * mb,
+             int(recomputed), 100.0 * recomputed / max(seqlen, 1));
+}
+
+
+
+void ArgHmmFloatForwardTable::new_block(int start, int end, int nstates)
+{
+    nstates = max(nstates, 1);
+
+    // store previous block in single precision
+    if (loaded != -1)
+        store_block(loaded);
+
+    float_blocks.push_back(FloatBlock(start, end, nstates));
+    ArgHmmForwardTable::new_block(start, end, nstates);
+    loaded = float_blocks.size() - 1;
+}
+
+
+// convert block from double to single precision
+void ArgHmmFloatForwardTable::store_block(int index)
+{
+    FloatBlock &block = float_blocks[index];
+    const int nstates = block.nstates;
+
+    if (block.data.size() == 0) {
+        block.data.resize(size_t(block.end - block.start) * nstates);
+        for (int i=block.start; i<block.end; i++) {
+            const double *col = fw[i - start_coord];
+            float *fcol = &block.data[size_t(i - block.start) * nstates];
+            double top = max_array(col, nstates);
+            if (!(top > 0.0))
+                top = 1.0;
+            log_scales[i - start_coord] = log(top);
+            for (int k=0; k<nstates; k++)
+                fcol[k] = float(col[k] / top);
+        }
+    }
+
+    // keep last column, which the next block still needs
+    const double *col = fw[block.end - 1 - start_coord];
+    boundary.assign(col, col + nstates);
+    ArgHmmForwardTable::delete_blocks();
+    fw[block.end - 1 - start_coord] = &boundary[0];
+}
+
+
+// convert block from single to double precision
+void ArgHmmFloatForwardTable::expand_block(int index)
+{
+    const FloatBlock &block = float_blocks[index];
+    const int nstates = block.nstates;
+
+    ArgHmmForwardTable::delete_blocks();
+    ArgHmmForwardTable::new_block(block.start, block.end, nstates);
+    for (int i=block.start; i<block.end; i++) {
+        double *col = fw[i - start_coord];
+        const float *fcol = &block.data[size_t(i - block.start) * nstates];
+        const double scale = exp(log_scales[i - start_coord]);
+        for (int k=0; k<nstates; k++)
+            col[k] = fcol[k] * scale;
+    }
+    loaded = index;
+}
+
+
+void ArgHmmFloatForwardTable::load_columns(int start, int end)
+{
+    // find block containing start
+    int low = 0, high = float_blocks.size() - 1;
+    while (low < high) {
+        int mid = (low + high + 1) / 2;
+        if (float_blocks[mid].start <= start)
+            low = mid;
+        else
+            high = mid - 1;
+    }
+    if (low == loaded)
+        return;
+
+    assert(end <= float_blocks[low].end);
+    if (float_blocks[loaded].data.size() == 0)
+        store_block(loaded);
+    expand_block(low);
+}
+
+
+void ArgHmmFloatForwardTable::log_stats() const
+{
+    size_t size = 0;
+    for (unsigned int i=0; i<float_blocks.size(); i++)
+        size += size_t(float_blocks[i].end - float_blocks[i].start) *
+            float_blocks[i].nstates;
+    const double mb = 1.0 / 1048576.0;
+
+    printLog(LOG_LOW, "forward single precision: %.1f MB stored, "
+             "%.1f MB saved\n",
+             (size * sizeof(float) + log_scales.size() * sizeof(double)) * mb,
+             (double(size) * (sizeof(double) - sizeof(float)) -
+              log_scales.size() * sizeof(double)) * mb);
+}
+
+
+
+//=============================================================================
+// Time transition cache
+
+// The (time, path) group transition probabilities used by
+// arghmm_forward_block() depend on the local tree only through its lineage
+// counts, length and root age, so many blocks share them.  Tables are kept
+// for each distinct set of those summaries (together with the local rho,
+// minage and population sizes) and their entries are filled in on demand.
+class TimeTransCache
+{
+public:
+    TimeTransCache() :
+        size(0),
+        generation(0),
+        hits(0),
+        misses(0)
+    {}
+
+    // Returns the table of 'matrix'.  Entries are indexed by
+    // ((b * npaths + path_b) * ntimes + a) * npaths + path_a and are
+    // NAN until computed.
+    double *get_table(const ArgModel *model, const TransMatrix *matrix,
+                      const LineageCounts &lineages)
+    {
+        const int ntimes = model->ntimes;
+        const int npaths = model->num_pop_paths();
+        const int npops = model->num_pops();
+
+        // drop tables cleared by clear_time_trans_cache() in any thread
+        if (generation != g_generation) {
+            clear();
+            generation = g_generation;
+        }
+
+        key.clear();
+        key.push_back(ntimes);
+        key.push_back(npaths);
+        key.push_back(matrix->smc_prime);
+        key.push_back(matrix->internal);
+        key.push_back(matrix->minage);
+        key.push_back(matrix->rho);
+        key.push_back(matrix->treelen);
+        key.push_back(matrix->root_age_index);
+        key.insert(key.end(), lineages.nbranches, lineages.nbranches + ntimes);
+        key.insert(key.end(), lineages.nrecombs, lineages.nrecombs + ntimes);
+        for (int i=0; i<npops; i++) {
+            key.insert(key.end(), lineages.ncoals_pop[i],
+                       lineages.ncoals_pop[i] + ntimes);
+            key.insert(key.end(), lineages.nbranches_pop[i],
+                       lineages.nbranches_pop[i] + 2*ntimes);
+            key.insert(key.end(), model->popsizes[i],
+                       model->popsizes[i] + 2*ntimes-1);
+        }
+
+        map<vector<double>, vector<double> >::iterator it = tables.find(key);
+        if (it != tables.end()) {
+            hits++;
+            return &it->second[0];
+        }
+
+        misses++;
+        const size_t table_size = size_t(ntimes) * ntimes * npaths * npaths;
+        if (size + table_size > MAX_SIZE)
+            clear();
+        size += table_size;
+        vector<double> &table = tables[key];
+        table.assign(table_size, NAN);
+        return &table[0];
+    }
+
+    void clear()
+    {
+        tables.clear();
+        size = 0;
+    }
+
+    // maximum number of cached entries
+    static const size_t MAX_SIZE = 1 << 23;
+
+    // incremented whenever the caches of all threads become invalid
+    static atomic<int> g_generation;
+
+    map<vector<double>, vector<double> > tables;
+    vector<double> key;
+    size_t size;
+    int generation;
+    long hits;
+    long misses;
+};
+
+atomic<int> TimeTransCache::g_generation(0);
+
+// each sampling thread (e.g. each (MC)^3 chain) has its own cache
+static thread_local TimeTransCache g_time_trans_cache;
+
+
+void clear_time_trans_cache()
+{
+    printLog(LOG_HIGH, "time transition cache: %ld hits, %ld misses\n",
+             g_time_trans_cache.hits, g_time_trans_cache.misses);
+    g_time_trans_cache.clear();
+    TimeTransCache::g_generation++;
+}
+
+
+
 //=============================================================================
 // Forward algorithm for thread path
 
@@ -114,20 +521,33 @@ void arghmm_forward_block(const ArgModel *model,
             ages2[i] = (i == tree->root) ? maxtime : nodes[nodes[i].parent].age;
     }
 
-    // compute ntimes*ntimes and ntime*nstates temp matrices
-    double tmatrix[ntimes-1][max_numpath][ntimes-1][max_numpath];
+    // struct-of-arrays state data for the column kernel, reused by the
+    // blocks computed on this thread so its columns stay allocated
+    static thread_local ForwardBlockData data;
+    data.resize(nstates, ntimes, max_numpath);
+    for (int k=0; k<nstates; k++)
+        data.group[k] = data.group_index(states[k].time, path_map[k]);
+
+    // compute (time, path) group transition matrix
+    double *time_trans = g_time_trans_cache.get_table(model, matrix,
+                                                      lineages);
     for (int b=0; b<ntimes-1; b++) {
         for (int pb=0; pb < numpath_per_time[b]; pb++) {
+            const int path_b = paths_per_time[b][pb];
+            double *row = &data.tmatrix[data.group_index(b, pb) * data.ldt];
+            double *cached = &time_trans[(b * numpath + path_b) * ntimes
+                                         * numpath];
             for (int a=0; a<ntimes-1; a++) {
                 for (int pa=0; pa < numpath_per_time[a]; pa++) {
-                    tmatrix[b][pb][a][pa] =
-                        matrix->get_time(a, b, 0,
-                                         paths_per_time[a][pa],
-                                         paths_per_time[b][pb],
-                                         -1, minage, false);
-                    //                    printf("tmatrix %i %i = %e\n", a, b, tmatrix[pa][pb][a][b]);
-                    assert(!isnan(tmatrix[b][pb][a][pa]));
-                    assert(!isinf(tmatrix[b][pb][a][pa]));
+                    const int path_a = paths_per_time[a][pa];
+                    double &prob = cached[a * numpath + path_a];
+                    if (isnan(prob)) {
+                        prob = matrix->get_time(a, b, 0, path_a, path_b,
+                                                -1, minage, false);
+                        assert(!isnan(prob));
+                        assert(!isinf(prob));
+                    }
+                    row[data.group_index(a, pa)] = prob;
                 }
             }
         }
@@ -148,9 +568,6 @@ void arghmm_forward_block(const ArgModel *model,
             tmatrix2[k][a] =
                 matrix->get_time(a, b, c, p, p, pc, minage, true, k) -
                 matrix->get_time(a, b, 0, p, p, -1, minage, false);
-            /*            printf("tmatrix2\t%i\t%i\t%e\t%e\t%e\n", a, k, tmatrix2[k][a],
-                   matrix->get_time(a, b, c, p, p, pc, minage, true, k),
-                   matrix->get_time(a, b, 0, p, p, -1, minage, false));*/
             if (isnan(tmatrix2[k][a]) || isinf(tmatrix2[k][a]) || tmatrix2[k][a] < 0) {
                 printf("a=%i k=%i b=%i node2=%i c=%i p=%i pc=%i\n",
                        a, k, b, node2, c, p, pc);
@@ -177,11 +594,8 @@ void arghmm_forward_block(const ArgModel *model,
         }
     }
 
+    // record the same branch transitions into each state
     NodeStateLookup state_lookup(states, minage, model->pop_tree);
-    int max_idx = ntimes*nstates + max_numpath*nstates;
-    int nextState[max_idx];
-    int idx=0;
-    int age1_state[nstates];
     for (int k=0; k<nstates; k++) {
         const int b = states[k].time;
         const int node2 = states[k].node;
@@ -194,99 +608,32 @@ void arghmm_forward_block(const ArgModel *model,
             age1++;
             j = state_lookup.lookup_idx(node2, age1, path2);
         }
-        age1_state[k] = age1;
+        data.begin_row();
         for (int a=age1; a <= age2; a++, j++) {
             int j_state = state_lookup.lookup_by_idx(j);
             if (j_state >= 0 &&
                 (model->pop_tree == NULL || a >= b ||
                  model->paths_equal(path1,
-                                    path2, a, b))) {
-                nextState[idx++]=j_state;
-            } else nextState[idx++] = -1;
+                                    path2, a, b)))
+                data.add_trans(j_state, tmatrix2[k][a]);
         }
         // this setion accounts for self-recombinations that change paths
         // (same node, same time, different path)
         if (max_numpath > 1) {
             for (int pa=0; pa < numpath_per_time[b]; pa++) {
                 int path_a = paths_per_time[b][pa];
-                if (!model->paths_equal(path_a, path2, minage, b))
-                    nextState[idx++] = state_lookup.lookup(node2, b, path_a);
-                else nextState[idx++] = -1;
-            }
-        }
-    }
-    assert(idx <= max_idx);
-
-
-    double tmatrix_fgroups[max_numpath][ntimes];
-    double fgroups[max_numpath][ntimes];
-    for (int i=1; i<blocklen; i++) {
-        const double *col1 = fw[i-1];
-        double *col2 = fw[i];
-        const double *emit2 = emit[i];
-        idx = 0;
-
-        // precompute the fgroup sums
-        for (int p=0; p < max_numpath; p++)
-            fill(fgroups[p], fgroups[p]+ntimes, 0.0);
-        for (int j=0; j<nstates; j++) {
-            const int a = states[j].time;
-            fgroups[path_map[j]][a] += col1[j];
-            assert(!isinf(col1[j]));
-        }
-
-        // multiply tmatrix and fgroups together
-        for (int b=0; b<ntimes-1; b++) {
-            for (int pb=0; pb < numpath_per_time[b]; pb++) {
-                double sum = 0.0;
-                for (int a=0; a<ntimes-1; a++) {
-                    for (int pa=0; pa < numpath_per_time[a]; pa++) {
-                        sum += tmatrix[b][pb][a][pa] * fgroups[pa][a];
-                    }
+                if (!model->paths_equal(path_a, path2, minage, b)) {
+                    int j_state = state_lookup.lookup(node2, b, path_a);
+                    if (j_state >= 0)
+                        data.add_trans(j_state, tmatrix3[k][pa]);
                 }
-                tmatrix_fgroups[pb][b] = sum;
             }
         }
-
-        // fill in one column of forward table
-        double norm = 0.0;
-        for (int k=0; k<nstates; k++) {
-            const int b = states[k].time;
-            const int node2 = states[k].node;
-            const int age2 = ages2[node2];
-            double sum = tmatrix_fgroups[path_map[k]][b];
-
-            // same branch case
-            for (int a=age1_state[k]; a <= age2; a++) {
-                int j_state = nextState[idx++];
-                if (j_state >= 0 && col1[j_state] > 0) {
-                    sum += tmatrix2[k][a] * col1[j_state];
-                }
-            }
-            // this setion accounts for self-recombinations that change paths
-            // (same node, same time, different path)
-            if (max_numpath > 1) {
-                for (int pa=0; pa < numpath_per_time[b]; pa++) {
-                    int j_state = nextState[idx++];
-                    if (j_state >= 0 && col1[j_state] > 0) {
-                        sum += tmatrix3[k][pa] * col1[j_state];
-                    }
-                }
-            }
-            col2[k] = sum * emit2[k];
-            norm += col2[k];
-            if (isnan(col2[k]))
-                assert(false);
-        }
-        assert(norm > 0);
-        assert(!isnan(norm));
-        assert(!isinf(norm));
-
-        // normalize column for numerical stability
-        for (int k=0; k<nstates; k++)
-            col2[k] /= norm;
-
     }
+    data.end_rows();
+
+    // fill in rest of forward table
+    forward_block_columns(data, blocklen, emit, fw);
 }
 
 
@@ -419,11 +766,13 @@ void arghmm_forward_switch(const double *col1, double* col2,
 
 
 
-// Run forward algorithm for all blocks
-void arghmm_forward_alg(const LocalTrees *trees, const ArgModel *model,
-    const Sequences *sequences, ArgHmmMatrixIter *matrix_iter,
-    ArgHmmForwardTable *forward, PhaseProbs *phase_pr,
-    bool prior_given, bool internal, bool slow)
+// Run forward algorithm for the blocks overlapping [start, end)
+// NOTE: if start is not the first position of the ARG, the forward table
+// must provide the column at start when its block is allocated
+void arghmm_forward_blocks(const LocalTrees *trees, const ArgModel *model,
+    ArgHmmMatrixIter *matrix_iter, ArgHmmForwardTable *forward,
+    PhaseProbs *phase_pr, bool prior_given, bool internal, bool slow,
+    int start, int end)
 {
     LineageCounts lineages(model->ntimes, model->num_pops());
     States states;
@@ -440,7 +789,9 @@ void arghmm_forward_alg(const LocalTrees *trees, const ArgModel *model,
 #endif
 
     // forward algorithm over local trees
-    for (matrix_iter->begin(); matrix_iter->more(); matrix_iter->next()) {
+    for (matrix_iter->seek(start);
+         matrix_iter->more() && matrix_iter->get_block_start() < end;
+         matrix_iter->next()) {
         // get block information
     
 #ifdef DEBUG
@@ -476,6 +827,8 @@ void arghmm_forward_alg(const LocalTrees *trees, const ArgModel *model,
                 calc_state_priors(states, &lineages, &local_model,
                                   fw[pos], minage);
             }
+        } else if (pos == start) {
+            // first column was given by the forward table
         } else if (matrices.transmat_switch) {
             // perform one column of forward algorithm with transmat_switch
             arghmm_forward_switch(fw[pos-1], fw[pos],
@@ -516,6 +869,18 @@ void arghmm_forward_alg(const LocalTrees *trees, const ArgModel *model,
 }
 
 
+// Run forward algorithm for all blocks
+void arghmm_forward_alg(const LocalTrees *trees, const ArgModel *model,
+    const Sequences *sequences, ArgHmmMatrixIter *matrix_iter,
+    ArgHmmForwardTable *forward, PhaseProbs *phase_pr,
+    bool prior_given, bool internal, bool slow)
+{
+    arghmm_forward_blocks(trees, model, matrix_iter, forward, phase_pr,
+                          prior_given, internal, slow,
+                          trees->start_coord, trees->end_coord);
+}
+
+
 
 
 //=============================================================================
@@ -578,7 +943,8 @@ int sample_hmm_posterior_step(const TransMatrixSwitch *matrix,
 double stochastic_traceback(
     const LocalTrees *trees, const ArgModel *model,
     ArgHmmMatrixIter *matrix_iter,
-    double **fw, int *path, bool last_state_given, bool internal)
+    double **fw, int *path, bool last_state_given, bool internal,
+    ArgHmmForwardTable *forward)
 {
     States states;
     double lnl = 0.0;
@@ -592,6 +958,8 @@ double stochastic_traceback(
     if (!last_state_given) {
         ArgHmmMatrices &mat = matrix_iter->ref_matrices();
         const int nstates = max(mat.nstates2, 1);
+        if (forward)
+            forward->load_columns(pos - 1, pos);
         path[pos-1] = sample(fw[pos-1], nstates);
         lnl = fw[pos-1][path[pos-1]];
     }
@@ -603,11 +971,15 @@ double stochastic_traceback(
         mat.states_model.get_coal_states(tree, states);
         pos -= mat.blocklen;
 
+        if (forward)
+            forward->load_columns(pos, pos + mat.blocklen);
         lnl += sample_hmm_posterior(mat.blocklen, tree, states,
                                     mat.transmat, &fw[pos], &path[pos]);
 
         // fill in last col of next block
         if (pos > trees->start_coord) {
+            if (forward)
+                forward->load_columns(pos - 1, pos);
             if (mat.transmat_switch) {
                 // use switch matrix
                 int i = pos - 1;
@@ -637,7 +1009,6 @@ void sample_arg_thread(const ArgModel *model, Sequences *sequences,
                        LocalTrees *trees, int new_chrom)
 {
     // allocate temp variables
-    ArgHmmForwardTable forward(trees->start_coord, trees->length());
     int *thread_path_alloc = new int [trees->length()];
     int *thread_path = &thread_path_alloc[-trees->start_coord];
     int start_pop = sequences->get_pop(new_chrom);
@@ -652,26 +1023,42 @@ void sample_arg_thread(const ArgModel *model, Sequences *sequences,
       printf("treemap = %i %i\n", phase_pr.treemap1, phase_pr.treemap2);
 
     // build matrices
-    ArgHmmMatrixIter matrix_iter(model, sequences, trees, new_chrom);
+    ArgHmmMatrixPipeline matrix_iter(model, sequences, trees,
+                                     g_matrix_threads, new_chrom);
     matrix_iter.set_start_pop(start_pop);
 
+    // the backward passes reuse the forward pass transition matrices
+    // unless forward table memory is limited
+    ArgHmmMatrixList matrix_iter2(model, NULL, trees, new_chrom);
+    matrix_iter2.set_start_pop(start_pop);
+    if (g_forward_memory_budget == 0.0)
+        matrix_iter.keep_transitions(&matrix_iter2);
+
+    // allocate forward table
+    int nstates = get_num_coal_states(trees->front().tree, model->ntimes);
+    // phasing probabilities are computed during the forward algorithm and
+    // cannot be recomputed from checkpoints
+    ArgHmmForwardTable *forward = new_thread_forward_table(
+        trees, model, &matrix_iter, nstates, false, !model->unphased);
+
     // compute forward table
     Timer time;
-    arghmm_forward_alg(trees, model, sequences, &matrix_iter, &forward,
+    arghmm_forward_alg(trees, model, sequences, &matrix_iter, forward,
 		       model->unphased ? &phase_pr : NULL);
-    int nstates = get_num_coal_states(trees->front().tree, model->ntimes);
     printTimerLog(time, LOG_LOW,
                   "forward (%3d states, %6d blocks):",
                   nstates, trees->get_num_trees());
 
     // traceback
     time.start();
-    double **fw = forward.get_table();
-    ArgHmmMatrixIter matrix_iter2(model, NULL, trees, new_chrom);
-    matrix_iter2.set_start_pop(start_pop);
-    stochastic_traceback(trees, model, &matrix_iter2, fw, thread_path);
+    double **fw = forward->get_table();
+    stochastic_traceback(trees, model, &matrix_iter2, fw, thread_path,
+                         false, false, forward);
     printTimerLog(time, LOG_LOW,
                   "trace:                              ");
+    forward->log_stats();
+    delete forward;
+    matrix_iter.clear();
 
     time.start();
 
@@ -707,37 +1094,49 @@ void sample_arg_thread_internal(
     const bool internal = true;
 
     // allocate temp variables
-    ArgHmmForwardTable forward(trees->start_coord, trees->length());
     int *thread_path_alloc = new int [trees->length()];
     int *thread_path = &thread_path_alloc[-trees->start_coord];
 
     // build matrices
-    ArgHmmMatrixIter matrix_iter(model, sequences, trees);
+    ArgHmmMatrixPipeline matrix_iter(model, sequences, trees,
+                                     g_matrix_threads);
     matrix_iter.set_internal(internal, minage);
 
+    // the backward passes reuse the forward pass transition matrices
+    // unless forward table memory is limited
+    ArgHmmMatrixList matrix_iter2(model, NULL, trees);
+    matrix_iter2.set_internal(internal, minage);
+    if (g_forward_memory_budget == 0.0)
+        matrix_iter.keep_transitions(&matrix_iter2);
+
     if (phase_pr != NULL)
         printLog(LOG_HIGH, "treemap = %i %i\n",
                  phase_pr->treemap1, phase_pr->treemap2);
 
+    // allocate forward table
+    int nstates = get_num_coal_states_internal(
+           trees->front().tree, model->ntimes, minage);
+    ArgHmmForwardTable *forward = new_thread_forward_table(
+        trees, model, &matrix_iter, nstates, internal, phase_pr == NULL);
+
     // compute forward table
     Timer time;
-    arghmm_forward_alg(trees, model, sequences, &matrix_iter, &forward,
+    arghmm_forward_alg(trees, model, sequences, &matrix_iter, forward,
                        phase_pr, false, internal);
-    int nstates = get_num_coal_states_internal(
-           trees->front().tree, model->ntimes, minage);
     printTimerLog(time, LOG_LOW,
                   "forward (%3d states, %6d blocks):",
                   nstates, trees->get_num_trees());
 
     // traceback
     time.start();
-    double **fw = forward.get_table();
-    ArgHmmMatrixIter matrix_iter2(model, NULL, trees);
-    matrix_iter2.set_internal(internal, minage);
+    double **fw = forward->get_table();
     stochastic_traceback(trees, model, &matrix_iter2, fw, thread_path,
-                         false, internal);
+                         false, internal, forward);
     printTimerLog(time, LOG_LOW,
                   "trace:                              ");
+    forward->log_stats();
+    delete forward;
+    matrix_iter.clear();
 
     if (phase_pr != NULL)
         phase_pr->sample_phase(thread_path);
@@ -88,6 +88,13 @@ public:
         return ptr;
     }
 
+    // make sure columns [start, end) are stored in the table
+    // (all columns are always stored in this table)
+    virtual void load_columns(int start, int end) {}
+
+    // log memory usage of table variants
+    virtual void log_stats() const {}
+
     int start_coord;
     int seqlen;
 
@@ -124,9 +131,159 @@ public:
 };
 
 
+// Forward table that stores only one segment of columns at a time.
+//
+// Consecutive blocks are grouped into segments of at most 'segment_size'
+// entries (a single larger block forms its own segment).  Only the current
+// segment is stored during the forward algorithm, and the first column of
+// every finished segment is kept as a checkpoint.  load_columns()
+// recomputes a segment from its checkpoint with arghmm_forward_blocks(),
+// which stochastic_traceback() calls as it moves backwards.
+class ArgHmmCheckpointForwardTable : public ArgHmmForwardTable
+{
+public:
+    ArgHmmCheckpointForwardTable(int start_coord, int seqlen,
+                                 size_t segment_size) :
+        ArgHmmForwardTable(start_coord, seqlen),
+        segment_size(segment_size),
+        segment_used(0),
+        last_nstates(0),
+        loaded(-1),
+        recomputing(false),
+        full_size(0),
+        peak_size(0),
+        recomputed(0),
+        trees(NULL),
+        model(NULL),
+        matrix_iter(NULL),
+        internal(false)
+    {}
+
+    // set the matrices used for recomputing segments
+    void set_recompute(const LocalTrees *_trees, const ArgModel *_model,
+                       ArgHmmMatrixIter *_matrix_iter, bool _internal)
+    {
+        trees = _trees;
+        model = _model;
+        matrix_iter = _matrix_iter;
+        internal = _internal;
+    }
+
+    virtual void new_block(int start, int end, int nstates);
+    virtual void load_columns(int start, int end);
+
+    // log memory saved and columns recomputed
+    virtual void log_stats() const;
+
+protected:
+    class Segment
+    {
+    public:
+        Segment(int start, int nstates) :
+            start(start),
+            end(start),
+            nstates(nstates)
+        {}
+
+        int start;
+        int end;
+        int nstates;               // number of states in first column
+        vector<double> checkpoint; // first column of segment
+    };
+
+    void start_segment(int start, int nstates);
+
+    size_t segment_size;   // maximum entries stored per segment
+    size_t segment_used;   // entries stored for current segment
+    int last_nstates;      // number of states in last allocated block
+    int loaded;            // index of segment currently stored
+    bool recomputing;
+    vector<Segment> segments;
+    vector<double> boundary;  // last column of previous segment
+
+    // statistics
+    size_t full_size;      // entries in full forward table
+    size_t peak_size;      // maximum entries stored for one segment
+    size_t recomputed;     // number of recomputed columns
+
+    // recomputation
+    const LocalTrees *trees;
+    const ArgModel *model;
+    ArgHmmMatrixIter *matrix_iter;
+    bool internal;
+};
+
+
+// Forward table that stores columns in single precision.
+//
+// Each column is stored relative to its largest entry, whose log is kept
+// in double precision.  Only the most recent block is stored in double
+// precision during the forward algorithm, and load_columns() expands one
+// block at a time for stochastic_traceback().  Sampled paths follow the
+// same distribution as with the double precision table, up to the
+// rounding of each entry to float.
+class ArgHmmFloatForwardTable : public ArgHmmForwardTable
+{
+public:
+    ArgHmmFloatForwardTable(int start_coord, int seqlen) :
+        ArgHmmForwardTable(start_coord, seqlen),
+        log_scales(seqlen, 0.0),
+        loaded(-1)
+    {}
+
+    virtual void new_block(int start, int end, int nstates);
+    virtual void load_columns(int start, int end);
+
+    // log memory saved by single precision
+    virtual void log_stats() const;
+
+protected:
+    class FloatBlock
+    {
+    public:
+        FloatBlock(int start, int end, int nstates) :
+            start(start),
+            end(end),
+            nstates(nstates)
+        {}
+
+        int start;
+        int end;
+        int nstates;
+        vector<float> data;
+    };
+
+    void store_block(int index);
+    void expand_block(int index);
+
+    vector<FloatBlock> float_blocks;
+    vector<double> log_scales;  // log scale factor of each column
+    vector<double> boundary;    // last column of previous block
+    int loaded;                 // block stored in double precision
+};
+
+
 //=============================================================================
 // Forward algorithm for thread path
 
+void arghmm_forward_block(const ArgModel *model,
+                          const LocalTree *tree,
+                          const int blocklen, const States &states,
+                          const LineageCounts &lineages,
+                          const TransMatrix *matrix,
+                          const double* const *emit, double **fw);
+
+void arghmm_forward_block_slow(const LocalTree *tree, const int ntimes,
+                               const int blocklen, const States &states,
+                               const LineageCounts &lineages,
+                               const TransMatrix *matrix,
+                               const double* const *emit, double **fw);
+
+void arghmm_forward_blocks(const LocalTrees *trees, const ArgModel *model,
+    ArgHmmMatrixIter *matrix_iter, ArgHmmForwardTable *forward,
+    PhaseProbs *phase_pr, bool prior_given, bool internal, bool slow,
+    int start, int end);
+
 void arghmm_forward_alg(const LocalTrees *trees, const ArgModel *model,
     const Sequences *sequences, ArgHmmMatrixIter *matrix_iter,
     ArgHmmForwardTable *forward, PhaseProbs *phase_pr=NULL,
@@ -135,7 +292,29 @@ void arghmm_forward_alg(const LocalTrees *trees, const ArgModel *model,
 double stochastic_traceback(
     const LocalTrees *trees, const ArgModel *model,
     ArgHmmMatrixIter *matrix_iter,
-    double **fw, int *path, bool last_state_given=false, bool internal=false);
+    double **fw, int *path, bool last_state_given=false, bool internal=false,
+    ArgHmmForwardTable *forward=NULL);
+
+// Memory budget (in megabytes) for the forward table of thread sampling.
+// 0 stores the full table, a negative budget uses checkpoint segments of
+// sqrt(seqlen) columns.
+void set_forward_memory_budget(double mbytes);
+double get_forward_memory_budget();
+
+// Store forward tables of thread sampling in single precision
+// (ignored when a forward memory budget is set)
+void set_forward_single_precision(bool single);
+bool get_forward_single_precision();
+
+// Number of worker threads computing HMM matrices ahead of the forward
+// algorithm (0 computes them in the sampling thread)
+void set_matrix_threads(int nthreads);
+int get_matrix_threads();
+
+// Drop cached time transition probabilities.  Must be called whenever
+// the population model (population sizes or migration rates) changes.
+// Caches of other threads are dropped when they are next used.
+void clear_time_trans_cache();
 
 //=============================================================================
 // ARG thread sampling
@@ -1454,6 +1454,36 @@ void make_sites_from_sequences(const Sequences *sequences, Sites *sites)
 }
 
 
+// Copies the part of a Sites alignment within [start, end)
+void make_sites_region(const Sites *sites, int start, int end, Sites *region)
+{
+    const int nsites = sites->get_num_sites();
+    const bool have_ref = (int) sites->ref.size() == nsites;
+    const bool have_alt = (int) sites->alt.size() == nsites;
+    const bool have_base_probs = (int) sites->base_probs.size() == nsites;
+
+    region->clear();
+    region->chrom = sites->chrom;
+    region->start_coord = start;
+    region->end_coord = end;
+    region->names = sites->names;
+    region->pops = sites->pops;
+
+    const int first = lower_bound(sites->positions.begin(),
+                                  sites->positions.end(), start)
+        - sites->positions.begin();
+    for (int i=first; i<nsites && sites->positions[i] < end; i++) {
+        region->append(sites->positions[i], sites->cols[i], true);
+        if (have_ref)
+            region->ref.push_back(sites->ref[i]);
+        if (have_alt)
+            region->alt.push_back(sites->alt[i]);
+        if (have_base_probs)
+            region->base_probs.push_back(sites->base_probs[i]);
+    }
+}
+
+
 bool Sequences::get_non_singleton_snp(vector<bool> &nonsing) {
     if (seqs.size() == 0) return false;
     for (int i=0; i < seqlen; i++) {
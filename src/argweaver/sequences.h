@@ -182,11 +182,11 @@ class Sequences
 {
 public:
     explicit Sequences(int seqlen=0) :
-        seqlen(seqlen), owned(false)
+        version(0), seqlen(seqlen), owned(false)
     {}
 
     Sequences(char **_seqs, int nseqs, int seqlen) :
-        seqlen(seqlen), owned(false)
+        version(0), seqlen(seqlen), owned(false)
     {
         extend(_seqs, nseqs);
     }
@@ -194,7 +194,7 @@ public:
     // initialize from a subset of another Sequences alignment
     Sequences(const Sequences *sequences, int nseqs=-1, int _seqlen=-1,
               int offset=0) :
-        seqlen(_seqlen), owned(false)
+        version(0), seqlen(_seqlen), owned(false)
     {
         // use same nseqs and/or seqlen by default
         if (nseqs == -1)
@@ -375,6 +375,7 @@ public:
     }
 
     void switch_alleles(int coord, int seq1, int seq2) {
+      version++;
       char tmp = seqs[seq1][coord];
       seqs[seq1][coord] = seqs[seq2][coord];
       seqs[seq2][coord] = tmp;
@@ -406,6 +407,10 @@ public:
     vector <double> real_ages;
     vector<vector<BaseProbs> > base_probs;
 
+    // incremented whenever alleles are switched, so that cached scores of
+    // the sequences can be recognized as stale
+    unsigned int version;
+
 protected:
     int seqlen;
     bool owned;
@@ -734,6 +739,8 @@ bool read_vcfs(const vector<string> filenames, Sites* sites, const string region
 void make_sequences_from_sites(const Sites *sites, Sequences *sequencess,
                                char default_char='A');
 void make_sites_from_sequences(const Sequences *sequences, Sites *sites);
+void make_sites_region(const Sites *sites, int start, int end,
+                       Sites *region);
 
 void apply_mask_sequences(Sequences *sequences, const TrackNullValue &maskmap,
                           const char *ind=NULL);
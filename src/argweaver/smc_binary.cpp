@@ -0,0 +1,680 @@
+//=============================================================================
+// binary .smc format
+
+// c/c++ includes
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// arghmm includes
+#include "compress.h"
+#include "logging.h"
+#include "smc_binary.h"
+
+
+namespace argweaver {
+
+
+static inline int pad4(int len)
+{
+    return (len + 3) & ~3;
+}
+
+
+// Writes 'len' bytes followed by zeros up to the next multiple of 4 bytes
+static void write_padded(FILE *out, const char *buf, int len)
+{
+    static const char zeros[4] = {0, 0, 0, 0};
+    fwrite(buf, 1, len, out);
+    fwrite(zeros, 1, pad4(len) - len, out);
+}
+
+
+static inline SmcBinarySpr make_binary_spr(int pos, const Spr &spr,
+                                           const int *names)
+{
+    SmcBinarySpr rec;
+    rec.pos = pos;
+    rec.recomb_node = names[spr.recomb_node];
+    rec.recomb_time = spr.recomb_time;
+    rec.coal_node = names[spr.coal_node];
+    rec.coal_time = spr.coal_time;
+    rec.pop_path = spr.pop_path;
+    return rec;
+}
+
+
+static inline bool binary_nodes_equal(const SmcBinaryNode &a,
+                                      const SmcBinaryNode &b)
+{
+    return a.parent == b.parent &&
+        a.child[0] == b.child[0] && a.child[1] == b.child[1] &&
+        a.age == b.age && a.pop_path == b.pop_path;
+}
+
+
+void write_local_trees_binary(FILE *out, const LocalTrees *trees,
+                              const char *const *names,
+                              const double *times, int ntimes,
+                              bool pop_model,
+                              const vector<int> &self_recomb_pos,
+                              const vector<Spr> &self_recombs)
+{
+    const int nnodes = trees->nnodes;
+    const int nleaves = trees->get_num_leaves();
+
+    assert(self_recomb_pos.size() == self_recombs.size());
+
+    // collect names
+    string names_buf;
+    if (names) {
+        for (int i=0; i<nleaves; i++) {
+            names_buf += names[trees->seqids[i]];
+            names_buf += '\0';
+        }
+    }
+
+    // write header
+    SmcBinaryHeader header;
+    memcpy(header.magic, SMC_BINARY_MAGIC, sizeof(header.magic));
+    header.version = SMC_BINARY_VERSION;
+    header.byte_order = SMC_BINARY_BYTE_ORDER;
+    header.flags = pop_model ? SMC_BINARY_POP_PATHS : 0;
+    header.nnodes = nnodes;
+    header.nnames = names ? nleaves : 0;
+    header.ntimes = ntimes;
+    header.start_coord = trees->start_coord;
+    header.end_coord = trees->end_coord;
+    header.ntrees = trees->get_num_trees();
+    header.ninvisible = self_recombs.size();
+    header.chrom_len = trees->chrom.size();
+    header.names_len = names_buf.size();
+    fwrite(&header, sizeof(header), 1, out);
+    fwrite(times, sizeof(double), ntimes, out);
+    write_padded(out, trees->chrom.c_str(), header.chrom_len);
+    write_padded(out, names_buf.c_str(), header.names_len);
+
+    // 'total_mapping' names the nodes of the current tree as in the text
+    // format
+    vector<int> total_mapping(nnodes), tmp_mapping(nnodes);
+    for (int i=0; i<nnodes; i++)
+        total_mapping[i] = i;
+
+    vector<SmcBinaryNode> last_nodes(nnodes), nodes(nnodes);
+    vector<SmcBinaryNode> changed;
+    vector<SmcBinarySpr> invisible;
+    int next_self_pos = self_recomb_pos.size() == 0 ?
+        trees->end_coord + 1 : self_recomb_pos[0];
+    unsigned int self_idx = 0;
+
+    SmcBinaryBlock block;
+    block.spr.pos = trees->start_coord;
+    block.spr.recomb_node = block.spr.coal_node = -1;
+    block.spr.recomb_time = block.spr.coal_time = -1;
+    block.spr.pop_path = -1;
+
+    int end = trees->start_coord;
+    for (LocalTrees::const_iterator it=trees->begin();
+         it != trees->end(); ++it)
+    {
+        const LocalTree *tree = it->tree;
+        const int *name = &total_mapping[0];
+        end += it->blocklen;
+
+        // rename nodes
+        for (int i=0; i<nnodes; i++) {
+            const LocalNode &node = tree->nodes[i];
+            SmcBinaryNode &rec = nodes[name[i]];
+            rec.name = name[i];
+            rec.parent = node.parent == -1 ? -1 : name[node.parent];
+            for (int k=0; k<2; k++)
+                rec.child[k] = node.child[k] == -1 ? -1 : name[node.child[k]];
+            rec.age = node.age;
+            rec.pop_path = pop_model ? node.pop_path : 0;
+        }
+
+        // write the nodes that differ from the previous tree
+        changed.clear();
+        for (int i=0; i<nnodes; i++) {
+            if (it == trees->begin() ||
+                !binary_nodes_equal(nodes[i], last_nodes[i]))
+                changed.push_back(nodes[i]);
+        }
+        block.blocklen = it->blocklen;
+        block.root = name[tree->root];
+        block.nchanged = changed.size();
+        fwrite(&block, sizeof(block), 1, out);
+        if (!changed.empty())
+            fwrite(&changed[0], sizeof(SmcBinaryNode), changed.size(), out);
+        nodes.swap(last_nodes);
+
+        // invisible recombinations use 1-based positions as in the text
+        // format
+        while (next_self_pos < end) {
+            assert(self_idx < self_recomb_pos.size());
+            invisible.push_back(make_binary_spr(
+                next_self_pos + 1, self_recombs[self_idx], name));
+            self_idx++;
+            if (self_idx < self_recomb_pos.size())
+                next_self_pos = self_recomb_pos[self_idx];
+            else
+                next_self_pos = trees->end_coord + 1;
+        }
+
+        LocalTrees::const_iterator it2 = it;
+        ++it2;
+        if (it2 != trees->end()) {
+            // record SPR with the names of this tree
+            const Spr &spr = it2->spr;
+            block.spr = make_binary_spr(end, spr, name);
+            if (!pop_model)
+                block.spr.pop_path = 0;
+
+            // update total mapping
+            const int *mapping = it2->mapping;
+            tmp_mapping = total_mapping;
+            for (int i=0; i<nnodes; i++) {
+                if (mapping[i] != -1)
+                    total_mapping[mapping[i]] = tmp_mapping[i];
+                else {
+                    int recoal = get_recoal_node(tree, spr, mapping);
+                    total_mapping[recoal] = tmp_mapping[i];
+                }
+            }
+        }
+    }
+
+    if (!invisible.empty())
+        fwrite(&invisible[0], sizeof(SmcBinarySpr), invisible.size(), out);
+}
+
+
+void write_local_trees_binary(FILE *out, const LocalTrees *trees,
+                              const Sequences &seqs,
+                              const double *times, int ntimes,
+                              bool pop_model,
+                              const vector<int> &self_recomb_pos,
+                              const vector<Spr> &self_recombs)
+{
+    // setup names
+    const unsigned int nleaves = trees->get_num_leaves();
+    vector<string> names(nleaves);
+    vector<const char*> names2(nleaves);
+    for (unsigned int i=0; i<nleaves; i++) {
+        if (i < seqs.names.size()) {
+            names[i] = seqs.names[i];
+        } else {
+            // use ids
+            char id[11];
+            snprintf(id, 10, "%d", i);
+            names[i] = id;
+        }
+        names2[i] = names[i].c_str();
+    }
+
+    write_local_trees_binary(out, trees, &names2[0], times, ntimes, pop_model,
+                             self_recomb_pos, self_recombs);
+}
+
+
+bool write_local_trees_binary(const char *filename, const LocalTrees *trees,
+                              const Sequences &seqs,
+                              const double *times, int ntimes,
+                              bool pop_model,
+                              const vector<int> &self_recomb_pos,
+                              const vector<Spr> &self_recombs)
+{
+    FILE *out = NULL;
+
+    if ((out = fopen(filename, "w")) == NULL) {
+        printError("cannot write file '%s'\n", filename);
+        return false;
+    }
+
+    write_local_trees_binary(out, trees, seqs, times, ntimes, pop_model,
+                             self_recomb_pos, self_recombs);
+    fclose(out);
+    return true;
+}
+
+
+//=============================================================================
+// reading
+
+
+bool SmcBinaryReader::open(const char *filename)
+{
+    close();
+
+    int fd = ::open(filename, O_RDONLY);
+    if (fd == -1) {
+        printError("cannot read '%s'", filename);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 ||
+        (size_t) st.st_size < sizeof(SmcBinaryHeader)) {
+        printError("'%s' is not a binary .smc file", filename);
+        ::close(fd);
+        return false;
+    }
+
+    void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+        printError("cannot map '%s'", filename);
+        return false;
+    }
+    madvise(addr, st.st_size, MADV_SEQUENTIAL);
+
+    data = (const char*) addr;
+    size = st.st_size;
+    mapped = true;
+
+    if (!check_header()) {
+        printError("'%s' is not a readable binary .smc file", filename);
+        close();
+        return false;
+    }
+    return true;
+}
+
+
+bool SmcBinaryReader::open(const char *buffer, size_t len)
+{
+    close();
+    data = buffer;
+    size = len;
+    mapped = false;
+
+    if (!check_header()) {
+        printError("not a readable binary .smc file");
+        close();
+        return false;
+    }
+    return true;
+}
+
+
+void SmcBinaryReader::close()
+{
+    if (mapped)
+        munmap((void*) data, size);
+    header = NULL;
+    data = NULL;
+    size = 0;
+    mapped = false;
+}
+
+
+bool SmcBinaryReader::check_header()
+{
+    if (size < sizeof(SmcBinaryHeader))
+        return false;
+    header = (const SmcBinaryHeader*) data;
+
+    if (memcmp(header->magic, SMC_BINARY_MAGIC, sizeof(header->magic)) != 0)
+        return false;
+    if (header->byte_order != SMC_BINARY_BYTE_ORDER) {
+        printError("binary .smc file was written with another byte order");
+        return false;
+    }
+    if (header->version != SMC_BINARY_VERSION) {
+        printError("unsupported binary .smc version %d", header->version);
+        return false;
+    }
+    if (header->nnodes < 1 || header->nnames < 0 || header->ntimes < 0 ||
+        header->ntrees < 0 || header->ninvisible < 0 ||
+        header->chrom_len < 0 || header->names_len < 0)
+        return false;
+
+    size_t len = sizeof(SmcBinaryHeader) + header->ntimes * sizeof(double) +
+        pad4(header->chrom_len) + pad4(header->names_len);
+    return len <= size;
+}
+
+
+bool SmcBinaryReader::read(const double *times, int ntimes,
+                           LocalTrees *trees, vector<string> &seqnames,
+                           vector<int> *invisible_recomb_pos,
+                           vector<Spr> *invisible_recombs)
+{
+    return read_trees(times, ntimes, trees, NULL, seqnames,
+                      invisible_recomb_pos, invisible_recombs);
+}
+
+
+bool SmcBinaryReader::read(const double *times, int ntimes,
+                           CompactLocalTrees *trees, vector<string> &seqnames)
+{
+    LocalTrees trees2;
+    return read_trees(times, ntimes, &trees2, trees, seqnames, NULL, NULL);
+}
+
+
+bool SmcBinaryReader::read_trees(const double *times, int ntimes,
+                                 LocalTrees *trees, CompactLocalTrees *compact,
+                                 vector<string> &seqnames,
+                                 vector<int> *invisible_recomb_pos,
+                                 vector<Spr> *invisible_recombs)
+{
+    assert((invisible_recomb_pos==NULL && invisible_recombs==NULL) ||
+           (invisible_recomb_pos!=NULL && invisible_recombs!=NULL));
+    assert(header);
+
+    const int nnodes = header->nnodes;
+    const char *ptr = data + sizeof(SmcBinaryHeader);
+    const char *end = data + size;
+
+    // map time points of file onto 'times'
+    const double *file_times = (const double*) ptr;
+    vector<int> time_map(header->ntimes);
+    for (int i=0; i<header->ntimes; i++)
+        time_map[i] = find_time(file_times[i], times, ntimes);
+    ptr += header->ntimes * sizeof(double);
+
+    // init trees
+    trees->clear();
+    trees->chrom = string(ptr, header->chrom_len);
+    ptr += pad4(header->chrom_len);
+    trees->start_coord = header->start_coord;
+    trees->end_coord = header->end_coord;
+    trees->nnodes = nnodes;
+    trees->set_default_seqids();
+
+    // read names
+    seqnames.clear();
+    const char *names_end = ptr + header->names_len;
+    for (int i=0; i<header->nnames && ptr < names_end; i++) {
+        seqnames.push_back(string(ptr, strnlen(ptr, names_end - ptr)));
+        ptr += seqnames.back().size() + 1;
+    }
+    ptr = names_end + pad4(header->names_len) - header->names_len;
+
+    if (compact)
+        compact->set_info(trees);
+
+    // read trees
+    LocalTree *last_tree = NULL;
+    LocalTree compact_trees[2];
+    vector<int> compact_mapping(nnodes);
+    int coord = trees->start_coord;
+    for (int i=0; i<header->ntrees; i++) {
+        if (ptr + sizeof(SmcBinaryBlock) > end) {
+            printError("binary .smc file is truncated (tree %d)", i);
+            return false;
+        }
+        const SmcBinaryBlock *block = (const SmcBinaryBlock*) ptr;
+        ptr += sizeof(SmcBinaryBlock);
+        const SmcBinaryNode *nodes = (const SmcBinaryNode*) ptr;
+        if (block->nchanged < 0 || block->nchanged > nnodes ||
+            (i == 0 && block->nchanged != nnodes) ||
+            block->blocklen <= 0 ||
+            block->blocklen > trees->end_coord - coord ||
+            ptr + block->nchanged * sizeof(SmcBinaryNode) > end) {
+            printError("bad binary .smc tree %d", i);
+            return false;
+        }
+        ptr += block->nchanged * sizeof(SmcBinaryNode);
+
+        // build tree from the previous one
+        LocalTree *tree;
+        if (compact) {
+            tree = &compact_trees[i % 2];
+            tree->ensure_capacity(nnodes);
+            tree->nnodes = nnodes;
+        } else {
+            tree = new LocalTree(nnodes);
+        }
+        if (last_tree)
+            tree->copy(*last_tree);
+
+        bool valid = (block->root >= 0 && block->root < nnodes);
+        for (int j=0; j<block->nchanged && valid; j++) {
+            const SmcBinaryNode &rec = nodes[j];
+            if (rec.name < 0 || rec.name >= nnodes ||
+                rec.parent < -1 || rec.parent >= nnodes ||
+                rec.child[0] < -1 || rec.child[0] >= nnodes ||
+                rec.child[1] < -1 || rec.child[1] >= nnodes ||
+                rec.age < 0 || rec.age >= header->ntimes) {
+                valid = false;
+                break;
+            }
+            LocalNode &node = tree->nodes[rec.name];
+            node.parent = rec.parent;
+            node.child[0] = rec.child[0];
+            node.child[1] = rec.child[1];
+            node.age = time_map[rec.age];
+            node.pop_path = rec.pop_path;
+        }
+        tree->root = block->root;
+
+        // setup SPR and mapping
+        Spr spr;
+        spr.set_null();
+        int *mapping = NULL;
+        if (valid && last_tree) {
+            const SmcBinarySpr &rec = block->spr;
+            if (rec.recomb_node < 0 || rec.recomb_node >= nnodes ||
+                rec.coal_node < 0 || rec.coal_node >= nnodes ||
+                rec.recomb_time < 0 || rec.recomb_time >= header->ntimes ||
+                rec.coal_time < 0 || rec.coal_time >= header->ntimes) {
+                valid = false;
+            } else {
+                spr = Spr(rec.recomb_node, time_map[rec.recomb_time],
+                          rec.coal_node, time_map[rec.coal_time],
+                          rec.pop_path);
+                mapping = compact ? &compact_mapping[0] : new int [nnodes];
+                for (int j=0; j<nnodes; j++)
+                    mapping[j] = j;
+                if (spr.recomb_node != spr.coal_node)
+                    mapping[last_tree->nodes[spr.recomb_node].parent] = -1;
+            }
+        }
+
+        if (!valid) {
+            printError("bad binary .smc tree %d", i);
+            if (!compact)
+                delete tree;
+            return false;
+        }
+
+        if (compact)
+            compact->push_back(LocalTreeSpr(tree, spr, block->blocklen,
+                                            mapping));
+        else
+            trees->trees.push_back(LocalTreeSpr(tree, spr, block->blocklen,
+                                                mapping));
+        coord += block->blocklen;
+        last_tree = tree;
+    }
+
+    if (coord != trees->end_coord) {
+        printError("binary .smc blocks do not cover region");
+        return false;
+    }
+
+    // read invisible recombinations
+    if (ptr + header->ninvisible * sizeof(SmcBinarySpr) > end) {
+        printError("binary .smc file is truncated");
+        return false;
+    }
+    if (invisible_recombs) {
+        const SmcBinarySpr *recs = (const SmcBinarySpr*) ptr;
+        for (int i=0; i<header->ninvisible; i++) {
+            const SmcBinarySpr &rec = recs[i];
+            if (rec.recomb_node < 0 || rec.recomb_node >= nnodes ||
+                rec.coal_node < 0 || rec.coal_node >= nnodes ||
+                rec.recomb_time < 0 || rec.recomb_time >= header->ntimes ||
+                rec.coal_time < 0 || rec.coal_time >= header->ntimes) {
+                printError("bad binary .smc invisible recombination %d", i);
+                return false;
+            }
+            Spr ispr(recs[i].recomb_node, time_map[recs[i].recomb_time],
+                     recs[i].coal_node, time_map[recs[i].coal_time],
+                     recs[i].pop_path);
+            invisible_recombs->push_back(ispr);
+            invisible_recomb_pos->push_back(recs[i].pos);
+        }
+    }
+
+    if (compact) {
+        compact->end_coord = trees->end_coord;
+        trees->clear();
+    } else if (trees->get_num_trees() > 0) {
+        trees->compact();
+    }
+
+    return true;
+}
+
+
+bool is_smc_binary(const char *filename)
+{
+    FILE *infile = fopen(filename, "r");
+    if (!infile)
+        return false;
+
+    char magic[8];
+    bool binary = (fread(magic, 1, sizeof(magic), infile) == sizeof(magic) &&
+                   memcmp(magic, SMC_BINARY_MAGIC, sizeof(magic)) == 0);
+    fclose(infile);
+    return binary;
+}
+
+
+bool read_arg_file(const char *filename, const double *times, int ntimes,
+                   LocalTrees *trees, vector<string> &seqnames,
+                   vector<int> *invisible_recomb_pos,
+                   vector<Spr> *invisible_recombs)
+{
+    if (is_smc_binary(filename)) {
+        SmcBinaryReader reader;
+        return reader.open(filename) &&
+            reader.read(times, ntimes, trees, seqnames,
+                        invisible_recomb_pos, invisible_recombs);
+    }
+
+    CompressStream stream(filename, "r");
+    if (!stream.stream) {
+        printError("cannot read '%s'", filename);
+        return false;
+    }
+    return read_local_trees(stream.stream, times, ntimes, trees, seqnames,
+                            invisible_recomb_pos, invisible_recombs);
+}
+
+
+bool read_arg_file(const char *filename, const double *times, int ntimes,
+                   CompactLocalTrees *trees, vector<string> &seqnames)
+{
+    if (is_smc_binary(filename)) {
+        SmcBinaryReader reader;
+        return reader.open(filename) &&
+            reader.read(times, ntimes, trees, seqnames);
+    }
+
+    LocalTrees trees2;
+    if (!read_arg_file(filename, times, ntimes, &trees2, seqnames))
+        return false;
+    trees->set(&trees2);
+    return true;
+}
+
+
+//=============================================================================
+// streaming ARG files
+
+
+bool LocalTreesStream::open(const char *filename, const double *times,
+                            int ntimes)
+{
+    close();
+    error = true;
+    if (is_smc_binary(filename)) {
+        if (!read_arg_file(filename, times, ntimes, &compact, seqnames))
+            return false;
+        chrom = compact.chrom;
+        seqids = compact.seqids;
+        cursor = new CompactLocalTrees::Cursor(&compact);
+        ahead = new CompactLocalTrees::Cursor(&compact);
+        ahead->next();
+    } else {
+        stream = new CompressStream(filename, "r");
+        if (!stream->stream) {
+            printError("cannot read '%s'", filename);
+            return false;
+        }
+        reader = new LocalTreesReader(stream->stream, times, ntimes);
+        if (!reader->ok())
+            return false;
+        reader->skip_to(region_start);
+        chrom = reader->chrom;
+        seqnames = reader->seqnames;
+        seqids.clear();
+        for (unsigned int i=0; i<seqnames.size(); i++)
+            seqids.push_back(i);
+    }
+    error = false;
+    return true;
+}
+
+
+void LocalTreesStream::close()
+{
+    delete reader;
+    delete stream;
+    delete cursor;
+    delete ahead;
+    reader = NULL;
+    stream = NULL;
+    cursor = NULL;
+    ahead = NULL;
+    tree = NULL;
+}
+
+
+bool LocalTreesStream::next()
+{
+    if (!reader && !cursor)
+        return false;
+
+    do {
+        if (reader) {
+            if (!reader->next())
+                return false;
+            tree = &reader->tree;
+            start = reader->start;
+            end = reader->end;
+            next_spr = reader->next_spr;
+        } else {
+            if (!cursor->next())
+                return false;
+            tree = &cursor->tree;
+            start = cursor->start;
+            end = cursor->end;
+            if (ahead->next())
+                next_spr = ahead->spr;
+            else
+                next_spr.set_null();
+        }
+    } while (end <= region_start);
+
+    if (region_end != -1) {
+        if (start >= region_end)
+            return false;
+        if (end >= region_end) {
+            end = region_end;
+            next_spr.set_null();
+        }
+    }
+    if (start < region_start)
+        start = region_start;
+    return true;
+}
+
+
+} // namespace argweaver
@@ -0,0 +1,253 @@
+//=============================================================================
+// binary .smc format
+
+#ifndef ARGWEAVER_SMC_BINARY_H
+#define ARGWEAVER_SMC_BINARY_H
+
+// c/c++ includes
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+// arghmm includes
+#include "compact_arg.h"
+#include "compress.h"
+#include "local_tree.h"
+#include "sequences.h"
+
+
+namespace argweaver {
+
+using namespace std;
+
+
+// A binary .smc file (suffix .smcb) holds the same ARG as a text .smc
+// file:
+//
+//   SmcBinaryHeader
+//   double times[ntimes]            time points used by node ages
+//   char chrom[chrom_len]           padded to 4 bytes
+//   char names[names_len]           NUL-terminated leaf names, padded
+//   ntrees x (SmcBinaryBlock, SmcBinaryNode[nchanged])
+//   SmcBinarySpr invisible[ninvisible]
+//
+// Nodes are named as in the text format, so that every node except the
+// broken node keeps its name across an SPR.  The first block stores every
+// node and each later block only the nodes its SPR changed.  All fields
+// are 32-bit integers in the byte order of the machine that wrote the file.
+
+#define SMC_BINARY_SUFFIX ".smcb"
+#define SMC_BINARY_MAGIC "ARGWSMCB"
+#define SMC_BINARY_VERSION 1
+#define SMC_BINARY_BYTE_ORDER 0x01020304
+
+// header flags
+#define SMC_BINARY_POP_PATHS 0x1
+
+
+struct SmcBinaryHeader
+{
+    char magic[8];
+    int32_t version;
+    int32_t byte_order;
+    int32_t flags;
+    int32_t nnodes;
+    int32_t nnames;
+    int32_t ntimes;
+    int32_t start_coord;     // 0-based
+    int32_t end_coord;
+    int32_t ntrees;
+    int32_t ninvisible;
+    int32_t chrom_len;
+    int32_t names_len;
+};
+
+struct SmcBinarySpr
+{
+    int32_t pos;
+    int32_t recomb_node;
+    int32_t recomb_time;
+    int32_t coal_node;
+    int32_t coal_time;
+    int32_t pop_path;
+};
+
+struct SmcBinaryBlock
+{
+    int32_t blocklen;
+    int32_t root;
+    int32_t nchanged;
+    SmcBinarySpr spr;        // SPR to the left of the tree (pos unused)
+};
+
+struct SmcBinaryNode
+{
+    int32_t name;
+    int32_t parent;
+    int32_t child[2];
+    int32_t age;
+    int32_t pop_path;
+};
+
+
+// Reads a binary .smc file through a read-only memory map.  Trees are
+// built directly from the mapped records without any parsing.
+class SmcBinaryReader
+{
+public:
+    SmcBinaryReader() :
+        header(NULL),
+        data(NULL),
+        size(0),
+        mapped(false)
+    {}
+
+    ~SmcBinaryReader()
+    {
+        close();
+    }
+
+    // Maps a file.  Returns false if it is not a binary .smc file.
+    bool open(const char *filename);
+
+    // Reads from a buffer owned by the caller
+    bool open(const char *buffer, size_t len);
+
+    void close();
+
+    // Time points of node ages as stored in the file
+    inline const double *get_times() const
+    {
+        return (const double*) (data + sizeof(SmcBinaryHeader));
+    }
+
+    inline int get_ntimes() const
+    {
+        return header->ntimes;
+    }
+
+    inline bool has_pop_paths() const
+    {
+        return header->flags & SMC_BINARY_POP_PATHS;
+    }
+
+    // Builds the ARG, converting node ages to the closest of 'times'
+    bool read(const double *times, int ntimes, LocalTrees *trees,
+              vector<string> &seqnames,
+              vector<int> *invisible_recomb_pos=NULL,
+              vector<Spr> *invisible_recombs=NULL);
+
+    // Builds the ARG in compact storage, holding one full tree at a time
+    bool read(const double *times, int ntimes, CompactLocalTrees *trees,
+              vector<string> &seqnames);
+
+protected:
+    bool check_header();
+    bool read_trees(const double *times, int ntimes, LocalTrees *trees,
+                    CompactLocalTrees *compact, vector<string> &seqnames,
+                    vector<int> *invisible_recomb_pos,
+                    vector<Spr> *invisible_recombs);
+
+    const SmcBinaryHeader *header;
+    const char *data;
+    size_t size;
+    bool mapped;
+};
+
+
+// Returns true if 'filename' starts with the binary .smc magic number
+bool is_smc_binary(const char *filename);
+
+void write_local_trees_binary(FILE *out, const LocalTrees *trees,
+                              const char *const *names,
+                              const double *times, int ntimes,
+                              bool pop_model=false,
+                              const vector<int> &self_recomb_pos=vector<int>(),
+                              const vector<Spr> &self_recombs=vector<Spr>());
+void write_local_trees_binary(FILE *out, const LocalTrees *trees,
+                              const Sequences &seqs,
+                              const double *times, int ntimes,
+                              bool pop_model=false,
+                              const vector<int> &self_recomb_pos=vector<int>(),
+                              const vector<Spr> &self_recombs=vector<Spr>());
+bool write_local_trees_binary(const char *filename, const LocalTrees *trees,
+                              const Sequences &seqs,
+                              const double *times, int ntimes,
+                              bool pop_model=false,
+                              const vector<int> &self_recomb_pos=vector<int>(),
+                              const vector<Spr> &self_recombs=vector<Spr>());
+
+// Reads an ARG from a text (.smc, .smc.gz) or binary (.smcb) file
+bool read_arg_file(const char *filename, const double *times, int ntimes,
+                   LocalTrees *trees, vector<string> &seqnames,
+                   vector<int> *invisible_recomb_pos=NULL,
+                   vector<Spr> *invisible_recombs=NULL);
+bool read_arg_file(const char *filename, const double *times, int ntimes,
+                   CompactLocalTrees *trees, vector<string> &seqnames);
+
+
+// Visits the trees of a text or binary ARG file in order, optionally
+// clipped to a region, without building the whole ARG.  Text files are
+// read one tree at a time; binary files are read into compact storage.
+class LocalTreesStream
+{
+public:
+    LocalTreesStream(int region_start=-1, int region_end=-1) :
+        tree(NULL),
+        start(0),
+        end(0),
+        error(false),
+        region_start(region_start),
+        region_end(region_end),
+        stream(NULL),
+        reader(NULL),
+        cursor(NULL),
+        ahead(NULL)
+    {
+        next_spr.set_null();
+    }
+
+    virtual ~LocalTreesStream()
+    {
+        close();
+    }
+
+    // Opens 'filename' before its first tree.  Returns false on error.
+    bool open(const char *filename, const double *times, int ntimes);
+    void close();
+
+    // Moves to the next tree in the region, clipping its block to the
+    // region.  Returns false after the last tree.
+    bool next();
+
+    // Returns false if the file could not be parsed
+    bool ok() const
+    {
+        return !error && (!reader || reader->ok());
+    }
+
+    string chrom;                 // chromosome name of ARG
+    vector<string> seqnames;
+    vector<int> seqids;           // mapping from tree leaves to seqnames
+    const LocalTree *tree;        // current tree
+    int start;                    // current block [start, end) (0-based)
+    int end;
+    Spr next_spr;                 // SPR to the right of current tree (null
+                                  // at the end of the ARG or region)
+
+protected:
+    bool error;
+    int region_start;             // region [region_start, region_end)
+    int region_end;               // (-1 for whole file)
+    CompressStream *stream;
+    LocalTreesReader *reader;
+    CompactLocalTrees compact;
+    CompactLocalTrees::Cursor *cursor;
+    CompactLocalTrees::Cursor *ahead;
+};
+
+
+} // namespace argweaver
+
+#endif // ARGWEAVER_SMC_BINARY_H
@@ -1,4 +1,7 @@
 #include <unistd.h>
+#include <zlib.h>
+#include <algorithm>
+#include <limits.h>
 #include <string>
 #include <stdlib.h>
 
@@ -11,29 +14,436 @@ namespace argweaver {
 using namespace std;
 
 
-FILE *read_tabix(const char *filename, const char *region,
-                 const char *tabix_dir) {
-    FILE *pipe;
+// record formats
+#define TABIX_FORMAT_VCF 2
+#define TABIX_ZERO_BASED 0x10000
+
+
+// Reads little-endian fields of an index, checking that they lie within
+// the data
+class IndexParser
+{
+public:
+    IndexParser(const string &data, size_t pos) :
+        data(data),
+        pos(pos),
+        ok(true)
+    {}
+
+    template <class T>
+    T get()
+    {
+        T value = 0;
+        if (pos + sizeof(T) > data.size()) {
+            ok = false;
+            return value;
+        }
+        memcpy(&value, data.data() + pos, sizeof(T));
+        pos += sizeof(T);
+        return value;
+    }
+
+    // Returns 'count' if that many items of 'size' bytes fit in the data
+    int get_count(int count, size_t size)
+    {
+        if (count < 0 || pos + (size_t) count * size > data.size()) {
+            ok = false;
+            return 0;
+        }
+        return count;
+    }
+
+    const string &data;
+    size_t pos;
+    bool ok;
+};
+
+
+bool TabixIndex::read(const char *filename)
+{
+    gzFile infile = gzopen(filename, "rb");
+    if (!infile) {
+        printError("cannot read index '%s'", filename);
+        return false;
+    }
+    string data;
+    char buf[1 << 16];
+    int n;
+    while ((n = gzread(infile, buf, sizeof(buf))) > 0)
+        data.append(buf, n);
+    gzclose(infile);
+
+    seqs.clear();
+    seqnames.clear();
+    seqids.clear();
+
+    bool ok = false;
+    if (data.compare(0, 4, "TBI\1") == 0)
+        ok = read_tbi(data);
+    else if (data.compare(0, 4, "CSI\1") == 0)
+        ok = read_csi(data);
+    if (!ok)
+        printError("bad tabix index '%s'", filename);
+    return ok;
+}
+
+
+void TabixIndex::read_seqnames(const char *names, int len)
+{
+    int start = 0;
+    for (int i=0; i<len; i++) {
+        if (names[i] == '\0') {
+            seqids[string(&names[start])] = seqnames.size();
+            seqnames.push_back(string(&names[start]));
+            start = i + 1;
+        }
+    }
+}
+
+
+bool TabixIndex::read_tbi(const string &data)
+{
+    IndexParser p(data, 4);
+    const int nseqs = p.get<int32_t>();
+    format = p.get<int32_t>();
+    col_seq = p.get<int32_t>();
+    col_beg = p.get<int32_t>();
+    col_end = p.get<int32_t>();
+    meta = (char) p.get<int32_t>();
+    skip = p.get<int32_t>();
+    const int names_len = p.get_count(p.get<int32_t>(), 1);
+    if (!p.ok)
+        return false;
+    read_seqnames(data.data() + p.pos, names_len);
+    p.pos += names_len;
+
+    min_shift = 14;
+    depth = 5;
+    csi = false;
+    seqs.resize(p.get_count(nseqs, 4));
+    for (unsigned int i=0; i<seqs.size() && p.ok; i++) {
+        const int nbins = p.get_count(p.get<int32_t>(), 8);
+        for (int j=0; j<nbins && p.ok; j++) {
+            Bin &bin = seqs[i].bins[p.get<uint32_t>()];
+            const int nchunks = p.get_count(p.get<int32_t>(), 16);
+            for (int k=0; k<nchunks; k++) {
+                uint64_t chunk_beg = p.get<uint64_t>();
+                bin.chunks.push_back(TabixChunk(chunk_beg,
+                                                p.get<uint64_t>()));
+            }
+        }
+        const int nintervals = p.get_count(p.get<int32_t>(), 8);
+        for (int j=0; j<nintervals; j++)
+            seqs[i].linear.push_back(p.get<uint64_t>());
+    }
+    return p.ok && (int) seqs.size() == nseqs &&
+        seqnames.size() == seqs.size();
+}
+
+
+bool TabixIndex::read_csi(const string &data)
+{
+    IndexParser p(data, 4);
+    min_shift = p.get<int32_t>();
+    depth = p.get<int32_t>();
+    const int aux_len = p.get_count(p.get<int32_t>(), 1);
+    if (!p.ok || min_shift < 0 || min_shift > 30 || depth < 0 || depth > 10)
+        return false;
+
+    // tabix configuration is kept in the auxiliary data
+    const size_t aux_end = p.pos + aux_len;
+    if (aux_len >= 28) {
+        format = p.get<int32_t>();
+        col_seq = p.get<int32_t>();
+        col_beg = p.get<int32_t>();
+        col_end = p.get<int32_t>();
+        meta = (char) p.get<int32_t>();
+        skip = p.get<int32_t>();
+        const int names_len = p.get<int32_t>();
+        if (names_len < 0 || p.pos + names_len > aux_end)
+            return false;
+        read_seqnames(data.data() + p.pos, names_len);
+    }
+    p.pos = aux_end;
+
+    csi = true;
+    const int nseqs = p.get<int32_t>();
+    seqs.resize(p.get_count(nseqs, 4));
+    for (unsigned int i=0; i<seqs.size() && p.ok; i++) {
+        const int nbins = p.get_count(p.get<int32_t>(), 16);
+        for (int j=0; j<nbins && p.ok; j++) {
+            Bin &bin = seqs[i].bins[p.get<uint32_t>()];
+            bin.loffset = p.get<uint64_t>();
+            const int nchunks = p.get_count(p.get<int32_t>(), 16);
+            for (int k=0; k<nchunks; k++) {
+                uint64_t chunk_beg = p.get<uint64_t>();
+                bin.chunks.push_back(TabixChunk(chunk_beg,
+                                                p.get<uint64_t>()));
+            }
+        }
+    }
+    return p.ok && (int) seqs.size() == nseqs &&
+        seqnames.size() == seqs.size();
+}
+
+
+int TabixIndex::get_seqid(const string &name) const
+{
+    map<string, int>::const_iterator it = seqids.find(name);
+    return it == seqids.end() ? -1 : it->second;
+}
+
+
+void TabixIndex::query(int seqid, int beg, int end,
+                       vector<TabixChunk> &chunks) const
+{
+    chunks.clear();
+    if (seqid < 0 || seqid >= (int) seqs.size())
+        return;
+    const Seq &seq = seqs[seqid];
+
+    const int64_t max_pos = (int64_t) 1 << (min_shift + 3 * depth);
+    if (beg < 0)
+        beg = 0;
+    if (end > max_pos)
+        end = max_pos;
+    if (beg >= end)
+        return;
+
+    // smallest file offset of records at or after beg
+    uint64_t min_offset = 0;
+    if (csi) {
+        unsigned int bin = ((((int64_t) 1 << 3 * depth) - 1) / 7) +
+            (beg >> min_shift);
+        while (true) {
+            map<unsigned int, Bin>::const_iterator it = seq.bins.find(bin);
+            if (it != seq.bins.end()) {
+                min_offset = it->second.loffset;
+                break;
+            }
+            if (bin == 0)
+                break;
+            bin = (bin - 1) >> 3;
+        }
+    } else if (!seq.linear.empty()) {
+        unsigned int i = min(beg >> min_shift, (int) seq.linear.size() - 1);
+        min_offset = seq.linear[i];
+    }
+
+    // visit the bins of each level that overlap the region
+    int64_t first = 0;
+    for (int level=0, shift=min_shift + 3 * depth; level<=depth;
+         level++, shift-=3) {
+        const unsigned int bin_beg = first + ((int64_t) beg >> shift);
+        const unsigned int bin_end = first + ((int64_t) (end - 1) >> shift);
+        for (unsigned int b=bin_beg; b<=bin_end; b++) {
+            map<unsigned int, Bin>::const_iterator it = seq.bins.find(b);
+            if (it == seq.bins.end())
+                continue;
+            const vector<TabixChunk> &bin_chunks = it->second.chunks;
+            for (unsigned int k=0; k<bin_chunks.size(); k++)
+                if (bin_chunks[k].second > min_offset)
+                    chunks.push_back(bin_chunks[k]);
+        }
+        first += (int64_t) 1 << (3 * level);
+    }
+
+    // merge overlapping chunks
+    sort(chunks.begin(), chunks.end());
+    unsigned int n = 0;
+    for (unsigned int i=0; i<chunks.size(); i++) {
+        if (n > 0 && chunks[i].first <= chunks[n-1].second)
+            chunks[n-1].second = max(chunks[n-1].second, chunks[i].second);
+        else
+            chunks[n++] = chunks[i];
+    }
+    chunks.resize(n);
+}
+
+
+bool TabixIndex::parse_record(const string &line, string &seqname,
+                              int *beg, int *end) const
+{
+    if (line.empty() || line[0] == meta)
+        return false;
+
+    bool has_seq = false, has_beg = false, has_end = false;
+    int ref_len = 1;
+    size_t pos = 0;
+    for (int col=1; ; col++) {
+        size_t tab = line.find('\t', pos);
+        size_t stop = (tab == string::npos ? line.size() : tab);
+        if (col == col_seq) {
+            seqname.assign(line, pos, stop - pos);
+            has_seq = true;
+        } else if (col == col_beg) {
+            *beg = atoi(line.c_str() + pos);
+            has_beg = true;
+        } else if (col == col_end) {
+            *end = atoi(line.c_str() + pos);
+            has_end = true;
+        } else if ((format & 0xffff) == TABIX_FORMAT_VCF && col == 4) {
+            ref_len = stop - pos;
+        }
+        if (tab == string::npos)
+            break;
+        pos = tab + 1;
+    }
+    if (!has_seq || !has_beg)
+        return false;
+
+    if (!(format & TABIX_ZERO_BASED))
+        (*beg)--;
+    if ((format & 0xffff) == TABIX_FORMAT_VCF)
+        *end = *beg + ref_len;
+    else if (!has_end)
+        *end = *beg + 1;
+    if (*end <= *beg)
+        *end = *beg + 1;
+    return true;
+}
+
+
+//=============================================================================
+
+bool TabixStream::open(const char *filename, const char *region)
+{
+    this->filename = filename;
+    has_index = false;
+    return set_region(region);
+}
+
+
+bool TabixStream::open_index()
+{
+    string index_file = filename + ".tbi";
+    if (access(index_file.c_str(), F_OK) != 0)
+        index_file = filename + ".csi";
+    if (!index.read(index_file.c_str()))
+        return false;
+    if (!reader.open(filename.c_str())) {
+        printError("cannot read file '%s'", filename.c_str());
+        return false;
+    }
+
+    // header lines
+    header.clear();
+    string line;
+    for (int i=0; reader.getline(line); i++) {
+        if (i >= index.skip && (line.empty() || line[0] != index.meta))
+            break;
+        header += line;
+        header += '\n';
+    }
+    has_index = true;
+    return true;
+}
+
+
+bool TabixStream::set_region(const char *region)
+{
+    if (stream) {
+        fclose(stream);
+        stream = NULL;
+    }
 
     if (region == NULL) {
-        return read_compress(filename);
+        stream = read_compress(filename.c_str());
+    } else if (has_index || open_index()) {
+        // parse region
+        string str = region;
+        str.erase(std::remove(str.begin(), str.end(), ','), str.end());
+        seqname = str;
+        beg = 0;
+        end = INT_MAX;
+        size_t colon = str.rfind(':');
+        if (colon != string::npos && index.get_seqid(str) == -1) {
+            seqname = str.substr(0, colon);
+            string range = str.substr(colon + 1);
+            size_t dash = range.find('-');
+            beg = max(atoi(range.substr(0, dash).c_str()) - 1, 0);
+            if (dash != string::npos && dash + 1 < range.size())
+                end = atoi(range.substr(dash + 1).c_str());
+        }
+
+        index.query(index.get_seqid(seqname), beg, end, chunks);
+        chunki = 0;
+        chunk_started = false;
+        pending = header;
+        pending_pos = 0;
+        stream = open_read_stream(this);
+    }
+
+    if (stream == NULL) {
+        printError("Error opening %s, region=%s\n",
+                   filename.c_str(), region == NULL ? "NULL" : region);
+        return false;
     }
+    return true;
+}
+
 
-    string cmd = "tabix -h " + quote_arg(filename) + " " +  region;
-    if (tabix_dir != NULL && strlen(tabix_dir) > 0)
-        cmd = string(tabix_dir) + "/" + cmd;
-    pipe = popen(cmd.c_str(), "r");
-    if (pipe == NULL) {
-        printError("Error opening %s with tabix. Is tabix installed and"
-                   " in your PATH?\n",
-                   filename);
+void TabixStream::close()
+{
+    if (stream) {
+        fclose(stream);
+        stream = NULL;
     }
-    return pipe;
+    reader.close();
+    has_index = false;
 }
 
 
-int close_tabix(FILE *stream) {
-    return pclose(stream);
+bool TabixStream::next_line(string &line)
+{
+    string name;
+    int rec_beg, rec_end;
+
+    while (chunki < chunks.size()) {
+        if (!chunk_started) {
+            if (!reader.seek(chunks[chunki].first))
+                break;
+            chunk_started = true;
+        }
+        if (reader.tell() >= chunks[chunki].second || !reader.getline(line)) {
+            chunki++;
+            chunk_started = false;
+            continue;
+        }
+
+        if (!index.parse_record(line, name, &rec_beg, &rec_end) ||
+            name != seqname || rec_end <= beg)
+            continue;
+        if (rec_beg >= end) {
+            // records are sorted, so no later record overlaps the region
+            chunki = chunks.size();
+            break;
+        }
+        return true;
+    }
+    return false;
 }
 
+
+size_t TabixStream::read(char *buf, size_t size)
+{
+    size_t n = 0;
+    while (n < size) {
+        if (pending_pos == pending.size()) {
+            pending_pos = 0;
+            if (!next_line(pending)) {
+                pending.clear();
+                break;
+            }
+            pending += '\n';
+        }
+        size_t len = min(size - n, pending.size() - pending_pos);
+        memcpy(buf + n, pending.data() + pending_pos, len);
+        n += len;
+        pending_pos += len;
+    }
+    return n;
 }
+
+
+} //namespace argweaver
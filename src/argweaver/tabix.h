@@ -1,55 +1,154 @@
 #ifndef ARGWEAVER_TABIX_H
 #define ARGWEAVER_TABIX_H
 
+#include <stdint.h>
 #include <stdio.h>
+#include <map>
 #include <string>
+#include <utility>
+#include <vector>
 
+#include "compress.h"
 #include "logging.h"
 
 namespace argweaver {
 
 using namespace std;
 
-FILE *read_tabix(const char *filename, const char *region,
-                 const char *tabix_dir);
-int close_tabix(FILE *stream);
 
-class TabixStream
+// A range [first, second) of virtual file offsets in a BGZF file
+typedef pair<uint64_t, uint64_t> TabixChunk;
+
+
+// A tabix index (.tbi or .csi) of a bgzipped, position-sorted file
+class TabixIndex
 {
 public:
+    TabixIndex() :
+        format(0),
+        col_seq(1),
+        col_beg(2),
+        col_end(3),
+        meta('#'),
+        skip(0),
+        min_shift(14),
+        depth(5)
+    {}
+
+    // Reads an index file
+    bool read(const char *filename);
+
+    // Returns the index of sequence 'name', or -1 if it is not indexed
+    int get_seqid(const string &name) const;
+
+    // Returns the sorted, merged chunks of the file that may hold records
+    // of sequence 'seqid' overlapping [beg, end) (0-based)
+    void query(int seqid, int beg, int end, vector<TabixChunk> &chunks) const;
+
+    // Parses the sequence name and 0-based interval [beg, end) of a record.
+    // Returns false if the line is not a record.
+    bool parse_record(const string &line, string &seqname,
+                      int *beg, int *end) const;
+
+    // layout of records
+    int format;       // 0: generic, 1: SAM, 2: VCF, 0x10000: 0-based
+    int col_seq;      // 1-based columns of sequence name, start and end
+    int col_beg;
+    int col_end;
+    char meta;        // leading character of header lines
+    int skip;         // number of header lines at start of file
+    vector<string> seqnames;
+
+protected:
+    struct Bin {
+        Bin() : loffset(0) {}
+        uint64_t loffset;    // smallest offset of records in bin (.csi)
+        vector<TabixChunk> chunks;
+    };
+
+    struct Seq {
+        map<unsigned int, Bin> bins;
+        vector<uint64_t> linear;   // linear index (.tbi)
+    };
+
+    bool read_tbi(const string &data);
+    bool read_csi(const string &data);
+    void read_seqnames(const char *names, int len);
+
+    int min_shift;
+    int depth;
+    bool csi;
+    vector<Seq> seqs;
+    map<string, int> seqids;
+};
+
+
+// Reads a bgzipped, tabix-indexed file, either in whole or the records
+// overlapping a region, through a stdio stream.  The header lines are read
+// first, as with "tabix -h".  The file and its index stay open, so that
+// many regions can be read one after another.
+class TabixStream : public StreamReader
+{
+public:
+    // Opens 'filename' without reading it until set_region() is called
+    TabixStream(const char *filename) :
+        stream(NULL),
+        filename(filename),
+        has_index(false)
+    {}
+
+    // A NULL region reads the whole file.  'tabix_dir' is unused and kept
+    // for compatibility.
     TabixStream(const char *filename, const char *region,
-                const char *tabix_dir=NULL)
+                const char *tabix_dir=NULL) :
+        stream(NULL)
     {
-        stream = read_tabix(filename, region, tabix_dir);
-        if (stream == NULL) {
-            printError("Error opening %s, region=%s\n",
-                        filename, region == NULL ? "NULL" : region);
-        }
+        open(filename, region);
     }
 
-    TabixStream(string filename, const char *region, string tabix_dir) {
-        stream = read_tabix(filename.c_str(), region,
-                            tabix_dir.empty() ? NULL : tabix_dir.c_str());
-        if (stream == NULL) {
-            printError("Error opening %s, region=%s\n",
-                       filename.c_str(), region == NULL ? "NULL" : region);
-        }
+    TabixStream(string filename, const char *region, string tabix_dir) :
+        stream(NULL)
+    {
+        open(filename.c_str(), region);
     }
 
-    ~TabixStream()
+    virtual ~TabixStream()
     {
         close();
     }
 
-    void close()
-    {
-        if (stream) {
-            close_tabix(stream);
-            stream = NULL;
-        }
-    }
+    // Restarts 'stream' at the records overlapping 'region'
+    // ("chrom:start-end", 1-based), or the whole file if 'region' is NULL
+    bool set_region(const char *region);
+
+    void close();
+
+    virtual size_t read(char *buf, size_t size);
+
     FILE *stream;
+
+protected:
+    bool open(const char *filename, const char *region);
+    bool open_index();
+    bool next_line(string &line);
+
+    string filename;
+    BgzfReader reader;
+    TabixIndex index;
+    bool has_index;
+    string header;              // header lines of the file
+
+    // current region
+    string seqname;
+    int beg;
+    int end;
+    vector<TabixChunk> chunks;
+    unsigned int chunki;        // chunk being read
+    bool chunk_started;
+    string pending;             // data not yet returned by read()
+    size_t pending_pos;
 };
 
+
 } //namespace argweaver
 #endif // ARGWEAVER_TABIX_H
@@ -204,7 +204,7 @@ void add_spr_branch(const LocalTree *tree, const LocalTree *last_tree,
     const State orig_state(state);
     const State orig_last_state(last_state);
     const Spr orig_spr(*spr);
-    static int count=0;
+    static thread_local int count=0;
     count++;
 #endif
 
@@ -350,6 +350,7 @@ void add_arg_thread(LocalTrees *trees, const StatesModel &states_model,
     int nleaves = trees->get_num_leaves();
     int nnodes = trees->nnodes;
     int nnodes2 = nnodes + 2;
+    trees->reset_index();
 
     // node names
     int newleaf = nleaves;
@@ -360,7 +361,7 @@ void add_arg_thread(LocalTrees *trees, const StatesModel &states_model,
     State last_state;
     LocalTree *last_tree = NULL;
 #ifdef DEBUG
-    static int count=0;
+    static thread_local int count=0;
 #endif
 
     assert_trees(trees, pop_tree, true);
@@ -508,6 +509,7 @@ void remove_arg_thread(LocalTrees *trees, int remove_seqid,
     int nleaves = trees->get_num_leaves();
     int displace[nnodes];
     int last_leaf = nleaves - 1;
+    trees->reset_index();
 
     // find leaf to remove from seqid
     int remove_leaf = -1;
@@ -836,7 +838,7 @@ void sample_arg_removal_path_forward(
             if (next_nodes[1] == -1)
                 j = 0;
             else
-                j = int(rand() < prob_switch);
+                j = int(rand_int() < prob_switch);
             path[i++] = next_nodes[j];
 
             // ensure that a removal path re-enters the local tree correctly
@@ -873,7 +875,7 @@ void sample_arg_removal_path_backward(
         if (prev_nodes[1] == -1)
             j = 0;
         else
-            j = int(rand() < prob_switch);
+            j = int(rand_int() < prob_switch);
         path[i--] = prev_nodes[j];
 
         spr2 = &it->spr;
@@ -1396,7 +1398,7 @@ void add_spr_branch(const LocalTree *tree, const LocalTree *last_tree,
     const LocalNode *last_nodes = last_tree->nodes;
     int node2 = state.node;
     int last_newcoal = last_nodes[last_subtree_root].parent;
-    static int count=0;
+    static thread_local int count=0;
     bool fix_mapping=true;
     count++;
 
@@ -1543,8 +1545,9 @@ void add_arg_thread_path(LocalTrees *trees, const StatesModel &states_model,
     int last_subtree_root = -1;
     unsigned int irecomb = 0;
     int end = trees->start_coord;
+    trees->reset_index();
 #ifdef DEBUG
-    static int count=0;
+    static thread_local int count=0;
     LocalTree orig_tree;
     LocalTree orig_last_tree;
     Spr orig_spr;
@@ -1561,6 +1564,7 @@ void add_arg_thread_path(LocalTrees *trees, const StatesModel &states_model,
         const int subtree_root = nodes[tree->root].child[0];
         states_model.get_coal_states(tree, states);
         int nstates = states.size();
+        trees->save_block(it);
  #ifdef DEBUG
         orig_tree.copy(*tree);
         orig_spr.copy(*spr);
@@ -1664,7 +1668,7 @@ void add_arg_thread_path(LocalTrees *trees, const StatesModel &states_model,
             // insert new tree and spr into local trees list
             it->blocklen = pos - start;
             ++it;
-            it = trees->trees.insert(it,
+            it = trees->insert_block(it,
                 LocalTreeSpr(new_tree, spr2, block_end - pos, mapping2));
 
             // remember the previous tree for next iteration of loop
@@ -1724,8 +1728,8 @@ void remove_arg_thread_path(LocalTrees *trees, const int *removal_path,
     LocalTree *tree = NULL;
     State *original_states = NULL;
 #ifdef DEBUG
-    static int count=0;
-    static int call_count=0;
+    static thread_local int count=0;
+    static thread_local int call_count=0;
     call_count++;
     assert_trees(trees, pop_tree, false);
     LocalTree orig_last_tree;
@@ -1738,6 +1742,7 @@ void remove_arg_thread_path(LocalTrees *trees, const int *removal_path,
     if (original_thread) {
         original_states = new State [trees->length()];
     }
+    trees->reset_index();
 
     int i = 0;
     int end = trees->start_coord;
@@ -1748,6 +1753,7 @@ void remove_arg_thread_path(LocalTrees *trees, const int *removal_path,
         LocalNode *nodes = tree->nodes;
         int start = end;
         end += it->blocklen;
+        trees->save_block(it);
 
 #ifdef DEBUG
         count++;
@@ -1820,6 +1826,7 @@ void remove_arg_thread_path(LocalTrees *trees, const int *removal_path,
 
 
         // fix SPR
+        trees->save_block(it2);
         Spr *spr = &it2->spr;
         int *mapping = it2->mapping;
 
@@ -1,6 +1,8 @@
 // c++ includes
 #include <list>
+#include <map>
 #include <vector>
+#include <stdint.h>
 #include <string.h>
 
 // arghmm includes
@@ -35,9 +37,10 @@ double calc_arg_likelihood(const ArgModel *model, const Sequences *sequences,
     for (int j=0; j<nseqs; j++)
         seqs[j] = sequences->seqs[trees->seqids[j]];
 
-    int end = trees->start_coord;
+    int end;
     int mu_idx = 0, rho_idx = 0;
-    for (LocalTrees::const_iterator it=trees->begin(); it!=trees->end(); ++it) {
+    LocalTrees::const_iterator it = trees->get_first_block(start_coord, end);
+    for (; it != trees->end(); ++it) {
         int start = end;
         end = start + it->blocklen;
         if (end <= start_coord) continue;
@@ -57,6 +60,67 @@ double calc_arg_likelihood(const ArgModel *model, const Sequences *sequences,
 }
 
 
+// Likelihood of the block [start, end) of an uncompressed ARG given the
+// compressed sequences.  The sites that were compressed away are filled
+// in as invariant, or as missing where masked.
+static double calc_block_likelihood(const ArgModel *local_model,
+                                    const Sequences *sequences,
+                                    const LocalTree *tree, const int *seqids,
+                                    const SitesMapping* sites_mapping,
+                                    const TrackNullValue *maskmap_uncompressed,
+                                    int start, int end, int *mask_pos)
+{
+    const int nseqs = sequences->get_num_seqs();
+    const int blocklen = end - start;
+    const char default_char = 'A';
+    const bool have_base_probs = ( sequences->base_probs.size() > 0 );
+    const bool mask_sorted = maskmap_uncompressed->is_sorted();
+
+    // get sequences for trees
+    char *seqs[nseqs];
+    char *matrix = new char [blocklen*nseqs];
+    for (int j=0; j<nseqs; j++)
+        seqs[j] = &matrix[j*blocklen];
+    vector<vector<BaseProbs> > base_probs;
+    if (have_base_probs)
+        base_probs.resize(nseqs);
+
+    // find first site within this block
+    const vector<int> &all_sites = sites_mapping->all_sites;
+    unsigned int i2 = lower_bound(all_sites.begin(), all_sites.end(), start) -
+        all_sites.begin();
+
+    // copy sites into new alignment
+    for (int i=start; i<end; i++) {
+        while (i2 < all_sites.size() && all_sites[i2] < i)
+            i2++;
+        if (i2 < all_sites.size() && i == all_sites[i2]) {
+            // copy site
+            for (int j=0; j<nseqs; j++) {
+                seqs[j][i-start] = sequences->seqs[seqids[j]][i2];
+                if (have_base_probs)
+                    base_probs[j].push_back(BaseProbs(sequences->base_probs[seqids[j]][i2]));
+            }
+        } else {
+            // copy non-variant site
+            char c=default_char;
+            if (maskmap_uncompressed->find(i, mask_pos, mask_sorted))
+                c='N';
+            for (int j=0; j<nseqs; j++) {
+                seqs[j][i-start] = c;
+                if (have_base_probs)
+                    base_probs[j].push_back(BaseProbs(default_char));
+            }
+        }
+    }
+
+    double lnl = likelihood_tree(tree, local_model, seqs, base_probs,
+                                 nseqs, 0, blocklen);
+    delete [] matrix;
+    return lnl;
+}
+
+
     // TODO: This fills in compressed sites with A's... should
     // take mask into account!
 // NOTE: trees should be uncompressed and sequences compressed
@@ -71,8 +135,6 @@ double calc_arg_likelihood(const ArgModel *model, const Sequences *sequences,
         return calc_arg_likelihood(model, sequences, trees, start_coord, end_coord);
 
     double lnl = 0.0;
-    int nseqs = sequences->get_num_seqs();
-    const char default_char = 'A';
 
     if (start_coord < trees->start_coord)
         start_coord = trees->start_coord;
@@ -83,20 +145,12 @@ double calc_arg_likelihood(const ArgModel *model, const Sequences *sequences,
     if (trees->nnodes < 3)
         return lnl += log(.25) * (end_coord - start_coord);
 
-    bool have_base_probs = ( sequences->base_probs.size() > 0 );
-    vector<vector<BaseProbs> > base_probs;
-    if (have_base_probs) {
-        for (int j=0; j < nseqs; j++) {
-            base_probs.push_back(vector<BaseProbs>());
-        }
-    }
-
-    int end = trees->start_coord;
+    int end;
     int mu_idx = 0;
     int rho_idx = 0;
     int mask_pos=0;
-    bool mask_sorted = maskmap_uncompressed->is_sorted();
-    for (LocalTrees::const_iterator it=trees->begin(); it!=trees->end(); ++it) {
+    LocalTrees::const_iterator it = trees->get_first_block(start_coord, end);
+    for (; it != trees->end(); ++it) {
         int start = end;
         end = start + it->blocklen;
         if (end <= start_coord) continue;
@@ -105,56 +159,14 @@ double calc_arg_likelihood(const ArgModel *model, const Sequences *sequences,
             start = start_coord;
         if (end > end_coord)
             end = end_coord;
-        int blocklen = end - start;
-        LocalTree *tree = it->tree;
-
-
-        // get sequences for trees
-        char *seqs[nseqs];
-        char *matrix = new char [blocklen*nseqs];
-        for (int j=0; j<nseqs; j++)
-            seqs[j] = &matrix[j*blocklen];
-        if (have_base_probs) {
-            for (int j=0; j < nseqs; j++) base_probs[j].clear();
-        }
-
-
-        // find first site within this block
-        unsigned int i2 = 0;
-
-        // copy sites into new alignment
-        for (int i=start; i<end; i++) {
-            while (i2 < sites_mapping->all_sites.size() &&
-                   sites_mapping->all_sites[i2] < i)
-                i2++;
-            if (i2 < sites_mapping->all_sites.size() &&
-                i == sites_mapping->all_sites[i2]) {
-                // copy site
-                for (int j=0; j<nseqs; j++) {
-                    seqs[j][i-start] = sequences->seqs[trees->seqids[j]][i2];
-                    if (have_base_probs)
-                        base_probs[j].push_back(BaseProbs(sequences->base_probs[trees->seqids[j]][i2]));
-                }
-            } else {
-                // copy non-variant site
-                char c=default_char;
-                if (maskmap_uncompressed->find(i, &mask_pos, mask_sorted))
-                    c='N';
-                for (int j=0; j<nseqs; j++) {
-                    seqs[j][i-start] = c;
-                    if (have_base_probs)
-                        base_probs[j].push_back(BaseProbs(default_char));
-                }
-            }
-        }
 
         ArgModel local_model;
         model->get_local_model((start+end)/2, local_model,
                                &mu_idx, &rho_idx);
-        lnl += likelihood_tree(tree, &local_model, seqs, base_probs,
-                               nseqs, 0, end-start);
-
-        delete [] matrix;
+        lnl += calc_block_likelihood(&local_model, sequences, it->tree,
+                                     &trees->seqids[0], sites_mapping,
+                                     maskmap_uncompressed, start, end,
+                                     &mask_pos);
     }
 
     return lnl;
@@ -292,6 +304,22 @@ void calc_coal_rates_spr_self(const ArgModel *model, const LocalTree *tree,
 }
 
 
+// Returns the number of branches that the branch of 'spr' can recoalesce
+// with in half time interval 'i', and sets 'spr_pop' to their population
+static inline int spr_coal_branches(const ArgModel *model,
+                                    const LocalTree *tree, const Spr &spr,
+                                    const LineageCounts &lineages,
+                                    int broken_age, int i, int *spr_pop)
+{
+    int pop_time = (i+1)/2;
+    *spr_pop = model->get_pop(spr.pop_path, pop_time);
+    int recomb_parent_pop =
+        model->get_pop(tree->nodes[spr.recomb_node].pop_path, pop_time);
+    return lineages.nbranches_pop[*spr_pop][i]
+        - int((!model->smc_prime) && i/2 < broken_age && *spr_pop == recomb_parent_pop);
+}
+
+
 void calc_coal_rates_spr(const ArgModel *model, const LocalTree *tree,
                          const Spr &spr, const LineageCounts &lineages,
                          double *coal_rates)
@@ -300,12 +328,9 @@ void calc_coal_rates_spr(const ArgModel *model, const LocalTree *tree,
     int broken_age = tree->nodes[tree->nodes[spr.recomb_node].parent].age;
 
     for (int i=spr.recomb_time*2; i<=2*spr.coal_time; i++) {
-        int pop_time = (i+1)/2;
-        int spr_pop = model->get_pop(spr.pop_path, pop_time);
-        int recomb_parent_pop =
-            model->get_pop(tree->nodes[spr.recomb_node].pop_path, pop_time);
-        int nbranches = lineages.nbranches_pop[spr_pop][i]
-            - int((!model->smc_prime) && i/2 < broken_age && spr_pop == recomb_parent_pop);
+        int spr_pop;
+        int nbranches = spr_coal_branches(model, tree, spr, lineages,
+                                          broken_age, i, &spr_pop);
         if (nbranches < 0) {
             // the rates here should never be used in downstream calculations
             coal_rates[i]=0;
@@ -472,6 +497,58 @@ double calc_log_self_recomb_prob(const ArgModel *model, LocalTree *tree,
 }
 
 
+// Log prior of the block [start, end) of 'tree': the recombinations
+// within it, including the invisible recombinations from index *self_idx
+// that fall before 'end', and the SPR 'spr' to the next tree, or no
+// recombination at the end if 'spr' is NULL
+static double calc_block_prior(const ArgModel *local_model,
+                               const LocalTree *tree, int start, int end,
+                               const Spr *spr,
+                               const vector<int> &invisible_recomb_pos,
+                               const vector<Spr> &invisible_recombs,
+                               int *self_idx, LineageCounts &lineages,
+                               double **num_coal, double **num_nocoal)
+{
+    double lnl = 0.0;
+    const int num_invis = (int)invisible_recombs.size();
+    int last_pos = start;
+    double treelen = get_treelen(tree, local_model->times,
+                                 local_model->ntimes, false);
+    lineages.count(tree, local_model->pop_tree);
+
+    // not sure what this is for but it is only used for non-SMC' calcs
+    lineages.nrecombs[tree->nodes[tree->root].age]--;
+
+    // calculate probability P(blocklen | T_{i-1})
+    double recomb_rate = max(local_model->rho * treelen, local_model->rho);
+
+    while (*self_idx < num_invis && invisible_recomb_pos[*self_idx] < end) {
+        const int pos = invisible_recomb_pos[*self_idx];
+        lnl += log(recomb_rate) - recomb_rate * (pos - last_pos);
+        last_pos = pos;
+        lnl += calc_log_spr_prob(local_model, tree,
+                                 invisible_recombs[*self_idx], lineages,
+                                 treelen, num_coal, num_nocoal, 1.0, true);
+        (*self_idx)++;
+    }
+
+    if (spr) {
+        // not last block
+        // probability of recombining after blocklen
+        lnl += log(recomb_rate) - recomb_rate * (end - last_pos);
+
+        // get SPR move information
+        lnl += calc_log_spr_prob(local_model, tree, *spr, lineages, treelen,
+                                 num_coal, num_nocoal, 1.0, true);
+    } else {
+        // last block
+        // probability of not recombining after blocklen
+        lnl += - recomb_rate * (end - last_pos);
+    }
+    return lnl;
+}
+
+
 // calculate the probability of an ARG given the model parameters
 double calc_arg_prior(const ArgModel *model, const LocalTrees *trees,
 		      double **num_coal, double **num_nocoal,
@@ -496,82 +573,189 @@ double calc_arg_prior(const ArgModel *model, const LocalTrees *trees,
     if (end_coord < 0 || end_coord > trees->end_coord)
         end_coord = trees->end_coord;
 
-    int next_self_pos = ( num_invis == 0 ?
-                          trees->end_coord + 1 : invisible_recomb_pos[0] );
+    // skip invisible recombinations before the region
     int self_idx = 0;
-    while (start_coord > next_self_pos) {
+    while (self_idx < num_invis && invisible_recomb_pos[self_idx] < start_coord)
         self_idx++;
-        if (self_idx == num_invis) {
-            next_self_pos = trees->end_coord + 1;
-            break;
-        }
-        next_self_pos = invisible_recomb_pos[self_idx];
-    }
 
     // first tree prior
         if (start_coord <= trees->start_coord)
         lnl += calc_log_tree_prior(model, trees->front().tree, lineages);
     //    printLog(LOG_MEDIUM, "tree_prior: %f\n", lnl);
 
-    int end = trees->start_coord;
+    int end;
     int mu_idx = 0, rho_idx = 0;
-    for (LocalTrees::const_iterator it=trees->begin(); it != trees->end();) {
+    LocalTrees::const_iterator it = trees->get_first_block(start_coord, end);
+    for (; it != trees->end(); ++it) {
         int start=end;
         end += it->blocklen;
-        if (end <= start_coord) {++it; continue;}
+        if (end <= start_coord) continue;
         if (start >= end_coord) break;
         if (start < start_coord)
             start = start_coord;
         if (end > end_coord)
             end = end_coord;
-        int last_pos = start;
-        LocalTree *tree = it->tree;
-        double treelen = get_treelen(tree, model->times, model->ntimes, false);
         ArgModel local_model;
         model->get_local_model((start+end)/2, local_model, &mu_idx, &rho_idx);
-        lineages.count(tree, model->pop_tree);
 
-        // not sure what this is for but it is only used for non-SMC' calcs
-        lineages.nrecombs[tree->nodes[tree->root].age]--;
-
-        // calculate probability P(blocklen | T_{i-1})
-        double recomb_rate = max(local_model.rho * treelen, local_model.rho);
-
-        while (next_self_pos < end) {
-            lnl += log(recomb_rate) - recomb_rate * (next_self_pos - last_pos);
-            last_pos = next_self_pos;
-            lnl += calc_log_spr_prob(&local_model, tree, invisible_recombs[self_idx],
-                                     lineages, treelen, num_coal, num_nocoal, 1.0, true);
-            self_idx++;
-            if (self_idx == num_invis) {
-                next_self_pos = end_coord + 1;
-            } else {
-                next_self_pos = invisible_recomb_pos[self_idx];
-            }
-        }
+        LocalTrees::const_iterator it2 = it;
+        ++it2;
+        const Spr *spr = (end < end_coord ? &it2->spr : NULL);
+        lnl += calc_block_prior(&local_model, it->tree, start, end, spr,
+                                invisible_recomb_pos, invisible_recombs,
+                                &self_idx, lineages, num_coal, num_nocoal);
+    }
+    return lnl;
+ }
 
+// Log prior of a block of 'blocklen' sites of 'tree' (one more for the
+// last block), integrating over the recombinations consistent with the
+// SPR 'next_spr' to the next tree, or with no change if it is NULL
+static double calc_block_prior_recomb_integrate(
+    const ArgModel *model, LocalTree *tree, int blocklen,
+    const Spr *next_spr, double rho, LineageCounts &lineages,
+    double **num_coal, double **num_nocoal)
+{
+    double lnl = 0.0;
+    double treelen = get_treelen(tree, model->times, model->ntimes, false);
+    lineages.count(tree, model->pop_tree);
+    const int root_age = tree->nodes[tree->root].age;
+    lineages.nrecombs[root_age]--;  // SMC' calcs not affected by this
 
+    // calculate probability P(blocklen | T_{i-1})
+    double recomb_rate = max(rho * treelen, rho);
 
-        if (end < end_coord) {
-            // not last block
-            // probability of recombining after blocklen
-	    lnl += log(recomb_rate) - recomb_rate * (end - last_pos);
 
-            // get SPR move information
-            ++it;
-            const Spr *spr = &it->spr;
-            lnl += calc_log_spr_prob(&local_model, tree, *spr, lineages, treelen,
-                                     num_coal, num_nocoal, 1.0, true);
+    //for single site, probability of no recomb
+    double pr_no_recomb = exp(-recomb_rate);
+    double pr_recomb = 1.0 - pr_no_recomb;
+    double pr_self = 0.0;
 
-        } else {
-            // last block
-            // probability of not recombining after blocklen
-            lnl += - recomb_rate * (end - last_pos);
-            ++it;
+    // only do this for smc_prime because under non-smc-prime, recombs to
+    // parent/sister branch that do not change topology are still in ARG
+    if (model->smc_prime)
+        pr_self = pr_recomb * exp(calc_log_self_recomb_prob(model, tree, lineages, treelen));
+    double log_pr_nochange  = log(pr_no_recomb + pr_self);
+
+
+    if (blocklen > 1) {
+        lnl += ((double)blocklen - 1.0)*log_pr_nochange;
+    }
+
+    if (next_spr) {
+        // not last block, add probability of any recomb that results in
+        // same topology as sampled SPR
+        const Spr *real_spr = next_spr;
+        int node = real_spr->recomb_node;
+        int parent = tree->nodes[node].parent;
+        int sib = tree->nodes[parent].child[0] == node ?
+            tree->nodes[parent].child[1] : tree->nodes[parent].child[0];
+        int max_age = min(tree->nodes[parent].age,
+                          real_spr->coal_time);
+        assert(tree->nodes[node].age <= max_age);
+        assert(real_spr->recomb_time >= tree->nodes[node].age &&
+               real_spr->recomb_time <= max_age);
+        if (real_spr->coal_time == tree->nodes[parent].age &&
+            (real_spr->coal_node == parent ||
+             real_spr->coal_node == sib) &&
+            model->paths_equal(real_spr->pop_path, tree->nodes[node].pop_path,
+                               real_spr->recomb_time, real_spr->coal_time)) {
+            lnl += log_pr_nochange;
+            return lnl;
         }
+
+        // from here we assume that the SPR changes the tree
+        double recomb_sum = 0.0;
+        int target_path = model->consistent_path(tree->nodes[node].pop_path,
+                                                 real_spr->pop_path,
+                                                 tree->nodes[node].age,
+                                                 real_spr->recomb_time,
+                                                 real_spr->coal_time);
+        double coal_rates[2*model->ntimes];
+        int minage = tree->nodes[node].age;
+        bool coalToSib = false;
+        bool coalToParent = false;
+        if (real_spr->coal_node == sib) {
+            if (model->paths_equal(real_spr->pop_path, tree->nodes[node].pop_path,
+                                   real_spr->recomb_time, real_spr->coal_time)) {
+                coalToSib = true;
+                if (tree->nodes[sib].age < minage)
+                    minage = tree->nodes[sib].age;
+            }
+        } else if (real_spr->coal_node == parent) {
+            int path = model->consistent_path(tree->nodes[node].pop_path,
+                                              tree->nodes[parent].pop_path,
+                                              tree->nodes[node].age,
+                                              tree->nodes[parent].age,
+                                              real_spr->coal_time);
+            if (model->paths_equal(path, real_spr->pop_path,
+                                   real_spr->recomb_time, real_spr->coal_time)) {
+                coalToParent = true;
+                if (tree->nodes[sib].age < minage)
+                    minage = tree->nodes[sib].age;
+            }
+        }
+
+        calc_coal_rates_spr(model, tree,
+                            Spr(node, minage, real_spr->coal_node,
+                                real_spr->coal_time, target_path),
+                            lineages, coal_rates);
+        int this_max_age = min(max_age,
+                               model->max_matching_path(tree->nodes[node].pop_path,
+                                                        target_path, tree->nodes[node].age));
+        for (int age=tree->nodes[node].age; age <= this_max_age; age++) {
+            Spr spr(node, age, real_spr->coal_node, real_spr->coal_time,
+                    target_path);
+            double val = exp(calc_log_spr_prob(model, tree, spr, lineages,
+                                               treelen, num_coal, num_nocoal,
+                                               age == real_spr->recomb_time
+                                               ? 1.0 : 0.0, true, coal_rates));
+            recomb_sum += val;
+        }
+        if (coalToSib) {
+            if (! model->paths_equal(target_path, tree->nodes[sib].pop_path,
+                             tree->nodes[sib].age, real_spr->coal_time)) {
+                calc_coal_rates_spr(model, tree,
+                                    Spr(sib, tree->nodes[sib].age,
+                                        node, real_spr->coal_time,
+                                        tree->nodes[sib].pop_path),
+                                    lineages, coal_rates);
+            }
+            for (int age=tree->nodes[sib].age; age <= max_age; age++) {
+                Spr spr(sib, age, node, real_spr->coal_time,
+                        tree->nodes[sib].pop_path);
+                double val = exp(calc_log_spr_prob(model, tree, spr, lineages,
+                                                   treelen, num_coal, num_nocoal,
+                                                   0, true, coal_rates));
+                recomb_sum += val;
+            }
+        } else if (coalToParent) {
+            int path = model->consistent_path(tree->nodes[sib].pop_path,
+                                              tree->nodes[parent].pop_path,
+                                              tree->nodes[sib].age,
+                                              tree->nodes[parent].age,
+                                              real_spr->coal_time);
+            if (! model->paths_equal(path, tree->nodes[sib].pop_path,
+                             tree->nodes[sib].age, real_spr->coal_time)) {
+                calc_coal_rates_spr(model, tree,
+                                    Spr(sib, tree->nodes[sib].age,
+                                        parent, real_spr->coal_time, path),
+                                    lineages, coal_rates);
+            }
+            for (int age=tree->nodes[sib].age; age <= max_age; age++) {
+                Spr spr(sib, age, parent, real_spr->coal_time, path);
+                recomb_sum += exp(calc_log_spr_prob(model, tree, spr, lineages,
+                                                    treelen, num_coal, num_nocoal,
+                                                    0, true, coal_rates));
+            }
+        }
+        lnl += log(pr_recomb * recomb_sum);
+        if (isinf(lnl))
+            assert(0);
     }
     return lnl;
- }
+}
+
 
 double calc_arg_prior_recomb_integrate(const ArgModel *model,
                                        const LocalTrees *trees,
@@ -600,8 +784,9 @@ double calc_arg_prior_recomb_integrate(const ArgModel *model,
     //    printLog(LOG_MEDIUM, "tree_prior: %f\n", lnl);
 
     int rho_idx = 0;
-    int end = trees->start_coord;
-    for (LocalTrees::const_iterator it=trees->begin(); it != trees->end(); ) {
+    int end;
+    LocalTrees::const_iterator it = trees->get_first_block(start_coord, end);
+    for (; it != trees->end(); ) {
         int start = end;
         end += it->blocklen;
         if (end <= start_coord) {++it; continue;}
@@ -611,164 +796,429 @@ double calc_arg_prior_recomb_integrate(const ArgModel *model,
         if (end > end_coord)
             end = end_coord;
         int blocklen = end - start;
-        LocalTree *tree = it->tree;
-        double treelen = get_treelen(tree, model->times, model->ntimes, false);
-        lineages.count(tree, model->pop_tree);
-        const int root_age = tree->nodes[tree->root].age;
-        lineages.nrecombs[root_age]--;  // SMC' calcs not affected by this
-
-        // calculate probability P(blocklen | T_{i-1})
+        LocalTrees::const_iterator it2 = it;
+        ++it2;
+        const Spr *spr = NULL;
+        if (end < end_coord)
+            spr = &it2->spr;
+        else
+            blocklen++;
         double rho = model->get_local_rho(trees->start_coord, &rho_idx);
-        double recomb_rate = max(rho * treelen, rho);
+        lnl += calc_block_prior_recomb_integrate(model, it->tree, blocklen,
+                                                 spr, rho, lineages,
+                                                 num_coal, num_nocoal);
+        it = it2;
+    }
+    assert(!isnan(lnl));
+    assert(!isinf(lnl));
+    return lnl;
+}
+
+
+double calc_arg_prior_recomb_integrate(const ArgModel *model,
+                                       const LocalTrees *trees,
+                                       int start_coord, int end_coord) {
+    return calc_arg_prior_recomb_integrate(model, trees,
+                                           NULL, NULL, NULL,
+                                           start_coord, end_coord);
+}
 
 
-        //for single site, probability of no recomb
-        double pr_no_recomb = exp(-recomb_rate);
-        double pr_recomb = 1.0 - pr_no_recomb;
-        double pr_self = 0.0;
+//=============================================================================
+// population size statistics of the ARG prior
 
-        // only do this for smc_prime because under non-smc-prime, recombs to
-        // parent/sister branch that do not change topology are still in ARG
-        if (model->smc_prime)
-            pr_self = pr_recomb * exp(calc_log_self_recomb_prob(model, tree, lineages, treelen));
-        double log_pr_nochange  = log(pr_no_recomb + pr_self);
 
+bool PopsizePriorStats::CoalTerm::operator<(const CoalTerm &other) const
+{
+    if (idx1 != other.idx1) return idx1 < other.idx1;
+    if (nbranches1 != other.nbranches1) return nbranches1 < other.nbranches1;
+    if (idx2 != other.idx2) return idx2 < other.idx2;
+    return nbranches2 < other.nbranches2;
+}
 
-        if (end >= end_coord)
-            blocklen++;
-        if (blocklen > 1) {
-            lnl += ((double)blocklen - 1.0)*log_pr_nochange;
+
+void PopsizePriorStats::calc(const ArgModel *model, const LocalTrees *trees)
+{
+    const int ntimes = model->ntimes;
+    const int npops = model->num_pops();
+    LineageCounts lineages(ntimes, npops);
+    map<CoalTerm, double> terms;
+
+    nintervals = 2 * ntimes;
+    tree_counts.clear();
+    nocoal_rates.assign(npops * nintervals, 0.0);
+    coal_terms.clear();
+
+    // first tree prior, as in calc_log_tree_prior()
+    double lnl = calc_log_tree_prior(model, trees->front().tree, lineages);
+    for (int pop=0; pop < npops; pop++) {
+        for (int i=0; i<ntimes-1; i++) {
+            TreeCounts counts;
+            counts.idx = pop * nintervals + 2*i;
+            counts.a = (lineages.ncoals_pop[pop][i] +
+                        lineages.nbranches_pop[pop][2*i])/2;
+            counts.b = lineages.nbranches_pop[pop][2*i];
+            counts.t = model->coal_time_steps[2*i];
+            if (i > 0) counts.t += model->coal_time_steps[2*i-1];
+            tree_counts.push_back(counts);
         }
+    }
 
-        if (end < end_coord) {
-            // not last block, add probability of any recomb that results in
-            // same topology as sampled SPR
-
-            // get SPR move information
-            ++it;
-            const Spr *real_spr = &it->spr;
-            int node = real_spr->recomb_node;
-            int parent = tree->nodes[node].parent;
-            int sib = tree->nodes[parent].child[0] == node ?
-                tree->nodes[parent].child[1] : tree->nodes[parent].child[0];
-            int max_age = min(tree->nodes[parent].age,
-                              real_spr->coal_time);
-            assert(tree->nodes[node].age <= max_age);
-            assert(real_spr->recomb_time >= tree->nodes[node].age &&
-                   real_spr->recomb_time <= max_age);
-            if (real_spr->coal_time == tree->nodes[parent].age &&
-                (real_spr->coal_node == parent ||
-                 real_spr->coal_node == sib) &&
-                model->paths_equal(real_spr->pop_path, tree->nodes[node].pop_path,
-                                   real_spr->recomb_time, real_spr->coal_time)) {
-                lnl += log_pr_nochange;
-                continue;
-            }
+    // re-coalescence of each SPR, as in calc_log_spr_prob()
+    const vector<int> no_invisible_pos;
+    const vector<Spr> no_invisible;
+    int self_idx = 0;
+    int end = trees->start_coord;
+    int mu_idx = 0, rho_idx = 0;
+    for (LocalTrees::const_iterator it=trees->begin();
+         it != trees->end(); ++it) {
+        int start = end;
+        end += it->blocklen;
+        ArgModel local_model;
+        model->get_local_model((start+end)/2, local_model, &mu_idx, &rho_idx);
 
-            // from here we assume that the SPR changes the tree
-            double recomb_sum = 0.0;
-            int target_path = model->consistent_path(tree->nodes[node].pop_path,
-                                                     real_spr->pop_path,
-                                                     tree->nodes[node].age,
-                                                     real_spr->recomb_time,
-                                                     real_spr->coal_time);
-            double coal_rates[2*model->ntimes];
-            int minage = tree->nodes[node].age;
-            bool coalToSib = false;
-            bool coalToParent = false;
-            if (real_spr->coal_node == sib) {
-                if (model->paths_equal(real_spr->pop_path, tree->nodes[node].pop_path,
-                                       real_spr->recomb_time, real_spr->coal_time)) {
-                    coalToSib = true;
-                    if (tree->nodes[sib].age < minage)
-                        minage = tree->nodes[sib].age;
-                }
-            } else if (real_spr->coal_node == parent) {
-                int path = model->consistent_path(tree->nodes[node].pop_path,
-                                                  tree->nodes[parent].pop_path,
-                                                  tree->nodes[node].age,
-                                                  tree->nodes[parent].age,
-                                                  real_spr->coal_time);
-                if (model->paths_equal(path, real_spr->pop_path,
-                                       real_spr->recomb_time, real_spr->coal_time)) {
-                    coalToParent = true;
-                    if (tree->nodes[sib].age < minage)
-                        minage = tree->nodes[sib].age;
-                }
-            }
+        LocalTrees::const_iterator it2 = it;
+        ++it2;
+        const Spr *spr = (it2 != trees->end() ? &it2->spr : NULL);
+        lnl += calc_block_prior(&local_model, it->tree, start, end, spr,
+                                no_invisible_pos, no_invisible, &self_idx,
+                                lineages, NULL, NULL);
 
-            calc_coal_rates_spr(model, tree,
-                                Spr(node, minage, real_spr->coal_node,
-                                    real_spr->coal_time, target_path),
-                                lineages, coal_rates);
-            int this_max_age = min(max_age,
-                                   model->max_matching_path(tree->nodes[node].pop_path,
-                                                            target_path, tree->nodes[node].age));
-            for (int age=tree->nodes[node].age; age <= this_max_age; age++) {
-                Spr spr(node, age, real_spr->coal_node, real_spr->coal_time,
-                        target_path);
-                double val = exp(calc_log_spr_prob(model, tree, spr, lineages,
-                                                   treelen, num_coal, num_nocoal,
-                                                   age == real_spr->recomb_time
-                                                   ? 1.0 : 0.0, true, coal_rates));
-                recomb_sum += val;
-            }
-            if (coalToSib) {
-                if (! model->paths_equal(target_path, tree->nodes[sib].pop_path,
-                                 tree->nodes[sib].age, real_spr->coal_time)) {
-                    calc_coal_rates_spr(model, tree,
-                                        Spr(sib, tree->nodes[sib].age,
-                                            node, real_spr->coal_time,
-                                            tree->nodes[sib].pop_path),
-                                        lineages, coal_rates);
-                }
-                for (int age=tree->nodes[sib].age; age <= max_age; age++) {
-                    Spr spr(sib, age, node, real_spr->coal_time,
-                            tree->nodes[sib].pop_path);
-                    double val = exp(calc_log_spr_prob(model, tree, spr, lineages,
-                                                       treelen, num_coal, num_nocoal,
-                                                       0, true, coal_rates));
-                    recomb_sum += val;
-                }
-            } else if (coalToParent) {
-                int path = model->consistent_path(tree->nodes[sib].pop_path,
-                                                  tree->nodes[parent].pop_path,
-                                                  tree->nodes[sib].age,
-                                                  tree->nodes[parent].age,
-                                                  real_spr->coal_time);
-                if (! model->paths_equal(path, tree->nodes[sib].pop_path,
-                                 tree->nodes[sib].age, real_spr->coal_time)) {
-                    calc_coal_rates_spr(model, tree,
-                                        Spr(sib, tree->nodes[sib].age,
-                                            parent, real_spr->coal_time, path),
-                                        lineages, coal_rates);
-                }
-                for (int age=tree->nodes[sib].age; age <= max_age; age++) {
-                    Spr spr(sib, age, parent, real_spr->coal_time, path);
-                    recomb_sum += exp(calc_log_spr_prob(model, tree, spr, lineages,
-                                                        treelen, num_coal, num_nocoal,
-                                                        0, true, coal_rates));
-                }
+        const LocalTree *tree = it->tree;
+        if (!spr || spr->recomb_node == tree->root)
+            continue;
+
+        const int k = spr->recomb_time;
+        const int j = spr->coal_time;
+        const int broken_age =
+            tree->nodes[tree->nodes[spr->recomb_node].parent].age;
+        int pop;
+        for (int m=2*k; m<2*j-1; m++) {
+            int nbranches = spr_coal_branches(model, tree, *spr, lineages,
+                                              broken_age, m, &pop);
+            if (nbranches > 0)
+                nocoal_rates[pop * nintervals + m] +=
+                    model->coal_time_steps[m] * nbranches / 2.0;
+        }
+        if (j < ntimes - 2) {
+            CoalTerm term;
+            term.nbranches1 = max(spr_coal_branches(
+                model, tree, *spr, lineages, broken_age, 2*j, &pop), 0);
+            term.idx1 = pop * nintervals + 2*j;
+            term.rate1 = model->coal_time_steps[2*j] * term.nbranches1 / 2.0;
+            term.idx2 = -1;
+            term.nbranches2 = 0;
+            term.rate2 = 0.0;
+            if (j > k) {
+                term.nbranches2 = max(spr_coal_branches(
+                    model, tree, *spr, lineages, broken_age, 2*j-1, &pop), 0);
+                term.idx2 = pop * nintervals + 2*j-1;
+                term.rate2 = model->coal_time_steps[2*j-1] *
+                    term.nbranches2 / 2.0;
             }
-            lnl += log(pr_recomb * recomb_sum);
-	    if (isinf(lnl))
-		assert(0);
-        } else {
-            ++it;
+            terms[term] += 1.0;
         }
     }
-    assert(!isnan(lnl));
-    assert(!isinf(lnl));
+
+    for (map<CoalTerm, double>::iterator it=terms.begin();
+         it != terms.end(); ++it) {
+        coal_terms.push_back(it->first);
+        coal_terms.back().count = it->second;
+    }
+
+    const_lnl = lnl - calc_popsize_terms(model);
+}
+
+
+// Returns the terms of the prior that depend on population sizes
+double PopsizePriorStats::calc_popsize_terms(const ArgModel *model) const
+{
+    assert(nintervals == 2 * model->ntimes);
+    double lnl = 0.0;
+
+    for (unsigned int i=0; i<tree_counts.size(); i++) {
+        const TreeCounts &counts = tree_counts[i];
+        lnl += log_prob_coal_counts(counts.a, counts.b, counts.t,
+                                    2.0 * get_popsize(model, counts.idx));
+    }
+
+    for (unsigned int i=0; i<nocoal_rates.size(); i++) {
+        if (nocoal_rates[i] != 0.0)
+            lnl -= nocoal_rates[i] / get_popsize(model, i);
+    }
+
+    for (unsigned int i=0; i<coal_terms.size(); i++) {
+        const CoalTerm &term = coal_terms[i];
+        double rate = term.rate1 / get_popsize(model, term.idx1);
+        if (term.idx2 >= 0)
+            rate += term.rate2 / get_popsize(model, term.idx2);
+        lnl += term.count * log(1.0 - exp(-rate));
+    }
+
     return lnl;
 }
 
 
-double calc_arg_prior_recomb_integrate(const ArgModel *model,
-                                       const LocalTrees *trees,
-                                       int start_coord, int end_coord) {
-    return calc_arg_prior_recomb_integrate(model, trees,
-                                           NULL, NULL, NULL,
-                                           start_coord, end_coord);
+//=============================================================================
+// cached ARG scores
+
+
+// Mixes 'value' into the hash 'h'
+static inline uint64_t hash_mix(uint64_t h, uint64_t value)
+{
+    h ^= value + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+    h *= 0xbf58476d1ce4e5b9ULL;
+    return h ^ (h >> 31);
+}
+
+static inline uint64_t hash_mix(uint64_t h, double value)
+{
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return hash_mix(h, bits);
+}
+
+static inline uint64_t hash_mix(uint64_t h, const Spr &spr)
+{
+    h = hash_mix(h, (uint64_t) (spr.recomb_node + 1));
+    h = hash_mix(h, (uint64_t) spr.recomb_time);
+    h = hash_mix(h, (uint64_t) spr.coal_node);
+    h = hash_mix(h, (uint64_t) spr.coal_time);
+    return hash_mix(h, (uint64_t) spr.pop_path);
+}
+
+
+// Returns a hash of the topology, ages and population paths of a tree
+static uint64_t hash_tree(const LocalTree *tree)
+{
+    uint64_t h = hash_mix(0, (uint64_t) tree->nnodes);
+    const LocalNode *nodes = tree->nodes;
+    for (int i=0; i<tree->nnodes; i++) {
+        h = hash_mix(h, (uint64_t) nodes[i].parent);
+        h = hash_mix(h, ((uint64_t) nodes[i].age << 32) |
+                     (uint32_t) nodes[i].pop_path);
+    }
+    return h;
+}
+
+
+// Returns a hash of the model parameters the prior depends on, besides
+// the local recombination rates
+static uint64_t hash_prior_model(const ArgModel *model)
+{
+    uint64_t h = hash_mix(0, (uint64_t) model->smc_prime);
+    for (int pop=0; pop < model->num_pops(); pop++)
+        for (int i=0; i < 2*model->ntimes-1; i++)
+            h = hash_mix(h, model->popsizes[pop][i]);
+    if (model->pop_tree) {
+        const PopulationTree *pop_tree = model->pop_tree;
+        for (unsigned int t=0; t < pop_tree->mig_matrix.size(); t++)
+            for (int a=0; a < pop_tree->npop; a++)
+                for (int b=0; b < pop_tree->npop; b++)
+                    h = hash_mix(h, pop_tree->mig_matrix[t].get(a, b));
+    }
+    return h;
+}
+
+
+// Looks up the cached score with 'key', moving it to the front
+static inline bool find_score(CachedScore *entries, uint64_t key,
+                              double *value)
+{
+    if (entries[0].key != key) {
+        if (entries[1].key != key)
+            return false;
+        swap(entries[0], entries[1]);
+    }
+    *value = entries[0].value;
+    return true;
+}
+
+
+// Caches a score, replacing the least recently used one
+static inline void add_score(CachedScore *entries, uint64_t key,
+                             double value)
+{
+    entries[1] = entries[0];
+    entries[0].key = key;
+    entries[0].value = value;
+}
+
+
+// Keys of 0 mean no score
+static inline uint64_t score_key(uint64_t h)
+{
+    return h ? h : 1;
+}
+
+
+void calc_arg_scores(const ArgModel *model, const Sequences *sequences,
+                     const LocalTrees *trees, ArgScores *scores,
+                     const SitesMapping *sites_mapping,
+                     const TrackNullValue *maskmap_uncompressed,
+                     const vector<int> &invisible_recomb_pos,
+                     const vector<Spr> &invisible_recombs)
+{
+    const int start_coord = trees->start_coord;
+    const int num_invis = (int)invisible_recombs.size();
+    assert(num_invis == (int)invisible_recomb_pos.size());
+    assert(!(scores->calc_noncompat && sites_mapping));
+
+    // special case for truck genealogies
+    if (trees->nnodes < 3) {
+        if (scores->calc_prior)
+            scores->prior = calc_arg_prior(
+                model, trees, NULL, NULL, -1, -1,
+                invisible_recomb_pos, invisible_recombs);
+        if (scores->calc_prior2)
+            scores->prior2 = calc_arg_prior_recomb_integrate(
+                model, trees, NULL, NULL, NULL);
+        if (scores->calc_likelihood)
+            scores->likelihood = calc_arg_likelihood(
+                model, sequences, trees, sites_mapping,
+                maskmap_uncompressed);
+        if (scores->calc_noncompat)
+            scores->noncompat = count_noncompat(trees, sequences);
+        return;
+    }
+
+    // what the scores depend on besides the block
+    uint64_t seqs_key = hash_mix(0, (uint64_t) sequences);
+    seqs_key = hash_mix(seqs_key, (uint64_t) sequences->version);
+    seqs_key = hash_mix(seqs_key, (uint64_t) sites_mapping);
+    seqs_key = hash_mix(seqs_key, (uint64_t) maskmap_uncompressed);
+    for (unsigned int i=0; i<trees->seqids.size(); i++)
+        seqs_key = hash_mix(seqs_key, (uint64_t) trees->seqids[i]);
+    const uint64_t model_key = hash_prior_model(model);
+
+    // get sequences for trees
+    const int nseqs = sequences->get_num_seqs();
+    const int nleaves = trees->get_num_leaves();
+    const char *seqs[nseqs];
+    for (int j=0; j<nseqs; j++)
+        seqs[j] = sequences->seqs[trees->seqids[j]];
+
+    LineageCounts lineages(model->ntimes, model->num_pops());
+    double prior = 0.0, prior2 = 0.0, likelihood = 0.0;
+    int noncompat = 0;
+
+    // first tree prior
+    if (scores->calc_prior || scores->calc_prior2) {
+        double lnl = calc_log_tree_prior(model, trees->front().tree,
+                                         lineages);
+        prior = prior2 = lnl;
+    }
+
+    int self_idx = 0;
+    while (self_idx < num_invis && invisible_recomb_pos[self_idx] < start_coord)
+        self_idx++;
+
+    int end = start_coord;
+    int mu_idx = 0, rho_idx = 0, rho_idx2 = 0, mask_pos = 0;
+    const double rho2 = model->get_local_rho(start_coord, &rho_idx2);
+    for (LocalTrees::const_iterator it=trees->begin(); it != trees->end();) {
+        const int start = end;
+        end += it->blocklen;
+        LocalTrees::const_iterator it2 = it;
+        ++it2;
+        const Spr *next_spr = (it2 != trees->end() ? &it2->spr : NULL);
+        LocalTree *tree = it->tree;
+        BlockScores &cache = it->scores;
+        const uint64_t tree_key = hash_mix(
+            hash_mix(hash_tree(tree), (uint64_t) start), (uint64_t) end);
+
+        ArgModel local_model;
+        model->get_local_model((start+end)/2, local_model, &mu_idx, &rho_idx);
+
+        if (scores->calc_prior) {
+            // invisible recombinations within block
+            uint64_t h = hash_mix(tree_key, model_key);
+            h = hash_mix(h, local_model.rho);
+            if (next_spr)
+                h = hash_mix(h, *next_spr);
+            int self_end = self_idx;
+            while (self_end < num_invis && invisible_recomb_pos[self_end] < end) {
+                h = hash_mix(h, (uint64_t) invisible_recomb_pos[self_end]);
+                h = hash_mix(h, invisible_recombs[self_end]);
+                self_end++;
+            }
+            const uint64_t key = score_key(h);
+
+            double lnl;
+            if (!find_score(cache.prior, key, &lnl)) {
+                lnl = calc_block_prior(&local_model, tree, start, end,
+                                       next_spr, invisible_recomb_pos,
+                                       invisible_recombs, &self_idx,
+                                       lineages, NULL, NULL);
+                add_score(cache.prior, key, lnl);
+            }
+            self_idx = self_end;
+            prior += lnl;
+        }
+
+        if (scores->calc_prior2) {
+            int blocklen = end - start + (next_spr ? 0 : 1);
+            uint64_t h = hash_mix(hash_mix(tree_key, model_key), rho2);
+            if (next_spr)
+                h = hash_mix(h, *next_spr);
+            const uint64_t key = score_key(h);
+
+            double lnl;
+            if (!find_score(cache.prior2, key, &lnl)) {
+                lnl = calc_block_prior_recomb_integrate(
+                    model, tree, blocklen, next_spr, rho2, lineages,
+                    NULL, NULL);
+                add_score(cache.prior2, key, lnl);
+            }
+            prior2 += lnl;
+        }
+
+        if (scores->calc_likelihood) {
+            const uint64_t key = score_key(hash_mix(
+                hash_mix(tree_key, seqs_key), local_model.mu));
+
+            double lnl;
+            if (!find_score(cache.likelihood, key, &lnl)) {
+                if (sites_mapping)
+                    lnl = calc_block_likelihood(
+                        &local_model, sequences, tree, &trees->seqids[0],
+                        sites_mapping, maskmap_uncompressed, start, end,
+                        &mask_pos);
+                else
+                    lnl = likelihood_tree(tree, &local_model, seqs,
+                                          sequences->base_probs, nseqs,
+                                          start, end);
+                add_score(cache.likelihood, key, lnl);
+            }
+            likelihood += lnl;
+        }
+
+        if (scores->calc_noncompat) {
+            const uint64_t key = score_key(hash_mix(tree_key, seqs_key));
+
+            double count;
+            if (!find_score(cache.noncompat, key, &count)) {
+                const char *subseqs[nleaves];
+                for (int i=0; i<nleaves; i++)
+                    subseqs[i] = &sequences->seqs[trees->seqids[i]][start];
+                count = count_noncompat(tree, subseqs, nleaves, 0,
+                                        end - start, NULL);
+                add_score(cache.noncompat, key, count);
+            }
+            noncompat += (int) count;
+        }
+
+        it = it2;
+    }
+
+    if (scores->calc_prior)
+        scores->prior = prior;
+    if (scores->calc_prior2)
+        scores->prior2 = prior2;
+    if (scores->calc_likelihood)
+        scores->likelihood = likelihood;
+    if (scores->calc_noncompat)
+        scores->noncompat = noncompat;
 }
 
 
@@ -49,6 +49,108 @@ double calc_arg_joint_prob(const ArgModel *model, const Sequences *sequences,
                            const LocalTrees *trees);
 
 
+// Statistics of an ARG from which its prior (as calc_arg_prior()) is
+// calculated for any population sizes without revisiting the local trees.
+// The prior factors into terms independent of population sizes, the
+// lineage counts of the first tree, and the rates of not coalescing and of
+// coalescing in each time interval summed over the SPRs.
+class PopsizePriorStats
+{
+public:
+    PopsizePriorStats() :
+        const_lnl(0.0),
+        nintervals(0)
+    {}
+
+    // Gathers the statistics of 'trees' in one pass
+    void calc(const ArgModel *model, const LocalTrees *trees);
+
+    // Returns the prior of the ARG for the population sizes of 'model'
+    double log_prior(const ArgModel *model) const
+    {
+        return const_lnl + calc_popsize_terms(model);
+    }
+
+protected:
+    // Lineages a -> b of the first tree over time 't' in the population
+    // and time interval of 'idx'
+    struct TreeCounts {
+        int idx;
+        int a, b;
+        double t;
+    };
+
+    // 'count' SPRs recoalescing in the intervals 'idx1' and 'idx2' (-1 if
+    // none) with the given rates at unit population size
+    struct CoalTerm {
+        bool operator<(const CoalTerm &other) const;
+
+        int idx1, nbranches1;
+        int idx2, nbranches2;
+        double rate1, rate2;
+        double count;
+    };
+
+    double calc_popsize_terms(const ArgModel *model) const;
+
+    // population size of index 'pop * nintervals + interval'
+    inline double get_popsize(const ArgModel *model, int idx) const
+    {
+        return model->popsizes[idx / nintervals][idx % nintervals];
+    }
+
+    double const_lnl;             // terms independent of population sizes
+    int nintervals;               // half time intervals per population
+    vector<TreeCounts> tree_counts;
+    vector<double> nocoal_rates;  // rates of not coalescing at unit
+                                  // population size, by index
+    vector<CoalTerm> coal_terms;
+};
+
+
+
+// Scores of an ARG calculated by calc_arg_scores()
+class ArgScores
+{
+public:
+    ArgScores(bool calc_prior=true, bool calc_prior2=false,
+              bool calc_likelihood=true, bool calc_noncompat=false) :
+        calc_prior(calc_prior),
+        calc_prior2(calc_prior2),
+        calc_likelihood(calc_likelihood),
+        calc_noncompat(calc_noncompat),
+        prior(0.0),
+        prior2(0.0),
+        likelihood(0.0),
+        noncompat(0)
+    {}
+
+    // which scores to calculate
+    bool calc_prior;
+    bool calc_prior2;
+    bool calc_likelihood;
+    bool calc_noncompat;
+
+    double prior;        // as calc_arg_prior()
+    double prior2;       // as calc_arg_prior_recomb_integrate()
+    double likelihood;   // as calc_arg_likelihood()
+    int noncompat;       // as count_noncompat()
+};
+
+// Calculates the requested scores of the whole ARG block by block.  The
+// score of each block is cached in the block and reused as long as the
+// block's tree, coordinates and SPR to the next tree, the sequences and
+// the model parameters are unchanged, so that after an MCMC move only the
+// blocks it changed are scored again.  Non-compatible sites can only be
+// counted without a sites mapping.
+void calc_arg_scores(const ArgModel *model, const Sequences *sequences,
+                     const LocalTrees *trees, ArgScores *scores,
+                     const SitesMapping *sites_mapping=NULL,
+                     const TrackNullValue *maskmap_uncompressed=NULL,
+                     const vector<int> &invisible_recomb_pos=vector<int>(),
+                     const vector<Spr> &invisible_recombs=vector<Spr>());
+
+
 
 } // namespace argweaver
 
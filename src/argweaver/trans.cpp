@@ -1,6 +1,8 @@
 //=============================================================================
 // transitions
 
+#include <memory>
+
 #include "matrices.h"
 #include "total_prob.h"
 #include "thread.h"
@@ -15,65 +17,84 @@ void TransMatrix::initialize(const ArgModel *model, int nstates)
     npaths = model->num_pop_paths();
     smc_prime = model->smc_prime;
     pop_tree = model->pop_tree;
-    int data_len=0;
-    if (smc_prime) {
-        data_len = npaths * ntimes + 2 * ntimes;
-    } else {
-        data_len = ntimes*2 + npaths*ntimes*4 + npaths*npaths*ntimes*3;
-    }
-    data_alloc = new double [data_len];
 
-    C1_prime = new MultiArray(3, npaths, npaths, 2*ntimes);
-    Q1_prime = new MultiArray(3, npaths, npaths, 2*ntimes);
+    nterms = 0;
+    C1_prime = add_term(3, npaths, npaths, 2*ntimes);
+    Q1_prime = add_term(3, npaths, npaths, 2*ntimes);
     if (smc_prime) {
-        B0_prime = new MultiArray(2, npaths, ntimes);
+        B0_prime = add_term(2, npaths, ntimes);
         B0_prime->setDefault(-INFINITY); // B's are in log space
-        B1_prime = new MultiArray(3, npaths, npaths, ntimes);
+        B1_prime = add_term(3, npaths, npaths, ntimes);
         B1_prime->setDefault(-INFINITY);
-        B2_prime = new MultiArray(3, npaths, npaths, ntimes);
+        B2_prime = add_term(3, npaths, npaths, ntimes);
         B2_prime->setDefault(-INFINITY);
-        E0_prime = new MultiArray(2, npaths, ntimes);
-        E1_prime = new MultiArray(3, npaths, npaths, ntimes);
-        E2_prime = new MultiArray(3, npaths, npaths, ntimes);
-        F0_prime = new MultiArray(2, npaths, ntimes);
-        F1_prime = new MultiArray(3, npaths, npaths, ntimes);
-        F2_prime = new MultiArray(3, npaths, npaths, ntimes);
-        C0_prime = new MultiArray(2, npaths, 2*ntimes);
-        Q0_prime = new MultiArray(2, npaths, 2*ntimes);
-        G0_prime = new MultiArray(2, npaths, ntimes);
-        G1_prime = new MultiArray(3, npaths, npaths, ntimes);
-        G2_prime = new MultiArray(3, npaths, npaths, ntimes);
-        L0_prime = new MultiArray(2, npaths, ntimes);
-        L1_prime = new MultiArray(3, npaths, npaths, ntimes);
-        L2_prime = new MultiArray(3, npaths, npaths, ntimes);
-        K0_prime = new MultiArray(2, npaths, ntimes);
-        K1_prime = new MultiArray(3, npaths, npaths, ntimes);
-        K2_prime = new MultiArray(3, npaths, npaths, ntimes);
-        RK0_prime = new MultiArray(2, npaths, ntimes);
+        E0_prime = add_term(2, npaths, ntimes);
+        E1_prime = add_term(3, npaths, npaths, ntimes);
+        E2_prime = add_term(3, npaths, npaths, ntimes);
+        F0_prime = add_term(2, npaths, ntimes);
+        F1_prime = add_term(3, npaths, npaths, ntimes);
+        F2_prime = add_term(3, npaths, npaths, ntimes);
+        C0_prime = add_term(2, npaths, 2*ntimes);
+        Q0_prime = add_term(2, npaths, 2*ntimes);
+        G0_prime = add_term(2, npaths, ntimes);
+        G1_prime = add_term(3, npaths, npaths, ntimes);
+        G2_prime = add_term(3, npaths, npaths, ntimes);
+        L0_prime = add_term(2, npaths, ntimes);
+        L1_prime = add_term(3, npaths, npaths, ntimes);
+        L2_prime = add_term(3, npaths, npaths, ntimes);
+        K0_prime = add_term(2, npaths, ntimes);
+        K1_prime = add_term(3, npaths, npaths, ntimes);
+        K2_prime = add_term(3, npaths, npaths, ntimes);
+        RK0_prime = add_term(2, npaths, ntimes);
         RK0_prime->setDefault(-INFINITY);
-        RK2_prime = new MultiArray(3, npaths, npaths, ntimes);
+        RK2_prime = add_term(3, npaths, npaths, ntimes);
         RK2_prime->setDefault(-INFINITY);
-        self_recomb = new double[nstates];
+    }
+
+    // all terms share one allocation
+    int data_len=0;
+    if (smc_prime) {
+        data_len = npaths * ntimes + 2 * ntimes + nstates;
     } else {
-        E = new double* [npaths];
-        lnB = new double** [npaths];
-        lnE2 = new double** [npaths];
-        lnNegG1 = new double** [npaths];
-        G2 = new double* [npaths];
-        G3 = new double* [npaths];
+        data_len = ntimes*2 + npaths*ntimes*4 + npaths*npaths*ntimes*3;
+    }
+    int terms_len = 0;
+    for (int i=0; i < nterms; i++)
+        terms_len += terms[i].matSize;
+    data_alloc = new double [data_len + terms_len];
+    double *term_data = &data_alloc[data_len];
+    for (int i=0; i < nterms; i++) {
+        terms[i].set_data(term_data);
+        term_data += terms[i].matSize;
+    }
+
+    // row pointers into data_alloc
+    ptr_alloc = new double* [
+        npaths * (smc_prime ? 1 : 4 + 3 * npaths)];
+    path_prob = &ptr_alloc[0];
+    if (!smc_prime) {
+        E = &ptr_alloc[npaths];
+        G2 = &ptr_alloc[2*npaths];
+        G3 = &ptr_alloc[3*npaths];
+        ptr2_alloc = new double** [3*npaths];
+        lnB = &ptr2_alloc[0];
+        lnE2 = &ptr2_alloc[npaths];
+        lnNegG1 = &ptr2_alloc[2*npaths];
+    } else {
+        ptr2_alloc = NULL;
     }
-    path_prob = new double* [npaths];
     D = &data_alloc[0];
     norecombs = &data_alloc[ntimes];
     int idx=ntimes*2;
+    int ptr_idx=4*npaths;
     for (int i=0; i < npaths; i++) {
         if (!smc_prime) {
             E[i] = &data_alloc[idx]; idx += ntimes;
             G2[i] = &data_alloc[idx]; idx += ntimes;
             G3[i] = &data_alloc[idx]; idx += ntimes;
-            lnB[i] = new double* [npaths];
-            lnE2[i] = new double* [npaths];
-            lnNegG1[i] = new double* [npaths];
+            lnB[i] = &ptr_alloc[ptr_idx]; ptr_idx += npaths;
+            lnE2[i] = &ptr_alloc[ptr_idx]; ptr_idx += npaths;
+            lnNegG1[i] = &ptr_alloc[ptr_idx]; ptr_idx += npaths;
             for (int j=0; j < npaths; j++) {
                 lnB[i][j] = &data_alloc[idx]; idx += ntimes;
                 lnE2[i][j] = &data_alloc[idx]; idx += ntimes;
@@ -82,9 +103,23 @@ void TransMatrix::initialize(const ArgModel *model, int nstates)
         }
         path_prob[i] = &data_alloc[idx]; idx += ntimes;
     }
+    if (smc_prime) {
+        self_recomb = &data_alloc[idx]; idx += nstates;
+    }
     assert(idx == data_len);
 }
 
+
+// Adds an array for an intermediate term.  Its data is assigned by
+// initialize().
+MultiArray *TransMatrix::add_term(int ndim, int dim0, int dim1, int dim2)
+{
+    assert(nterms < MAX_TERMS);
+    MultiArray *term = &terms[nterms++];
+    term->init(ndim, dim0, dim1, dim2);
+    return term;
+}
+
 void calc_coal_rates_partial_tree(const ArgModel *model, const LocalTree *tree,
                                   const LineageCounts *lineages,
                                   MultiArray *coal_rates,
@@ -219,9 +254,6 @@ double TransMatrix::selfRecombDiffTimeProb(int min_k, int max_k,
                                            int max_d, int path_d,
                                            int a, int path_a) const {
     if (min_k > max_k) return -INFINITY;
-    static int count=0;
-    static int total_count=0;
-    total_count++;
     assert(max_k < max_d);
     double kstar = get_k_term(max_d, path_d, a, path_a);   // not log space
     double bstar = logsub(get_b_term(max_k, path_d, a, path_a),
@@ -231,8 +263,7 @@ double TransMatrix::selfRecombDiffTimeProb(int min_k, int max_k,
     double val1 = log(kstar) + bstar;
     double val2 = rkstar;
     if (fabs(val1 - val2)/fabs(val1) < 1.0e-8) {
-        count++;
-        //        printf("val1=%e val2=%e diff=%e count=%i total=%i\n", val1, val2, fabs(val1-val2)/fabs(val1), count, total_count);
+        //        printf("val1=%e val2=%e diff=%e\n", val1, val2, fabs(val1-val2)/fabs(val1));
         return INFINITY;
     }
     return logsub(log(kstar)+bstar, rkstar);
@@ -259,7 +290,16 @@ inline double TransMatrix::self_recomb_prob(int a, int path_a,
     //    use state_time : 1 = branch_start, 2=branch_start+1, ...,
     //        1 + branch_end -branch_start = branch_end,
     //        2 + branch_end - branch_start for > branch_end
-    static MultiArray branchProbs(5, npaths, ntimes, ntimes, npaths, ntimes);
+    // one table per thread, since matrices may be computed by worker
+    // threads; remade if a model with other dimensions is used
+    static thread_local unique_ptr<MultiArray> branchProbsPtr;
+    if (!branchProbsPtr || branchProbsPtr->dimSize[0] != npaths ||
+        branchProbsPtr->dimSize[1] != ntimes) {
+        branchProbsPtr.reset(new MultiArray(5, npaths, ntimes, ntimes,
+                                            npaths, ntimes));
+        branchProbsPtr->set_all(-1.0);
+    }
+    MultiArray &branchProbs = *branchProbsPtr;
     if (path_a == -1 && path_d == -1)
         branchProbs.set_all(-1.0);
     int age_idx = ( a > max_d ? max_d - min_d + 2 :
@@ -431,7 +471,10 @@ void TransMatrix::assert_transmat(const LocalTree *tree,
 
 void TransMatrix::calc_self_recomb_probs_smcPrime(const LocalTree *tree,
                                                   const States &states) {
-    MultiArray selfProbs(2, npaths, ntimes);
+    double self_probs_data[npaths * ntimes];
+    MultiArray selfProbs;
+    selfProbs.init(2, npaths, ntimes);
+    selfProbs.set_data(self_probs_data);
     selfProbs.set_all(-1.0);
     const int subtree_root = internal ? tree->nodes[tree->root].child[0] : -1;
     const int maintree_root = internal  ? tree->nodes[tree->root].child[1] : -1;
@@ -542,6 +585,9 @@ void TransMatrix::calc_transition_probs_smcPrime(const LocalTree *tree,
         root_age = times[root_age_index];
         treelen = get_treelen(tree, times, ntimes, false);
     }
+    this->rho = rho;
+    this->treelen = treelen;
+    this->root_age_index = root_age_index;
 
     calc_coal_rates_partial_tree(model, tree, lineages,
                                  Q1_prime, Q0_prime,
@@ -816,6 +862,9 @@ void TransMatrix::calc_transition_probs(const LocalTree *tree,
         root_age = times[root_age_index];
         treelen = get_treelen(tree, times, ntimes, false);
     }
+    this->rho = rho;
+    this->treelen = treelen;
+    this->root_age_index = root_age_index;
 
     calc_coal_rates_partial_tree(model, tree, lineages,
                                  Q1_prime, Q0_prime,
@@ -966,7 +1015,7 @@ void get_deterministic_transitions(
     // recomb_node in tree and last_tree
     // coal_node in last_tree
 #ifdef DEBUG
-    static int count=0;
+    static thread_local int count=0;
     count++;
 #endif
 
@@ -1641,8 +1690,6 @@ void calc_transition_probs_switch(
     const int last_subtree_root = internal ? last_nodes[last_root].child[0] : -1;
     const int minage1 = internal ? last_nodes[last_subtree_root].age : 0;
     const int minage2 = internal ?  nodes[subtree_root].age : 0;
-    static int count=0;
-    count++;
 
     //    printf("calc_transition_probs_switch internal=%i\n", internal);
     for (int i=0; i < max(1,nstates1); i++)
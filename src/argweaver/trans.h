@@ -25,53 +25,18 @@ public:
     TransMatrix(const ArgModel *model, int nstates) :
         nstates(nstates),
         internal(false),
-        smc_prime(false)
+        smc_prime(false),
+        rho(0.0),
+        treelen(0.0),
+        root_age_index(0)
     {
         initialize(model, nstates);
     }
 
     ~TransMatrix()
     {
-        delete C1_prime;
-        delete Q1_prime;
-        if (!smc_prime) {
-            for (int i=0; i < npaths; i++) {
-                delete [] lnB[i];
-                delete [] lnE2[i];
-                delete [] lnNegG1[i];
-            }
-            delete [] E;
-            delete [] lnB;
-            delete [] lnE2;
-            delete [] lnNegG1;
-            delete [] G2;
-            delete [] G3;
-        } else {
-            delete B0_prime;
-            delete B1_prime;
-            delete B2_prime;
-            delete C0_prime;
-            delete Q0_prime;
-            delete E0_prime;
-            delete E1_prime;
-            delete E2_prime;
-            delete F0_prime;
-            delete F1_prime;
-            delete F2_prime;
-            delete G0_prime;
-            delete G1_prime;
-            delete G2_prime;
-            delete L0_prime;
-            delete L1_prime;
-            delete L2_prime;
-            delete K0_prime;
-            delete K1_prime;
-            delete K2_prime;
-            delete RK0_prime;
-            delete RK2_prime;
-            delete [] self_recomb;
-        }
-        delete [] path_prob;
+        delete [] ptr2_alloc;
+        delete [] ptr_alloc;
         delete [] data_alloc;
     }
 
@@ -353,7 +318,14 @@ public:
 
     bool smc_prime;
 
+    // tree and model summaries the time terms were computed from
+    double rho;
+    double treelen;
+    int root_age_index;
+
     double *data_alloc;
+    double **ptr_alloc;
+    double ***ptr2_alloc;
 
     // Intermediate terms in calculating entries in the full transition matrix
 
@@ -400,6 +372,13 @@ public:
     double **G3;
 
  private:
+    MultiArray *add_term(int ndim, int dim0, int dim1, int dim2=0);
+
+    // storage for the *_prime terms
+    static const int MAX_TERMS = 24;
+    MultiArray terms[MAX_TERMS];
+    int nterms;
+
     double get_l_term(int d, int path_d, int a, int path_a) const;
     double get_k_term(int d, int path_d, int a, int path_a) const;
     double get_b_term(int d, int path_d, int a, int path_a) const;
@@ -440,10 +419,6 @@ public:
         if (own_data) {
             delete [] determ;
             delete [] determprob;
-            delete [] recoalrow;
-            delete [] recombrow;
-            delete [] recombsrc;
-            delete [] recoalsrc;
         }
     }
 
@@ -457,13 +432,17 @@ public:
         // NOTE: nstates1 and nstates2 might be zero
         // we still calculate transitions for a state space of size zero
 
+        // the int and double arrays each share one allocation, owned
+        // through determ and determprob
+        const int nrows = max(nstates1, 1);
+        const int rowlen = max(nstates2, 1) * npaths;
         own_data = true;
-        determ = new int [max(nstates1, 1)];
-        determprob = new double [max(nstates1, 1)];
-        recoalrow = new double [max(nstates2, 1) * npaths];
-        recombrow = new double [max(nstates2, 1) * npaths];
-        recombsrc = new int [max(nstates1, 1)];
-        recoalsrc = new int[max(nstates1, 1)];
+        determ = new int [3 * nrows];
+        recombsrc = &determ[nrows];
+        recoalsrc = &determ[2 * nrows];
+        determprob = new double [nrows + 2 * rowlen];
+        recoalrow = &determprob[nrows];
+        recombrow = &determprob[nrows + rowlen];
     }
 
     // Log probability of transition from state i to state j.
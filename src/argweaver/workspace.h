@@ -0,0 +1,121 @@
+//=============================================================================
+// scratch memory for HMM matrix computations
+
+#ifndef ARGWEAVER_WORKSPACE_H
+#define ARGWEAVER_WORKSPACE_H
+
+// c/c++ includes
+#include <stdlib.h>
+#include <algorithm>
+#include <new>
+#include <vector>
+
+
+namespace argweaver {
+
+using namespace std;
+
+
+// An arena of scratch memory for computing the matrices of one block.
+//
+// Allocations are 64-byte aligned slices of a single slab and are all
+// released together by reset().  If a block needs more memory than the
+// slab holds, the extra allocations come from separate chunks and the
+// slab is enlarged at the next reset(), so that after the first few blocks
+// each block is served from one slab without further heap allocation.
+class HmmWorkspace
+{
+public:
+    static const size_t ALIGN = 64;
+
+    HmmWorkspace() :
+        slab(NULL),
+        capacity(0),
+        used(0),
+        overflow_size(0)
+    {}
+
+    ~HmmWorkspace()
+    {
+        release_overflow();
+        free(slab);
+    }
+
+    // Returns uninitialized space for n items of type T
+    template <class T>
+    T *alloc(size_t n)
+    {
+        size_t bytes = (n * sizeof(T) + ALIGN - 1) & ~(ALIGN - 1);
+        if (bytes < ALIGN)
+            bytes = ALIGN;
+        if (used + bytes <= capacity) {
+            T *ptr = (T*) (slab + used);
+            used += bytes;
+            return ptr;
+        }
+
+        char *chunk = aligned_chunk(bytes);
+        overflow.push_back(chunk);
+        overflow_size += bytes;
+        return (T*) chunk;
+    }
+
+    // Returns an nrows x ncols matrix stored row-major in one allocation
+    template <class T>
+    T **alloc_matrix(int nrows, int ncols)
+    {
+        T **mat = alloc<T*>(nrows);
+        T *block = alloc<T>(size_t(nrows) * ncols);
+        for (int i=0; i<nrows; i++)
+            mat[i] = &block[size_t(i) * ncols];
+        return mat;
+    }
+
+    // Releases all allocations
+    void reset()
+    {
+        if (overflow_size > 0) {
+            const size_t needed = used + overflow_size;
+            release_overflow();
+            free(slab);
+            capacity = max(2 * capacity, needed);
+            slab = aligned_chunk(capacity);
+        }
+        used = 0;
+    }
+
+    // Returns the workspace of the calling thread
+    static HmmWorkspace &thread_workspace()
+    {
+        static thread_local HmmWorkspace workspace;
+        return workspace;
+    }
+
+protected:
+    static char *aligned_chunk(size_t bytes)
+    {
+        void *ptr;
+        if (posix_memalign(&ptr, ALIGN, bytes) != 0)
+            throw bad_alloc();
+        return (char*) ptr;
+    }
+
+    void release_overflow()
+    {
+        for (unsigned int i=0; i<overflow.size(); i++)
+            free(overflow[i]);
+        overflow.clear();
+        overflow_size = 0;
+    }
+
+    char *slab;
+    size_t capacity;
+    size_t used;
+    vector<char*> overflow;
+    size_t overflow_size;
+};
+
+
+} // namespace argweaver
+
+#endif // ARGWEAVER_WORKSPACE_H
@@ -1,6 +1,11 @@
 // C/C++ includes
+#include <limits.h>
 #include <time.h>
+#include <condition_variable>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <thread>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -14,6 +19,7 @@
 #include "argweaver/parsing.h"
 #include "argweaver/sample_arg.h"
 #include "argweaver/sequences.h"
+#include "argweaver/smc_binary.h"
 #include "argweaver/total_prob.h"
 #include "argweaver/track.h"
 #include "argweaver/est_popsize.h"
@@ -69,7 +75,7 @@ public:
 		    "file where popsize samples are written"));
         config.add(new ConfigParam<string>
                    ("-a", "--arg", "<arg-sample output directory>", &arg_dir, "",
-		    "directory where arg-sample *.smc.gz files are"));
+		    "directory where arg-sample *.smc.gz or *.smcb files are"));
 	config.add(new ConfigParam<int>
 		   ("", "--arg-start", "<first sample number>", &arg_start, 500,
 		    "starting iteration of ARGs to use"));
@@ -139,6 +145,9 @@ public:
         config.add(new ConfigParam<int>
                    ("", "--sample-step", "<sample step size>", &sample_step,
                     10, "number of iterations between steps (default=10)"));
+        config.add(new ConfigParam<int>
+                   ("", "--threads", "<threads>", &nthreads, 1,
+                    "number of threads reading ARG files (default=1)"));
         config.add(new ConfigParam<int>
                    ("-x", "--randseed", "<random seed>", &randseed, 0,
                     "seed for random number generator (default=current time)"));
@@ -178,6 +187,11 @@ public:
             printf(VERSION_INFO);
             return EXIT_ERROR;
         }
+
+        if (nthreads < 1) {
+            printError("--threads must be at least 1");
+            return EXIT_ERROR;
+        }
         return 0;
     }
 
@@ -219,6 +233,7 @@ public:
     // misc
     int sample_step;
     int randseed;
+    int nthreads;
 
     // help/information
     bool quiet;
@@ -276,8 +291,8 @@ void log_model(const ArgModel &model)
     printLog(LOG_LOW, "%f]\n", model.times[model.ntimes-1]);
     printLog(LOG_LOW, "  popsizes = [");
     for (int i=0; i<2*model.ntimes-2; i++)
-        printLog(LOG_LOW, "%f,", model.popsizes[i]);
-    printLog(LOG_LOW, "%f]\n", model.popsizes[2*model.ntimes-2]);
+        printLog(LOG_LOW, "%f,", model.popsizes[0][i]);
+    printLog(LOG_LOW, "%f]\n", model.popsizes[0][2*model.ntimes-2]);
 
     if (isLogLevel(LOG_HIGH)) {
         printLog(LOG_HIGH, "mutmap = [\n");
@@ -308,7 +323,7 @@ void print_stats_header(Config *config) {
 void print_stats_popsizes(Config *config, int iter, ArgModel *model) {
     fprintf(config->stats_file, "popsize_mle\t%i", iter);
     for (int i=0; i < config->model.ntimes-1; i++)
-	fprintf(config->stats_file, "\t%.1lf", model->popsizes[2*i]);
+	fprintf(config->stats_file, "\t%.1lf", model->popsizes[0][2*i]);
     fprintf(config->stats_file, "\n");
 }
 
@@ -355,20 +370,159 @@ bool read_doubles(const char *filename, vector<double> &values) {
 }
 
 
-bool read_arg(const char *arg_file, const ArgModel *model,
-	      LocalTrees *trees, vector<string> &seqnames)
+// Gathers the sufficient statistics of the ARG in 'arg_file' while
+// streaming its trees.  Returns false if there is no ARG.
+bool read_arg_stats(const char *arg_file, ArgModel *model,
+                    struct popsize_data *data)
 {
-    CompressStream stream(arg_file, "r");
-    if (!stream.stream) {
-        printError("cannot read '%s'", arg_file);
+    LocalTreesStream trees;
+    if (!trees.open(arg_file, model->times, model->ntimes))
         return false;
+
+    LineageCounts lineages(model->ntimes, model->num_pops());
+    bool has_tree = false;
+    while (trees.next()) {
+        if (!has_tree) {
+            init_popsize_data(data, model, trees.seqids.size(), 0.0);
+            has_tree = true;
+        }
+        if (!trees.next_spr.is_null())
+            add_popsize_spr(data, trees.tree, trees.next_spr, lineages);
     }
 
-    return read_local_trees(stream.stream, model->times, model->ntimes,
-                            trees, seqnames);
+    if (has_tree && !trees.ok()) {
+        delete_popsize_data(data);
+        return false;
+    }
+    return has_tree;
 }
 
 
+// Sufficient statistics of one ARG file
+struct ArgFileStats
+{
+    string filename;
+    bool read;                  // whether an ARG was read
+    struct popsize_data data;
+};
+
+
+// Reads ARG files with worker threads.  File 'index' is file
+// 'index % files_per_rep' of replicate 'index / files_per_rep'.  Workers
+// take files in order and stay a bounded number of files ahead of the
+// caller, who takes the statistics of each file in order.
+class ArgStatsPool
+{
+public:
+    ArgStatsPool(const Config *config, ArgModel *model, int files_per_rep) :
+        config(config),
+        model(model),
+        files_per_rep(files_per_rep),
+        next_index(0),
+        taken(0),
+        stop_index(INT_MAX),
+        max_ahead(4 * config->nthreads)
+    {
+        for (int i=0; i<config->nthreads; i++)
+            workers.push_back(thread(&ArgStatsPool::worker, this));
+    }
+
+    ~ArgStatsPool()
+    {
+        {
+            lock_guard<mutex> guard(lock);
+            stop_index = 0;
+        }
+        file_wanted.notify_all();
+        for (unsigned int i=0; i<workers.size(); i++)
+            workers[i].join();
+
+        for (map<int, ArgFileStats*>::iterator it=done.begin();
+             it != done.end(); ++it) {
+            if (it->second->read)
+                delete_popsize_data(&it->second->data);
+            delete it->second;
+        }
+    }
+
+    // Returns the statistics of the next file, waiting until they are
+    // gathered.  The caller owns the result.
+    ArgFileStats *take()
+    {
+        unique_lock<mutex> guard(lock);
+        while (done.find(taken) == done.end())
+            file_done.wait(guard);
+        ArgFileStats *stats = done[taken];
+        done.erase(taken);
+        taken++;
+        file_wanted.notify_all();
+        return stats;
+    }
+
+protected:
+    void worker()
+    {
+        while (true) {
+            int index;
+            {
+                unique_lock<mutex> guard(lock);
+                while (next_index < stop_index &&
+                       next_index >= taken + max_ahead)
+                    file_wanted.wait(guard);
+                if (next_index >= stop_index)
+                    return;
+                index = next_index++;
+            }
+
+            ArgFileStats *stats = read_file(index);
+            {
+                lock_guard<mutex> guard(lock);
+                done[index] = stats;
+            }
+            file_done.notify_all();
+        }
+    }
+
+    ArgFileStats *read_file(int index)
+    {
+        const int rep = config->arg_start +
+            (index / files_per_rep) * config->arg_step;
+        const int mpi = index % files_per_rep;
+        char file[10000];
+        if (!config->mpi)
+            snprintf(file, sizeof(file), "%s.%i.smc.gz",
+                     config->arg_dir.c_str(), rep);
+        else
+            snprintf(file, sizeof(file), "%s%i.%i.smc.gz",
+                     config->arg_dir.c_str(), mpi, rep);
+
+        // fall back to binary ARG
+        struct stat st;
+        if (stat(file, &st) != 0)
+            strcpy(strstr(file, ".smc.gz"), SMC_BINARY_SUFFIX);
+
+        ArgFileStats *stats = new ArgFileStats();
+        stats->filename = file;
+        stats->read = (stat(file, &st) == 0 &&
+                       read_arg_stats(file, model, &stats->data));
+        return stats;
+    }
+
+    const Config *config;
+    ArgModel *model;
+    int files_per_rep;
+    vector<thread> workers;
+    mutex lock;
+    condition_variable file_wanted;
+    condition_variable file_done;
+    map<int, ArgFileStats*> done;  // files gathered but not yet taken
+    int next_index;                // next file for a worker
+    int taken;                     // next file for the caller
+    int stop_index;                // no files are read from here on
+    int max_ahead;
+};
+
+
 
 //=============================================================================
 
@@ -396,7 +550,7 @@ int main(int argc, char **argv)
     // init random number generator
     if (c.randseed == 0)
         c.randseed = time(NULL);
-    srand(c.randseed);
+    seed_rand(c.randseed);
     printLog(LOG_LOW, "random seed: %d\n", c.randseed);
 
     // setup model parameters
@@ -408,7 +562,7 @@ int main(int argc, char **argv)
         c.model.set_log_times(c.maxtime, c.ntimes, c.delta);
     c.model.rho = c.rho;
     c.model.mu = c.mu;
-    c.model.set_popsizes(c.popsize_str, c.model.ntimes);
+    c.model.set_popsizes(c.popsize_str);
     c.model.popsize_config.pseudocount = c.pseudocount;
 
     // log original model
@@ -424,32 +578,36 @@ int main(int argc, char **argv)
     }
 
     print_stats_header(&c);
-    //    ExtendArray<struct popsize_data> suff_stats;
+
+    // Files are read concurrently.  Their statistics are combined and
+    // population sizes estimated in order, starting each estimate from the
+    // previous one.
+    const int files_per_rep = max(c.mpi, 1);
+    ArgStatsPool pool(&c, &model, files_per_rep);
     for (int rep=c.arg_start; ; rep += c.arg_step) {
 	struct popsize_data data;
 	int num_read=0;
-	for (int mpi=0; mpi==0 || mpi < c.mpi; mpi++) {
-	    char file[10000];
-	    if (!c.mpi)
-		sprintf(file, "%s.%i.smc.gz", c.arg_dir.c_str(), rep);
-	    else sprintf(file, "%s%i.%i.smc.gz", c.arg_dir.c_str(), mpi, rep);
-	    LocalTrees *trees = new LocalTrees();
-	    bool new_arg;
-	    vector<string> seqnames;
-	    new_arg = read_arg(file, &c.model, trees, seqnames);
+	for (int mpi=0; mpi < files_per_rep; mpi++) {
+	    ArgFileStats *stats = pool.take();
+	    bool new_arg = stats->read;
 	    if (new_arg) {
-		printLog(LOG_LOW, "read input ARG from %s\n", file);
-		// TODO: set pseudocount to zero first? Keep that separate?
-		//	    popsize_sufficient_stats(&data, model, trees);
-		//	    suff_stats.push(&data);
-		popsize_sufficient_stats(&data, &model, trees, mpi != 0);
+		printLog(LOG_LOW, "read input ARG from %s\n",
+                         stats->filename.c_str());
+		if (num_read == 0)
+		    init_popsize_data(&data, &model, stats->data.numleaf,
+                                      model.popsize_config.pseudocount);
+		add_popsize_data(&data, &stats->data);
+		delete_popsize_data(&stats->data);
 	    }
-	    delete trees;
+	    delete stats;
 	    if (!new_arg) break;
 	    num_read++;
 	}
 	if (num_read == 0) break;
-	if (c.mpi > 0 && num_read != c.mpi) break;
+	if (c.mpi > 0 && num_read != c.mpi) {
+	    delete_popsize_data(&data);
+	    break;
+	}
 	mle_popsize(&model, &data, c.min_events);
 	print_stats_popsizes(&c, rep, &model);
 	delete_popsize_data(&data);
@@ -0,0 +1,165 @@
+#include "getopt.h"
+#include <assert.h>
+
+// argweaver includes
+#include "argweaver/local_tree.h"
+#include "argweaver/compress.h"
+#include "argweaver/logging.h"
+#include "argweaver/model.h"
+#include "argweaver/sequences.h"
+#include "argweaver/smc_binary.h"
+
+using namespace argweaver;
+
+void print_usage() {
+    printf("smc-convert: This program converts an smc file between the\n"
+           "  text format (.smc, .smc.gz) and the binary format (.smcb).\n"
+           "  A binary input file is written as text, and a text input file\n"
+           "  is written as binary.\n\n");
+    printf("Usage: ./smc-convert [OPTIONS] <input-file> <output-file>\n"
+           "  output-file is gzipped if it ends in .gz\n"
+           " OPTIONS:\n"
+           " --log-file <file.log>\n"
+           "   Log file from arg-sample run; this is used to read the time\n"
+           "   points of a text input file. If not provided, smc-convert\n"
+           "   will look for log file in directory with smc file.\n");
+}
+
+
+bool guess_log_file(char *smc_file, char *log_file) {
+    int len = strlen(smc_file);
+    strcpy(log_file, smc_file);
+    int suffix_len = 0;
+    if (len > 7 && strcmp(&smc_file[len-7], ".smc.gz")==0)
+        suffix_len = 7;
+    else if (len > 4 && strcmp(&smc_file[len-4], ".smc")==0)
+        suffix_len = 4;
+    if (suffix_len > 0) {
+        int pos=len-suffix_len-1;
+        while (pos >= 0 && smc_file[pos] != '.') pos--;
+        if (pos < 0) return false;
+        log_file[pos]='\0';
+        strcat(log_file, ".log");
+        return true;
+    }
+    return false;
+}
+
+
+// The readers return invisible recombination positions as they appear in
+// the file (1-based), while the writers expect 0-based positions
+static void invisible_to_0based(vector<int> &pos)
+{
+    for (unsigned int i=0; i<pos.size(); i++)
+        pos[i]--;
+}
+
+
+int binary_to_text(char *infile, char *outfile)
+{
+    SmcBinaryReader reader;
+    if (!reader.open(infile)) {
+        fprintf(stderr, "Error opening binary SMC file %s\n", infile);
+        return 1;
+    }
+
+    // use the time points stored in the file
+    vector<double> times(reader.get_times(),
+                         reader.get_times() + reader.get_ntimes());
+    const bool pop_model = reader.has_pop_paths();
+    LocalTrees trees;
+    Sequences seqs;
+    vector<int> invisible_recomb_pos;
+    vector<Spr> invisible_recombs;
+    if (!reader.read(&times[0], times.size(), &trees, seqs.names,
+                     &invisible_recomb_pos, &invisible_recombs)) {
+        fprintf(stderr, "Error parsing binary SMC file %s\n", infile);
+        return 1;
+    }
+    reader.close();
+    invisible_to_0based(invisible_recomb_pos);
+
+    CompressStream stream(outfile, "w");
+    if (!stream.stream) {
+        fprintf(stderr, "Cannot write file %s\n", outfile);
+        return 1;
+    }
+    write_local_trees(stream.stream, &trees, seqs, &times[0], pop_model,
+                      invisible_recomb_pos, invisible_recombs);
+    return 0;
+}
+
+
+int text_to_binary(char *infile, char *outfile, char *log_file)
+{
+    if (log_file == NULL) {
+        log_file = (char*)malloc((strlen(infile)+10)*sizeof(char));
+        if (!guess_log_file(infile, log_file)) {
+            fprintf(stderr, "Could not guess log file name, provide with -l");
+            return 1;
+        }
+    }
+    ArgModel model(log_file);
+
+    CompressStream instream(infile);
+    if (!instream.stream) {
+        fprintf(stderr, "Cannot read file %s\n", infile);
+        return 1;
+    }
+    LocalTrees trees;
+    Sequences seqs;
+    vector<int> invisible_recomb_pos;
+    vector<Spr> invisible_recombs;
+    if (!read_local_trees(instream.stream, model.times, model.ntimes,
+                          &trees, seqs.names,
+                          &invisible_recomb_pos, &invisible_recombs)) {
+        fprintf(stderr, "Error parsing SMC file %s\n", infile);
+        return 1;
+    }
+    instream.close();
+    invisible_to_0based(invisible_recomb_pos);
+
+    if (!write_local_trees_binary(outfile, &trees, seqs, model.times,
+                                  model.ntimes, model.pop_tree != NULL,
+                                  invisible_recomb_pos, invisible_recombs)) {
+        fprintf(stderr, "Cannot write file %s\n", outfile);
+        return 1;
+    }
+    return 0;
+}
+
+
+int main(int argc, char *argv[]) {
+    char c;
+    char *log_file = NULL;
+    int opt_idx;
+    struct option long_opts[] = {
+        {"log-file", 1, 0, 'l'},
+        {"help", 0, 0, 'h'},
+        {0,0,0,0}};
+    while ((c = (char)getopt_long(argc, argv, "l:h", long_opts, &opt_idx))
+           != -1) {
+        switch (c) {
+        case 'l':
+            log_file = optarg;
+            break;
+        case 'h':
+            print_usage();
+            return 0;
+        case '?':
+            fprintf(stderr, "unknown option. Try --help\n");
+            return 1;
+        }
+    }
+    if (optind != argc - 2) {
+        fprintf(stderr, "Bad arguments. Try --help\n");
+        return 1;
+    }
+    Logger *logger = new Logger(stderr, LOG_HIGH);
+    g_logger.setChain(logger);
+
+    if (is_smc_binary(argv[optind]))
+        return binary_to_text(argv[optind], argv[optind+1]);
+    else
+        return text_to_binary(argv[optind], argv[optind+1], log_file);
+}
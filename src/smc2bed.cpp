@@ -2,46 +2,76 @@
 #include <iostream>
 #include <fstream>
 #include <assert.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <queue>
 
 // argweaver includes
 #include "argweaver/local_tree.h"
 #include "argweaver/compress.h"
 #include "argweaver/parsing.h"
 #include "argweaver/model.h"
+#include "argweaver/smc_binary.h"
 
 //using namespace spidir;
 using namespace argweaver;
 
 void print_usage() {
-    printf("smc2bed: This program converts a single smc file into a\n"
-           "  bed file. The bed file format is chrom,start,end,sample,tree.\n"
+    printf("smc2bed: This program converts smc files into a bed file.\n"
+           "  The bed file format is chrom,start,end,sample,tree.\n"
            "  The tree nodes are labelled with NHX-style comments indicating\n"
            "  the nodes and times of the recombination event which leads to\n"
            "  the next tree.\n\n"
            "This program is intended for use combining multiple SMC files\n"
-           "  from different MCMC samples; the pipeline for doing this is to\n"
-           "  run smc2bed on each file, piping the results to sort-bed, then\n"
-           "  bgzip. The resulting file can be indexed using tabix.\n\n");
-    printf("Usage: ./smc2bed [OPTIONS] <smc-file>\n"
-           "  smc-file can be gzipped\n"
+           "  from different MCMC samples.  Given several files, smc2bed\n"
+           "  merges their trees into one sorted bed file, which can be\n"
+           "  written bgzipped with --output and indexed using tabix.\n\n");
+    printf("Usage: ./smc2bed [OPTIONS] <smc-file> [<smc-file> ...]\n"
+           "  smc-file can be gzipped or binary (.smcb)\n"
            " OPTIONS:\n"
            " --region START-END\n"
            "   Process only these coordinates (1-based)\n"
            " --sample <sample>\n"
            "   Give the sample number for this file; this is important\n"
-           "   when combining multiple smc files."
+           "   when combining multiple smc files.  Without --sample,\n"
+           "   files are numbered 0, 1, 2, ... in the order given.\n"
+           " --sample-from-name\n"
+           "   Take the sample number of each file from its name\n"
+           "   <base>.<sample>.smc.gz\n"
+           " --output <file.bed.gz>\n"
+           "   Write to this file instead of stdout; bgzipped if it ends in .gz\n"
            " --log-file <file.log>\n"
            "   Log file from arg-sample run; this is used as input to read model"
            "   parameters. If not provided, smc2bed will look for log file"
-           "   in directory with smc file.\n");
+           "   in directory with smc file.\n"
+           " --max-open <n>\n"
+           "   Open at most this many files at once (default: 128).  More\n"
+           "   files are merged in batches through temporary files in\n"
+           "   $TMPDIR (or /tmp).\n");
+}
+
+
+// Returns the length of the smc suffix of 'smc_file', or 0 if it has none
+int smc_suffix_len(const char *smc_file) {
+    int len = strlen(smc_file);
+    if (len > 7 && strcmp(&smc_file[len-7], ".smc.gz")==0)
+        return 7;
+    else if (len > 5 && strcmp(&smc_file[len-5], SMC_BINARY_SUFFIX)==0)
+        return 5;
+    else if (len > 4 && strcmp(&smc_file[len-4], ".smc")==0)
+        return 4;
+    return 0;
 }
 
 
 bool guess_log_file(char *smc_file, char *log_file) {
     int len = strlen(smc_file);
     strcpy(log_file, smc_file);
-    if (strcmp(&smc_file[len-7], ".smc.gz")==0) {
-        int pos=len-8;
+    int suffix_len = smc_suffix_len(smc_file);
+    if (suffix_len > 0) {
+        int pos=len-suffix_len-1;
         while (pos >= 0 && smc_file[pos] != '.') pos--;
         if (pos < 0) return false;
         log_file[pos]='\0';
@@ -52,21 +82,297 @@ bool guess_log_file(char *smc_file, char *log_file) {
 }
 
 
+// Parses the sample number from a file name <base>.<sample>.smc.gz
+bool guess_sample(const char *smc_file, int *sample) {
+    int end = strlen(smc_file) - smc_suffix_len(smc_file);
+    int pos = end;
+    while (pos > 0 && isdigit(smc_file[pos-1])) pos--;
+    if (pos == end || pos == 0 || smc_file[pos-1] != '.')
+        return false;
+    *sample = atoi(&smc_file[pos]);
+    return true;
+}
+
+
+
+
+// The trees of one smc file, visited in order, with the names of their
+// nodes
+class SampleTrees : public LocalTreesStream {
+public:
+    SampleTrees(int sample, int region_start=-1, int region_end=-1) :
+        LocalTreesStream(region_start, region_end),
+        sample(sample)
+    {}
+
+    // Opens 'filename' and moves to its first tree in the region.  Returns
+    // false if there is no such tree or on error.
+    bool open(const char *filename, const ArgModel *model) {
+        if (!LocalTreesStream::open(filename, model->times, model->ntimes))
+            return false;
+
+        const int nleaves = seqids.size();
+        nodeids.assign(2 * nleaves - 1, "");
+        for (int i=0; i<nleaves; i++)
+            nodeids[i] = seqnames[seqids[i]].c_str();
+
+        return next();
+    }
+
+    // Writes the current tree as a bed line
+    void write(FILE *out, const ArgModel *model) const {
+        if (end - start > 0)
+            write_local_tree_as_bed(out, chrom, start, end, sample, tree,
+                                    &nodeids[0], model, next_spr);
+    }
+
+    int sample;
+    vector<const char*> nodeids;  // names of tree nodes
+};
+
+
+// The lines of a sorted bed file written by an earlier merge pass
+class BedLines {
+public:
+    BedLines() :
+        start(0),
+        end(0),
+        sample(0),
+        stream(NULL),
+        line(NULL),
+        linesize(1024),
+        error(false)
+    {}
+
+    ~BedLines() {
+        delete stream;
+        if (line)
+            delete [] line;
+    }
+
+    // Opens 'filename' and moves to its first line.  Returns false if the
+    // file is empty or on error.
+    bool open(const char *filename) {
+        stream = new CompressStream(filename, "r");
+        if (!stream->stream) {
+            printError("cannot read '%s'", filename);
+            error = true;
+            return false;
+        }
+        return next();
+    }
+
+    // Moves to the next line.  Returns false at the end of the file.
+    bool next() {
+        if (fgetline(&line, &linesize, stream->stream) <= 0)
+            return false;
+        chomp(line);
+
+        const char *tab = strchr(line, '\t');
+        if (!tab || sscanf(tab, "%d %d %d", &start, &end, &sample) != 3) {
+            printError("bad bed line in merge file");
+            error = true;
+            return false;
+        }
+        chrom.assign(line, tab - line);
+        return true;
+    }
+
+    bool ok() const {
+        return !error;
+    }
+
+    // Writes the current line
+    void write(FILE *out, const ArgModel *model) const {
+        fprintf(out, "%s\n", line);
+    }
+
+    string chrom;
+    int start;
+    int end;
+    int sample;
+
+protected:
+    CompressStream *stream;
+    char *line;
+    int linesize;
+    bool error;
+};
+
+
+// Orders the trees of several files by position, as sort-bed does
+template <class Stream>
+struct StreamAfter {
+    bool operator()(const Stream *a, const Stream *b) const {
+        int cmp = a->chrom.compare(b->chrom);
+        if (cmp != 0)
+            return cmp > 0;
+        if (a->start != b->start)
+            return a->start > b->start;
+        if (a->end != b->end)
+            return a->end > b->end;
+        return a->sample > b->sample;
+    }
+};
+
+
+// Writes the lines of several open streams to 'out' in bed order.  Each
+// stream must be at its first line.  Returns false on a parse error.
+template <class Stream>
+bool merge_streams(const vector<Stream*> &streams, FILE *out,
+                   const ArgModel *model)
+{
+    priority_queue<Stream*, vector<Stream*>, StreamAfter<Stream> > queue;
+    for (unsigned int i=0; i<streams.size(); i++)
+        queue.push(streams[i]);
+
+    while (!queue.empty()) {
+        Stream *stream = queue.top();
+        queue.pop();
+        stream->write(out, model);
+
+        if (stream->next())
+            queue.push(stream);
+        else if (!stream->ok())
+            return false;
+    }
+    return true;
+}
+
+
+// An smc file to convert and its sample number
+struct SmcInput {
+    const char *filename;
+    int sample;
+};
+
+
+// Merges the trees of smc files inputs[begin:end) into 'out'
+bool merge_smc_files(const vector<SmcInput> &inputs, int begin, int end,
+                     const int *region, const ArgModel *model, FILE *out)
+{
+    bool ok = true;
+    vector<SampleTrees*> open_trees;
+    for (int i=begin; i<end && ok; i++) {
+        SampleTrees *trees = new SampleTrees(inputs[i].sample,
+                                             region[0], region[1]);
+        if (trees->open(inputs[i].filename, model)) {
+            open_trees.push_back(trees);
+        } else {
+            if (!trees->ok()) {
+                fprintf(stderr, "Error parsing SMC file %s\n",
+                        inputs[i].filename);
+                ok = false;
+            }
+            delete trees;
+        }
+    }
+
+    if (ok && !merge_streams(open_trees, out, model)) {
+        fprintf(stderr, "Error parsing SMC file\n");
+        ok = false;
+    }
+
+    for (unsigned int i=0; i<open_trees.size(); i++)
+        delete open_trees[i];
+    return ok;
+}
+
+
+// Merges the bed files files[begin:end) written by earlier passes into
+// 'out'
+bool merge_bed_files(const vector<string> &files, int begin, int end,
+                     FILE *out)
+{
+    bool ok = true;
+    vector<BedLines*> open_beds;
+    for (int i=begin; i<end && ok; i++) {
+        BedLines *bed = new BedLines();
+        if (bed->open(files[i].c_str()))
+            open_beds.push_back(bed);
+        else {
+            ok = bed->ok();
+            delete bed;
+        }
+    }
+
+    if (ok)
+        ok = merge_streams(open_beds, out, (const ArgModel*) NULL);
+
+    for (unsigned int i=0; i<open_beds.size(); i++)
+        delete open_beds[i];
+    return ok;
+}
+
+
+// Makes a new temporary file for the output of a merge pass.  Returns
+// false on error.
+bool make_temp_file(string *filename)
+{
+    const char *tmpdir = getenv("TMPDIR");
+    const char suffix[] = ".bed.gz";
+    string name = string(tmpdir && tmpdir[0] ? tmpdir : "/tmp") +
+        "/smc2bed.XXXXXX" + suffix;
+
+    vector<char> buf(name.begin(), name.end());
+    buf.push_back('\0');
+    int fd = mkstemps(&buf[0], strlen(suffix));
+    if (fd == -1) {
+        printError("cannot make temporary file '%s'", name.c_str());
+        return false;
+    }
+    close(fd);
+    *filename = &buf[0];
+    return true;
+}
+
+
+void remove_temp_files(const vector<string> &files)
+{
+    for (unsigned int i=0; i<files.size(); i++)
+        unlink(files[i].c_str());
+}
+
+
+// Opens a temporary file and starts a merge pass that writes to it
+CompressStream *open_temp_file(vector<string> &temp_files)
+{
+    string filename;
+    if (!make_temp_file(&filename))
+        return NULL;
+    temp_files.push_back(filename);
+
+    CompressStream *out = new CompressStream(filename.c_str(), "w");
+    if (!out->stream) {
+        printError("cannot write '%s'", filename.c_str());
+        delete out;
+        return NULL;
+    }
+    return out;
+}
+
+
 int main(int argc, char *argv[]) {
     char c;
     int region[2]={-1,-1};
-    LocalTrees *trees=NULL;
     char *log_file = NULL;
+    char *out_file = NULL;
     ArgModel *model;
     int sample=0, opt_idx;
+    bool has_sample = false;
+    bool sample_from_name = false;
+    int max_open = 128;
     struct option long_opts[] = {
         {"region", 1, 0, 'r'},
         {"sample", 1, 0, 's'},
+        {"sample-from-name", 0, 0, 'n'},
+        {"output", 1, 0, 'o'},
         {"log-file", 1, 0, 'l'},
+        {"max-open", 1, 0, 'm'},
         {"help", 0, 0, 'h'},
         {0,0,0,0}};
-    while ((c = (char)getopt_long(argc, argv, "r:s:l:h", long_opts, &opt_idx))
-           != -1) {
+    while ((c = (char)getopt_long(argc, argv, "r:s:no:l:m:h", long_opts,
+                                  &opt_idx)) != -1) {
         switch (c) {
         case 'r':
             if (2 != (sscanf(optarg, "%d-%d", &region[0], &region[1]))) {
@@ -77,10 +383,24 @@ int main(int argc, char *argv[]) {
             break;
         case 's':
             sample = atoi(optarg);
+            has_sample = true;
+            break;
+        case 'n':
+            sample_from_name = true;
+            break;
+        case 'o':
+            out_file = optarg;
             break;
         case 'l':
             log_file = optarg;
             break;
+        case 'm':
+            max_open = atoi(optarg);
+            if (max_open < 2) {
+                fprintf(stderr, "--max-open must be at least 2\n");
+                return 1;
+            }
+            break;
         case 'h':
             print_usage();
             return 0;
@@ -89,10 +409,15 @@ int main(int argc, char *argv[]) {
             return 1;
         }
     }
-    if (optind != argc - 1) {
+    if (optind >= argc) {
         fprintf(stderr, "Bad arguments. Try --help\n");
         return 1;
     }
+    const int nfiles = argc - optind;
+    if (has_sample && nfiles > 1) {
+        fprintf(stderr, "--sample can only be given with one smc file\n");
+        return 1;
+    }
     Logger *logger = new Logger(stderr, LOG_HIGH);
     g_logger.setChain(logger);
 
@@ -109,24 +434,68 @@ int main(int argc, char *argv[]) {
         model = new ArgModel(log_file);
     }
 
-    CompressStream instream(argv[optind], "r");
-    vector<string> seqnames;
+    vector<SmcInput> inputs(nfiles);
+    for (int i=0; i<nfiles; i++) {
+        inputs[i].filename = argv[optind + i];
+        inputs[i].sample = sample + i;
+        if (sample_from_name && !guess_sample(inputs[i].filename,
+                                              &inputs[i].sample))
+            printLog(LOG_LOW, "could not find sample number of '%s', "
+                     "using %d\n", inputs[i].filename, inputs[i].sample);
+    }
 
-    trees = new LocalTrees();
-    if (!read_local_trees(instream.stream, model->times, model->ntimes,
-                          trees, seqnames)) {
-        fprintf(stderr, "Error parsing SMC file\n");
-        return 1;
+    // With more than 'max_open' files, merge them in batches into
+    // temporary bed files, and then merge those, so that no more than
+    // 'max_open' inputs are open (or loaded, for .smcb files) at once.
+    vector<string> temp_files;
+    if (nfiles > max_open) {
+        for (int i=0; i<nfiles; i+=max_open) {
+            CompressStream *tmp = open_temp_file(temp_files);
+            bool ok = tmp && merge_smc_files(
+                inputs, i, min(i + max_open, nfiles), region, model,
+                tmp->stream);
+            delete tmp;
+            if (!ok) {
+                remove_temp_files(temp_files);
+                return 1;
+            }
+        }
+
+        while ((int) temp_files.size() > max_open) {
+            vector<string> pass_files;
+            const int nbeds = temp_files.size();
+            for (int i=0; i<nbeds; i+=max_open) {
+                CompressStream *tmp = open_temp_file(pass_files);
+                bool ok = tmp && merge_bed_files(
+                    temp_files, i, min(i + max_open, nbeds), tmp->stream);
+                delete tmp;
+                if (!ok) {
+                    remove_temp_files(pass_files);
+                    remove_temp_files(temp_files);
+                    return 1;
+                }
+            }
+            remove_temp_files(temp_files);
+            temp_files = pass_files;
+        }
     }
-    if (region[0] != -1) {
-        LocalTrees *trees2 = partition_local_trees(trees, region[0], true);
-        delete trees;
-        trees = trees2;
+
+    CompressStream *out = (out_file ? new CompressStream(out_file, "w") :
+                           new CompressStream(stdout, false));
+    if (!out->stream) {
+        fprintf(stderr, "cannot write '%s'\n", out_file);
+        remove_temp_files(temp_files);
+        return 1;
     }
-    if (region[1] != -1)
-        partition_local_trees(trees, region[1], true);
-    write_local_trees_as_bed(stdout, trees, seqnames,
-                             model, sample);
-    instream.close();
-    return 0;
+
+    // write trees of all files in order
+    bool ok;
+    if (temp_files.empty())
+        ok = merge_smc_files(inputs, 0, nfiles, region, model, out->stream);
+    else
+        ok = merge_bed_files(temp_files, 0, temp_files.size(), out->stream);
+    delete out;
+    remove_temp_files(temp_files);
+
+    return ok ? 0 : 1;
 }
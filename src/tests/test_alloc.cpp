@@ -0,0 +1,105 @@
+//=============================================================================
+// heap allocations made while threading a sequence
+
+#include <atomic>
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "gtest/gtest.h"
+
+#include "argweaver/common.h"
+#include "argweaver/logging.h"
+#include "argweaver/matrices.h"
+#include "argweaver/model.h"
+#include "argweaver/sample_arg.h"
+#include "argweaver/sample_thread.h"
+#include "argweaver/sequences.h"
+
+
+// count every allocation made through operator new in the test program
+static std::atomic<long> g_num_allocs(0);
+
+void *operator new(size_t size)
+{
+    g_num_allocs++;
+    void *ptr = malloc(size > 0 ? size : 1);
+    if (!ptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *ptr) noexcept { free(ptr); }
+void operator delete[](void *ptr) noexcept { free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { free(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { free(ptr); }
+
+
+namespace argweaver {
+
+
+// Returns the heap allocations per block of one forward pass for
+// threading the last sequence.  Also prints the time per block.
+static double forward_allocs_per_block(bool smc_prime)
+{
+    const int nseqs = 12;
+    const int seqlen = 50000;
+    const int new_chrom = nseqs - 1;
+
+    ArgModel model(20, 200e3, 10000, 1.5e-8, 2.5e-8);
+    model.smc_prime = smc_prime;
+
+    seed_rand(3);
+    char **seqs = new char* [nseqs];
+    for (int i=0; i<nseqs; i++) {
+        seqs[i] = new char [seqlen + 1];
+        for (int j=0; j<seqlen; j++)
+            seqs[i][j] = "ACGT"[frand() < 0.99 ? 0 : irand(4)];
+        seqs[i][seqlen] = '\0';
+    }
+    Sequences sequences;
+    sequences.extend(seqs, nseqs);
+    sequences.set_length(seqlen);
+    sequences.set_owned(true);
+    delete [] seqs;
+
+    Sequences sequences2(&sequences, nseqs - 1);
+    LocalTrees trees;
+    sample_arg_seq(&model, &sequences2, &trees);
+
+    // the first pass sizes the per-thread scratch space
+    double per_block = 0.0;
+    for (int pass=0; pass<2; pass++) {
+        ArgHmmForwardTable forward(trees.start_coord, trees.length());
+        ArgHmmMatrixIter matrix_iter(&model, &sequences, &trees, new_chrom);
+        Timer time;
+        const long start_allocs = g_num_allocs;
+        arghmm_forward_alg(&trees, &model, &sequences, &matrix_iter,
+                           &forward);
+        const int nblocks = trees.get_num_trees();
+        per_block = double(g_num_allocs - start_allocs) / nblocks;
+        if (pass == 1)
+            printf("smc_prime=%d: %d blocks, %.1f allocations/block, "
+                   "%.0f us/block\n", smc_prime, nblocks, per_block,
+                   time.time() * 1e6 / nblocks);
+    }
+    return per_block;
+}
+
+
+// Besides the state lookup tables, a block only allocates what outlives
+// it: the transition and switch matrices, the emission matrix and the
+// forward table columns.
+TEST(AllocTest, forward_allocs)
+{
+    EXPECT_LT(forward_allocs_per_block(false), 20.0);
+    EXPECT_LT(forward_allocs_per_block(true), 20.0);
+}
+
+
+} // namespace argweaver
@@ -0,0 +1,92 @@
+#include "gtest/gtest.h"
+
+#include "argweaver/common.h"
+#include "argweaver/compact_arg.h"
+#include "argweaver/local_tree.h"
+#include "argweaver/model.h"
+#include "argweaver/sample_arg.h"
+#include "argweaver/sequences.h"
+
+#include "test_util.h"
+
+
+namespace argweaver {
+
+
+// Returns true if two trees have the same nodes
+static bool trees_equal(const LocalTree *tree1, const LocalTree *tree2)
+{
+    if (tree1->nnodes != tree2->nnodes || tree1->root != tree2->root)
+        return false;
+    for (int i=0; i<tree1->nnodes; i++) {
+        const LocalNode &a = tree1->nodes[i];
+        const LocalNode &b = tree2->nodes[i];
+        if (a.parent != b.parent || a.age != b.age ||
+            a.child[0] != b.child[0] || a.child[1] != b.child[1] ||
+            a.pop_path != b.pop_path)
+            return false;
+    }
+    return true;
+}
+
+
+// Trees materialized from compact storage match the original trees.
+TEST(CompactArgTest, materialize)
+{
+    ArgModel model(20, 200e3, 10000, 5e-7, 2.5e-8);
+    Sequences sequences;
+    LocalTrees trees;
+    make_test_arg(&model, &sequences, &trees);
+    ASSERT_TRUE(trees.get_num_trees() > 8);
+
+    CompactLocalTrees compact(4);
+    compact.set(&trees);
+    EXPECT_EQ(compact.get_num_trees(), trees.get_num_trees());
+    EXPECT_EQ(compact.start_coord, trees.start_coord);
+    EXPECT_EQ(compact.end_coord, trees.end_coord);
+
+    // random access and cursor
+    CompactLocalTrees::Cursor cursor(&compact);
+    LocalTree tree;
+    int i = 0;
+    for (LocalTrees::iterator it=trees.begin(); it != trees.end(); ++it, i++)
+    {
+        compact.get_tree(i, &tree);
+        EXPECT_TRUE(trees_equal(&tree, it->tree));
+
+        ASSERT_TRUE(cursor.next());
+        EXPECT_TRUE(trees_equal(&cursor.tree, it->tree));
+        EXPECT_EQ(cursor.blocklen, it->blocklen);
+        EXPECT_EQ(cursor.spr.recomb_node, it->spr.recomb_node);
+        EXPECT_EQ(cursor.spr.coal_node, it->spr.coal_node);
+        if (it->mapping) {
+            ASSERT_TRUE(cursor.get_mapping() != NULL);
+            for (int j=0; j<trees.nnodes; j++)
+                EXPECT_EQ(cursor.get_mapping()[j], it->mapping[j]);
+        } else {
+            EXPECT_TRUE(cursor.get_mapping() == NULL);
+        }
+    }
+    EXPECT_FALSE(cursor.next());
+
+    // expand a region
+    const int start = trees.start_coord + trees.length() / 3;
+    const int end = trees.start_coord + 2 * trees.length() / 3;
+    LocalTrees trees2;
+    compact.expand(&trees2, start, end);
+    EXPECT_TRUE(assert_trees(&trees2));
+    EXPECT_TRUE(trees2.start_coord <= start);
+    EXPECT_TRUE(trees2.end_coord >= end);
+
+    int start2, end2;
+    LocalTrees::iterator it = trees.get_block(trees2.start_coord,
+                                              start2, end2);
+    for (LocalTrees::iterator it2=trees2.begin(); it2 != trees2.end();
+         ++it2, ++it) {
+        EXPECT_TRUE(trees_equal(it2->tree, it->tree));
+        EXPECT_EQ(it2->blocklen, it->blocklen);
+    }
+}
+
+
+} // namespace argweaver
@@ -0,0 +1,106 @@
+#include "gtest/gtest.h"
+
+#include <string>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "argweaver/compress.h"
+
+
+namespace argweaver {
+
+using namespace std;
+
+
+// Returns text spanning several BGZF blocks
+static string make_text()
+{
+    string text;
+    char line[100];
+    for (int i=0; i<20000; i++) {
+        snprintf(line, sizeof(line), "chr\t%d\t%d\t%d\n", i, i * 7, i % 13);
+        text += line;
+    }
+    return text;
+}
+
+
+static string read_text(const char *filename)
+{
+    CompressStream stream(filename);
+    EXPECT_TRUE(stream.stream != NULL);
+    string text;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), stream.stream)) > 0)
+        text.append(buf, n);
+    return text;
+}
+
+
+static void write_read(int nthreads)
+{
+    const string text = make_text();
+    char filename[] = "/tmp/test_compress_XXXXXX.gz";
+    int fd = mkstemps(filename, 3);
+    ASSERT_TRUE(fd != -1);
+    close(fd);
+
+    int orig_nthreads = get_compress_threads();
+    set_compress_threads(nthreads);
+    {
+        CompressStream stream(filename, "w");
+        ASSERT_TRUE(stream.stream != NULL);
+        fputs(text.c_str(), stream.stream);
+    }
+    set_compress_threads(orig_nthreads);
+
+    // file is BGZF: gzip header with a BC extra field, ending in the
+    // empty EOF block
+    FILE *infile = fopen(filename, "rb");
+    unsigned char header[16];
+    ASSERT_EQ(fread(header, 1, sizeof(header), infile), sizeof(header));
+    EXPECT_EQ(header[0], 0x1f);
+    EXPECT_EQ(header[1], 0x8b);
+    EXPECT_EQ(header[3] & 4, 4);
+    EXPECT_EQ(header[12], 'B');
+    EXPECT_EQ(header[13], 'C');
+    fseek(infile, 0, SEEK_END);
+    EXPECT_TRUE(ftell(infile) < (long) text.size() / 2);
+    fclose(infile);
+
+    EXPECT_TRUE(read_text(filename) == text);
+    unlink(filename);
+}
+
+
+// Compressed files read back as written
+TEST(CompressTest, write_read)
+{
+    write_read(0);
+}
+
+
+// Compressing blocks on worker threads gives the same file contents
+TEST(CompressTest, write_read_threads)
+{
+    write_read(3);
+}
+
+
+// Uncompressed files with a .gz suffix are read as is
+TEST(CompressTest, read_plain)
+{
+    const string text = make_text();
+    char filename[] = "/tmp/test_compress_XXXXXX.gz";
+    int fd = mkstemps(filename, 3);
+    ASSERT_TRUE(fd != -1);
+    ASSERT_EQ(write(fd, text.c_str(), text.size()), (ssize_t) text.size());
+    close(fd);
+
+    EXPECT_TRUE(read_text(filename) == text);
+    unlink(filename);
+}
+
+
+} // namespace argweaver
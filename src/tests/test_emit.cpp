@@ -0,0 +1,147 @@
+#include "gtest/gtest.h"
+
+#include "argweaver/common.h"
+#include "argweaver/emit.h"
+#include "argweaver/local_tree.h"
+#include "argweaver/model.h"
+#include "argweaver/sample_arg.h"
+#include "argweaver/sequences.h"
+
+
+namespace argweaver {
+
+
+// Random alignment with masked bases and all four nucleotides.
+static void make_random_sequences(Sequences *sequences, int nseqs, int seqlen)
+{
+    seed_rand(3);
+    char **seqs = new char* [nseqs];
+    for (int i=0; i<nseqs; i++) {
+        seqs[i] = new char [seqlen + 1];
+        seqs[i][seqlen] = '\0';
+    }
+    for (int j=0; j<seqlen; j++) {
+        const double r = frand();
+        for (int i=0; i<nseqs; i++) {
+            if (r < 0.3)
+                seqs[i][j] = "ACGT"[irand(0, 4)];
+            else if (r < 0.35 && frand() < 0.5)
+                seqs[i][j] = 'N';
+            else
+                seqs[i][j] = (r < 0.4 ? 'N' : 'G');
+        }
+    }
+
+    sequences->extend(seqs, nseqs);
+    sequences->set_length(seqlen);
+    sequences->set_owned(true);
+    delete [] seqs;
+}
+
+
+// Batched calc_inner_outer() gives the same tables as the per-site code.
+static void check_inner_outer(bool internal)
+{
+    const char *newick =
+        "(((0,1)6[&&NHX:age=3],(2,3)7[&&NHX:age=5])9[&&NHX:age=12],"
+        "(4,5)8[&&NHX:age=8])10[&&NHX:age=15]";
+    const int ntimes = 20;
+    const int nseqs = 6;
+    const int nsites = 101;
+
+    ArgModel model(ntimes, 200e3, 10000, 1.5e-8, 2.5e-8);
+    LocalTree tree;
+    ASSERT_TRUE(parse_local_tree(newick, &tree, model.times, ntimes));
+    const int nnodes = tree.nnodes;
+
+    Sequences sequences;
+    make_random_sequences(&sequences, nseqs, nsites);
+    vector<vector<BaseProbs> > base_probs;
+
+    int sites[nsites];
+    bool use[nsites];
+    for (int k=0; k<nsites; k++) {
+        sites[k] = k;
+        use[k] = (k % 7 != 3);
+    }
+
+    lk_row **inner = new_matrix<lk_row>(nsites, nnodes);
+    lk_row **outer = new_matrix<lk_row>(nsites, nnodes);
+    lk_row **inner_slow = new_matrix<lk_row>(nsites, nnodes);
+    lk_row **outer_slow = new_matrix<lk_row>(nsites, nnodes);
+    calc_inner_outer(&tree, &model, sequences.get_seqs(), base_probs,
+                     sites, nsites, use, internal, inner, outer);
+    calc_inner_outer_slow(&tree, &model, sequences.get_seqs(), base_probs,
+                          sites, nsites, use, internal,
+                          inner_slow, outer_slow);
+
+    const int maintree_root = internal ? tree.nodes[tree.root].child[1] :
+        tree.root;
+    int mainnodes[nnodes];
+    int nmainnodes = 0;
+    tree.get_preorder(maintree_root, mainnodes, nmainnodes);
+
+    for (int k=0; k<nsites; k++) {
+        if (!use[k])
+            continue;
+        for (int j=0; j<nnodes; j++)
+            for (int a=0; a<4; a++)
+                ASSERT_EQ(inner[k][j][a], inner_slow[k][j][a])
+                    << "site " << k << " node " << j;
+        for (int i=0; i<nmainnodes; i++)
+            for (int a=0; a<4; a++)
+                ASSERT_EQ(outer[k][mainnodes[i]][a],
+                          outer_slow[k][mainnodes[i]][a])
+                    << "site " << k << " node " << mainnodes[i];
+    }
+
+    delete_matrix<lk_row>(inner, nsites);
+    delete_matrix<lk_row>(outer, nsites);
+    delete_matrix<lk_row>(inner_slow, nsites);
+    delete_matrix<lk_row>(outer_slow, nsites);
+}
+
+
+TEST(EmitTest, inner_outer_batch)
+{
+    check_inner_outer(false);
+}
+
+
+TEST(EmitTest, inner_outer_batch_internal)
+{
+    check_inner_outer(true);
+}
+
+
+// Batched likelihood_tree() gives the same likelihoods as the per-site
+// code for every local tree of an ARG.
+TEST(EmitTest, likelihood_tree_batch)
+{
+    const int nseqs = 8;
+    const int seqlen = 3000;
+
+    ArgModel model(20, 200e3, 10000, 1.5e-8, 2.5e-8);
+    Sequences sequences;
+    make_random_sequences(&sequences, nseqs, seqlen);
+    LocalTrees trees;
+    sample_arg_seq(&model, &sequences, &trees);
+
+    const char *seqs[nseqs];
+    for (int i=0; i<nseqs; i++)
+        seqs[i] = sequences.seqs[trees.seqids[i]];
+
+    int end = trees.start_coord;
+    for (LocalTrees::iterator it=trees.begin(); it != trees.end(); ++it) {
+        const int start = end;
+        end += it->blocklen;
+        ASSERT_EQ(likelihood_tree(it->tree, &model, seqs,
+                                  sequences.base_probs, nseqs, start, end),
+                  likelihood_tree_slow(it->tree, &model, seqs,
+                                       sequences.base_probs, nseqs,
+                                       start, end));
+    }
+}
+
+
+} // namespace argweaver
@@ -0,0 +1,127 @@
+#include "gtest/gtest.h"
+
+#include "argweaver/common.h"
+#include "argweaver/forward_kernel.h"
+#include "argweaver/local_tree.h"
+#include "argweaver/model.h"
+#include "argweaver/sample_thread.h"
+#include "argweaver/states.h"
+#include "argweaver/trans.h"
+
+
+namespace argweaver {
+
+
+// Compare every supported forward kernel against the reference recursion.
+// If 'pop_tree_text' is given, the model uses that population tree.
+static void check_forward_kernels(bool smc_prime,
+                                  const char *pop_tree_text=NULL)
+{
+    const char *newick =
+        "(((0,1)6[&&NHX:age=3],(2,3)7[&&NHX:age=5])9[&&NHX:age=12],"
+        "(4,5)8[&&NHX:age=8])10[&&NHX:age=15]";
+    const int ntimes = 20;
+    const int blocklen = 50;
+
+    ArgModel model(ntimes, 1.5e-8, 2.5e-8);
+    model.set_log_times(200e3, ntimes);
+    if (pop_tree_text) {
+        FILE *infile = tmpfile();
+        ASSERT_TRUE(infile != NULL);
+        fputs(pop_tree_text, infile);
+        rewind(infile);
+        model.read_population_tree(infile);
+        fclose(infile);
+        model.pop_tree->max_migrations = 1;
+    }
+    model.set_popsizes(10000.0);
+    model.smc_prime = smc_prime;
+
+    LocalTree tree;
+    ASSERT_TRUE(parse_local_tree(newick, &tree, model.times, ntimes));
+
+    States states;
+    get_coal_states(&tree, ntimes, states, false, model.pop_tree);
+    const int nstates = states.size();
+    ASSERT_GT(nstates, 0);
+
+    // a population tree must give some (node, time) several paths, so
+    // that the kernels see more than one path per time
+    if (pop_tree_text) {
+        bool multiple_paths = false;
+        for (int j=1; j<nstates; j++)
+            if (states[j].node == states[j-1].node &&
+                states[j].time == states[j-1].time)
+                multiple_paths = true;
+        ASSERT_TRUE(multiple_paths);
+    }
+
+    LineageCounts lineages(ntimes, model.num_pops());
+    lineages.count(&tree, model.pop_tree);
+    TransMatrix matrix(&model, nstates);
+    matrix.calc_transition_probs(&tree, &model, states, &lineages);
+
+    seed_rand(1);
+    double **emit = new_matrix<double>(blocklen, nstates);
+    for (int i=0; i<blocklen; i++)
+        for (int k=0; k<nstates; k++)
+            emit[i][k] = 0.5 + frand();
+
+    double **fw_slow = new_matrix<double>(blocklen, nstates);
+    double **fw = new_matrix<double>(blocklen, nstates);
+    for (int k=0; k<nstates; k++)
+        fw_slow[0][k] = 1.0 / nstates;
+    arghmm_forward_block_slow(&tree, ntimes, blocklen, states, lineages,
+                              &matrix, emit, fw_slow);
+
+    const ForwardKernel orig_kernel = get_forward_kernel();
+    const ForwardKernel kernels[] = {
+        FORWARD_KERNEL_SCALAR, FORWARD_KERNEL_AVX2, FORWARD_KERNEL_AVX512};
+    for (int j=0; j<3; j++) {
+        if (!set_forward_kernel(kernels[j]))
+            continue;
+        for (int k=0; k<nstates; k++)
+            fw[0][k] = 1.0 / nstates;
+        arghmm_forward_block(&model, &tree, blocklen, states, lineages,
+                             &matrix, emit, fw);
+        for (int i=0; i<blocklen; i++)
+            for (int k=0; k<nstates; k++)
+                EXPECT_NEAR(fw[i][k], fw_slow[i][k],
+                            FORWARD_KERNEL_TOLERANCE * fw_slow[i][k])
+                    << forward_kernel_name(kernels[j])
+                    << " column " << i << " state " << k;
+    }
+    set_forward_kernel(orig_kernel);
+
+    delete_matrix<double>(emit, blocklen);
+    delete_matrix<double>(fw_slow, blocklen);
+    delete_matrix<double>(fw, blocklen);
+}
+
+
+// Forward kernels agree with arghmm_forward_block_slow() under SMC.
+TEST(ForwardTest, forward_kernels_smc)
+{
+    check_forward_kernels(false);
+}
+
+
+// Forward kernels agree with arghmm_forward_block_slow() under SMC'.
+TEST(ForwardTest, forward_kernels_smc_prime)
+{
+    check_forward_kernels(true);
+}
+
+
+// Forward kernels agree with arghmm_forward_block_slow() when a migration
+// lets states at the same time differ by population path.
+TEST(ForwardTest, forward_kernels_pop_paths)
+{
+    check_forward_kernels(true,
+                          "npop 2\n"
+                          "mig 1000 0 1 0.1\n"
+                          "div 5000 1 0\n");
+}
+
+
+} // namespace argweaver
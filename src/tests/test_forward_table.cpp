@@ -0,0 +1,279 @@
+#include "gtest/gtest.h"
+
+#include "argweaver/common.h"
+#include "argweaver/local_tree.h"
+#include "argweaver/matrices.h"
+#include "argweaver/model.h"
+#include "argweaver/sample_arg.h"
+#include "argweaver/sample_thread.h"
+#include "argweaver/sequences.h"
+#include "argweaver/states.h"
+
+
+namespace argweaver {
+
+
+// Simulate a small alignment with a shared set of segregating sites.
+static void make_test_sequences(Sequences *sequences, int nseqs, int seqlen)
+{
+    seed_rand(7);
+    char **seqs = new char* [nseqs];
+    for (int i=0; i<nseqs; i++) {
+        seqs[i] = new char [seqlen + 1];
+        for (int j=0; j<seqlen; j++)
+            seqs[i][j] = 'A';
+        seqs[i][seqlen] = '\0';
+    }
+    for (int j=0; j<seqlen; j++) {
+        if (frand() < 0.02) {
+            // mutation shared by a random subset of the sequences
+            int split = irand(1, nseqs);
+            for (int i=0; i<nseqs; i++)
+                if ((i + j) % nseqs < split)
+                    seqs[i][j] = 'C';
+        }
+    }
+
+    sequences->extend(seqs, nseqs);
+    sequences->set_length(seqlen);
+    sequences->set_owned(true);
+    delete [] seqs;
+}
+
+
+// Compute the forward table for threading new_chrom and sample 'nsamples'
+// thread paths.  Returns the sampled coalescence time indices at each
+// position in 'times'.
+static void sample_thread_times(const ArgModel *model,
+                                const Sequences *sequences,
+                                const LocalTrees *trees, int new_chrom,
+                                ArgHmmForwardTable *forward, int nsamples,
+                                vector<vector<int> > &times)
+{
+    ArgHmmMatrixIter matrix_iter(model, sequences, trees, new_chrom);
+    arghmm_forward_alg(trees, model, sequences, &matrix_iter, forward);
+
+    const int seqlen = trees->length();
+    int *path = new int [seqlen];
+    States states;
+    ArgHmmMatrixIter matrix_iter2(model, NULL, trees, new_chrom);
+    times.assign(seqlen, vector<int>());
+    for (int n=0; n<nsamples; n++) {
+        stochastic_traceback(trees, model, &matrix_iter2,
+                             forward->get_table(), path, false, false,
+                             forward);
+
+        for (matrix_iter2.begin(); matrix_iter2.more();
+             matrix_iter2.next()) {
+            matrix_iter2.get_coal_states(states);
+            for (int i=matrix_iter2.get_block_start();
+                 i<matrix_iter2.get_block_end(); i++)
+                times[i].push_back(states[path[i]].time);
+        }
+    }
+    delete [] path;
+}
+
+
+// The single precision forward table samples threads from the same
+// distribution as the double precision table.
+TEST(ForwardTableTest, float_forward_table)
+{
+    const int nseqs = 6;
+    const int seqlen = 5000;
+    const int nsamples = 400;
+    const int new_chrom = nseqs - 1;
+
+    ArgModel model(20, 200e3, 10000, 1.5e-8, 2.5e-8);
+    Sequences sequences;
+    make_test_sequences(&sequences, nseqs, seqlen);
+
+    // build an ARG for all but the last sequence
+    Sequences sequences2(&sequences, nseqs - 1);
+    LocalTrees trees;
+    sample_arg_seq(&model, &sequences2, &trees);
+
+    ArgHmmForwardTable forward(trees.start_coord, trees.length());
+    ArgHmmFloatForwardTable forward_float(trees.start_coord,
+                                          trees.length());
+    vector<vector<int> > times, times_float;
+
+    seed_rand(1);
+    sample_thread_times(&model, &sequences, &trees, new_chrom,
+                        &forward, nsamples, times);
+    seed_rand(2);
+    sample_thread_times(&model, &sequences, &trees, new_chrom,
+                        &forward_float, nsamples, times_float);
+
+    // forward tables agree to single precision
+    double **fw = forward.get_table();
+    double **fw_float = forward_float.get_table();
+    ArgHmmMatrixIter matrix_iter(&model, NULL, &trees, new_chrom);
+    States states;
+    for (matrix_iter.begin(); matrix_iter.more(); matrix_iter.next()) {
+        int start = matrix_iter.get_block_start();
+        int end = matrix_iter.get_block_end();
+        matrix_iter.get_coal_states(states);
+        int nstates = max((int) states.size(), 1);
+        forward_float.load_columns(start, end);
+        for (int i=start; i<end; i++) {
+            double top = max_array(fw[i], nstates);
+            for (int k=0; k<nstates; k++)
+                ASSERT_NEAR(fw_float[i][k], fw[i][k], 1e-6 * top);
+        }
+    }
+
+    // mean sampled coalescence times agree within sampling error
+    for (int i=0; i<seqlen; i += seqlen / 10) {
+        double mean = 0.0, mean_float = 0.0;
+        double var = 0.0, var_float = 0.0;
+        for (int n=0; n<nsamples; n++) {
+            mean += times[i][n];
+            mean_float += times_float[i][n];
+        }
+        mean /= nsamples;
+        mean_float /= nsamples;
+        for (int n=0; n<nsamples; n++) {
+            var += (times[i][n] - mean) * (times[i][n] - mean);
+            var_float += ((times_float[i][n] - mean_float) *
+                          (times_float[i][n] - mean_float));
+        }
+        double std_err = sqrt((var + var_float) / (nsamples - 1) / nsamples);
+        EXPECT_NEAR(mean_float, mean, 5.0 * std_err + 0.05)
+            << "position " << i;
+    }
+}
+
+
+// The checkpointed forward table recomputes the same columns as the full
+// table and gives the same sampled thread paths.
+TEST(ForwardTableTest, checkpoint_forward_table)
+{
+    const int nseqs = 6;
+    const int seqlen = 5000;
+    const int nsamples = 20;
+    const int new_chrom = nseqs - 1;
+
+    ArgModel model(20, 200e3, 10000, 1.5e-8, 2.5e-8);
+    Sequences sequences;
+    make_test_sequences(&sequences, nseqs, seqlen);
+
+    Sequences sequences2(&sequences, nseqs - 1);
+    LocalTrees trees;
+    sample_arg_seq(&model, &sequences2, &trees);
+
+    // choose a segment size that holds at least two blocks, so that
+    // segments span block boundaries, and that splits the table into
+    // several segments
+    ArgHmmMatrixIter matrix_iter(&model, NULL, &trees, new_chrom);
+    States states;
+    size_t full_size = 0, max_block_size = 0;
+    int last_nstates = -1;
+    bool nstates_change = false;
+    for (matrix_iter.begin(); matrix_iter.more(); matrix_iter.next()) {
+        matrix_iter.get_coal_states(states);
+        int nstates = max((int) states.size(), 1);
+        size_t size = size_t(matrix_iter.get_blocklen()) * nstates;
+        full_size += size;
+        max_block_size = max(max_block_size, size);
+        if (last_nstates != -1 && nstates != last_nstates)
+            nstates_change = true;
+        last_nstates = nstates;
+    }
+    const size_t segment_size = 2 * max_block_size;
+    ASSERT_TRUE(nstates_change);
+    ASSERT_GT(full_size, 3 * segment_size);
+
+    ArgHmmForwardTable forward(trees.start_coord, trees.length());
+    ArgHmmCheckpointForwardTable forward_checkpoint(
+        trees.start_coord, trees.length(), segment_size);
+    ArgHmmMatrixIter recompute_iter(&model, &sequences, &trees, new_chrom);
+    forward_checkpoint.set_recompute(&trees, &model, &recompute_iter, false);
+    vector<vector<int> > times, times_checkpoint;
+
+    seed_rand(1);
+    sample_thread_times(&model, &sequences, &trees, new_chrom,
+                        &forward, nsamples, times);
+    seed_rand(1);
+    sample_thread_times(&model, &sequences, &trees, new_chrom,
+                        &forward_checkpoint, nsamples, times_checkpoint);
+
+    // recomputed columns match the full table
+    double **fw = forward.get_table();
+    double **fw_checkpoint = forward_checkpoint.get_table();
+    for (matrix_iter.begin(); matrix_iter.more(); matrix_iter.next()) {
+        int start = matrix_iter.get_block_start();
+        int end = matrix_iter.get_block_end();
+        matrix_iter.get_coal_states(states);
+        int nstates = max((int) states.size(), 1);
+        forward_checkpoint.load_columns(start, end);
+        for (int i=start; i<end; i++)
+            for (int k=0; k<nstates; k++)
+                ASSERT_DOUBLE_EQ(fw_checkpoint[i][k], fw[i][k])
+                    << "position " << i << " state " << k;
+    }
+
+    // same random seed gives the same thread paths
+    for (int i=0; i<seqlen; i++)
+        ASSERT_EQ(times_checkpoint[i], times[i]) << "position " << i;
+}
+
+
+// Matrices computed ahead by worker threads give the same forward table as
+// matrices computed in the sampling thread.
+TEST(ForwardTableTest, matrix_pipeline)
+{
+    const int nseqs = 6;
+    const int seqlen = 5000;
+    const int new_chrom = nseqs - 1;
+
+    ArgModel model(20, 200e3, 10000, 1.5e-8, 2.5e-8);
+    Sequences sequences;
+    make_test_sequences(&sequences, nseqs, seqlen);
+
+    Sequences sequences2(&sequences, nseqs - 1);
+    LocalTrees trees;
+    sample_arg_seq(&model, &sequences2, &trees);
+
+    ArgHmmForwardTable forward(trees.start_coord, trees.length());
+    ArgHmmMatrixIter matrix_iter(&model, &sequences, &trees, new_chrom);
+    arghmm_forward_alg(&trees, &model, &sequences, &matrix_iter, &forward);
+
+    ArgHmmForwardTable forward2(trees.start_coord, trees.length());
+    ArgHmmMatrixPipeline pipeline(&model, &sequences, &trees, 3, new_chrom);
+    ArgHmmMatrixList kept(&model, NULL, &trees, new_chrom);
+    pipeline.keep_transitions(&kept);
+    arghmm_forward_alg(&trees, &model, &sequences, &pipeline, &forward2);
+
+    // restart the pipeline part way through the ARG
+    const int start = seqlen / 2;
+    pipeline.seek(start);
+    arghmm_forward_blocks(&trees, &model, &pipeline, &forward2, NULL,
+                          false, false, false, start, seqlen);
+    pipeline.clear();
+
+    double **fw = forward.get_table();
+    double **fw2 = forward2.get_table();
+    States states;
+    for (matrix_iter.begin(); matrix_iter.more(); matrix_iter.next()) {
+        matrix_iter.get_coal_states(states);
+        int nstates = max((int) states.size(), 1);
+        for (int i=matrix_iter.get_block_start();
+             i<matrix_iter.get_block_end(); i++)
+            for (int k=0; k<nstates; k++)
+                ASSERT_EQ(fw2[i][k], fw[i][k]);
+    }
+
+    // transition matrices were kept for every block
+    int nblocks = 0;
+    for (kept.begin(); kept.more(); kept.next(), nblocks++) {
+        ArgHmmMatrices &mat = kept.ref_matrices();
+        ASSERT_TRUE(mat.transmat != NULL);
+        ASSERT_TRUE(mat.emit == NULL);
+        ASSERT_EQ(mat.blocklen, kept.get_blocklen());
+    }
+    ASSERT_GT(nblocks, 1);
+}
+
+
+} // namespace argweaver
@@ -0,0 +1,129 @@
+#include "gtest/gtest.h"
+
+#include <thread>
+
+#include "argweaver/common.h"
+#include "argweaver/random.h"
+
+
+namespace argweaver {
+
+
+// Streams are reproducible from their seed and stream number, and
+// different streams give different draws.
+TEST(RandomTest, streams)
+{
+    RandStream a(10, 0), b(10, 0), c(10, 1), d(11, 0);
+    for (int i=0; i<100; i++) {
+        const uint64_t x = a.next();
+        ASSERT_EQ(x, b.next());
+        ASSERT_NE(x, c.next());
+        ASSERT_NE(x, d.next());
+    }
+
+    // stream 1 is stream 0 after one jump
+    RandStream e(10, 0);
+    e.jump();
+    ASSERT_TRUE(e == RandStream(10, 1));
+}
+
+
+// Uniform draws stay inside their ranges.
+TEST(RandomTest, uniform)
+{
+    RandStream stream(3);
+    double mean = 0.0;
+    const int n = 100000;
+    for (int i=0; i<n; i++) {
+        const double x = stream.uniform();
+        ASSERT_GT(x, 0.0);
+        ASSERT_LT(x, 1.0);
+        mean += x;
+
+        const int j = stream.uniform_int(7);
+        ASSERT_GE(j, 0);
+        ASSERT_LT(j, 7);
+    }
+    EXPECT_NEAR(mean / n, 0.5, 0.01);
+}
+
+
+// A saved stream continues with the same draws.
+TEST(RandomTest, read_write)
+{
+    RandStream a(5);
+    for (int i=0; i<10; i++)
+        a.next();
+
+    FILE *tmp = tmpfile();
+    ASSERT_TRUE(tmp != NULL);
+    a.write(tmp);
+    rewind(tmp);
+    RandStream b;
+    ASSERT_TRUE(b.read(tmp));
+    fclose(tmp);
+
+    for (int i=0; i<10; i++)
+        ASSERT_EQ(a.next(), b.next());
+}
+
+
+static void draw_frand(RandStream *stream, double *values, int n)
+{
+    set_rand_stream(stream);
+    for (int i=0; i<n; i++)
+        values[i] = frand();
+    set_rand_stream(NULL);
+}
+
+
+// frand() draws from the stream set for the calling thread.
+TEST(RandomTest, thread_streams)
+{
+    const int n = 100;
+    double values[2][n];
+    RandStream streams[2] = {RandStream(7, 1), RandStream(7, 2)};
+    std::thread t0(draw_frand, &streams[0], values[0], n);
+    std::thread t1(draw_frand, &streams[1], values[1], n);
+    t0.join();
+    t1.join();
+
+    RandStream expected[2] = {RandStream(7, 1), RandStream(7, 2)};
+    for (int j=0; j<2; j++)
+        for (int i=0; i<n; i++)
+            ASSERT_EQ(values[j][i], expected[j].uniform());
+}
+
+
+static void draw_default(double *value)
+{
+    *value = frand();
+}
+
+
+// Threads without a stream draw from default streams that do not overlap
+// the numbered streams of the seed, and seed_rand() gives the calling
+// thread stream 0.
+TEST(RandomTest, default_streams)
+{
+    seed_rand(9);
+    double values[2];
+    std::thread t0(draw_default, &values[0]);
+    t0.join();
+    std::thread t1(draw_default, &values[1]);
+    t1.join();
+    ASSERT_NE(values[0], values[1]);
+
+    for (int k=0; k<16; k++) {
+        RandStream numbered(9, k);
+        const double x = numbered.uniform();
+        ASSERT_NE(values[0], x);
+        ASSERT_NE(values[1], x);
+    }
+
+    RandStream stream0(9, 0);
+    ASSERT_EQ(frand(), stream0.uniform());
+}
+
+
+} // namespace argweaver
@@ -0,0 +1,408 @@
+#include "gtest/gtest.h"
+
+#include <string>
+
+#include "argweaver/common.h"
+#include "argweaver/emit.h"
+#include "argweaver/local_tree.h"
+#include "argweaver/model.h"
+#include "argweaver/recomb.h"
+#include "argweaver/sample_arg.h"
+#include "argweaver/sample_thread.h"
+#include "argweaver/sequences.h"
+#include "argweaver/thread.h"
+#include "argweaver/total_prob.h"
+#include "argweaver/track.h"
+
+#include "test_util.h"
+
+
+namespace argweaver {
+
+
+// Simulate a small alignment with a shared set of segregating sites.
+static void make_test_sequences(Sequences *sequences, int nseqs, int seqlen)
+{
+    seed_rand(5);
+    char **seqs = new char* [nseqs];
+    for (int i=0; i<nseqs; i++) {
+        seqs[i] = new char [seqlen + 1];
+        for (int j=0; j<seqlen; j++)
+            seqs[i][j] = 'A';
+        seqs[i][seqlen] = '\0';
+    }
+    for (int j=0; j<seqlen; j++) {
+        if (frand() < 0.02) {
+            int split = irand(1, nseqs);
+            for (int i=0; i<nseqs; i++)
+                if ((i + j) % nseqs < split)
+                    seqs[i][j] = 'C';
+        }
+    }
+
+    sequences->extend(seqs, nseqs);
+    sequences->set_length(seqlen);
+    sequences->set_owned(true);
+    delete [] seqs;
+}
+
+
+// Resample the windows of an ARG with 'nthreads' window threads
+static string resample_windows(int nthreads)
+{
+    const int nseqs = 6;
+    const int seqlen = 4000;
+
+    ArgModel model(20, 200e3, 10000, 1.5e-8, 2.5e-8);
+    Sequences sequences;
+    make_test_sequences(&sequences, nseqs, seqlen);
+    LocalTrees trees;
+    sample_arg_seq(&model, &sequences, &trees);
+
+    const int orig_nthreads = get_window_threads();
+    set_window_threads(nthreads);
+    seed_rand(11);
+    for (int i=0; i<3; i++)
+        resample_arg_regions(&model, &sequences, &trees, 500, 2);
+    set_window_threads(orig_nthreads);
+
+    EXPECT_TRUE(assert_trees(&trees));
+    EXPECT_EQ(trees.start_coord, 0);
+    EXPECT_EQ(trees.end_coord, seqlen);
+    return local_trees_text(&trees, &sequences, &model);
+}
+
+
+// Concurrent window resampling gives valid ARGs that do not depend on the
+// number of threads.
+TEST(SampleArgTest, window_threads)
+{
+    const string arg2 = resample_windows(2);
+    const string arg4 = resample_windows(4);
+    ASSERT_TRUE(arg2 == arg4);
+}
+
+
+// Reverting an undo log restores the ARG after a thread path is removed
+// and resampled.
+TEST(SampleArgTest, undo_revert)
+{
+    const int nseqs = 6;
+    const int seqlen = 4000;
+
+    ArgModel model(20, 200e3, 10000, 1.5e-8, 2.5e-8);
+    Sequences sequences;
+    make_test_sequences(&sequences, nseqs, seqlen);
+    LocalTrees trees;
+    sample_arg_seq(&model, &sequences, &trees);
+    const string orig = local_trees_text(&trees, &sequences, &model);
+
+    seed_rand(7);
+    for (int i=0; i<5; i++) {
+        LocalTreesUndo undo;
+        undo.begin(&trees);
+
+        int *removal_path = new int [trees.get_num_trees()];
+        sample_arg_removal_path_uniform(&trees, removal_path);
+        remove_arg_thread_path(&trees, removal_path,
+                               model.get_removed_root_time(), model.pop_tree);
+        delete [] removal_path;
+        sample_arg_thread_internal(&model, &sequences, &trees);
+
+        undo.revert();
+        EXPECT_TRUE(assert_trees(&trees));
+        ASSERT_TRUE(local_trees_text(&trees, &sequences, &model) == orig);
+    }
+}
+
+
+// Compacting local trees keeps the ARG and places the nodes of neighboring
+// trees next to each other.
+TEST(SampleArgTest, compact)
+{
+    const int nseqs = 6;
+    const int seqlen = 4000;
+
+    ArgModel model(20, 200e3, 10000, 1.5e-8, 2.5e-8);
+    Sequences sequences;
+    make_test_sequences(&sequences, nseqs, seqlen);
+    LocalTrees trees;
+    sample_arg_seq(&model, &sequences, &trees);
+    const string orig = local_trees_text(&trees, &sequences, &model);
+
+    trees.compact(4);
+    ASSERT_TRUE(local_trees_text(&trees, &sequences, &model) == orig);
+    int i = 0;
+    LocalTree *last_tree = NULL;
+    for (LocalTrees::iterator it=trees.begin(); it != trees.end(); ++it, i++) {
+        if (i % 4 != 0) {
+            EXPECT_EQ(it->tree->nodes,
+                      last_tree->nodes + last_tree->capacity);
+        }
+        last_tree = it->tree;
+    }
+
+    // trees stay valid after being split apart and resampled
+    LocalTrees *trees2 = partition_local_trees(&trees, seqlen / 2);
+    trees.compact();
+    append_local_trees(&trees, trees2);
+    delete trees2;
+    EXPECT_TRUE(assert_trees(&trees));
+    ASSERT_TRUE(local_trees_text(&trees, &sequences, &model) == orig);
+
+    seed_rand(3);
+    resample_arg_regions(&model, &sequences, &trees, 500, 2);
+    EXPECT_TRUE(assert_trees(&trees));
+}
+
+
+// Check every lookup of the block index against a walk over the blocks
+static void check_block_index(LocalTrees *trees)
+{
+    const LocalTrees *const_trees = trees;
+    int end = trees->start_coord;
+    for (LocalTrees::iterator it=trees->begin(); it != trees->end(); ++it) {
+        const int start = end;
+        end += it->blocklen;
+        for (int site=start; site<end; site += max((end - start) / 3, 1)) {
+            int start2, end2;
+            ASSERT_TRUE(const_trees->get_block(site, start2, end2) ==
+                        LocalTrees::const_iterator(it));
+            EXPECT_EQ(start2, start);
+            EXPECT_EQ(end2, end);
+            ASSERT_TRUE(trees->get_block(site, start2, end2) == it);
+            EXPECT_EQ(start2, start);
+            EXPECT_EQ(end2, end);
+            ASSERT_TRUE(const_trees->get_first_block(site, start2) ==
+                        LocalTrees::const_iterator(it));
+            EXPECT_EQ(start2, start);
+        }
+    }
+    EXPECT_TRUE(trees->get_block(trees->end_coord) == trees->end());
+    EXPECT_TRUE(trees->get_block(trees->start_coord - 1) == trees->end());
+}
+
+
+// The block index stays consistent as windows are split off, appended and
+// resampled.
+TEST(SampleArgTest, block_index)
+{
+    const int nseqs = 6;
+    const int seqlen = 4000;
+
+    ArgModel model(20, 200e3, 10000, 1.5e-8, 2.5e-8);
+    Sequences sequences;
+    make_test_sequences(&sequences, nseqs, seqlen);
+    LocalTrees trees;
+    sample_arg_seq(&model, &sequences, &trees);
+
+    trees.get_block(seqlen / 2);
+    check_block_index(&trees);
+
+    LocalTrees *trees2 = partition_local_trees(&trees, seqlen / 3);
+    check_block_index(&trees);
+    check_block_index(trees2);
+    append_local_trees(&trees, trees2);
+    delete trees2;
+    check_block_index(&trees);
+
+    seed_rand(3);
+    resample_arg_regions(&model, &sequences, &trees, 500, 2);
+    check_block_index(&trees);
+    resample_arg_mcmc_all(&model, &sequences, &trees, false, 500, 2);
+    check_block_index(&trees);
+}
+
+
+
+// Check the scores of calc_arg_scores() against the whole-ARG functions
+static void check_arg_scores(const ArgModel *model,
+                             const Sequences *sequences,
+                             const LocalTrees *trees)
+{
+    ArgScores scores(true, true, true, true);
+    calc_arg_scores(model, sequences, trees, &scores);
+    EXPECT_NEAR(scores.prior, calc_arg_prior(model, trees), 1e-6);
+    EXPECT_NEAR(scores.prior2,
+                calc_arg_prior_recomb_integrate(model, trees, -1, -1), 1e-6);
+    EXPECT_NEAR(scores.likelihood,
+                calc_arg_likelihood(model, sequences, trees), 1e-6);
+    EXPECT_EQ(scores.noncompat, count_noncompat(trees, sequences));
+}
+
+
+// Cached block scores are reused only while the blocks, sequences and
+// model are unchanged.
+TEST(SampleArgTest, arg_scores)
+{
+    const int nseqs = 6;
+    const int seqlen = 4000;
+
+    ArgModel model(20, 200e3, 10000, 1.5e-8, 2.5e-8);
+    Sequences sequences;
+    make_test_sequences(&sequences, nseqs, seqlen);
+    LocalTrees trees;
+    sample_arg_seq(&model, &sequences, &trees);
+
+    check_arg_scores(&model, &sequences, &trees);
+    check_arg_scores(&model, &sequences, &trees);
+
+    seed_rand(3);
+    for (int i=0; i<3; i++) {
+        resample_arg_regions(&model, &sequences, &trees, 500, 2);
+        check_arg_scores(&model, &sequences, &trees);
+    }
+
+    for (int i=0; i<model.ntimes; i++)
+        model.popsizes[0][i] *= 2.0;
+    check_arg_scores(&model, &sequences, &trees);
+
+    model.rho *= 3.0;
+    model.mu *= 0.5;
+    check_arg_scores(&model, &sequences, &trees);
+
+    // switching alleles, as when phasing, changes the likelihood
+    const double likelihood = calc_arg_likelihood(&model, &sequences, &trees);
+    int coord = 0;
+    while (sequences.seqs[0][coord] == sequences.seqs[1][coord])
+        coord++;
+    sequences.switch_alleles(coord, 0, 1);
+    EXPECT_NE(calc_arg_likelihood(&model, &sequences, &trees), likelihood);
+    check_arg_scores(&model, &sequences, &trees);
+    sequences.switch_alleles(coord, 0, 1);
+    check_arg_scores(&model, &sequences, &trees);
+}
+
+
+// Check the scores of an uncompressed ARG of compressed sequences against
+// the whole-ARG functions, as print_stats() of arg-sample calculates them
+static void check_arg_scores(const ArgModel *model,
+                             const Sequences *sequences,
+                             const LocalTrees *trees,
+                             const SitesMapping *sites_mapping,
+                             const TrackNullValue *maskmap,
+                             const vector<int> &invisible_recomb_pos,
+                             const vector<Spr> &invisible_recombs)
+{
+    ArgScores scores(true, true, true, false);
+    calc_arg_scores(model, sequences, trees, &scores, sites_mapping, maskmap,
+                    invisible_recomb_pos, invisible_recombs);
+    EXPECT_NEAR(scores.prior,
+                calc_arg_prior(model, trees, NULL, NULL, -1, -1,
+                               invisible_recomb_pos, invisible_recombs),
+                1e-6);
+    EXPECT_NEAR(scores.prior2,
+                calc_arg_prior_recomb_integrate(model, trees, -1, -1), 1e-6);
+    EXPECT_NEAR(scores.likelihood,
+                calc_arg_likelihood(model, sequences, trees, sites_mapping,
+                                    maskmap), 1e-6);
+}
+
+
+// Cached block scores follow the sites mapping, mask and invisible
+// recombinations.
+TEST(SampleArgTest, arg_scores_compressed)
+{
+    const int nseqs = 6;
+    const int seqlen = 4000;
+    const int compress = 5;
+
+    Sequences sequences;
+    make_test_sequences(&sequences, nseqs, seqlen);
+    Sites sites;
+    make_sites_from_sequences(&sequences, &sites);
+    SitesMapping sites_mapping;
+    ASSERT_TRUE(find_compress_cols(&sites, compress, &sites_mapping));
+    compress_sites(&sites, &sites_mapping);
+    Sequences csequences;
+    make_sequences_from_sites(&sites, &csequences);
+
+    ArgModel model(20, 200e3, 10000, 1.5e-8, 2.5e-8);
+    model.smc_prime = true;
+    compress_model(&model, &sites_mapping, compress);
+    LocalTrees trees;
+    sample_arg_seq(&model, &csequences, &trees);
+    seed_rand(3);
+    resample_arg_regions(&model, &csequences, &trees, 100, 2);
+    vector<int> invisible_recomb_pos0;
+    vector<Spr> invisible_recombs;
+    sample_invisible_recombinations(&model, &trees, invisible_recomb_pos0,
+                                    invisible_recombs);
+    ASSERT_TRUE(invisible_recombs.size() > 0);
+
+    TrackNullValue maskmap;
+    maskmap.append("chr", 1000, 1500, 0);
+    maskmap.append("chr", 3000, 3100, 0);
+    TrackNullValue no_mask;
+
+    // scores of the uncompressed ARG, with and without a mask
+    uncompress_local_trees(&trees, &sites_mapping);
+    uncompress_model(&model, &sites_mapping, compress);
+    vector<int> invisible_recomb_pos;
+    sites_mapping.uncompress(invisible_recomb_pos0, invisible_recomb_pos);
+    EXPECT_NE(calc_arg_likelihood(&model, &csequences, &trees,
+                                  &sites_mapping, &maskmap),
+              calc_arg_likelihood(&model, &csequences, &trees,
+                                  &sites_mapping, &no_mask));
+    for (int i=0; i<2; i++) {
+        check_arg_scores(&model, &csequences, &trees, &sites_mapping,
+                         &maskmap, invisible_recomb_pos, invisible_recombs);
+        check_arg_scores(&model, &csequences, &trees, &sites_mapping,
+                         &no_mask, invisible_recomb_pos, invisible_recombs);
+    }
+
+    // fewer invisible recombinations
+    const double prior = calc_arg_prior(&model, &trees, NULL, NULL, -1, -1,
+                                        invisible_recomb_pos,
+                                        invisible_recombs);
+    invisible_recomb_pos.pop_back();
+    invisible_recombs.pop_back();
+    EXPECT_NE(calc_arg_prior(&model, &trees, NULL, NULL, -1, -1,
+                             invisible_recomb_pos, invisible_recombs), prior);
+    check_arg_scores(&model, &csequences, &trees, &sites_mapping,
+                     &maskmap, invisible_recomb_pos, invisible_recombs);
+    check_arg_scores(&model, &csequences, &trees, &sites_mapping,
+                     &maskmap, vector<int>(), vector<Spr>());
+
+    // the compressed ARG keeps its own scores
+    compress_local_trees(&trees, &sites_mapping);
+    compress_model(&model, &sites_mapping, compress);
+    check_arg_scores(&model, &csequences, &trees);
+    uncompress_local_trees(&trees, &sites_mapping);
+    uncompress_model(&model, &sites_mapping, compress);
+    check_arg_scores(&model, &csequences, &trees, &sites_mapping,
+                     &maskmap, invisible_recomb_pos, invisible_recombs);
+}
+
+
+
+// The ARG prior calculated from population size statistics matches
+// calc_arg_prior() as population sizes change.
+TEST(SampleArgTest, popsize_prior_stats)
+{
+    const int nseqs = 6;
+    const int seqlen = 4000;
+
+    ArgModel model(20, 200e3, 10000, 1.5e-8, 2.5e-8);
+    Sequences sequences;
+    make_test_sequences(&sequences, nseqs, seqlen);
+    LocalTrees trees;
+    sample_arg_seq(&model, &sequences, &trees);
+    seed_rand(3);
+    resample_arg_regions(&model, &sequences, &trees, 500, 2);
+
+    PopsizePriorStats stats;
+    stats.calc(&model, &trees);
+    EXPECT_NEAR(stats.log_prior(&model), calc_arg_prior(&model, &trees),
+                1e-6);
+
+    for (int i=0; i<10; i++) {
+        for (int j=0; j<2*model.ntimes-1; j++)
+            model.popsizes[0][j] = 10000 * exp(frand(-1.0, 1.0));
+        EXPECT_NEAR(stats.log_prior(&model), calc_arg_prior(&model, &trees),
+                    1e-6);
+    }
+}
+
+
+} // namespace argweaver
@@ -0,0 +1,333 @@
+#include "gtest/gtest.h"
+
+#include <string>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "argweaver/common.h"
+#include "argweaver/compact_arg.h"
+#include "argweaver/compress.h"
+#include "argweaver/est_popsize.h"
+#include "argweaver/local_tree.h"
+#include "argweaver/model.h"
+#include "argweaver/sample_arg.h"
+#include "argweaver/sequences.h"
+#include "argweaver/smc_binary.h"
+
+#include "test_util.h"
+
+
+namespace argweaver {
+
+
+// Returns the contents of a stream
+static string read_stream(FILE *stream)
+{
+    rewind(stream);
+    string text;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), stream)) > 0)
+        text.append(buf, n);
+    return text;
+}
+
+
+// An ARG read from the binary format is the ARG read from the text format.
+TEST(SmcBinaryTest, round_trip)
+{
+    ArgModel model(20, 200e3, 10000, 5e-7, 2.5e-8);
+    Sequences sequences;
+    LocalTrees trees;
+    make_test_arg(&model, &sequences, &trees);
+    ASSERT_TRUE(trees.get_num_trees() > 8);
+
+    // read back text
+    FILE *tmp = tmpfile();
+    write_local_trees(tmp, &trees, sequences, model.times);
+    rewind(tmp);
+    LocalTrees text_trees;
+    vector<string> text_names;
+    ASSERT_TRUE(read_local_trees(tmp, model.times, model.ntimes,
+                                 &text_trees, text_names));
+    fclose(tmp);
+
+    // read back binary from memory
+    tmp = tmpfile();
+    write_local_trees_binary(tmp, &trees, sequences, model.times,
+                             model.ntimes);
+    const string data = read_stream(tmp);
+    fclose(tmp);
+
+    SmcBinaryReader reader;
+    ASSERT_TRUE(reader.open(data.c_str(), data.size()));
+    EXPECT_EQ(reader.get_ntimes(), model.ntimes);
+    LocalTrees binary_trees;
+    vector<string> binary_names;
+    ASSERT_TRUE(reader.read(model.times, model.ntimes, &binary_trees,
+                            binary_names));
+
+    EXPECT_TRUE(assert_trees(&binary_trees));
+    EXPECT_TRUE(binary_names == text_names);
+    EXPECT_EQ(binary_trees.chrom, text_trees.chrom);
+    EXPECT_EQ(binary_trees.get_num_trees(), text_trees.get_num_trees());
+    ASSERT_TRUE(local_trees_text(&binary_trees, &sequences, &model) ==
+                local_trees_text(&text_trees, &sequences, &model));
+}
+
+
+// Corrupt binary files are reported as errors instead of being read.
+TEST(SmcBinaryTest, corrupt)
+{
+    ArgModel model(20, 200e3, 10000, 5e-7, 2.5e-8);
+    Sequences sequences;
+    LocalTrees trees;
+    make_test_arg(&model, &sequences, &trees);
+
+    FILE *tmp = tmpfile();
+    write_local_trees_binary(tmp, &trees, sequences, model.times,
+                             model.ntimes);
+    const string data = read_stream(tmp);
+    fclose(tmp);
+
+    // find the first two tree blocks
+    const SmcBinaryHeader *header = (const SmcBinaryHeader*) data.c_str();
+    ASSERT_GT(header->ntrees, 1);
+    const size_t first = sizeof(SmcBinaryHeader) +
+        header->ntimes * sizeof(double) +
+        ((header->chrom_len + 3) & ~3) + ((header->names_len + 3) & ~3);
+    const size_t second = first + sizeof(SmcBinaryBlock) +
+        header->nnodes * sizeof(SmcBinaryNode);
+    ASSERT_LT(second + sizeof(SmcBinaryBlock), data.size());
+
+    for (int k=0; k<5; k++) {
+        string bad = data;
+        SmcBinaryBlock *block1 = (SmcBinaryBlock*) &bad[first];
+        SmcBinaryBlock *block2 = (SmcBinaryBlock*) &bad[second];
+        SmcBinaryNode *node = (SmcBinaryNode*) &bad[first +
+                                                    sizeof(SmcBinaryBlock)];
+        switch (k) {
+        case 0: block1->blocklen = 0; break;
+        case 1: block1->blocklen = header->end_coord; break;
+        case 2: block2->spr.coal_time = header->ntimes; break;
+        case 3: block2->spr.recomb_node = header->nnodes; break;
+        case 4: node->age = -1; break;
+        }
+
+        SmcBinaryReader reader;
+        ASSERT_TRUE(reader.open(bad.c_str(), bad.size()));
+        LocalTrees trees2;
+        vector<string> seqnames;
+        EXPECT_FALSE(reader.read(model.times, model.ntimes, &trees2,
+                                 seqnames)) << "corruption " << k;
+    }
+
+    // truncated file
+    SmcBinaryReader reader;
+    if (reader.open(data.c_str(), second)) {
+        LocalTrees trees2;
+        vector<string> seqnames;
+        EXPECT_FALSE(reader.read(model.times, model.ntimes, &trees2,
+                                 seqnames));
+    }
+}
+
+
+// Binary files are recognized and read by read_arg_file, including into
+// compact storage.
+TEST(SmcBinaryTest, read_arg_file)
+{
+    ArgModel model(20, 200e3, 10000, 5e-7, 2.5e-8);
+    Sequences sequences;
+    LocalTrees trees;
+    make_test_arg(&model, &sequences, &trees);
+
+    char filename[] = "/tmp/test_smc_binary_XXXXXX";
+    int fd = mkstemp(filename);
+    ASSERT_TRUE(fd != -1);
+    close(fd);
+    ASSERT_TRUE(write_local_trees_binary(filename, &trees, sequences,
+                                         model.times, model.ntimes));
+    EXPECT_TRUE(is_smc_binary(filename));
+
+    LocalTrees trees2;
+    vector<string> seqnames;
+    ASSERT_TRUE(read_arg_file(filename, model.times, model.ntimes,
+                              &trees2, seqnames));
+    const string text = local_trees_text(&trees2, &sequences, &model);
+
+    CompactLocalTrees compact;
+    ASSERT_TRUE(read_arg_file(filename, model.times, model.ntimes,
+                              &compact, seqnames));
+    EXPECT_EQ(compact.get_num_trees(), trees2.get_num_trees());
+    LocalTrees trees3;
+    compact.expand(&trees3);
+    ASSERT_TRUE(local_trees_text(&trees3, &sequences, &model) == text);
+
+    unlink(filename);
+    EXPECT_FALSE(is_smc_binary(filename));
+}
+
+
+// Streaming the trees of an .smc file gives the trees read as a whole,
+// from the start or from a skipped-to position.
+TEST(SmcBinaryTest, local_trees_reader)
+{
+    ArgModel model(20, 200e3, 10000, 5e-7, 2.5e-8);
+    Sequences sequences;
+    LocalTrees trees;
+    make_test_arg(&model, &sequences, &trees);
+
+    FILE *tmp = tmpfile();
+    write_local_trees(tmp, &trees, sequences, model.times);
+    rewind(tmp);
+    LocalTrees text_trees;
+    vector<string> text_names;
+    ASSERT_TRUE(read_local_trees(tmp, model.times, model.ntimes,
+                                 &text_trees, text_names));
+    const int ntrees = text_trees.get_num_trees();
+    ASSERT_TRUE(ntrees > 8);
+
+    const int skips[] = {-1, text_trees.start_coord + text_trees.length() / 2};
+    for (int k=0; k<2; k++) {
+        rewind(tmp);
+        LocalTreesReader reader(tmp, model.times, model.ntimes);
+        ASSERT_TRUE(reader.ok());
+        EXPECT_TRUE(reader.seqnames == text_names);
+        EXPECT_EQ(reader.chrom, text_trees.chrom);
+        EXPECT_EQ(reader.start_coord, text_trees.start_coord);
+        EXPECT_EQ(reader.end_coord, text_trees.end_coord);
+        reader.skip_to(skips[k]);
+
+        int i = 0;
+        int end = text_trees.start_coord;
+        int nread = 0;
+        for (LocalTrees::iterator it=text_trees.begin();
+             it != text_trees.end(); ++it, i++) {
+            int start = end;
+            end += it->blocklen;
+            if (end <= skips[k])
+                continue;
+
+            ASSERT_TRUE(reader.next());
+            nread++;
+            EXPECT_EQ(reader.start, start);
+            EXPECT_EQ(reader.end, end);
+            EXPECT_EQ(reader.spr.recomb_node, it->spr.recomb_node);
+            EXPECT_EQ(reader.spr.coal_node, it->spr.coal_node);
+            if (i + 1 < ntrees) {
+                LocalTrees::iterator it2 = it;
+                ++it2;
+                EXPECT_EQ(reader.next_spr.recomb_node, it2->spr.recomb_node);
+                EXPECT_EQ(reader.next_spr.coal_time, it2->spr.coal_time);
+            } else {
+                EXPECT_TRUE(reader.next_spr.is_null());
+            }
+
+            // same tree, up to the order of children
+            const LocalTree *tree = it->tree;
+            EXPECT_EQ(reader.tree.root, tree->root);
+            for (int j=0; j<tree->nnodes; j++) {
+                EXPECT_EQ(reader.tree.nodes[j].parent, tree->nodes[j].parent);
+                EXPECT_EQ(reader.tree.nodes[j].age, tree->nodes[j].age);
+            }
+        }
+        EXPECT_FALSE(reader.next());
+        EXPECT_TRUE(reader.ok());
+        if (k > 0) {
+            EXPECT_TRUE(nread < ntrees);
+        }
+    }
+    fclose(tmp);
+}
+
+
+
+// Streaming text and binary ARG files visits the blocks and SPRs of the
+// whole ARG, and gives the same population size statistics.
+TEST(SmcBinaryTest, local_trees_stream)
+{
+    ArgModel model(20, 200e3, 10000, 5e-7, 2.5e-8);
+    Sequences sequences;
+    LocalTrees trees;
+    make_test_arg(&model, &sequences, &trees);
+
+    struct popsize_data expected;
+    popsize_sufficient_stats(&expected, &model, &trees);
+
+    char text_file[] = "/tmp/test_smc_binary_XXXXXX.smc.gz";
+    int fd = mkstemps(text_file, 7);
+    ASSERT_TRUE(fd != -1);
+    close(fd);
+    {
+        CompressStream out(text_file, "w");
+        write_local_trees(out.stream, &trees, sequences, model.times);
+    }
+    char binary_file[] = "/tmp/test_smc_binary_XXXXXX";
+    fd = mkstemp(binary_file);
+    ASSERT_TRUE(fd != -1);
+    close(fd);
+    ASSERT_TRUE(write_local_trees_binary(binary_file, &trees, sequences,
+                                         model.times, model.ntimes));
+
+    const char *files[] = {text_file, binary_file};
+    for (int k=0; k<2; k++) {
+        LocalTreesStream stream;
+        ASSERT_TRUE(stream.open(files[k], model.times, model.ntimes));
+        EXPECT_EQ(stream.chrom, trees.chrom);
+        EXPECT_EQ((int) stream.seqids.size(), trees.get_num_leaves());
+
+        struct popsize_data data;
+        init_popsize_data(&data, &model, trees.get_num_leaves(), 0.0);
+        LineageCounts lineages(model.ntimes, model.num_pops());
+        int end = trees.start_coord;
+        for (LocalTrees::iterator it=trees.begin(); it != trees.end(); ++it) {
+            const int start = end;
+            end += it->blocklen;
+            ASSERT_TRUE(stream.next());
+            EXPECT_EQ(stream.start, start);
+            EXPECT_EQ(stream.end, end);
+            LocalTrees::iterator it2 = it;
+            ++it2;
+            if (it2 == trees.end()) {
+                EXPECT_TRUE(stream.next_spr.is_null());
+            } else {
+                // nodes are renamed in files, so compare times only
+                EXPECT_EQ(stream.next_spr.recomb_time, it2->spr.recomb_time);
+                EXPECT_EQ(stream.next_spr.coal_time, it2->spr.coal_time);
+                add_popsize_spr(&data, stream.tree, stream.next_spr,
+                                lineages);
+            }
+        }
+        EXPECT_FALSE(stream.next());
+        EXPECT_TRUE(stream.ok());
+
+        for (int i=0; i<data.arr_size; i++)
+            ASSERT_EQ(data.arr_alloc[i], expected.arr_alloc[i]) << files[k];
+        delete_popsize_data(&data);
+    }
+
+    // a region clips the first and last blocks
+    const int region_start = trees.start_coord + 1000;
+    const int region_end = trees.end_coord - 1000;
+    LocalTreesStream stream(region_start, region_end);
+    ASSERT_TRUE(stream.open(text_file, model.times, model.ntimes));
+    ASSERT_TRUE(stream.next());
+    EXPECT_EQ(stream.start, region_start);
+    int end = stream.end;
+    bool last_spr_null = stream.next_spr.is_null();
+    while (stream.next()) {
+        EXPECT_EQ(stream.start, end);
+        end = stream.end;
+        last_spr_null = stream.next_spr.is_null();
+    }
+    EXPECT_EQ(end, region_end);
+    EXPECT_TRUE(last_spr_null);
+
+    delete_popsize_data(&expected);
+    unlink(text_file);
+    unlink(binary_file);
+}
+
+
+} // namespace argweaver
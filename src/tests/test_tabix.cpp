@@ -0,0 +1,466 @@
+#include "gtest/gtest.h"
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <zlib.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "argweaver/common.h"
+#include "argweaver/compress.h"
+#include "argweaver/parsing.h"
+#include "argweaver/tabix.h"
+
+
+namespace argweaver {
+
+using namespace std;
+
+
+struct TestRecord {
+    string chrom;
+    int start;
+    int end;
+    string line;
+};
+
+
+// Binning scheme of tabix indexes (min_shift 14, 5 levels)
+const int MIN_SHIFT = 14;
+const int NLEVELS = 5;
+const unsigned int NBINS = ((1 << (3 * NLEVELS + 3)) - 1) / 7;
+const unsigned int META_BIN = NBINS + 1;
+
+
+// bin holding [beg, end)
+static unsigned int reg2bin(int beg, int end)
+{
+    --end;
+    if (beg >> 14 == end >> 14) return ((1 << 15) - 1) / 7 + (beg >> 14);
+    if (beg >> 17 == end >> 17) return ((1 << 12) - 1) / 7 + (beg >> 17);
+    if (beg >> 20 == end >> 20) return ((1 << 9) - 1) / 7 + (beg >> 20);
+    if (beg >> 23 == end >> 23) return ((1 << 6) - 1) / 7 + (beg >> 23);
+    if (beg >> 26 == end >> 26) return ((1 << 3) - 1) / 7 + (beg >> 26);
+    return 0;
+}
+
+static unsigned int bin_first(int level)
+{
+    return ((1 << (3 * level)) - 1) / 7;
+}
+
+static int bin_level(unsigned int bin)
+{
+    int level = 0;
+    for (; bin; bin = (bin - 1) >> 3)
+        level++;
+    return level;
+}
+
+// first linear index window of a bin
+static unsigned int bin_bottom(unsigned int bin)
+{
+    const int level = bin_level(bin);
+    return (bin - bin_first(level)) << (3 * (NLEVELS - level));
+}
+
+
+template <class T>
+static void put(string &data, T value)
+{
+    data.append((const char*) &value, sizeof(T));
+}
+
+
+// Index of one sequence, built the way htslib builds tabix indexes
+struct TestSeqIndex
+{
+    TestSeqIndex() : off_beg(0), off_end(0), nrecords(0) {}
+
+    // add a record at file offsets [offset, next)
+    void add(int start, int end, uint64_t offset, uint64_t next)
+    {
+        if (nrecords++ == 0)
+            off_beg = offset;
+        off_end = next;
+
+        vector<TabixChunk> &chunks = bins[reg2bin(start, end)];
+        if (!chunks.empty() && chunks.back().second == offset)
+            chunks.back().second = next;
+        else
+            chunks.push_back(TabixChunk(offset, next));
+
+        for (int w=start >> MIN_SHIFT; w <= (end - 1) >> MIN_SHIFT; w++) {
+            if (w >= (int) linear.size())
+                linear.resize(w + 1, (uint64_t) -1);
+            if (linear[w] == (uint64_t) -1)
+                linear[w] = offset;
+        }
+    }
+
+    // fill the linear index, set the smallest offset of each bin, move
+    // the chunks of bins spanning little of the file to their parents
+    // and merge chunks that start in the same BGZF block
+    void finish()
+    {
+        for (unsigned int w=0; w<linear.size(); w++) {
+            if (linear[w] == (uint64_t) -1)
+                linear[w] = (w == 0 ? off_beg : linear[w-1]);
+        }
+        for (map<unsigned int, vector<TabixChunk> >::iterator it =
+                 bins.begin(); it != bins.end(); ++it) {
+            unsigned int w = bin_bottom(it->first);
+            loffset[it->first] = (w < linear.size() ? linear[w] : 0);
+        }
+
+        for (int level=NLEVELS; level>0; level--) {
+            for (unsigned int b=bin_first(level); b<bin_first(level + 1);
+                 b++) {
+                map<unsigned int, vector<TabixChunk> >::iterator it =
+                    bins.find(b);
+                if (it == bins.end())
+                    continue;
+                vector<TabixChunk> &chunks = it->second;
+                sort(chunks.begin(), chunks.end());
+                if ((chunks.back().second >> 16) -
+                    (chunks.front().first >> 16) >= 0x10000)
+                    continue;
+                map<unsigned int, vector<TabixChunk> >::iterator parent =
+                    bins.find((b - 1) >> 3);
+                if (parent == bins.end())
+                    continue;
+                parent->second.insert(parent->second.end(),
+                                      chunks.begin(), chunks.end());
+                bins.erase(it);
+                loffset.erase(b);
+            }
+        }
+        if (bins.count(0))
+            sort(bins[0].begin(), bins[0].end());
+
+        for (map<unsigned int, vector<TabixChunk> >::iterator it =
+                 bins.begin(); it != bins.end(); ++it) {
+            vector<TabixChunk> &chunks = it->second;
+            unsigned int m = 0;
+            for (unsigned int k=1; k<chunks.size(); k++) {
+                if (chunks[m].second >> 16 >= chunks[k].first >> 16)
+                    chunks[m].second = max(chunks[m].second,
+                                           chunks[k].second);
+                else
+                    chunks[++m] = chunks[k];
+            }
+            chunks.resize(m + 1);
+        }
+    }
+
+    // write bins, with the pseudo-bin of file offsets and record counts
+    void write_bins(string &data, bool csi) const
+    {
+        put<int32_t>(data, bins.size() + 1);
+        for (map<unsigned int, vector<TabixChunk> >::const_iterator it =
+                 bins.begin(); it != bins.end(); ++it) {
+            put<uint32_t>(data, it->first);
+            if (csi)
+                put<uint64_t>(data, loffset.find(it->first)->second);
+            put<int32_t>(data, it->second.size());
+            for (unsigned int k=0; k<it->second.size(); k++) {
+                put<uint64_t>(data, it->second[k].first);
+                put<uint64_t>(data, it->second[k].second);
+            }
+        }
+        put<uint32_t>(data, META_BIN);
+        if (csi)
+            put<uint64_t>(data, 0);
+        put<int32_t>(data, 2);
+        put<uint64_t>(data, off_beg);
+        put<uint64_t>(data, off_end);
+        put<uint64_t>(data, nrecords);
+        put<uint64_t>(data, 0);
+    }
+
+    map<unsigned int, vector<TabixChunk> > bins;
+    map<unsigned int, uint64_t> loffset;
+    vector<uint64_t> linear;
+    uint64_t off_beg;
+    uint64_t off_end;
+    uint64_t nrecords;
+};
+
+
+// Writes a .tbi or .csi index of a bgzipped BED file in the layout that
+// tabix writes
+static void write_index(const char *filename,
+                        const vector<string> &seqnames, bool csi)
+{
+    vector<TestSeqIndex> seqs(seqnames.size());
+
+    BgzfReader reader;
+    ASSERT_TRUE(reader.open(filename));
+    string line;
+    uint64_t offset = reader.tell();
+    while (reader.getline(line)) {
+        uint64_t next = reader.tell();
+        if (line[0] != '#') {
+            char chrom[100];
+            int start, end;
+            ASSERT_EQ(sscanf(line.c_str(), "%s %d %d", chrom, &start, &end),
+                      3);
+            int seqid = (seqnames[0] == chrom ? 0 : 1);
+            seqs[seqid].add(start, end, offset, next);
+        }
+        offset = next;
+    }
+    for (unsigned int i=0; i<seqs.size(); i++)
+        seqs[i].finish();
+
+    string names;
+    for (unsigned int i=0; i<seqnames.size(); i++)
+        names += seqnames[i] + '\0';
+
+    // tabix settings: generic, 0-based, columns 1-3, '#' header lines
+    string conf;
+    put<int32_t>(conf, 0x10000);
+    put<int32_t>(conf, 1);
+    put<int32_t>(conf, 2);
+    put<int32_t>(conf, 3);
+    put<int32_t>(conf, '#');
+    put<int32_t>(conf, 0);
+    put<int32_t>(conf, names.size());
+    conf += names;
+
+    string data;
+    if (csi) {
+        data = "CSI\1";
+        put<int32_t>(data, MIN_SHIFT);
+        put<int32_t>(data, NLEVELS);
+        put<int32_t>(data, conf.size());
+        data += conf;
+        put<int32_t>(data, seqnames.size());
+        for (unsigned int i=0; i<seqs.size(); i++)
+            seqs[i].write_bins(data, true);
+    } else {
+        data = "TBI\1";
+        put<int32_t>(data, seqnames.size());
+        data += conf;
+        for (unsigned int i=0; i<seqs.size(); i++) {
+            seqs[i].write_bins(data, false);
+            put<int32_t>(data, seqs[i].linear.size());
+            for (unsigned int w=0; w<seqs[i].linear.size(); w++)
+                put<uint64_t>(data, seqs[i].linear[w]);
+        }
+    }
+    put<uint64_t>(data, 0);   // records without coordinates
+
+    string index_file = string(filename) + (csi ? ".csi" : ".tbi");
+    gzFile out = gzopen(index_file.c_str(), "wb");
+    ASSERT_TRUE(out != NULL);
+    gzwrite(out, data.data(), data.size());
+    gzclose(out);
+}
+
+
+static string read_all(FILE *stream)
+{
+    string text;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), stream)) > 0)
+        text.append(buf, n);
+    return text;
+}
+
+
+// Region queries on one open stream return the header and the records
+// overlapping each region, through either kind of index
+TEST(TabixTest, region)
+{
+    const char *header = "#NAMES\ta\tb\n";
+    vector<string> seqnames;
+    seqnames.push_back("chr1");
+    seqnames.push_back("chr2");
+
+    // sorted records of varying length on two sequences
+    seed_rand(7);
+    vector<TestRecord> records;
+    for (unsigned int i=0; i<seqnames.size(); i++) {
+        int pos = 0;
+        for (int j=0; j<30000; j++) {
+            TestRecord rec;
+            rec.chrom = seqnames[i];
+            pos += irand(40);
+            rec.start = pos;
+            rec.end = pos + 1 + (frand() < 0.01 ? irand(100000) : irand(50));
+            char line[200];
+            snprintf(line, sizeof(line), "%s\t%d\t%d\t%d\n",
+                     rec.chrom.c_str(), rec.start, rec.end, j);
+            rec.line = line;
+            records.push_back(rec);
+        }
+    }
+
+    char filename[] = "/tmp/test_tabix_XXXXXX.bed.gz";
+    int fd = mkstemps(filename, 7);
+    ASSERT_TRUE(fd != -1);
+    close(fd);
+    {
+        CompressStream out(filename, "w");
+        fputs(header, out.stream);
+        for (unsigned int i=0; i<records.size(); i++)
+            fputs(records[i].line.c_str(), out.stream);
+    }
+    // query through a .tbi index, then through a .csi index
+    for (int csi=0; csi<2; csi++) {
+        write_index(filename, seqnames, csi);
+        if (csi)
+            unlink((string(filename) + ".tbi").c_str());
+        const char *format = (csi ? "csi" : "tbi");
+
+        TabixStream stream(filename);
+        for (int k=0; k<50; k++) {
+            const string chrom = seqnames[irand(seqnames.size())];
+            const int start = irand(600000);
+            const int end = start + 1 + irand(k % 2 ? 100 : 20000);
+            char region[100];
+            snprintf(region, sizeof(region), "%s:%d-%d",
+                     chrom.c_str(), start + 1, end);
+
+            string expected = header;
+            for (unsigned int i=0; i<records.size(); i++)
+                if (records[i].chrom == chrom && records[i].start < end &&
+                    records[i].end > start)
+                    expected += records[i].line;
+
+            ASSERT_TRUE(stream.set_region(region)) << format;
+            EXPECT_TRUE(read_all(stream.stream) == expected)
+                << format << " " << region;
+        }
+
+        // unknown sequences give only the header
+        ASSERT_TRUE(stream.set_region("chrX:1-1000"));
+        EXPECT_EQ(read_all(stream.stream), string(header)) << format;
+
+        // whole file
+        string expected = header;
+        for (unsigned int i=0; i<records.size(); i++)
+            expected += records[i].line;
+        ASSERT_TRUE(stream.set_region(NULL));
+        EXPECT_TRUE(read_all(stream.stream) == expected) << format;
+        stream.close();
+    }
+
+    unlink(filename);
+    unlink((string(filename) + ".csi").c_str());
+}
+
+
+static bool copy_file(const string &from, const string &to)
+{
+    FILE *infile = fopen(from.c_str(), "rb");
+    if (!infile)
+        return false;
+    FILE *out = fopen(to.c_str(), "wb");
+    if (!out) {
+        fclose(infile);
+        return false;
+    }
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), infile)) > 0)
+        fwrite(buf, 1, n, out);
+    fclose(infile);
+    return fclose(out) == 0;
+}
+
+
+// Region queries through the .tbi and .csi indexes of a BED file that was
+// bgzipped and indexed outside of argweaver (see
+// test/data/test_tabix/make_fixtures.py)
+TEST(TabixTest, fixtures)
+{
+    const string fixture = "test/data/test_tabix/regions.bed.gz";
+
+    // read the records by decompressing the whole file
+    string header;
+    vector<TestRecord> records;
+    {
+        CompressStream in(fixture.c_str(), "r");
+        ASSERT_TRUE(in.stream != NULL);
+        char *line;
+        while ((line = fgetline(in.stream))) {
+            if (line[0] == '#') {
+                header += line;
+            } else {
+                TestRecord rec;
+                char chrom[100];
+                ASSERT_EQ(sscanf(line, "%99s %d %d", chrom, &rec.start,
+                                 &rec.end), 3);
+                rec.chrom = chrom;
+                rec.line = line;
+                records.push_back(rec);
+            }
+            delete [] line;
+        }
+    }
+    ASSERT_TRUE(records.size() > 100);
+
+    // regions at the ends of the sequences, within one bin, spanning
+    // bins, and before and after all records
+    const char *regions[] = {
+        "chr1:1-1", "chr1:1-20000", "chr1:16384-16385", "chr1:40000-90000",
+        "chr1:99990-100000", "chr2:1-740", "chr2:50000-50001",
+        "chr2:30000-70000", "chr2:100000-200000", "chr1:1-100000",
+        "chr2:1-100000"};
+    const int nregions = sizeof(regions) / sizeof(regions[0]);
+
+    char filename[] = "/tmp/test_tabix_XXXXXX.bed.gz";
+    int fd = mkstemps(filename, 7);
+    ASSERT_TRUE(fd != -1);
+    close(fd);
+    ASSERT_TRUE(copy_file(fixture, filename));
+
+    const char *formats[] = {"tbi", "csi"};
+    for (int k=0; k<2; k++) {
+        const string ext = string(".") + formats[k];
+        const string index_file = string(filename) + ext;
+        ASSERT_TRUE(copy_file(fixture + ext, index_file));
+
+        TabixIndex index;
+        ASSERT_TRUE(index.read(index_file.c_str())) << formats[k];
+        EXPECT_EQ(index.format, 0x10000);
+        EXPECT_EQ(index.col_seq, 1);
+        EXPECT_EQ(index.col_beg, 2);
+        EXPECT_EQ(index.col_end, 3);
+        EXPECT_EQ(index.meta, '#');
+        ASSERT_EQ(index.seqnames.size(), 2u);
+        EXPECT_EQ(index.get_seqid("chr2"), 1);
+
+        TabixStream stream(filename);
+        for (int j=0; j<nregions; j++) {
+            char chrom[100];
+            int start, end;
+            ASSERT_EQ(sscanf(regions[j], "%99[^:]:%d-%d", chrom, &start,
+                             &end), 3);
+            start--;
+
+            string expected = header;
+            for (unsigned int i=0; i<records.size(); i++)
+                if (records[i].chrom == chrom && records[i].start < end &&
+                    records[i].end > start)
+                    expected += records[i].line;
+
+            ASSERT_TRUE(stream.set_region(regions[j])) << formats[k];
+            EXPECT_TRUE(read_all(stream.stream) == expected)
+                << formats[k] << " " << regions[j];
+        }
+        stream.close();
+        unlink(index_file.c_str());
+    }
+
+    unlink(filename);
+}
+
+
+} // namespace argweaver
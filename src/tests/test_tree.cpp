@@ -0,0 +1,160 @@
+#include "gtest/gtest.h"
+
+#include <algorithm>
+#include <math.h>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "argweaver/common.h"
+#include "argweaver/Tree.h"
+
+
+namespace spidir {
+
+using namespace std;
+
+
+// Returns the newick string of a random coalescent tree of 'nleaves'
+// leaves with ages of one decimal place, as in arg-sample output
+static string random_newick(int nleaves)
+{
+    vector<string> subtrees;
+    vector<double> ages;
+    for (int i=0; i<nleaves; i++) {
+        char name[20];
+        snprintf(name, sizeof(name), "n%d", i);
+        subtrees.push_back(name);
+        ages.push_back(0.0);
+    }
+
+    double age = 0.0;
+    while (subtrees.size() > 1) {
+        age += (1 + irand(1000)) / 10.0;
+        int i = irand(subtrees.size());
+        int j = irand(subtrees.size() - 1);
+        if (j >= i) j++;
+
+        char buf[100];
+        string newick = "(" + subtrees[i];
+        snprintf(buf, sizeof(buf), ":%g,", age - ages[i]);
+        newick += buf + subtrees[j];
+        snprintf(buf, sizeof(buf), ":%g)", age - ages[j]);
+        newick += buf;
+
+        subtrees[i] = newick;
+        ages[i] = age;
+        subtrees.erase(subtrees.begin() + j);
+        ages.erase(ages.begin() + j);
+    }
+    return subtrees[0] + ";";
+}
+
+
+// Returns a random SPR of 'tree' that Tree::apply_spr accepts
+static NodeSpr random_spr(Tree *tree)
+{
+    NodeSpr spr;
+    while (true) {
+        Node *recomb = tree->nodes[irand(tree->nnodes)];
+        Node *coal = tree->nodes[irand(tree->nnodes)];
+        if (recomb == tree->root)
+            continue;
+
+        // coal node may not be below recomb node
+        bool below = false;
+        for (Node *n=coal; n != NULL; n=n->parent)
+            if (n == recomb && coal != recomb)
+                below = true;
+        if (below)
+            continue;
+
+        double top = (coal->parent != NULL ? coal->parent->age :
+                      coal->age + 100);
+        spr.recomb_node = recomb;
+        spr.coal_node = coal;
+        spr.coal_time = floor(10 * (coal->age + frand() *
+                                    (top - coal->age))) / 10;
+        if (spr.coal_time < recomb->age || spr.coal_time < coal->age)
+            continue;
+        spr.recomb_time = recomb->age;
+        return spr;
+    }
+}
+
+
+static void expect_same_stats(Tree *tree, const FlatTree &flat)
+{
+    EXPECT_EQ(flat.root, tree->root->name);
+    EXPECT_DOUBLE_EQ(flat.tmrca(), tree->tmrca());
+    EXPECT_EQ(flat.total_branchlength(), tree->total_branchlength());
+    EXPECT_EQ(flat.avg_pairwise_distance(), tree->avg_pairwise_distance());
+    EXPECT_DOUBLE_EQ(flat.tmrca_half(), tree->tmrca_half());
+    if (tree->tmrca() > 0) {
+        EXPECT_DOUBLE_EQ(flat.rth(), tree->rth());
+    }
+    EXPECT_EQ(flat.popsize(), tree->popsize());
+
+    // coalescence counts at the ages of the tree
+    vector<double> ages;
+    for (int i=0; i < tree->nnodes; i++)
+        if (tree->nodes[i]->nchildren > 0)
+            ages.push_back(tree->nodes[i]->age);
+    sort(ages.begin(), ages.end());
+    ages.erase(unique(ages.begin(), ages.end()), ages.end());
+    EXPECT_TRUE(flat.coalCounts(&ages[0], ages.size()) ==
+                tree->coalCounts(&ages[0], ages.size()));
+}
+
+
+// Statistics of a flat tree follow those of the tree under SPRs
+TEST(TreeTest, flat_tree_spr)
+{
+    seed_rand(11);
+    for (int k=0; k<20; k++) {
+        Tree tree(random_newick(2 + irand(30)), NULL);
+        FlatTree flat(&tree);
+        expect_same_stats(&tree, flat);
+
+        for (int i=0; i<200; i++) {
+            NodeSpr spr = random_spr(&tree);
+            flat.apply_spr(spr);
+            tree.apply_spr(&spr);
+            expect_same_stats(&tree, flat);
+            for (int j=0; j < tree.nnodes; j++) {
+                ASSERT_EQ(flat.age[j], tree.nodes[j]->age);
+                ASSERT_EQ(flat.dist[j], tree.nodes[j]->dist);
+                ASSERT_EQ(flat.parent[j], tree.nodes[j]->parent == NULL ? -1 :
+                          tree.nodes[j]->parent->name);
+            }
+        }
+    }
+}
+
+
+// Flat copy of a pruned tree
+TEST(TreeTest, flat_tree_pruned)
+{
+    seed_rand(12);
+    Tree tree(random_newick(20), NULL);
+    set<string> leaves;
+    for (int i=0; i<20; i+=3) {
+        char name[20];
+        snprintf(name, sizeof(name), "n%d", i);
+        leaves.insert(name);
+    }
+    tree.prune(leaves, true);
+    FlatTree flat(&tree);
+    EXPECT_EQ(flat.nnodes, 13);
+    expect_same_stats(&tree, flat);
+
+    for (int i=0; i<200; i++) {
+        NodeSpr spr = random_spr(&tree);
+        flat.apply_spr(spr);
+        tree.apply_spr(&spr);
+        expect_same_stats(&tree, flat);
+    }
+}
+
+
+} // namespace spidir
@@ -0,0 +1,53 @@
+//=============================================================================
+// helpers shared by the unit tests
+
+#include "argweaver/common.h"
+#include "argweaver/sample_arg.h"
+
+#include "test_util.h"
+
+
+namespace argweaver {
+
+
+void make_test_arg(const ArgModel *model, Sequences *sequences,
+                   LocalTrees *trees)
+{
+    const int nseqs = 6;
+    const int seqlen = 4000;
+
+    seed_rand(5);
+    char **seqs = new char* [nseqs];
+    for (int i=0; i<nseqs; i++) {
+        seqs[i] = new char [seqlen + 1];
+        for (int j=0; j<seqlen; j++)
+            seqs[i][j] = "ACGT"[frand() < 0.98 ? 0 : irand(4)];
+        seqs[i][seqlen] = '\0';
+    }
+    sequences->extend(seqs, nseqs);
+    sequences->set_length(seqlen);
+    sequences->set_owned(true);
+    delete [] seqs;
+
+    sample_arg_seq(model, sequences, trees);
+    resample_arg_regions(model, sequences, trees, 500, 2);
+}
+
+
+string local_trees_text(const LocalTrees *trees, const Sequences *sequences,
+                        const ArgModel *model)
+{
+    FILE *tmp = tmpfile();
+    write_local_trees(tmp, trees, *sequences, model->times);
+    rewind(tmp);
+    string text;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), tmp)) > 0)
+        text.append(buf, n);
+    fclose(tmp);
+    return text;
+}
+
+
+} // namespace argweaver
@@ -0,0 +1,31 @@
+//=============================================================================
+// helpers shared by the unit tests
+
+#ifndef ARGWEAVER_TEST_UTIL_H
+#define ARGWEAVER_TEST_UTIL_H
+
+// c/c++ includes
+#include <string>
+
+#include "argweaver/local_tree.h"
+#include "argweaver/model.h"
+#include "argweaver/sequences.h"
+
+
+namespace argweaver {
+
+using namespace std;
+
+
+// Samples an ARG for a small random alignment
+void make_test_arg(const ArgModel *model, Sequences *sequences,
+                   LocalTrees *trees);
+
+// Returns the local trees written in .smc format
+string local_trees_text(const LocalTrees *trees, const Sequences *sequences,
+                        const ArgModel *model);
+
+
+} // namespace argweaver
+
+#endif // ARGWEAVER_TEST_UTIL_H
@@ -0,0 +1,260 @@
+#!/usr/bin/env python3
+"""
+Writes the tabix test fixtures of this directory:
+
+    regions.bed.gz      bgzipped BED file
+    regions.bed.gz.tbi  tabix index (tabix -p bed)
+    regions.bed.gz.csi  CSI index (tabix -C -p bed)
+
+usage: make_fixtures.py regions.bed
+
+regions.bed is the text of regions.bed.gz (zcat regions.bed.gz).
+
+The BGZF files are written and read with Biopython's Bio.bgzf, and the
+indexes are built following htslib's hts_idx_push() and hts_idx_finish(),
+so that the fixtures do not depend on argweaver's own BGZF code.  With
+htslib installed, equivalent files can be made with
+
+    bgzip -c regions.bed > regions.bed.gz
+    tabix -p bed regions.bed.gz
+    tabix -C -p bed regions.bed.gz
+"""
+
+import struct
+import sys
+
+from Bio import bgzf
+
+
+MIN_SHIFT = 14
+NLEVELS = 5
+NBINS = ((1 << (3 * NLEVELS + 3)) - 1) // 7
+META_BIN = NBINS + 1
+MIN_MARKER_DIST = 0x10000
+
+TBX_UCSC = 0x10000
+BGZIP_BLOCK_SIZE = 0xff00
+
+
+def reg2bin(beg, end):
+    """Bin of [beg, end), as hts_reg2bin()."""
+    end -= 1
+    s = MIN_SHIFT
+    t = ((1 << (NLEVELS * 3)) - 1) // 7
+    for level in range(NLEVELS, 0, -1):
+        if beg >> s == end >> s:
+            return t + (beg >> s)
+        s += 3
+        t -= 1 << ((level - 1) * 3)
+    return 0
+
+
+def bin_first(level):
+    return ((1 << (3 * level)) - 1) // 7
+
+
+def bin_level(b):
+    level = 0
+    while b:
+        b = (b - 1) >> 3
+        level += 1
+    return level
+
+
+def bin_bottom(b):
+    """First linear index window of bin 'b', as hts_bin_bot()."""
+    level = bin_level(b)
+    return (b - bin_first(level)) << (3 * (NLEVELS - level))
+
+
+class SeqIndex:
+    """Index of one sequence."""
+
+    def __init__(self):
+        self.bins = {}       # bin -> [[beg, end], ...] chunks
+        self.loff = {}
+        self.linear = []
+        self.off_beg = None
+        self.off_end = None
+        self.nmapped = 0
+
+    def add_chunk(self, b, beg, end):
+        chunks = self.bins.setdefault(b, [])
+        if chunks and chunks[-1][1] == beg:
+            chunks[-1][1] = end
+        else:
+            chunks.append([beg, end])
+
+    def add_linear(self, beg, end, offset):
+        last = (end - 1) >> MIN_SHIFT
+        while len(self.linear) <= last:
+            self.linear.append(None)
+        for w in range(beg >> MIN_SHIFT, last + 1):
+            if self.linear[w] is None:
+                self.linear[w] = offset
+
+    def finish(self):
+        # update_loff(): fill the linear index and set each bin's loff
+        for w in range(len(self.linear)):
+            if self.linear[w] is None:
+                self.linear[w] = (self.off_beg if w == 0
+                                  else self.linear[w - 1])
+        for b in self.bins:
+            w = bin_bottom(b)
+            self.loff[b] = self.linear[w] if w < len(self.linear) else 0
+
+        # compress_binning(): move small bins into their parents
+        for level in range(NLEVELS, 0, -1):
+            for b in sorted(self.bins):
+                if not bin_first(level) <= b < bin_first(level + 1):
+                    continue
+                chunks = self.bins[b]
+                if level < NLEVELS:
+                    chunks.sort()
+                if (chunks[-1][1] >> 16) - (chunks[0][0] >> 16) >= \
+                        MIN_MARKER_DIST:
+                    continue
+                parent = (b - 1) >> 3
+                if parent not in self.bins:
+                    continue
+                self.bins[parent].extend(chunks)
+                del self.bins[b]
+                del self.loff[b]
+        if 0 in self.bins:
+            self.bins[0].sort()
+
+        # merge chunks that start in the same BGZF block
+        for b, chunks in self.bins.items():
+            merged = [chunks[0]]
+            for chunk in chunks[1:]:
+                if merged[-1][1] >> 16 >= chunk[0] >> 16:
+                    merged[-1][1] = max(merged[-1][1], chunk[1])
+                else:
+                    merged.append(chunk)
+            self.bins[b] = merged
+
+    def pack_bins(self, csi):
+        data = struct.pack("<i", len(self.bins) + 1)
+        for b in sorted(self.bins):
+            data += struct.pack("<I", b)
+            if csi:
+                data += struct.pack("<Q", self.loff[b])
+            data += struct.pack("<i", len(self.bins[b]))
+            for beg, end in self.bins[b]:
+                data += struct.pack("<QQ", beg, end)
+        # pseudo-bin of the file offsets and number of records
+        data += struct.pack("<I", META_BIN)
+        if csi:
+            data += struct.pack("<Q", 0)
+        data += struct.pack("<iQQQQ", 2, self.off_beg, self.off_end,
+                            self.nmapped, 0)
+        return data
+
+
+def build_index(filename):
+    """Returns the sequence names and indexes of a bgzipped BED file."""
+    seqnames = []
+    seqs = []
+
+    reader = bgzf.BgzfReader(filename, "rb")
+    save_bin = None
+    save_off = last_off = reader.tell()
+    while True:
+        line = reader.readline()
+        if not line:
+            break
+        offset = reader.tell()
+        if line.startswith(b"#"):
+            last_off = offset
+            continue
+        if save_bin is None:
+            save_off = last_off
+
+        chrom, beg, end = line.split(b"\t")[:3]
+        chrom = chrom.decode()
+        beg = int(beg)
+        end = int(end)
+        if end <= beg:
+            end = beg + 1
+
+        if not seqnames or seqnames[-1] != chrom:
+            assert chrom not in seqnames, "BED file is not sorted"
+            if seqs:
+                seqs[-1].add_chunk(save_bin, save_off, last_off)
+                seqs[-1].off_end = last_off
+                save_bin = None
+                save_off = last_off
+            seqnames.append(chrom)
+            seqs.append(SeqIndex())
+            seqs[-1].off_beg = last_off
+        seq = seqs[-1]
+
+        seq.add_linear(beg, end, last_off)
+        b = reg2bin(beg, end)
+        if b != save_bin:
+            if save_bin is not None:
+                seq.add_chunk(save_bin, save_off, last_off)
+            save_off = last_off
+            save_bin = b
+        seq.nmapped += 1
+        last_off = offset
+    reader.close()
+
+    seqs[-1].add_chunk(save_bin, save_off, last_off)
+    seqs[-1].off_end = last_off
+    for seq in seqs:
+        seq.finish()
+    return seqnames, seqs
+
+
+def pack_conf(seqnames):
+    """tabix settings of 'tabix -p bed' and the sequence names."""
+    names = b"".join(name.encode() + b"\0" for name in seqnames)
+    return struct.pack("<6ii", TBX_UCSC, 1, 2, 3, ord("#"), 0,
+                       len(names)) + names
+
+
+def write_index(filename, data):
+    out = bgzf.BgzfWriter(filename, "wb")
+    out.write(data)
+    out.close()
+
+
+def main(argv):
+    if len(argv) != 2:
+        sys.stderr.write(__doc__)
+        return 1
+    bed_file = argv[1]
+    gz_file = bed_file + ".gz"
+
+    # blocks of bgzip's size
+    out = bgzf.BgzfWriter(gz_file, "wb")
+    with open(bed_file, "rb") as infile:
+        text = infile.read()
+    for i in range(0, len(text), BGZIP_BLOCK_SIZE):
+        out.write(text[i:i + BGZIP_BLOCK_SIZE])
+        out.flush()
+    out.close()
+
+    seqnames, seqs = build_index(gz_file)
+    conf = pack_conf(seqnames)
+
+    data = b"TBI\1" + struct.pack("<i", len(seqs)) + conf
+    for seq in seqs:
+        data += seq.pack_bins(False)
+        data += struct.pack("<i", len(seq.linear))
+        data += b"".join(struct.pack("<Q", off) for off in seq.linear)
+    data += struct.pack("<Q", 0)
+    write_index(gz_file + ".tbi", data)
+
+    data = b"CSI\1" + struct.pack("<iii", MIN_SHIFT, NLEVELS, len(conf))
+    data += conf + struct.pack("<i", len(seqs))
+    for seq in seqs:
+        data += seq.pack_bins(True)
+    data += struct.pack("<Q", 0)
+    write_index(gz_file + ".csi", data)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
@@ -1,4 +1,5 @@
 
+import gzip
 import os
 import subprocess
 
@@ -114,6 +115,56 @@ def test_prog_resume():
         -o test/tmp/test_prog_small/0.sample/out""")
 
 
+def test_prog_chunks():
+    """
+    Sample a region in chunks and stitch the chunks together
+    """
+
+    outdir = "test/tmp/test_prog_chunks"
+    make_clean_dir(outdir)
+    run_cmd("""bin/arg-sim \
+        -k 6 -L 200000 \
+        -N 1e4 -r 1.5e-8 -m 2.5e-8 \
+        --ntimes 10 --maxtime 400e3  \
+        -o %s/0 > /dev/null""" % outdir)
+
+    run_cmd("""bin/arg-sample -q \
+        -s %s/0.sites \
+        -x 1 -N 1e4 -r 1.5e-8 -m 2.5e-8 \
+        --ntimes 10 --maxtime 400e3 \
+        -n 4 --sample-step 2 \
+        --chunk-size 60000 --chunk-flank 10000 --chunk-threads 2 \
+        -o %s/out""" % (outdir, outdir))
+
+    # region of the sites file
+    with open(outdir + "/0.sites") as infile:
+        for line in infile:
+            if line.startswith("#REGION"):
+                chrom, start, end = line.split()[1:4]
+                start = int(start) - 1
+                end = int(end)
+                break
+    nchunks = (end - start + 59999) // 60000
+
+    for i in [0, 2, 4]:
+        # stitched local trees cover the region without gaps or overlaps
+        pos = start
+        with gzip.open("%s/out.%d.bed.gz" % (outdir, i)) as infile:
+            for line in infile:
+                row = line.split("\t")
+                assert row[0] == chrom
+                assert int(row[1]) == pos, (row[1], pos)
+                assert int(row[2]) > pos
+                pos = int(row[2])
+        assert pos == end, (pos, end)
+
+        # each chunk ARG can be read with the log of its chunk
+        for k in range(nchunks):
+            prefix = "%s/out.chunk%d" % (outdir, k)
+            run_cmd("bin/smc-convert -l %s.log %s.%d.smc.gz %s.%d.smcb" %
+                    (prefix, prefix, i, prefix, i))
+
+
 def test_tmrca():
 
     if not os.path.exists("test/tmp/test_prog_small/0.sample"):
@@ -247,3 +298,38 @@ def _test_prog_infsites():
                 print split
                 print
     print "num noncompats", len(noncompats)
+
+
+def test_summarize_threads():
+    """
+    Ensure arg-summarize output does not depend on the number of threads
+    """
+
+    outdir = "test/tmp/test_summarize_threads"
+    make_clean_dir(outdir)
+    with open(outdir + "/subset.txt", "w") as out:
+        out.write("\n".join(["tsk_0", "tsk_1", "tsk_2", "tsk_5", "tsk_7"]))
+        out.write("\n")
+
+    tests = [
+        ("raw", "--tmrca --branchlen --pi --rth --popsize --coalcounts"),
+        ("mean", "--tmrca --branchlen --pi --mean "
+         "--quantile 0.025,0.5,0.975"),
+        ("subset", "--subset %s/subset.txt --tmrca --branchlen --pi" %
+         outdir),
+    ]
+    for name, opts in tests:
+        outputs = []
+        for nthreads in [1, 4]:
+            filename = "%s/%s.%d.txt" % (outdir, name, nthreads)
+            run_cmd("""bin/arg-summarize \
+                -a test/data/test_summarize_threads/sim1.bed.gz \
+                -l examples/sim1/simultion.10.initial.log \
+                %s --threads %d > %s""" % (opts, nthreads, filename))
+
+            # skip header lines, which give the command line
+            with open(filename) as infile:
+                outputs.append([line for line in infile
+                                if not line.startswith("##")])
+        assert len(outputs[0]) > 0, name
+        assert outputs[0] == outputs[1], name